@@ -34,6 +34,25 @@
 #define FAT_SET_LOADED_SECTOR(volume, sector)	
 #endif
 
+/*
+// converts an ASCII character to upper case with a table lookup
+// instead of a call to toupper since it's done for every character
+// of every name that we compare. Other characters are left as they are
+*/
+#define FAT_TO_UPPER(c)		(((unsigned char) (c) < 0x80) ? fat_upper_case[(unsigned char) (c)] : (unsigned char) (c))
+
+static const unsigned char fat_upper_case[0x80] = 
+{
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F,
+	0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
+	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+	0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
+	0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F,
+	0x60, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
+	0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x7B, 0x7C, 0x7D, 0x7E, 0x7F
+};
+
 /*
 // function pointer for rtc access routing
 */
@@ -119,6 +138,9 @@ uint16_t fat_mount_volume(FAT_VOLUME* volume, STORAGE_DEVICE* device)
 	INITIALIZE_CRITICAL_SECTION(volume->write_lock);
 	volume->readers_count = 0;
 	#endif
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_DENTRY_CACHE)
+	INITIALIZE_CRITICAL_SECTION(volume->dentry_lock);
+	#endif
 	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
 	INITIALIZE_CRITICAL_SECTION(volume->sector_buffer_lock);
 	ENTER_CRITICAL_SECTION(volume->sector_buffer_lock);
@@ -424,6 +446,33 @@ retry:
 		}
 	}
 	volume->fsinfo_sector = 0xFFFFFFFF;
+	volume->next_free_cluster = 0xFFFFFFFF;
+	volume->total_free_clusters = volume->no_of_clusters - 1;
+	#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+	volume->reserved_clusters = 0;
+	volume->free_clusters_counted = 0;
+	#endif
+	#if defined(FAT_TAIL_HINTS)
+	memset(volume->tail_hints, 0, sizeof(volume->tail_hints));
+	volume->next_tail_hint = 0;
+	#endif
+	#if defined(FAT_DENTRY_CACHE)
+	memset(volume->dentries, 0, sizeof(volume->dentries));
+	volume->next_dentry = 0;
+	#endif
+	#if defined(FAT_DIRECTORY_INDEX)
+	volume->index_slots = 0;
+	volume->index_size = 0;
+	volume->index_count = 0;
+	volume->index_state = FAT_DIRECTORY_INDEX_NONE;
+	#endif
+	#if defined(FAT_AUTO_COMPACT) && !defined(FAT_READ_ONLY)
+	volume->compact_directory = 0;
+	volume->compact_count = 0;
+	#endif
+	#if !defined(FAT_READ_ONLY)
+	volume->no_of_open_files = 0;
+	#endif
 	/*
 	// if we find a valid fsinfo structure we'll use it
 	*/
@@ -498,47 +547,92 @@ retry:
 	return FAT_SUCCESS;
 }
 
+#if !defined(FAT_READ_ONLY)
 /*
-// dismounts a FAT volume
+// writes the free cluster count and the next free
+// cluster hint to the FSInfo sector of a FAT32 volume
 */
-uint16_t fat_dismount_volume(FAT_VOLUME* volume)
+uint16_t fat_update_fsinfo(FAT_VOLUME* volume)
 {
+	uint16_t ret;
+	FAT_FSINFO* fsinfo;
+	#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+	FAT_FSINFO fsinfo_mem;
+	#endif
+
+	#if defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	unsigned char* buffer = volume->sector_buffer;
+	#elif defined(FAT_ALLOCATE_SHARED_BUFFER)
+	unsigned char* buffer = fat_shared_buffer;
+	#else
+	ALIGN16 unsigned char buffer[MAX_SECTOR_LENGTH];
+	#endif
+
+	if (volume->fs_type != FAT_FS_TYPE_FAT32 || volume->fsinfo_sector == 0xFFFFFFFF)
+		return FAT_SUCCESS;
 	/*
-	// if this is a FAT32 volume we'll update the fsinfo structure
+	// lock the buffer
 	*/
-	#if !defined(FAT_READ_ONLY)
-	if (volume->fs_type == FAT_FS_TYPE_FAT32 && volume->fsinfo_sector != 0xFFFFFFFF)
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	ENTER_CRITICAL_SECTION(volume->sector_buffer_lock);
+	#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+	ENTER_CRITICAL_SECTION(fat_shared_buffer_lock);
+	#endif
+	/*
+	// mark the loaded sector as unknown
+	*/
+	FAT_SET_LOADED_SECTOR(volume, FAT_UNKNOWN_SECTOR);
+	/*
+	// read the sector containing the FSInfo structure
+	*/
+	ret = volume->device->read_sector(volume->device->driver, volume->fsinfo_sector, buffer);
+	if (ret != STORAGE_SUCCESS)
 	{
-		uint16_t ret;
-		FAT_FSINFO* fsinfo;
-		#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
-		FAT_FSINFO fsinfo_mem;
-		#endif
-
-		#if defined(FAT_ALLOCATE_VOLUME_BUFFER)
-		unsigned char* buffer = volume->sector_buffer;
-		#elif defined(FAT_ALLOCATE_SHARED_BUFFER)
-		unsigned char* buffer = fat_shared_buffer;
-		#else
-		ALIGN16 unsigned char buffer[MAX_SECTOR_LENGTH];
-		#endif
-		/*
-		// lock the buffer
-		*/
 		#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
-		INITIALIZE_CRITICAL_SECTION(volume->sector_buffer_lock);
-		ENTER_CRITICAL_SECTION(volume->sector_buffer_lock);
+		LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
 		#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
-		ENTER_CRITICAL_SECTION(fat_shared_buffer_lock);
+		LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
 		#endif
+		return FAT_CANNOT_READ_MEDIA;
+	}
+	/*
+	// set the pointer to the fsinfo structure
+	*/
+	#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+	fsinfo = &fsinfo_mem;
+	fat_read_fsinfo(fsinfo, buffer);
+	#else
+	fsinfo = (FAT_FSINFO*) buffer;
+	#endif
+	/*
+	// check the signatures before writting
+	// note: when you mount a removable device in windows it will channge
+	// these signatures, i guess it feels it cannot be trusted. So we're going
+	// to rebuild them no matter what as they significantly speed up this
+	// implementation. After the volume has been mounted elsewhere Free_Count cannot
+	// be trusted. This implementation doesn't actually use it but if you only
+	// mount the volume with us it will keep it up to date.
+	*/
+	/*if (fsinfo->LeadSig == 0x41615252 && fsinfo->StructSig == 0x61417272 && fsinfo->TrailSig == 0xAA550000)*/
+	{
 		/*
-		// mark the loaded sector as unknown
+		// mark all values as unknown
 		*/
-		FAT_SET_LOADED_SECTOR(volume, FAT_UNKNOWN_SECTOR);
+		fsinfo->Nxt_Free = volume->next_free_cluster;
+		fsinfo->Free_Count = volume->total_free_clusters;
+		fsinfo->LeadSig = 0x41615252;
+		fsinfo->StructSig = 0x61417272;
+		fsinfo->TrailSig = 0xAA550000;
 		/*
-		// read the sector containing the FSInfo structure
+		// copy fsinfo struct to buffer
+		*/
+		#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+		fat_write_fsinfo(fsinfo, buffer);
+		#endif
+		/*
+		// write the fsinfo sector
 		*/
-		ret = volume->device->read_sector(volume->device->driver, volume->fsinfo_sector, buffer);
+		ret = volume->device->write_sector(volume->device->driver, volume->fsinfo_sector, buffer);
 		if (ret != STORAGE_SUCCESS)
 		{
 			#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
@@ -546,68 +640,43 @@ uint16_t fat_dismount_volume(FAT_VOLUME* volume)
 			#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
 			LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
 			#endif
-			return FAT_CANNOT_READ_MEDIA;
-		}
-		/*
-		// set the pointer to the fsinfo structure
-		*/
-		#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
-		fsinfo = &fsinfo_mem;
-		fat_read_fsinfo(fsinfo, buffer);
-		#else
-		fsinfo = (FAT_FSINFO*) buffer;
-		#endif
-		/*
-		// check the signatures before writting
-		// note: when you mount a removable device in windows it will channge
-		// these signatures, i guess it feels it cannot be trusted. So we're going
-		// to rebuild them no matter what as they significantly speed up this
-		// implementation. After the volume has been mounted elsewhere Free_Count cannot
-		// be trusted. This implementation doesn't actually use it but if you only
-		// mount the volume with us it will keep it up to date.
-		*/
-		/*if (fsinfo->LeadSig == 0x41615252 && fsinfo->StructSig == 0x61417272 && fsinfo->TrailSig == 0xAA550000)*/
-		{
-			/*
-			// mark all values as unknown
-			*/
-			fsinfo->Nxt_Free = volume->next_free_cluster;
-			fsinfo->Free_Count = volume->total_free_clusters;
-			fsinfo->LeadSig = 0x41615252;
-			fsinfo->StructSig = 0x61417272;
-			fsinfo->TrailSig = 0xAA550000;
-			/*
-			// copy fsinfo struct to buffer
-			*/
-			#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
-			fat_write_fsinfo(fsinfo, buffer);
-			#endif
-			/*
-			// write the fsinfo sector
-			*/
-			ret = volume->device->write_sector(volume->device->driver, volume->fsinfo_sector, buffer);
-			if (ret != STORAGE_SUCCESS)
-			{
-				#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
-				LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
-				#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
-				LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
-				#endif
-				return FAT_CANNOT_READ_MEDIA;
-			}
+			return FAT_CANNOT_WRITE_MEDIA;
 		}
 	}
-	#endif
 	/*
-	// leave critical section and
-	// delete the critical section for volume buffer
+	// release the buffer
 	*/
 	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
 	LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
-	DELETE_CRITICAL_SECTION(volume->sector_buffer_lock);
 	#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
 	LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
 	#endif
+	return FAT_SUCCESS;
+}
+#endif
+
+/*
+// dismounts a FAT volume
+*/
+uint16_t fat_dismount_volume(FAT_VOLUME* volume)
+{
+	/*
+	// if this is a FAT32 volume we'll update the fsinfo structure
+	*/
+	#if !defined(FAT_READ_ONLY)
+	uint16_t ret = fat_update_fsinfo(volume);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	#endif
+	/*
+	// delete the critical section for volume buffer
+	*/
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	DELETE_CRITICAL_SECTION(volume->sector_buffer_lock);
+	#endif
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_DENTRY_CACHE)
+	DELETE_CRITICAL_SECTION(volume->dentry_lock);
+	#endif
 	/*
 	// return success code
 	*/
@@ -622,6 +691,23 @@ uint16_t fat_get_sector_size(FAT_VOLUME* volume)
 	return volume->no_of_bytes_per_serctor;
 }
 
+/*
+// gets the current time from the system time function
+// or 0 if there's none
+*/
+#if !defined(FAT_READ_ONLY)
+time_t fat_get_time()
+{
+	#if defined(FAT_USE_SYSTEM_TIME)
+	return time(0);
+	#else
+	if (timekeeper.fat_get_system_time)
+		return timekeeper.fat_get_system_time();
+	return 0;
+	#endif
+}
+#endif
+
 /*
 // registers the function that gets the system time
 */
@@ -638,6 +724,145 @@ void fat_register_system_time_function(FAT_GET_SYSTEM_TIME system_time)
 uint16_t fat_find_first_entry( 
 	FAT_VOLUME* volume, 
 	char* parent_path, unsigned char attributes, FAT_DIRECTORY_ENTRY** dir_entry, FAT_FILESYSTEM_QUERY* q) {
+
+	return fat_find_first_entry_ex(volume, parent_path, attributes, 0, dir_entry, q);
+}
+
+/*
+// converts a time to a FAT date in the high word and a FAT
+// time in the low word so it can be compared to the ones on
+// the raw entries
+*/
+static uint32_t fat_encode_filter_time(time_t time, uint32_t before_1980, uint32_t after_2107)
+{
+	struct tm* timeinfo;
+	timeinfo = localtime(&time);
+	if (!timeinfo || timeinfo->tm_year < 80)
+		return before_1980;
+	if (timeinfo->tm_year > 207)
+		return after_2107;
+	return ((uint32_t) FAT_ENCODE_DATE(timeinfo->tm_mon + 1, timeinfo->tm_mday, timeinfo->tm_year + 1900) << 16) |
+		FAT_ENCODE_TIME(timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec);
+}
+
+/*
+// matches a name against a pattern with wildcards
+*/
+static char fat_match_pattern(char* pattern, uint16_t* name)
+{
+	char* star = 0;
+	uint16_t* star_name = 0;
+
+	while (*name)
+	{
+		if (*pattern == '*')
+		{
+			star = ++pattern;
+			star_name = name;
+		}
+		else if (*pattern && (*pattern == '?' || 
+			FAT_TO_UPPER(*pattern) == ((*name < 0x80) ? FAT_TO_UPPER(*name) : *name)))
+		{
+			pattern++;
+			name++;
+		}
+		else if (star)
+		{
+			/*
+			// let the last '*' take one more character
+			// and try again from there
+			*/
+			pattern = star;
+			name = ++star_name;
+		}
+		else
+		{
+			return 0;
+		}
+	}
+	while (*pattern == '*')
+		pattern++;
+	return !*pattern;
+}
+
+/*
+// checks if the current entry of a query meets the
+// conditions of it's filter. It only looks at the raw
+// entry and the long name so it's cheaper than decoding it
+*/
+static char fat_query_filter_match(FAT_FILESYSTEM_QUERY_INNER* query)
+{
+	uint16_t i, c;
+	uint32_t modified;
+	uint16_t short_name[13];
+	FAT_QUERY_FILTER* filter = query->filter;
+	FAT_RAW_DIRECTORY_ENTRY* raw = query->state.current_entry_raw;
+
+	if ((raw->ENTRY.STD.attributes & filter->attributes_set) != filter->attributes_set)
+		return 0;
+	if (raw->ENTRY.STD.attributes & filter->attributes_clear)
+		return 0;
+	if (raw->ENTRY.STD.size < filter->min_size)
+		return 0;
+	if (filter->max_size && raw->ENTRY.STD.size > filter->max_size)
+		return 0;
+
+	modified = ((uint32_t) raw->ENTRY.STD.modify_date << 16) | raw->ENTRY.STD.modify_time;
+	if (modified < query->filter_modified_after || modified >= query->filter_modified_before)
+		return 0;
+
+	if (!filter->pattern)
+		return 1;
+	/*
+	// match the long name if there's one, otherwise
+	// the short name
+	*/
+	#if !defined(FAT_DISABLE_LONG_FILENAMES)
+	if (*query->state.long_filename)
+		return fat_match_pattern(filter->pattern, query->state.long_filename);
+	#endif
+	for (i = 0, c = 0; i < 8 && raw->ENTRY.STD.name[i] != 0x20; i++)
+		short_name[c++] = raw->ENTRY.STD.name[i];
+	if (raw->ENTRY.STD.name[8] != 0x20)
+	{
+		short_name[c++] = '.';
+		for (i = 8; i < 11 && raw->ENTRY.STD.name[i] != 0x20; i++)
+			short_name[c++] = raw->ENTRY.STD.name[i];
+	}
+	short_name[c] = 0;
+	if (short_name[0] == 0x05)
+		short_name[0] = 0xE5;
+	return fat_match_pattern(filter->pattern, short_name);
+}
+
+/*
+// moves a query past the entries that don't meet the
+// conditions of it's filter
+*/
+static uint16_t fat_query_filter_entries(FAT_VOLUME* volume, FAT_FILESYSTEM_QUERY_INNER* query)
+{
+	uint16_t ret;
+
+	if (!query->filter)
+		return FAT_SUCCESS;
+
+	while (query->state.current_entry_raw && 
+		*query->state.current_entry_raw->ENTRY.STD.name != 0 && !fat_query_filter_match(query))
+	{
+		ret = fat_query_next_entry(volume, &query->state, 0, 0);
+		if (ret != FAT_SUCCESS)
+			return ret;
+	}
+	return FAT_SUCCESS;
+}
+
+/*
+// finds the first file in a directory that
+// meets the conditions of a filter
+*/
+uint16_t fat_find_first_entry_ex( 
+	FAT_VOLUME* volume, 
+	char* parent_path, unsigned char attributes, FAT_QUERY_FILTER* filter, FAT_DIRECTORY_ENTRY** dir_entry, FAT_FILESYSTEM_QUERY* q) {
 	
 	uint16_t ret;
 	FAT_DIRECTORY_ENTRY parent_entry;
@@ -648,6 +873,18 @@ uint16_t fat_find_first_entry(
 	if (!q->state.buffer)
 		q->state.buffer = q->state.buff;
 	/*
+	// convert the times of the filter once so we can
+	// compare them to the raw entries
+	*/
+	query->filter = filter;
+	if (filter)
+	{
+		query->filter_modified_after = (filter->modified_after) ? 
+			fat_encode_filter_time(filter->modified_after, 0, 0xFFFFFFFF) : 0;
+		query->filter_modified_before = (filter->modified_before) ?
+			fat_encode_filter_time(filter->modified_before, 0, 0xFFFFFFFF) : 0xFFFFFFFF;
+	}
+	/*
 	// if the path starts with a backlash then advance to
 	// the next character
 	*/
@@ -691,6 +928,13 @@ uint16_t fat_find_first_entry(
 	if ( ret != FAT_SUCCESS )
 		return ret;
 	/*
+	// skip the entries that don't meet the conditions
+	// of the filter
+	*/
+	ret = fat_query_filter_entries(volume, query);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	/*
 	// if there are no more entries
 	*/
 	if ( query->state.current_entry_raw == 0 ) {
@@ -793,6 +1037,13 @@ uint16_t fat_find_next_entry(
 	if ( ret != FAT_SUCCESS )
 		return ret;
 	/*
+	// skip the entries that don't meet the conditions
+	// of the filter
+	*/
+	ret = fat_query_filter_entries(volume, query);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	/*
 	// if there are no more entries
 	*/
 	if ( query->state.current_entry_raw == 0 ) 
@@ -887,13 +1138,28 @@ void INLINE fat_fill_directory_entry_from_raw(
 	*/	
 	entry->attributes = raw_entry->ENTRY.STD.attributes;
 	entry->size = raw_entry->ENTRY.STD.size;
+	#if !defined(FAT_LAZY_DIRECTORY_TIMES)
 	entry->create_time = fat_decode_date_time(raw_entry->ENTRY.STD.create_date, raw_entry->ENTRY.STD.create_time);
 	entry->modify_time = fat_decode_date_time(raw_entry->ENTRY.STD.modify_date, raw_entry->ENTRY.STD.modify_time);
 	entry->access_time = fat_decode_date_time(raw_entry->ENTRY.STD.access_date, 0);
+	#endif
 	entry->raw = *raw_entry;
 		
 }	
 
+/*
+// decodes the timestamps of a directory entry
+*/
+void fat_get_entry_times(FAT_DIRECTORY_ENTRY* entry, time_t* create_time, time_t* modify_time, time_t* access_time)
+{
+	if (create_time)
+		*create_time = fat_decode_date_time(entry->raw.ENTRY.STD.create_date, entry->raw.ENTRY.STD.create_time);
+	if (modify_time)
+		*modify_time = fat_decode_date_time(entry->raw.ENTRY.STD.modify_date, entry->raw.ENTRY.STD.modify_time);
+	if (access_time)
+		*access_time = fat_decode_date_time(entry->raw.ENTRY.STD.access_date, 0);
+}
+
 /*
 // creates a directory
 */
@@ -1001,49 +1267,547 @@ uint16_t fat_create_directory(FAT_VOLUME* volume, char* directory)
 	#endif
 }
 
+#if defined(FAT_DENTRY_CACHE) || defined(FAT_DIRECTORY_INDEX) || (defined(FAT_AUTO_COMPACT) && !defined(FAT_READ_ONLY))
 /*
-// gets a FAT_DIRECTORY_ENTRY by it's full path
+// gets the 1st cluster of a directory as it's used to
+// key the path lookups. A null entry is the root
 */
-uint16_t fat_get_file_entry(FAT_VOLUME* volume, char* path, FAT_DIRECTORY_ENTRY* entry) 
+static uint32_t fat_get_directory_cluster(FAT_VOLUME* volume, FAT_RAW_DIRECTORY_ENTRY* directory)
 {
-	uint16_t ret;
-	char match;
-	unsigned char target_file[13];
-	unsigned char* pLevel;
-	FAT_RAW_DIRECTORY_ENTRY* current_entry;
-	FAT_QUERY_STATE_INTERNAL query;
-	/* FAT_QUERY_STATE query; */
-
-	#if !defined(FAT_DISABLE_LONG_FILENAMES)
-	char using_lfn;
-	/* char using_lfn_and_short; */
-	uint16_t target_file_long[FAT_MAX_PATH + 1];	/* stores the utf16 long filename */
-	unsigned char current_level[FAT_MAX_PATH + 1];
-	#else
-	unsigned char current_level[13];
-	/* unsigned char target_file[13]; */
-	#endif
-
-	#if defined(FAT_ALLOCATE_VOLUME_BUFFER)
-	query.buffer = volume->sector_buffer;
-	#elif defined(FAT_ALLOCATE_SHARED_BUFFER)
-	query.buffer = fat_shared_buffer;
-	#else
-	ALIGN16 unsigned char buffer[MAX_SECTOR_LENGTH];
-	query.buffer = buffer;
-	#endif
+	uint32_t cluster;
 
+	if (!directory)
+		return (volume->fs_type == FAT_FS_TYPE_FAT32) ? volume->root_cluster : 0;
 
+	((uint16_t*) &cluster)[INT32_WORD0] = directory->ENTRY.STD.first_cluster_lo;
+	((uint16_t*) &cluster)[INT32_WORD1] = 
+		(volume->fs_type == FAT_FS_TYPE_FAT32) ? directory->ENTRY.STD.first_cluster_hi : 0;
 	/*
-	// if the path starts with a backlash then advance to
-	// the next character
+	// the dotdot entry of a FAT32 directory points
+	// to cluster 0 when the parent is the root
 	*/
-	if (*path == '\\') 
-		path++;
+	if (!cluster && volume->fs_type == FAT_FS_TYPE_FAT32)
+		cluster = volume->root_cluster;
+	return cluster;
+}
+#endif
 
-	if (*path != 0) 
+#if defined(FAT_DENTRY_CACHE)
+/*
+// converts a name to upper case and hashes it. Returns zero
+// if the name is too long to be remembered
+*/
+static uint16_t fat_dentry_hash(unsigned char* name, unsigned char* folded)
+{
+	uint16_t i;
+	uint16_t hash = 0;
+
+	for (i = 0; name[i]; i++)
+	{
+		if (i == FAT_DENTRY_NAME_LENGTH)
+			return 0;
+		folded[i] = FAT_TO_UPPER(name[i]);
+		hash = (uint16_t) ((hash << 5) + hash + folded[i]);
+	}
+	folded[i] = 0;
+	return hash ? hash : 1;
+}
+
+/*
+// looks up a name on the cache. If the name was not
+// found when it was looked up raw is set to an empty entry
+*/
+static char fat_dentry_lookup(FAT_VOLUME* volume, uint32_t parent, unsigned char* name, uint16_t hash,
+	FAT_RAW_DIRECTORY_ENTRY* raw, uint32_t* sector_addr, uint16_t* sector_offset)
+{
+	uint16_t i;
+	char found = 0;
+
+	#if defined(FAT_MULTI_THREADED)
+	ENTER_CRITICAL_SECTION(volume->dentry_lock);
+	#endif
+	for (i = 0; i < FAT_DENTRY_CACHE; i++)
+	{
+		FAT_DENTRY* dentry = &volume->dentries[i];
+		if (dentry->hash == hash && dentry->parent == parent && !strcmp((char*) dentry->name, (char*) name))
+		{
+			if (dentry->negative)
+			{
+				raw->ENTRY.STD.name[0] = 0;
+			}
+			else
+			{
+				*raw = dentry->raw;
+				*sector_addr = dentry->sector_addr;
+				*sector_offset = dentry->sector_offset;
+			}
+			found = 1;
+			break;
+		}
+	}
+	#if defined(FAT_MULTI_THREADED)
+	LEAVE_CRITICAL_SECTION(volume->dentry_lock);
+	#endif
+	return found;
+}
+
+/*
+// remembers the result of a lookup. raw is null if the name
+// was not found. The oldest entry is replaced
+*/
+static void fat_dentry_insert(FAT_VOLUME* volume, uint32_t parent, unsigned char* name, uint16_t hash,
+	FAT_RAW_DIRECTORY_ENTRY* raw, uint32_t sector_addr, uint16_t sector_offset)
+{
+	FAT_DENTRY* dentry;
+
+	#if defined(FAT_MULTI_THREADED)
+	ENTER_CRITICAL_SECTION(volume->dentry_lock);
+	#endif
+	dentry = &volume->dentries[volume->next_dentry];
+	volume->next_dentry = (volume->next_dentry + 1) % FAT_DENTRY_CACHE;
+	dentry->parent = parent;
+	dentry->hash = hash;
+	strcpy((char*) dentry->name, (char*) name);
+	dentry->negative = (raw == 0);
+	if (raw)
+	{
+		dentry->raw = *raw;
+		dentry->sector_addr = sector_addr;
+		dentry->sector_offset = sector_offset;
+	}
+	#if defined(FAT_MULTI_THREADED)
+	LEAVE_CRITICAL_SECTION(volume->dentry_lock);
+	#endif
+}
+
+/*
+// updates the remembered copy of an entry after it's been
+// written to the volume and forgets it if it's been deleted
+*/
+void fat_dentry_cache_update(FAT_VOLUME* volume, uint32_t sector_addr, uint16_t sector_offset, FAT_RAW_DIRECTORY_ENTRY* raw)
+{
+	uint16_t i;
+
+	#if defined(FAT_MULTI_THREADED)
+	ENTER_CRITICAL_SECTION(volume->dentry_lock);
+	#endif
+	for (i = 0; i < FAT_DENTRY_CACHE; i++)
+	{
+		FAT_DENTRY* dentry = &volume->dentries[i];
+		if (dentry->hash && !dentry->negative && 
+			dentry->sector_addr == sector_addr && dentry->sector_offset == sector_offset)
+		{
+			if (raw->ENTRY.STD.name[0] == FAT_DELETED_ENTRY || raw->ENTRY.STD.name[0] == 0)
+			{
+				dentry->hash = 0;
+			}
+			else
+			{
+				dentry->raw = *raw;
+			}
+		}
+	}
+	#if defined(FAT_MULTI_THREADED)
+	LEAVE_CRITICAL_SECTION(volume->dentry_lock);
+	#endif
+}
+
+/*
+// forgets the lookups made on a directory. When an entry is created
+// only the names that were not found need to be forgotten
+*/
+void fat_dentry_cache_invalidate(FAT_VOLUME* volume, FAT_RAW_DIRECTORY_ENTRY* directory, char negative_only)
+{
+	uint16_t i;
+	uint32_t parent = fat_get_directory_cluster(volume, directory);
+
+	#if defined(FAT_MULTI_THREADED)
+	ENTER_CRITICAL_SECTION(volume->dentry_lock);
+	#endif
+	for (i = 0; i < FAT_DENTRY_CACHE; i++)
+	{
+		if (volume->dentries[i].parent == parent && (volume->dentries[i].negative || !negative_only))
+			volume->dentries[i].hash = 0;
+	}
+	#if defined(FAT_MULTI_THREADED)
+	LEAVE_CRITICAL_SECTION(volume->dentry_lock);
+	#endif
+}
+#endif
+
+#if defined(FAT_DIRECTORY_INDEX)
+/*
+// gets the sector address and offset of the current
+// entry of a query
+*/
+static void fat_get_query_entry_address(FAT_VOLUME* volume, FAT_QUERY_STATE* query, 
+	uint32_t* sector_addr, uint16_t* sector_offset)
+{
+	if (query->current_cluster == 0x0)
+	{
+		*sector_addr = volume->no_of_reserved_sectors + 
+			(volume->no_of_fat_tables * volume->fat_size) + query->current_sector;
+	}
+	else
+	{
+		*sector_addr = FIRST_SECTOR_OF_CLUSTER(volume, query->current_cluster) + query->current_sector;
+	}
+	#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+	*sector_offset = query->current_entry_raw_offset;
+	#else
+	*sector_offset = (uint16_t) ((uintptr_t) query->current_entry_raw - (uintptr_t) query->buffer);
+	#endif
+}
+
+/*
+// hashes a short name (11 chars) or a UTF16 long
+// name the same way the names are compared
+*/
+static uint16_t fat_directory_index_hash(unsigned char* name, uint16_t* long_name, uint16_t length)
+{
+	uint16_t i;
+	char c;
+	uint16_t hash = 0;
+
+	for (i = 0; i < length; i++)
+	{
+		c = (name) ? (char) name[i] : (char) long_name[i];
+		if (!c)
+			break;
+		hash = (uint16_t) ((hash << 5) + hash + FAT_TO_UPPER(c));
+	}
+	return hash ? hash : 1;
+}
+
+/*
+// adds a name to the index. Returns zero if the index is full
+*/
+static char fat_directory_index_insert(FAT_VOLUME* volume, uint16_t hash, uint32_t sector_addr, uint16_t sector_offset)
+{
+	uint32_t i;
+
+	if (volume->index_count >= volume->index_size - (volume->index_size >> 2))
+		return 0;
+
+	i = hash & (volume->index_size - 1);
+	while (volume->index_slots[i].hash)
+		i = (i + 1) & (volume->index_size - 1);
+
+	volume->index_slots[i].sector_addr = sector_addr;
+	volume->index_slots[i].sector_offset = sector_offset;
+	volume->index_slots[i].hash = hash;
+	volume->index_count++;
+	return 1;
+}
+
+/*
+// adds a new entry to the index of it's directory. If the
+// directory is being indexed the index is abandoned since
+// the scan may have gone past the new entry
+*/
+static void fat_directory_index_add(FAT_VOLUME* volume, FAT_RAW_DIRECTORY_ENTRY* directory, 
+	FAT_DIRECTORY_ENTRY* entry, char has_lfn)
+{
+	if (volume->index_state == FAT_DIRECTORY_INDEX_NONE || 
+		volume->index_directory != fat_get_directory_cluster(volume, directory))
+		return;
+
+	if (volume->index_state == FAT_DIRECTORY_INDEX_BUILDING ||
+		!fat_directory_index_insert(volume, 
+			fat_directory_index_hash(entry->raw.ENTRY.STD.name, 0, 11), entry->sector_addr, entry->sector_offset) ||
+		(has_lfn && !fat_directory_index_insert(volume, 
+			fat_directory_index_hash(entry->name, 0, 256), entry->sector_addr, entry->sector_offset)))
+	{
+		volume->index_state = FAT_DIRECTORY_INDEX_NONE;
+	}
+}
+
+/*
+// indexes a directory. The buffer must be locked
+// and it's used by the query
+*/
+static void fat_directory_index_build(FAT_VOLUME* volume, uint32_t directory, FAT_QUERY_STATE* query)
+{
+	uint16_t ret;
+	uint32_t sector_addr;
+	uint16_t sector_offset;
+	FAT_RAW_DIRECTORY_ENTRY directory_entry;
+
+	if (!volume->index_slots)
+		return;
+	/*
+	// the query needs an entry for the directory
+	// unless it's the root of a FAT12/16 volume
+	*/
+	memset(&directory_entry, 0, sizeof(directory_entry));
+	directory_entry.ENTRY.STD.attributes = FAT_ATTR_DIRECTORY;
+	directory_entry.ENTRY.STD.first_cluster_lo = LO16(directory);
+	directory_entry.ENTRY.STD.first_cluster_hi = HI16(directory);
+
+	memset(volume->index_slots, 0, volume->index_size * sizeof(FAT_DIRECTORY_INDEX_SLOT));
+	volume->index_count = 0;
+	volume->index_directory = directory;
+	volume->index_state = FAT_DIRECTORY_INDEX_BUILDING;
+	/*
+	// add the short name and long name (if
+	// there's one) of every entry
+	*/
+	ret = fat_query_first_entry(volume, (directory) ? &directory_entry : 0, 0, query, 1);
+	while (ret == FAT_SUCCESS && !IS_LAST_DIRECTORY_ENTRY(query->current_entry_raw))
 	{
-	
+		/*
+		// if an entry was created while we were reading
+		// the FAT the index has been abandoned
+		*/
+		if (volume->index_state != FAT_DIRECTORY_INDEX_BUILDING)
+			return;
+
+		fat_get_query_entry_address(volume, query, &sector_addr, &sector_offset);
+		if (!fat_directory_index_insert(volume, 
+			fat_directory_index_hash(query->current_entry_raw->ENTRY.STD.name, 0, 11), sector_addr, sector_offset))
+		{
+			ret = FAT_UNKNOWN_ERROR;
+			break;
+		}
+		#if !defined(FAT_DISABLE_LONG_FILENAMES)
+		if (query->long_filename[0] && 
+			query->lfn_checksum == fat_long_entry_checksum(query->current_entry_raw->ENTRY.STD.name))
+		{
+			if (!fat_directory_index_insert(volume, 
+				fat_directory_index_hash(0, query->long_filename, 256), sector_addr, sector_offset))
+			{
+				ret = FAT_UNKNOWN_ERROR;
+				break;
+			}
+		}
+		#endif
+		ret = fat_query_next_entry(volume, query, 1, 0);
+	}
+	volume->index_state = (ret == FAT_SUCCESS && volume->index_state == FAT_DIRECTORY_INDEX_BUILDING) ?
+		FAT_DIRECTORY_INDEX_READY : FAT_DIRECTORY_INDEX_NONE;
+}
+
+/*
+// positions a query on an indexed entry. back is the number of
+// bytes before the short entry where the entry starts. Returns 1
+// if the query is on the entry, 0 if the entry is no longer
+// there and -1 if it cannot tell
+*/
+static char fat_directory_index_seek(FAT_VOLUME* volume, FAT_DIRECTORY_INDEX_SLOT* slot, 
+	uint16_t back, FAT_QUERY_STATE* query)
+{
+	uint32_t sector_addr;
+	uint16_t sector_offset;
+	int32_t offset = (int32_t) slot->sector_offset - back;
+	/*
+	// find the cluster and the sector within the cluster
+	// of the short entry
+	*/
+	sector_addr = slot->sector_addr;
+	if (sector_addr < volume->first_data_sector)
+	{
+		query->current_cluster = 0x0;
+		query->current_sector = (uint16_t) (sector_addr - 
+			(volume->no_of_reserved_sectors + (volume->no_of_fat_tables * volume->fat_size)));
+	}
+	else
+	{
+		query->current_cluster = ((sector_addr - volume->first_data_sector) / volume->no_of_sectors_per_cluster) + 2;
+		query->current_sector = (uint16_t) ((sector_addr - volume->first_data_sector) % volume->no_of_sectors_per_cluster);
+	}
+	/*
+	// if the long name starts on a previous cluster
+	// the directory needs to be scanned
+	*/
+	while (offset < 0)
+	{
+		if (!query->current_sector)
+			return -1;
+		query->current_sector--;
+		sector_addr--;
+		offset += volume->no_of_bytes_per_serctor;
+	}
+	if (volume->device->read_sector(volume->device->driver, sector_addr, query->buffer) != STORAGE_SUCCESS)
+		return -1;
+
+	query->Attributes = 0;
+	#if !defined(FAT_DISABLE_LONG_FILENAMES)
+	query->long_filename[0] = 0;
+	query->lfn_sequence = 0;
+	query->lfn_checksum = 0;
+	#endif
+	#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+	query->current_entry_raw = &query->current_entry_raw_mem;
+	query->current_entry_raw_offset = (uint16_t) offset;
+	fat_read_raw_directory_entry(query->current_entry_raw, query->buffer + offset);
+	#else
+	query->first_entry_raw = (FAT_RAW_DIRECTORY_ENTRY*) query->buffer;
+	query->current_entry_raw = (FAT_RAW_DIRECTORY_ENTRY*) (query->buffer + offset);
+	#endif
+	/*
+	// read the entry and make sure that it's the one
+	// that the index points to
+	*/
+	if (fat_query_next_entry(volume, query, 1, 1) != FAT_SUCCESS)
+		return -1;
+	if (IS_LAST_DIRECTORY_ENTRY(query->current_entry_raw))
+		return 0;
+	fat_get_query_entry_address(volume, query, &sector_addr, &sector_offset);
+	return (sector_addr == slot->sector_addr && sector_offset == slot->sector_offset);
+}
+
+/*
+// finds a name on the index of a directory. Returns 1 if the query
+// is on the entry and 0 if the directory needs to be scanned. A name
+// that is not on the index is scanned for too since entries can be
+// moved or written without the index being updated
+*/
+static char fat_directory_index_find(FAT_VOLUME* volume, uint32_t directory, 
+	unsigned char* target_file, uint16_t* target_file_long, FAT_QUERY_STATE* query)
+{
+	uint32_t i;
+	uint16_t hash;
+	uint16_t back = 0;
+	char ret;
+
+	if (volume->index_state != FAT_DIRECTORY_INDEX_READY || volume->index_directory != directory)
+		return 0;
+	/*
+	// if we're looking for a long name it's entries
+	// are right before the short one
+	*/
+	if (target_file_long)
+	{
+		hash = fat_directory_index_hash(0, target_file_long, 256);
+		for (i = 0; target_file_long[i]; i++);
+		back = (uint16_t) (((i + 12) / 13) * 0x20);
+	}
+	else
+	{
+		hash = fat_directory_index_hash(target_file, 0, 11);
+	}
+	/*
+	// check every entry with the same hash
+	*/
+	i = hash & (volume->index_size - 1);
+	while (volume->index_slots[i].hash)
+	{
+		if (volume->index_slots[i].hash == hash)
+		{
+			ret = fat_directory_index_seek(volume, &volume->index_slots[i], back, query);
+			if (ret < 0)
+				return 0;
+			if (ret)
+			{
+				#if !defined(FAT_DISABLE_LONG_FILENAMES)
+				if (target_file_long)
+				{
+					if (fat_compare_long_name(target_file_long, query->long_filename))
+						return 1;
+				}
+				else
+				#endif
+				if (fat_compare_short_name(target_file, query->current_entry_raw->ENTRY.STD.name))
+				{
+					return 1;
+				}
+			}
+		}
+		i = (i + 1) & (volume->index_size - 1);
+	}
+	return 0;
+}
+
+/*
+// gives the volume memory to index a directory
+*/
+uint16_t fat_set_directory_index_buffer(FAT_VOLUME* volume, void* buffer, uint32_t size)
+{
+	uint32_t slots = 16;
+
+	if (buffer && size < slots * sizeof(FAT_DIRECTORY_INDEX_SLOT))
+		return FAT_INVALID_PARAMETERS;
+	/*
+	// use the largest power of 2 number
+	// of slots that fits
+	*/
+	while (slots < 0x10000 && (slots << 1) * sizeof(FAT_DIRECTORY_INDEX_SLOT) <= size)
+		slots <<= 1;
+
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	ENTER_CRITICAL_SECTION(volume->sector_buffer_lock);
+	#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+	ENTER_CRITICAL_SECTION(fat_shared_buffer_lock);
+	#endif
+	volume->index_slots = (FAT_DIRECTORY_INDEX_SLOT*) buffer;
+	volume->index_size = (buffer) ? slots : 0;
+	volume->index_count = 0;
+	volume->index_state = FAT_DIRECTORY_INDEX_NONE;
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
+	#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+	LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+	#endif
+	return FAT_SUCCESS;
+}
+#endif
+
+/*
+// gets a FAT_DIRECTORY_ENTRY by it's full path
+*/
+uint16_t fat_get_file_entry(FAT_VOLUME* volume, char* path, FAT_DIRECTORY_ENTRY* entry) 
+{
+	uint16_t ret;
+	char match;
+	unsigned char target_file[13];
+	unsigned char* pLevel;
+	FAT_RAW_DIRECTORY_ENTRY* current_entry;
+	FAT_RAW_DIRECTORY_ENTRY raw;
+	uint32_t sector_addr;
+	uint16_t sector_offset;
+	FAT_QUERY_STATE_INTERNAL query;
+	/* FAT_QUERY_STATE query; */
+	#if defined(FAT_DENTRY_CACHE) || defined(FAT_DIRECTORY_INDEX)
+	uint32_t parent;
+	#endif
+	#if defined(FAT_DENTRY_CACHE)
+	uint16_t hash;
+	unsigned char folded[FAT_DENTRY_NAME_LENGTH + 1];
+	#endif
+	#if defined(FAT_DIRECTORY_INDEX)
+	uint16_t scanned;
+	#endif
+
+	#if !defined(FAT_DISABLE_LONG_FILENAMES)
+	char using_lfn;
+	/* char using_lfn_and_short; */
+	uint16_t target_file_long[FAT_MAX_PATH + 1];	/* stores the utf16 long filename */
+	unsigned char current_level[FAT_MAX_PATH + 1];
+	#else
+	unsigned char current_level[13];
+	/* unsigned char target_file[13]; */
+	#endif
+
+	#if defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	query.buffer = volume->sector_buffer;
+	#elif defined(FAT_ALLOCATE_SHARED_BUFFER)
+	query.buffer = fat_shared_buffer;
+	#else
+	ALIGN16 unsigned char buffer[MAX_SECTOR_LENGTH];
+	query.buffer = buffer;
+	#endif
+
+
+	/*
+	// if the path starts with a backlash then advance to
+	// the next character
+	*/
+	if (*path == '\\') 
+		path++;
+
+	if (*path != 0) 
+	{
+	
 		/*
 		// set current_entry to 0, in this state
 		// it represents the root directory of the 
@@ -1156,8 +1920,85 @@ uint16_t fat_get_file_entry(FAT_VOLUME* volume, char* path, FAT_DIRECTORY_ENTRY*
 		}
 		*pLevel = 0x0;
 		/*
-		// try to find the first entry
+		// if we've looked up this name on this directory
+		// before use the entry we found then
+		*/
+		#if defined(FAT_DENTRY_CACHE) || defined(FAT_DIRECTORY_INDEX)
+		parent = fat_get_directory_cluster(volume, current_entry);
+		#endif
+		#if defined(FAT_DENTRY_CACHE)
+		hash = fat_dentry_hash(current_level, folded);
+		if (hash && fat_dentry_lookup(volume, parent, folded, hash, &raw, &sector_addr, &sector_offset))
+		{
+			if (IS_LAST_DIRECTORY_ENTRY(&raw))
+			{
+				*entry->name = 0;
+				#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+				LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
+				#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+				LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+				#endif
+				return FAT_SUCCESS;
+			}
+			current_entry = &raw;
+			continue;
+		}
+		#endif
+		/*
+		// get an LFN version of the filename
+		*/
+		#if !defined(FAT_DISABLE_LONG_FILENAMES)
+		using_lfn = 0;
+		/*/using_lfn_and_short = 0;*/
+		/*
+		// format the current level filename to the 8.3 format
+		// if this is an invalid 8.3 filename try to get the LFN
+		*/
+		if (get_short_name_for_entry(target_file, current_level, 1) == FAT_INVALID_FILENAME)
+		{	
+			if (get_long_name_for_entry(target_file_long, current_level) == FAT_INVALID_FILENAME)
+			{
+				#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+				LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
+				#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+				LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+				#endif
+				return FAT_INVALID_FILENAME;
+			}
+			/*
+			// there's no 8.3 name to match
+			*/
+			target_file[0] = 0;
+			using_lfn = 1;
+		}
+		#else
+		/*
+		// format the current level filename to the 8.3 format
+		// if this is an invalid filename return error
 		*/
+		if (get_short_name_for_entry(target_file, current_level, 0) == FAT_INVALID_FILENAME)
+		{
+			#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+			LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
+			#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+			LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+			#endif
+			return FAT_INVALID_FILENAME;
+		}
+		#endif
+		/*
+		// if the directory is indexed go straight to the entry,
+		// otherwise try to find the first entry
+		*/
+		#if defined(FAT_DIRECTORY_INDEX)
+		ret = FAT_SUCCESS;
+		scanned = 0;
+		#if !defined(FAT_DISABLE_LONG_FILENAMES)
+		if (!fat_directory_index_find(volume, parent, target_file, using_lfn ? target_file_long : 0, (FAT_QUERY_STATE*) &query))
+		#else
+		if (!fat_directory_index_find(volume, parent, target_file, 0, (FAT_QUERY_STATE*) &query))
+		#endif
+		#endif
 		ret = fat_query_first_entry(volume, current_entry, 0, (FAT_QUERY_STATE*) &query, 1);
 		/*
 		// if we could not find the entry then
@@ -1179,9 +2020,14 @@ uint16_t fat_get_file_entry(FAT_VOLUME* volume, char* path, FAT_DIRECTORY_ENTRY*
 		if (*query.current_entry_raw->ENTRY.STD.name == 0x0) 
 		{
 			/*
-			// set the name of the entry to 0
+			// set the name of the entry to 0 and
+			// remember that it's not there
 			*/
 			*entry->name = 0;
+			#if defined(FAT_DENTRY_CACHE)
+			if (hash)
+				fat_dentry_insert(volume, parent, folded, hash, 0, 0, 0);
+			#endif
 			/*
 			// unlock buffer
 			*/
@@ -1196,29 +2042,12 @@ uint16_t fat_get_file_entry(FAT_VOLUME* volume, char* path, FAT_DIRECTORY_ENTRY*
 			return FAT_SUCCESS;
 		}
 		/*
-		// get an LFN version of the filename
+		// compare the filename (either short or LFN) to
+		// the one on the current query entry
 		*/
 		#if !defined(FAT_DISABLE_LONG_FILENAMES)
-		using_lfn = 0;
-		/*/using_lfn_and_short = 0;*/
-		/*
-		// format the current level filename to the 8.3 format
-		// if this is an invalid 8.3 filename try to get the LFN
-		// once we get a valid filename (either short or LFN) compare
-		// it to the one on the current query entry
-		*/
-		if (get_short_name_for_entry(target_file, current_level, 1) == FAT_INVALID_FILENAME)
-		{	
-			if (get_long_name_for_entry(target_file_long, current_level) == FAT_INVALID_FILENAME)
-			{
-				#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
-				LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
-				#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
-				LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
-				#endif
-				return FAT_INVALID_FILENAME;
-			}
-			using_lfn = 1;
+		if (using_lfn)
+		{
 			match = fat_compare_long_name(target_file_long, query.long_filename)
 				|| fat_compare_short_name(target_file, query.current_entry_raw->ENTRY.STD.name);
 		}
@@ -1227,22 +2056,6 @@ uint16_t fat_get_file_entry(FAT_VOLUME* volume, char* path, FAT_DIRECTORY_ENTRY*
 			match = fat_compare_short_name(target_file, query.current_entry_raw->ENTRY.STD.name);
 		}
 		#else
-		/*
-		// format the current level filename to the 8.3 format
-		// if this is an invalid filename return error
-		*/
-		if (get_short_name_for_entry(target_file, current_level, 0) == FAT_INVALID_FILENAME)
-		{
-			#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
-			LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
-			#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
-			LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
-			#endif
-			return FAT_INVALID_FILENAME;
-		}
-		/*
-		// match the filename against the current entry
-		*/
 		match = fat_compare_short_name(target_file, query.current_entry_raw->ENTRY.STD.name);
 		#endif
 		/*
@@ -1255,6 +2068,9 @@ uint16_t fat_get_file_entry(FAT_VOLUME* volume, char* path, FAT_DIRECTORY_ENTRY*
 			//  try to get the next file
 			*/
 			ret = fat_query_next_entry(volume, (FAT_QUERY_STATE*) &query, 1, 0);
+			#if defined(FAT_DIRECTORY_INDEX)
+			scanned++;
+			#endif
 			/*
 			// if we received an error message then return
 			// it to the calling function
@@ -1276,6 +2092,21 @@ uint16_t fat_get_file_entry(FAT_VOLUME* volume, char* path, FAT_DIRECTORY_ENTRY*
 			if (IS_LAST_DIRECTORY_ENTRY(query.current_entry_raw))
 			{
 				*entry->name = 0;
+				#if defined(FAT_DENTRY_CACHE)
+				if (hash)
+					fat_dentry_insert(volume, parent, folded, hash, 0, 0, 0);
+				#endif
+				/*
+				// if the directory is large index it unless
+				// the index agrees that the name is not there
+				*/
+				#if defined(FAT_DIRECTORY_INDEX)
+				if (scanned >= FAT_DIRECTORY_INDEX && (volume->index_state != FAT_DIRECTORY_INDEX_READY ||
+					volume->index_directory != parent))
+				{
+					fat_directory_index_build(volume, parent, (FAT_QUERY_STATE*) &query);
+				}
+				#endif
 				#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
 				LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
 				#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
@@ -1301,10 +2132,46 @@ uint16_t fat_get_file_entry(FAT_VOLUME* volume, char* path, FAT_DIRECTORY_ENTRY*
 			#endif
 		}
 		/*
+		// calculate the sector address of the entry - if
+		// query->CurrentCluster equals zero then this is the root
+		// directory of a FAT12/FAT16 volume and the calculation is
+		// different
+		*/
+		if ( query.current_cluster == 0x0 ) 
+		{
+			sector_addr =
+				volume->no_of_reserved_sectors + (volume->no_of_fat_tables * volume->fat_size) +
+				query.current_sector;	
+		}
+		else 
+		{
+			sector_addr = 
+				FIRST_SECTOR_OF_CLUSTER( volume, query.current_cluster) +
+				query.current_sector; /*  + volume->NoOfSectorsPerCluster; */
+		}
+		/*
+		// calculate the offset of the entry within it's sector
+		*/
+		#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+		sector_offset = query.current_entry_raw_offset;
+		#else
+		sector_offset = (uint16_t) 
+			((uintptr_t) query.current_entry_raw) - ((uintptr_t) query.buffer);
+		#endif
+		/*
 		// set the current entry to the entry
-		// that we've just found
+		// that we've just found and remember it
 		*/
-		current_entry = query.current_entry_raw;
+		raw = *query.current_entry_raw;
+		current_entry = &raw;
+		#if defined(FAT_DENTRY_CACHE)
+		if (hash)
+			fat_dentry_insert(volume, parent, folded, hash, &raw, sector_addr, sector_offset);
+		#endif
+		#if defined(FAT_DIRECTORY_INDEX)
+		if (scanned >= FAT_DIRECTORY_INDEX)
+			fat_directory_index_build(volume, parent, (FAT_QUERY_STATE*) &query);
+		#endif
 	}
 	while (*path != 0x0);
 	/*
@@ -1319,55 +2186,105 @@ uint16_t fat_get_file_entry(FAT_VOLUME* volume, char* path, FAT_DIRECTORY_ENTRY*
 	// copy the filename and transform the filename
 	// from the internal structure to the public one
 	*/
-	fat_get_short_name_from_entry(entry->name, query.current_entry_raw->ENTRY.STD.name);
+	fat_get_short_name_from_entry(entry->name, raw.ENTRY.STD.name);
 	/*
 	// copy other data from the internal entry structure
 	// to the public one
 	*/	
-	entry->attributes = query.current_entry_raw->ENTRY.STD.attributes;
-	entry->size = query.current_entry_raw->ENTRY.STD.size;
-	entry->create_time = fat_decode_date_time(query.current_entry_raw->ENTRY.STD.create_date, query.current_entry_raw->ENTRY.STD.create_time);
-	entry->modify_time = fat_decode_date_time(query.current_entry_raw->ENTRY.STD.modify_date, query.current_entry_raw->ENTRY.STD.modify_time);
-	entry->access_time = fat_decode_date_time(query.current_entry_raw->ENTRY.STD.access_date, 0);
+	entry->attributes = raw.ENTRY.STD.attributes;
+	entry->size = raw.ENTRY.STD.size;
+	#if !defined(FAT_LAZY_DIRECTORY_TIMES)
+	entry->create_time = fat_decode_date_time(raw.ENTRY.STD.create_date, raw.ENTRY.STD.create_time);
+	entry->modify_time = fat_decode_date_time(raw.ENTRY.STD.modify_date, raw.ENTRY.STD.modify_time);
+	entry->access_time = fat_decode_date_time(raw.ENTRY.STD.access_date, 0);
+	#endif
+	entry->sector_addr = sector_addr;
+	entry->sector_offset = sector_offset;
 	/*
-	// calculate the sector address of the entry - if
-	// query->CurrentCluster equals zero then this is the root
-	// directory of a FAT12/FAT16 volume and the calculation is
-	// different
+	// store a copy of the original FAT directory entry
+	// within the FAT_DIRECTORY_ENTRY structure that is returned
+	// to users
+	*/
+	entry->raw = raw;
+	/*
+	// return success.
+	*/
+	return FAT_SUCCESS;
+}
+	
+
+#if defined(FAT_QUERY_READ_SECTORS)
+/*
+// loads a directory sector on the query buffer. The sectors that
+// follow it on the cluster, and on the clusters that follow it on
+// the device, are read with it so they're loaded when the query
+// moves to them
+*/
+static uint16_t fat_query_load_sector(FAT_VOLUME* volume, FAT_QUERY_STATE* query, uint32_t sector_address)
+{
+	uint16_t ret;
+	uint16_t count = 1;
+	uint32_t cluster;
+	FAT_ENTRY fat;
+	/*
+	// if the sector is already loaded we're done
+	*/
+	if (query->loaded_sectors && sector_address >= query->loaded_sector_addr &&
+		sector_address < query->loaded_sector_addr + query->loaded_sectors)
+	{
+		query->buffer = query->buff + 
+			(sector_address - query->loaded_sector_addr) * volume->no_of_bytes_per_serctor;
+		return FAT_SUCCESS;
+	}
+	/*
+	// count the sectors that follow it on the device. The root
+	// directory of a FAT12/16 volume is all contiguous
+	*/
+	if (volume->device->read_sectors)
+	{
+		if (query->current_cluster == 0x0)
+		{
+			count = volume->root_directory_sectors - query->current_sector;
+		}
+		else
+		{
+			count = volume->no_of_sectors_per_cluster - query->current_sector;
+			cluster = query->current_cluster;
+			while (count < FAT_QUERY_READ_SECTORS)
+			{
+				ret = fat_get_cluster_entry(volume, cluster, &fat);
+				if (ret != FAT_SUCCESS)
+					return ret;
+				if (fat != cluster + 1)
+					break;
+				cluster = fat;
+				count += volume->no_of_sectors_per_cluster;
+			}
+		}
+		if (count > FAT_QUERY_READ_SECTORS)
+			count = FAT_QUERY_READ_SECTORS;
+	}
+	/*
+	// read the sectors
 	*/
-	if ( query.current_cluster == 0x0 ) 
+	query->loaded_sectors = 0;
+	if (count > 1)
 	{
-		entry->sector_addr =
-			volume->no_of_reserved_sectors + (volume->no_of_fat_tables * volume->fat_size) +
-			query.current_sector;	
+		ret = volume->device->read_sectors(volume->device->driver, sector_address, sector_address + count - 1, query->buff);
 	}
-	else 
+	else
 	{
-		entry->sector_addr = 
-			FIRST_SECTOR_OF_CLUSTER( volume, query.current_cluster) +
-			query.current_sector; /*  + volume->NoOfSectorsPerCluster; */
+		ret = volume->device->read_sector(volume->device->driver, sector_address, query->buff);
 	}
-	/*
-	// calculate the offset of the entry within it's sector
-	*/
-	#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
-	entry->sector_offset = query.current_entry_raw_offset;
-	#else
-	entry->sector_offset = (uint16_t) 
-		((uintptr_t) query.current_entry_raw) - ((uintptr_t) query.buffer);
-	#endif
-	/*
-	// store a copy of the original FAT directory entry
-	// within the FAT_DIRECTORY_ENTRY structure that is returned
-	// to users
-	*/
-	entry->raw = *query.current_entry_raw;
-	/*
-	// return success.
-	*/
+	if (ret != STORAGE_SUCCESS)
+		return FAT_CANNOT_READ_MEDIA;
+
+	query->loaded_sector_addr = sector_address;
+	query->loaded_sectors = count;
+	query->buffer = query->buff;
 	return FAT_SUCCESS;
 }
-	
+#endif
 
 /*
 // initializes a query of a set of directory
@@ -1387,9 +2304,12 @@ uint16_t fat_query_first_entry
 	/* char pass; */
 	/*
 	// make sure the long filename is set to an empty string
+	// and that no lfn entry is expected yet
 	*/
 	#if !defined(FAT_DISABLE_LONG_FILENAMES)
 	query->long_filename[0] = 0;
+	query->lfn_sequence = 0;
+	query->lfn_checksum = 0;
 	#endif
 	/*
 	// if the directory entry has the cluster # set to
@@ -1464,16 +2384,28 @@ uint16_t fat_query_first_entry
 	// read the sector into the query
 	// state buffer
 	*/
-	ret = volume->device->read_sector(volume->device->driver, first_sector, query->buffer);
-	if (ret != STORAGE_SUCCESS)
-		return FAT_CANNOT_READ_MEDIA;
+	query->current_sector = 0;
+	#if defined(FAT_QUERY_READ_SECTORS)
+	if (!buffer_locked)
+	{
+		query->loaded_sectors = 0;
+		ret = fat_query_load_sector(volume, query, first_sector);
+		if (ret != FAT_SUCCESS)
+			return ret;
+	}
+	else
+	#endif
+	{
+		ret = volume->device->read_sector(volume->device->driver, first_sector, query->buffer);
+		if (ret != STORAGE_SUCCESS)
+			return FAT_CANNOT_READ_MEDIA;
+	}
 	/*
 	// set the 1st and current entry pointers
 	// on the query state to the 1st entry of the
 	// directory
 	*/
 	query->Attributes = attributes;
-	query->current_sector = 0;
 
 	#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
 	query->current_entry_raw = &query->current_entry_raw_mem;
@@ -1729,6 +2661,13 @@ uint16_t fat_query_next_entry(FAT_VOLUME* volume, FAT_QUERY_STATE* query, char b
 					if (fat_is_eof_entry(volume, fat)) 
 					{
 						/*
+						// if the buffer is locked it holds the FAT sector now
+						// so it must not be taken for it after we set the
+						// end marker on it
+						*/
+						if (buffer_locked)
+							FAT_SET_LOADED_SECTOR(volume, FAT_UNKNOWN_SECTOR);
+						/*
 						// set the current entry to 0
 						*/
 						*query->current_entry_raw->ENTRY.STD.name = 0;	
@@ -1785,11 +2724,26 @@ uint16_t fat_query_next_entry(FAT_VOLUME* volume, FAT_QUERY_STATE* query, char b
 					}
 				}
 				/*
-				// read the next sector into the query buffer
+				// read the next sector into the query buffer. If it's the
+				// locked buffer it no longer holds the FAT sector that
+				// fat_get_cluster_entry may have loaded
 				*/
-				ret = volume->device->read_sector(volume->device->driver, sector_address, query->buffer);
-				if (ret != STORAGE_SUCCESS)
-					return FAT_CANNOT_READ_MEDIA;
+				#if defined(FAT_QUERY_READ_SECTORS)
+				if (!buffer_locked)
+				{
+					ret = fat_query_load_sector(volume, query, sector_address);
+					if (ret != FAT_SUCCESS)
+						return ret;
+				}
+				else
+				#endif
+				{
+					ret = volume->device->read_sector(volume->device->driver, sector_address, query->buffer);
+					if (buffer_locked)
+						FAT_SET_LOADED_SECTOR(volume, FAT_UNKNOWN_SECTOR);
+					if (ret != STORAGE_SUCCESS)
+						return FAT_CANNOT_READ_MEDIA;
+				}
 				/*
 				// set the 1st and current entry pointers
 				// on the query state to the 1st entry of the
@@ -1855,6 +2809,15 @@ uint16_t fat_query_next_entry(FAT_VOLUME* volume, FAT_QUERY_STATE* query, char b
 				(query->lfn_sequence == (query->current_entry_raw->ENTRY.LFN.lfn_sequence & (0xFF ^ FAT_FIRST_LFN_ENTRY)) + 1))
 			{
 				query->lfn_sequence = query->current_entry_raw->ENTRY.LFN.lfn_sequence & (0xFF ^ FAT_FIRST_LFN_ENTRY );
+				/*
+				// on little endian targets the chars are stored on the entry the
+				// same way as on the name so we copy each of the 3 runs at once
+				*/
+				#if !defined(BIG_ENDIAN)
+				memcpy(&query->long_filename[((query->lfn_sequence - 1) * 13) + 0x0], query->current_entry_raw->ENTRY.LFN.lfn_chars_1, 10);
+				memcpy(&query->long_filename[((query->lfn_sequence - 1) * 13) + 0x5], query->current_entry_raw->ENTRY.LFN.lfn_chars_2, 12);
+				memcpy(&query->long_filename[((query->lfn_sequence - 1) * 13) + 0xB], query->current_entry_raw->ENTRY.LFN.lfn_chars_3, 4);
+				#else
 				((unsigned char*) &query->long_filename[((query->lfn_sequence - 1) * 13) + 0x0])[INT16_BYTE0] = query->current_entry_raw->ENTRY.LFN.lfn_chars_1[0];
 				((unsigned char*) &query->long_filename[((query->lfn_sequence - 1) * 13) + 0x0])[INT16_BYTE1] = query->current_entry_raw->ENTRY.LFN.lfn_chars_1[1];
 				((unsigned char*) &query->long_filename[((query->lfn_sequence - 1) * 13) + 0x1])[INT16_BYTE0] = query->current_entry_raw->ENTRY.LFN.lfn_chars_1[2];
@@ -1881,6 +2844,7 @@ uint16_t fat_query_next_entry(FAT_VOLUME* volume, FAT_QUERY_STATE* query, char b
 				((unsigned char*) &query->long_filename[((query->lfn_sequence - 1) * 13) + 0xB])[INT16_BYTE1] = query->current_entry_raw->ENTRY.LFN.lfn_chars_3[1];
 				((unsigned char*) &query->long_filename[((query->lfn_sequence - 1) * 13) + 0xC])[INT16_BYTE0] = query->current_entry_raw->ENTRY.LFN.lfn_chars_3[2];
 				((unsigned char*) &query->long_filename[((query->lfn_sequence - 1) * 13) + 0xC])[INT16_BYTE1] = query->current_entry_raw->ENTRY.LFN.lfn_chars_3[3];
+				#endif
 			}
 			else
 			{
@@ -1916,7 +2880,7 @@ uint16_t fat_query_next_entry(FAT_VOLUME* volume, FAT_QUERY_STATE* query, char b
 	// with it belongs to it. If it doesn't clear it.
 	*/
 	#if !defined(FAT_DISABLE_LONG_FILENAMES)
-	if (*query->current_entry_raw->ENTRY.STD.name != 0x0)
+	if (*query->current_entry_raw->ENTRY.STD.name != 0x0 && query->long_filename[0] != 0x0)
 	{
 		if (query->lfn_checksum != fat_long_entry_checksum((unsigned char*)query->current_entry_raw->ENTRY.STD.name))
 		{
@@ -1975,42 +2939,69 @@ uint16_t fat_query_next_entry(FAT_VOLUME* volume, FAT_QUERY_STATE* query, char b
 }
 
 /*
-// creates a FAT directory entry
+// fills an lfn entry with it's sequence # and the
+// 13 chars of the long filename that it holds
 */
-#if !defined(FAT_READ_ONLY)
-uint16_t fat_create_directory_entry( 
-	FAT_VOLUME* volume, FAT_RAW_DIRECTORY_ENTRY* parent, 
-	char* name, unsigned char attribs, uint32_t entry_cluster, FAT_DIRECTORY_ENTRY* new_entry) 
+#if !defined(FAT_READ_ONLY) && !defined(FAT_DISABLE_LONG_FILENAMES)
+static void fat_set_long_name_entry(FAT_RAW_DIRECTORY_ENTRY* entry, char* name, unsigned char sequence, unsigned char checksum, char first)
 {
+	uint16_t i, c;
+	/*
+	// set the required fields for this entry
+	*/
+	entry->ENTRY.LFN.lfn_sequence = sequence;
+	entry->ENTRY.LFN.lfn_checksum = checksum;
+	entry->ENTRY.STD.attributes = FAT_ATTR_LONG_NAME;
+	entry->ENTRY.LFN.lfn_first_cluster = 0;
+	entry->ENTRY.LFN.lfn_type = 0;
+	/*
+	// mark entry as the 1st entry if it is so
+	*/
+	if (first)
+		entry->ENTRY.LFN.lfn_sequence = entry->ENTRY.LFN.lfn_sequence | FAT_FIRST_LFN_ENTRY;
+	/*
+	// copy the lfn chars
+	*/
+	c = strlen(name);
+	i = ((sequence - 1) * 13);
+	entry->ENTRY.LFN.lfn_chars_1[0x0] = LO8((i + 0x0 > c) ? 0xFFFF : (uint16_t) name[i + 0x0]);
+	entry->ENTRY.LFN.lfn_chars_1[0x1] = HI8((i + 0x0 > c) ? 0xFFFF : (uint16_t) name[i + 0x0]);
+	entry->ENTRY.LFN.lfn_chars_1[0x2] = LO8((i + 0x1 > c) ? 0xFFFF : (uint16_t) name[i + 0x1]);
+	entry->ENTRY.LFN.lfn_chars_1[0x3] = HI8((i + 0x1 > c) ? 0xFFFF : (uint16_t) name[i + 0x1]);
+	entry->ENTRY.LFN.lfn_chars_1[0x4] = LO8((i + 0x2 > c) ? 0xFFFF : (uint16_t) name[i + 0x2]);
+	entry->ENTRY.LFN.lfn_chars_1[0x5] = HI8((i + 0x2 > c) ? 0xFFFF : (uint16_t) name[i + 0x2]);
+	entry->ENTRY.LFN.lfn_chars_1[0x6] = LO8((i + 0x3 > c) ? 0xFFFF : (uint16_t) name[i + 0x3]);
+	entry->ENTRY.LFN.lfn_chars_1[0x7] = HI8((i + 0x3 > c) ? 0xFFFF : (uint16_t) name[i + 0x3]);
+	entry->ENTRY.LFN.lfn_chars_1[0x8] = LO8((i + 0x4 > c) ? 0xFFFF : (uint16_t) name[i + 0x4]);
+	entry->ENTRY.LFN.lfn_chars_1[0x9] = HI8((i + 0x4 > c) ? 0xFFFF : (uint16_t) name[i + 0x4]);
+	entry->ENTRY.LFN.lfn_chars_2[0x0] = LO8((i + 0x5 > c) ? 0xFFFF : (uint16_t) name[i + 0x5]);
+	entry->ENTRY.LFN.lfn_chars_2[0x1] = HI8((i + 0x5 > c) ? 0xFFFF : (uint16_t) name[i + 0x5]);
+	entry->ENTRY.LFN.lfn_chars_2[0x2] = LO8((i + 0x6 > c) ? 0xFFFF : (uint16_t) name[i + 0x6]);
+	entry->ENTRY.LFN.lfn_chars_2[0x3] = HI8((i + 0x6 > c) ? 0xFFFF : (uint16_t) name[i + 0x6]);
+	entry->ENTRY.LFN.lfn_chars_2[0x4] = LO8((i + 0x7 > c) ? 0xFFFF : (uint16_t) name[i + 0x7]);
+	entry->ENTRY.LFN.lfn_chars_2[0x5] = HI8((i + 0x7 > c) ? 0xFFFF : (uint16_t) name[i + 0x7]);
+	entry->ENTRY.LFN.lfn_chars_2[0x6] = LO8((i + 0x8 > c) ? 0xFFFF : (uint16_t) name[i + 0x8]);
+	entry->ENTRY.LFN.lfn_chars_2[0x7] = HI8((i + 0x8 > c) ? 0xFFFF : (uint16_t) name[i + 0x8]);
+	entry->ENTRY.LFN.lfn_chars_2[0x8] = LO8((i + 0x9 > c) ? 0xFFFF : (uint16_t) name[i + 0x9]);
+	entry->ENTRY.LFN.lfn_chars_2[0x9] = HI8((i + 0x9 > c) ? 0xFFFF : (uint16_t) name[i + 0x9]);
+	entry->ENTRY.LFN.lfn_chars_2[0xA] = LO8((i + 0xA > c) ? 0xFFFF : (uint16_t) name[i + 0xA]);
+	entry->ENTRY.LFN.lfn_chars_2[0xB] = HI8((i + 0xA > c) ? 0xFFFF : (uint16_t) name[i + 0xA]);
+	entry->ENTRY.LFN.lfn_chars_3[0x0] = LO8((i + 0xB > c) ? 0xFFFF : (uint16_t) name[i + 0xB]);
+	entry->ENTRY.LFN.lfn_chars_3[0x1] = HI8((i + 0xB > c) ? 0xFFFF : (uint16_t) name[i + 0xB]);
+	entry->ENTRY.LFN.lfn_chars_3[0x2] = LO8((i + 0xC > c) ? 0xFFFF : (uint16_t) name[i + 0xC]);
+	entry->ENTRY.LFN.lfn_chars_3[0x3] = HI8((i + 0xC > c) ? 0xFFFF : (uint16_t) name[i + 0xC]);
+}
+#endif
 
+/*
+// checks that a filename is valid
+*/
+#if !defined(FAT_READ_ONLY)
+static uint16_t fat_check_filename(char* name)
+{
 	uint16_t ret;
 	int16_t char_index;
 	uint16_t illegal_char;
-	uint16_t entries_count = 0;
-	uint32_t sector;
-	uint32_t first_sector_of_cluster = 0;
-	uintptr_t last_entry_address;
-	FAT_ENTRY fat;
-	FAT_ENTRY last_fat;
-	FAT_RAW_DIRECTORY_ENTRY* parent_entry;
-	#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
-	FAT_RAW_DIRECTORY_ENTRY parent_entry_mem;
-	uint16_t parent_entry_offset;
-	#endif
-
-	#if !defined(FAT_DISABLE_LONG_FILENAMES)
-	char no_of_lfn_entries_needed = 0;
-	char no_of_lfn_entries_found;
-	char lfn_checksum;
-	#endif
-	
-	#if defined(FAT_ALLOCATE_VOLUME_BUFFER)
-	unsigned char* buffer = volume->sector_buffer;
-	#elif defined(FAT_ALLOCATE_SHARED_BUFFER)
-	unsigned char* buffer = fat_shared_buffer;
-	#else
-	ALIGN16 unsigned char buffer[MAX_SECTOR_LENGTH];
-	#endif
 
 	/*
 	// get the length of the filename
@@ -2088,6 +3079,249 @@ uint16_t fat_create_directory_entry(
 			}
 		}
 	}
+	return FAT_SUCCESS;
+}
+#endif
+
+/*
+// checks if an 8.3 name is made of the 1st chars of a base name
+// followed by a ~N tail and has the same extension. Returns N if
+// it is and 0 otherwise
+*/
+#if !defined(FAT_READ_ONLY) && !defined(FAT_DISABLE_LONG_FILENAMES)
+static uint16_t fat_get_short_name_tail(unsigned char* name, unsigned char* base, unsigned char base_length)
+{
+	unsigned char i;
+	unsigned char tilde = 8;
+	uint16_t tail = 0;
+
+	if (memcmp(name + 8, base + 8, 3))
+		return 0;
+	/*
+	// the base name may also have a ~ so we
+	// look for the last one
+	*/
+	for (i = 0; i < 8; i++)
+		if (name[i] == '~')
+			tilde = i;
+
+	if (tilde == 8 || tilde > base_length || memcmp(name, base, tilde))
+		return 0;
+
+	for (i = tilde + 1; i < 8 && name[i] >= '0' && name[i] <= '9'; i++)
+		tail = (tail * 10) + (name[i] - '0');
+	/*
+	// the base is truncated so that the tail fits
+	// in 8 chars and the rest is padded with spaces
+	*/
+	if (i == tilde + 1 || tilde != MIN(base_length, 7 - (i - tilde - 1)))
+		return 0;
+	for (; i < 8; i++)
+		if (name[i] != 0x20)
+			return 0;
+	return tail;
+}
+
+/*
+// writes an 8.3 name made of the 1st length chars of
+// a base name followed by a ~N tail
+*/
+static void fat_set_short_name_tail(unsigned char* name, unsigned char* base, unsigned char length, unsigned char tail)
+{
+	unsigned char i;
+
+	memcpy(name, base, length);
+	name[length] = '~';
+	name[length + 1] = '0' + tail;
+	for (i = length + 2; i < 8; i++)
+		name[i] = 0x20;
+	memcpy(name + 8, base + 8, 3);
+}
+
+/*
+// hashes a long filename for it's hashed short name
+*/
+static uint16_t fat_get_short_name_hash(char* name)
+{
+	uint16_t hash = 0;
+	for (; *name; name++)
+		hash = (hash << 5) + hash + (unsigned char) *name;
+	return hash;
+}
+
+/*
+// builds the hashed base of a short name by replacing all but
+// the 1st 2 chars of the base with 4 hex digits of the hash
+*/
+static void fat_get_hashed_short_name_base(unsigned char* base, uint16_t hash, unsigned char* hashed_base)
+{
+	static const char hex_digits[] = "0123456789ABCDEF";
+	unsigned char i;
+
+	memcpy(hashed_base, base, 11);
+	for (i = 0; i < 2 && base[i] != 0x20; i++);
+	hashed_base[i++] = hex_digits[(hash >> 12) & 0xF];
+	hashed_base[i++] = hex_digits[(hash >> 8) & 0xF];
+	hashed_base[i++] = hex_digits[(hash >> 4) & 0xF];
+	hashed_base[i++] = hex_digits[hash & 0xF];
+	for (; i < 8; i++)
+		hashed_base[i] = 0x20;
+}
+
+/*
+// if an 8.3 name uses one of the ~1..~9 tails of the base or the
+// hashed base it marks it as used. Bits 1-9 of used_tails are for
+// the base and bits 17-25 for the hashed base
+*/
+static void fat_mark_short_name_tails(unsigned char* name, unsigned char* base, unsigned char* hashed_base, uint32_t* used_tails)
+{
+	uint16_t tail;
+	unsigned char length;
+
+	for (length = 0; length < 8 && base[length] != 0x20; length++);
+	tail = fat_get_short_name_tail(name, base, length);
+	if (tail && tail < 10)
+		*used_tails |= (uint32_t) 1 << tail;
+
+	for (length = 0; length < 8 && hashed_base[length] != 0x20; length++);
+	tail = fat_get_short_name_tail(name, hashed_base, length);
+	if (tail && tail < 10)
+		*used_tails |= (uint32_t) 1 << (tail + 16);
+}
+
+/*
+// writes the short name with the 1st free tail, first on the base
+// and then on the hashed base. Returns 0 if all tails are used
+*/
+static char fat_pick_short_name_tail(unsigned char* short_name, unsigned char* base, unsigned char* hashed_base, uint32_t used_tails)
+{
+	unsigned char tail;
+	unsigned char length;
+
+	for (length = 0; length < 8 && base[length] != 0x20; length++);
+	for (tail = 1; tail < 10; tail++)
+	{
+		if (!(used_tails & ((uint32_t) 1 << tail)))
+		{
+			fat_set_short_name_tail(short_name, base, MIN(length, 6), tail);
+			return 1;
+		}
+	}
+	for (length = 0; length < 8 && hashed_base[length] != 0x20; length++);
+	for (tail = 1; tail < 10; tail++)
+	{
+		if (!(used_tails & ((uint32_t) 1 << (tail + 16))))
+		{
+			fat_set_short_name_tail(short_name, hashed_base, length, tail);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+// picks a free ~N tail for the short name of a long filename. The
+// 1st 9 tails are tried on the base name and after that the base is
+// replaced by it's 1st 2 chars and 4 hex digits of a hash of the
+// long name. The directory is scanned once to find which tails are
+// used on both bases
+*/
+static uint16_t fat_generate_short_name(FAT_VOLUME* volume, FAT_RAW_DIRECTORY_ENTRY* parent, char* name, unsigned char* short_name)
+{
+	uint16_t ret;
+	uint16_t hash;
+	uint16_t first_hash;
+	uint32_t used_tails;
+	unsigned char base[11];
+	unsigned char hashed_base[11];
+	FAT_QUERY_STATE query;
+
+	memcpy(base, short_name, 11);
+	hash = first_hash = fat_get_short_name_hash(name);
+	used_tails = 0;
+
+	do
+	{
+		fat_get_hashed_short_name_base(base, hash, hashed_base);
+		used_tails &= 0xFFFF;
+		/*
+		// loop through all entries in the parent directory
+		// and mark the tails that are used
+		*/
+		memset(&query, 0, sizeof(query));
+		query.buffer = query.buff;
+		ret = fat_query_first_entry(volume, parent, 0, &query, 0);
+		if (ret != FAT_SUCCESS)
+			return ret;
+
+		while (*query.current_entry_raw->ENTRY.STD.name != 0)
+		{
+			fat_mark_short_name_tails(query.current_entry_raw->ENTRY.STD.name, base, hashed_base, &used_tails);
+			ret = fat_query_next_entry(volume, &query, 0, 0);
+			if (ret != FAT_SUCCESS)
+				return ret;
+		}
+		/*
+		// use the 1st free tail
+		*/
+		if (fat_pick_short_name_tail(short_name, base, hashed_base, used_tails))
+			return FAT_SUCCESS;
+		/*
+		// all tails on the hashed base are taken so
+		// we try again with the next hash
+		*/
+		hash++;
+	}
+	while (hash != first_hash);
+
+	return FAT_DIRECTORY_LIMIT_EXCEEDED;
+}
+#endif
+
+/*
+// creates a FAT directory entry
+*/
+#if !defined(FAT_READ_ONLY)
+uint16_t fat_create_directory_entry( 
+	FAT_VOLUME* volume, FAT_RAW_DIRECTORY_ENTRY* parent, 
+	char* name, unsigned char attribs, uint32_t entry_cluster, FAT_DIRECTORY_ENTRY* new_entry) 
+{
+
+	uint16_t ret;
+	uint16_t entries_count = 0;
+	uint32_t sector;
+	uint32_t first_sector_of_cluster = 0;
+	uintptr_t last_entry_address;
+	FAT_ENTRY fat;
+	FAT_ENTRY last_fat;
+	FAT_RAW_DIRECTORY_ENTRY* parent_entry;
+	#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+	FAT_RAW_DIRECTORY_ENTRY parent_entry_mem;
+	uint16_t parent_entry_offset;
+	#endif
+
+	#if !defined(FAT_DISABLE_LONG_FILENAMES)
+	char no_of_lfn_entries_needed = 0;
+	char no_of_lfn_entries_found;
+	char lfn_checksum;
+	#endif
+	
+	#if defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	unsigned char* buffer = volume->sector_buffer;
+	#elif defined(FAT_ALLOCATE_SHARED_BUFFER)
+	unsigned char* buffer = fat_shared_buffer;
+	#else
+	ALIGN16 unsigned char buffer[MAX_SECTOR_LENGTH];
+	#endif
+
+	/*
+	// make sure that the filename is valid
+	*/
+	ret = fat_check_filename(name);
+	if (ret != FAT_SUCCESS)
+	{
+		return ret;
+	}
 	/*
 	// initialize the raw entry
 	// todo: check if no other functions are initializing
@@ -2111,75 +3345,15 @@ uint16_t fat_create_directory_entry(
 	/*
 	// if this is going to be an lfn entry we need to make
 	// sure that the short filename is available
-	*/
-	#if !defined(FAT_DISABLE_LONG_FILENAMES)
-	if (ret == FAT_LFN_GENERATED)
-	{
-		FAT_QUERY_STATE query;
-		uint16_t name_suffix = 0;
-		char is_valid_entry;
-		char name_suffix_str[6];
-		unsigned char i, c;
-
-		do
-		{
-			is_valid_entry = 1;
-
-			memset(&query, 0, sizeof(query));
-			query.buffer = query.buff;
-			ret = fat_query_first_entry(volume, parent, 0, &query, 0);
-			if (ret != FAT_SUCCESS)
-			{
-				return ret;
-			}
-
-			sprintf(name_suffix_str, "~%i", name_suffix);
-
-			for (i = 0; i <  8 - (char) strlen(name_suffix_str); i++)
-				if (new_entry->raw.ENTRY.STD.name[i] == 0x20)
-					break;
-
-			for (c = 0; c < (char) strlen(name_suffix_str); c++)
-				new_entry->raw.ENTRY.STD.name[i++] = name_suffix_str[c];
-			/*
-			// loop through all entries in the parent directory
-			// and if we find one with the same name as hours mark the name
-			// as invalid
-			*/
-			while (*query.current_entry_raw->ENTRY.STD.name != 0)
-			{
-				if (memcmp(query.current_entry_raw->ENTRY.STD.name, new_entry->raw.ENTRY.STD.name, 11) == 0)
-				{
-					is_valid_entry = 0;
-					break;
-				}
-				ret = fat_query_next_entry(volume, &query, 0, 0);
-				if (ret != FAT_SUCCESS)
-				{
-					return ret;
-				}
-			}
-			/*
-			// if the filename is taken we need to compute a new one
-			*/
-			if (!is_valid_entry)
-			{
-				/*
-				// create the filename suffix and append it after
-				// the last char or replace the end of the filename
-				// with it.
-				*/
-				sprintf(name_suffix_str, "~%i", name_suffix++);
-
-				for (i = 0; i <  8 - (char) strlen(name_suffix_str); i++)
-					if (new_entry->raw.ENTRY.STD.name[i] == 0x20)
-						break;
-
-				for (c = 0; c < (char) strlen(name_suffix_str); c++)
-					new_entry->raw.ENTRY.STD.name[i++] = name_suffix_str[c];
-			}
+	*/
+	#if !defined(FAT_DISABLE_LONG_FILENAMES)
+	if (ret == FAT_LFN_GENERATED)
+	{
+		ret = fat_generate_short_name(volume, parent, name, new_entry->raw.ENTRY.STD.name);
+		if (ret != FAT_SUCCESS)
+		{
+			return ret;
 		}
-		while (!is_valid_entry);
 		/*
 		// calculate the # of entries needed to store the lfn
 		// including the actual entry
@@ -2217,9 +3391,11 @@ uint16_t fat_create_directory_entry(
 	new_entry->raw.ENTRY.STD.modify_date = new_entry->raw.ENTRY.STD.create_date;
 	new_entry->raw.ENTRY.STD.modify_time = new_entry->raw.ENTRY.STD.create_time;
 	new_entry->raw.ENTRY.STD.access_date = new_entry->raw.ENTRY.STD.create_date;
+	#if !defined(FAT_LAZY_DIRECTORY_TIMES)
 	new_entry->create_time = fat_decode_date_time(new_entry->raw.ENTRY.STD.create_date, new_entry->raw.ENTRY.STD.create_time);
 	new_entry->modify_time = fat_decode_date_time(new_entry->raw.ENTRY.STD.modify_date, new_entry->raw.ENTRY.STD.modify_time);
 	new_entry->access_time = fat_decode_date_time(new_entry->raw.ENTRY.STD.access_date, 0);
+	#endif
 
 	/*
 	// there's no fat entry that points to the 1st cluster of
@@ -2391,6 +3567,9 @@ uint16_t fat_create_directory_entry(
 						#endif
 						return FAT_CANNOT_WRITE_MEDIA;
 					}
+					#if defined(FAT_DIRECTORY_INDEX)
+					fat_directory_index_add(volume, parent, new_entry, 0);
+					#endif
 					/*
 					// release the lock on the buffer
 					*/
@@ -2400,6 +3579,12 @@ uint16_t fat_create_directory_entry(
 					LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
 					#endif
 					/*
+					// the name is no longer missing from the parent
+					*/
+					#if defined(FAT_DENTRY_CACHE)
+					fat_dentry_cache_invalidate(volume, parent, 1);
+					#endif
+					/*
 					// store the sector and offset of the entry and go
 					*/
 					return FAT_SUCCESS;
@@ -2457,7 +3642,7 @@ uint16_t fat_create_directory_entry(
 										fat = last_fat;
 										first_sector_of_cluster = FIRST_SECTOR_OF_CLUSTER(volume, fat);
 									}
-									sector = first_sector_of_cluster + volume->no_of_sectors_per_cluster;
+									sector = first_sector_of_cluster + volume->no_of_sectors_per_cluster - 1;
 								}
 								/*
 								// read the last sector to the cache, calculate the last
@@ -2494,51 +3679,12 @@ uint16_t fat_create_directory_entry(
 						{
 							if (no_of_lfn_entries_found)
 							{
-								uint16_t i, c;
 								/*
 								// set the required fields for this entry
+								// and copy the lfn chars
 								*/
-								parent_entry->ENTRY.LFN.lfn_sequence = (unsigned char) no_of_lfn_entries_found;
-								parent_entry->ENTRY.LFN.lfn_checksum = lfn_checksum;
-								parent_entry->ENTRY.STD.attributes = FAT_ATTR_LONG_NAME;
-								parent_entry->ENTRY.LFN.lfn_first_cluster = 0;
-								parent_entry->ENTRY.LFN.lfn_type = 0;
-								/*
-								// mark entry as the 1st entry if it is so
-								*/
-								if (no_of_lfn_entries_found == no_of_lfn_entries_needed - 1)
-									parent_entry->ENTRY.LFN.lfn_sequence = parent_entry->ENTRY.LFN.lfn_sequence | FAT_FIRST_LFN_ENTRY;
-								/*
-								// copy the lfn chars
-								*/
-								c = strlen(name);
-								i = ((no_of_lfn_entries_found - 1) * 13);
-								parent_entry->ENTRY.LFN.lfn_chars_1[0x0] = LO8((i + 0x0 > c) ? 0xFFFF : (uint16_t) name[i + 0x0]);
-								parent_entry->ENTRY.LFN.lfn_chars_1[0x1] = HI8((i + 0x0 > c) ? 0xFFFF : (uint16_t) name[i + 0x0]);
-								parent_entry->ENTRY.LFN.lfn_chars_1[0x2] = LO8((i + 0x1 > c) ? 0xFFFF : (uint16_t) name[i + 0x1]);
-								parent_entry->ENTRY.LFN.lfn_chars_1[0x3] = HI8((i + 0x1 > c) ? 0xFFFF : (uint16_t) name[i + 0x1]);
-								parent_entry->ENTRY.LFN.lfn_chars_1[0x4] = LO8((i + 0x2 > c) ? 0xFFFF : (uint16_t) name[i + 0x2]);
-								parent_entry->ENTRY.LFN.lfn_chars_1[0x5] = HI8((i + 0x2 > c) ? 0xFFFF : (uint16_t) name[i + 0x2]);
-								parent_entry->ENTRY.LFN.lfn_chars_1[0x6] = LO8((i + 0x3 > c) ? 0xFFFF : (uint16_t) name[i + 0x3]);
-								parent_entry->ENTRY.LFN.lfn_chars_1[0x7] = HI8((i + 0x3 > c) ? 0xFFFF : (uint16_t) name[i + 0x3]);
-								parent_entry->ENTRY.LFN.lfn_chars_1[0x8] = LO8((i + 0x4 > c) ? 0xFFFF : (uint16_t) name[i + 0x4]);
-								parent_entry->ENTRY.LFN.lfn_chars_1[0x9] = HI8((i + 0x4 > c) ? 0xFFFF : (uint16_t) name[i + 0x4]);
-								parent_entry->ENTRY.LFN.lfn_chars_2[0x0] = LO8((i + 0x5 > c) ? 0xFFFF : (uint16_t) name[i + 0x5]);
-								parent_entry->ENTRY.LFN.lfn_chars_2[0x1] = HI8((i + 0x5 > c) ? 0xFFFF : (uint16_t) name[i + 0x5]);
-								parent_entry->ENTRY.LFN.lfn_chars_2[0x2] = LO8((i + 0x6 > c) ? 0xFFFF : (uint16_t) name[i + 0x6]);
-								parent_entry->ENTRY.LFN.lfn_chars_2[0x3] = HI8((i + 0x6 > c) ? 0xFFFF : (uint16_t) name[i + 0x6]);
-								parent_entry->ENTRY.LFN.lfn_chars_2[0x4] = LO8((i + 0x7 > c) ? 0xFFFF : (uint16_t) name[i + 0x7]);
-								parent_entry->ENTRY.LFN.lfn_chars_2[0x5] = HI8((i + 0x7 > c) ? 0xFFFF : (uint16_t) name[i + 0x7]);
-								parent_entry->ENTRY.LFN.lfn_chars_2[0x6] = LO8((i + 0x8 > c) ? 0xFFFF : (uint16_t) name[i + 0x8]);
-								parent_entry->ENTRY.LFN.lfn_chars_2[0x7] = HI8((i + 0x8 > c) ? 0xFFFF : (uint16_t) name[i + 0x8]);
-								parent_entry->ENTRY.LFN.lfn_chars_2[0x8] = LO8((i + 0x9 > c) ? 0xFFFF : (uint16_t) name[i + 0x9]);
-								parent_entry->ENTRY.LFN.lfn_chars_2[0x9] = HI8((i + 0x9 > c) ? 0xFFFF : (uint16_t) name[i + 0x9]);
-								parent_entry->ENTRY.LFN.lfn_chars_2[0xA] = LO8((i + 0xA > c) ? 0xFFFF : (uint16_t) name[i + 0xA]);
-								parent_entry->ENTRY.LFN.lfn_chars_2[0xB] = HI8((i + 0xA > c) ? 0xFFFF : (uint16_t) name[i + 0xA]);
-								parent_entry->ENTRY.LFN.lfn_chars_3[0x0] = LO8((i + 0xB > c) ? 0xFFFF : (uint16_t) name[i + 0xB]);
-								parent_entry->ENTRY.LFN.lfn_chars_3[0x1] = HI8((i + 0xB > c) ? 0xFFFF : (uint16_t) name[i + 0xB]);
-								parent_entry->ENTRY.LFN.lfn_chars_3[0x2] = LO8((i + 0xC > c) ? 0xFFFF : (uint16_t) name[i + 0xC]);
-								parent_entry->ENTRY.LFN.lfn_chars_3[0x3] = HI8((i + 0xC > c) ? 0xFFFF : (uint16_t) name[i + 0xC]);
+								fat_set_long_name_entry(parent_entry, name, (unsigned char) no_of_lfn_entries_found, lfn_checksum,
+									no_of_lfn_entries_found == no_of_lfn_entries_needed - 1);
 								/*
 								// write updated entry to buffer
 								*/
@@ -2703,6 +3849,9 @@ uint16_t fat_create_directory_entry(
 						#else
 						new_entry->sector_offset = (uintptr_t) parent_entry - (uintptr_t) buffer;
 						#endif
+						#if defined(FAT_DIRECTORY_INDEX)
+						fat_directory_index_add(volume, parent, new_entry, no_of_lfn_entries_needed > 0);
+						#endif
 						/*
 						// release the lock on the buffer
 						*/
@@ -2712,51 +3861,487 @@ uint16_t fat_create_directory_entry(
 						LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
 						#endif
 						/*
+						// the name is no longer missing from the parent
+						*/
+						#if defined(FAT_DENTRY_CACHE)
+						fat_dentry_cache_invalidate(volume, parent, 1);
+						#endif
+						/*
 						// we're done!!!!!
 						*/
 						return FAT_SUCCESS;
 					}
 					#endif
 				}
-				#if !defined(FAT_DISABLE_LONG_FILENAMES)
+				#if !defined(FAT_DISABLE_LONG_FILENAMES)
+				else
+				{
+					no_of_lfn_entries_found = 0;
+				}
+				#endif
+				/*
+				// move the parent entry pointer to
+				// the next entry in the sector
+				*/
+				#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+				/* fat_write_raw_directory_entry(parent_entry, buffer + parent_entry_offset); */
+				parent_entry_offset += 0x20;
+				fat_read_raw_directory_entry(parent_entry, buffer + parent_entry_offset);
+				#else
+				parent_entry++;
+				#endif
+			}
+			/*
+			// move to the next sector in the cluster
+			*/
+			sector++;
+			/*
+			// make sure that we don't overflow the root directory
+			// on FAT12/16 volumes
+			*/
+			if (!fat)
+			{
+				if (sector > first_sector_of_cluster + volume->root_directory_sectors)
+				{
+					#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+					LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
+					#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+					LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+					#endif
+					return FAT_ROOT_DIRECTORY_LIMIT_EXCEEDED;
+				}
+			}
+		}
+		/*
+		// the following functions need the buffer so we must
+		// release it's lock before calling them
+		*/
+		#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+		LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
+		#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+		LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+		#endif
+		/*
+		// get the next cluster, we'll remember the last one in
+		// case we need to rewind to write lfn entries
+		*/
+		last_fat = fat;
+		ret = fat_get_cluster_entry( volume, fat, &fat );
+		if (ret != FAT_SUCCESS)
+			return ret;
+		/*
+		// if this is the end of the FAT chain allocate
+		// a new cluster to this folder and continue
+		*/
+		if (fat_is_eof_entry(volume, fat))
+		{
+			FAT_ENTRY newfat;
+			/*
+			// allocate the cluster
+			*/
+			newfat = fat_allocate_data_cluster(volume, 1, 1, &ret);
+			if (ret != FAT_SUCCESS) 
+				return ret;
+			/*
+			// link it to the cluster chain
+			*/
+			ret = fat_set_cluster_entry(volume, last_fat, newfat);
+			if (ret != FAT_SUCCESS) 
+				return ret;
+			fat = newfat;
+		}
+		/*
+		// re-acquire the lock on the buffer
+		*/
+		#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+		ENTER_CRITICAL_SECTION(volume->sector_buffer_lock);
+		#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+		ENTER_CRITICAL_SECTION(fat_shared_buffer_lock);
+		#endif
+		/*
+		// mark the loaded sector as unknown
+		*/
+		FAT_SET_LOADED_SECTOR(volume, FAT_UNKNOWN_SECTOR);
+	}
+	while (1);
+}
+#endif
+
+/*
+// writes the index'th directory entry of a new file to the
+// buffer. While the entries are being created entry->size holds
+// the # of lfn entries needed, which go before the 8.3 entry
+*/
+#if !defined(FAT_READ_ONLY)
+static void fat_write_new_entry(FAT_DIRECTORY_ENTRY* entry, unsigned char index, unsigned char* buffer)
+{
+	FAT_RAW_DIRECTORY_ENTRY raw;
+
+	#if !defined(FAT_DISABLE_LONG_FILENAMES)
+	if (index < entry->size)
+	{
+		memset(&raw, 0, sizeof(raw));
+		fat_set_long_name_entry(&raw, (char*) entry->name, (unsigned char) (entry->size - index),
+			fat_long_entry_checksum(entry->raw.ENTRY.STD.name), index == 0);
+	}
+	else
+	#endif
+	{
+		raw = entry->raw;
+	}
+	#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+	fat_write_raw_directory_entry(&raw, buffer);
+	#else
+	*((FAT_RAW_DIRECTORY_ENTRY*) buffer) = raw;
+	#endif
+}
+
+/*
+// compares two filenames ignoring case
+*/
+static char fat_compare_filename(char* name1, char* name2)
+{
+	for (; FAT_TO_UPPER(*name1) == FAT_TO_UPPER(*name2); name1++, name2++)
+		if (*name1 == 0x0)
+			return 1;
+	return 0;
+}
+
+/*
+// creates several files on the same directory
+*/
+uint16_t fat_create_files(FAT_VOLUME* volume, char* dir_path, char** names, uint16_t count,
+	unsigned char access_flags, FAT_FILE* handles, FAT_DIRECTORY_ENTRY* entries)
+{
+	uint16_t ret;
+	uint16_t i;
+	uint16_t j;
+	uint16_t fat_date;
+	uint16_t fat_time;
+	uint16_t offset;
+	uint16_t entries_count = 0;
+	uint32_t sector;
+	uint32_t first_sector_of_cluster = 0;
+	unsigned char slot = 0;
+	unsigned char run = 0;
+	unsigned char needed;
+	char end_reached = 0;
+	char new_cluster = 0;
+	char dirty;
+	FAT_ENTRY fat;
+	FAT_ENTRY last_fat;
+	FAT_DIRECTORY_ENTRY parent;
+	FAT_DIRECTORY_ENTRY* entry;
+	FAT_QUERY_STATE query;
+	#if !defined(FAT_DISABLE_LONG_FILENAMES)
+	unsigned char base[11];
+	unsigned char hashed_base[11];
+	unsigned char short_name[13];
+	#endif
+	#if defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	unsigned char* buffer = volume->sector_buffer;
+	#elif defined(FAT_ALLOCATE_SHARED_BUFFER)
+	unsigned char* buffer = fat_shared_buffer;
+	#else
+	ALIGN16 unsigned char buffer[MAX_SECTOR_LENGTH];
+	#endif
+
+	if (!count)
+		return FAT_SUCCESS;
+	if (!names || (!handles && !entries))
+		return FAT_INVALID_PARAMETERS;
+	/*
+	// get the entry of the directory
+	*/
+	ret = fat_get_file_entry(volume, dir_path, &parent);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	if (*parent.name == 0)
+		return FAT_DIRECTORY_DOES_NOT_EXIST;
+	if (!(parent.attributes & FAT_ATTR_DIRECTORY))
+		return FAT_NOT_A_DIRECTORY;
+	/*
+	// check the filenames and format their short names. Until
+	// the entries are written sector_addr holds the ~N tails used
+	// on the short name bases, sector_offset the hash of the name
+	// and size the # of lfn entries needed
+	*/
+	for (i = 0; i < count; i++)
+	{
+		entry = (handles) ? &handles[i].directory_entry : &entries[i];
+		ret = fat_check_filename(names[i]);
+		if (ret != FAT_SUCCESS)
+			return ret;
+
+		memset(&entry->raw, 0, sizeof(entry->raw));
+		ret = get_short_name_for_entry(entry->raw.ENTRY.STD.name, (unsigned char*) names[i], 0);
+		if (ret != FAT_SUCCESS && ret != FAT_LFN_GENERATED)
+			return FAT_INVALID_FILENAME;
+
+		strcpy((char*) entry->name, names[i]);
+		entry->sector_addr = 0;
+		entry->sector_offset = 0;
+		entry->size = 0;
+		#if !defined(FAT_DISABLE_LONG_FILENAMES)
+		if (ret == FAT_LFN_GENERATED)
+		{
+			entry->sector_offset = fat_get_short_name_hash(names[i]);
+			entry->size = (strlen(names[i]) + 12) / 13;
+		}
+		#endif
+		/*
+		// the same name cannot be used twice
+		*/
+		for (j = 0; j < i; j++)
+		{
+			if (fat_compare_filename(names[i], names[j]))
+				return FAT_FILENAME_ALREADY_EXISTS;
+		}
+	}
+	/*
+	// scan the directory once to make sure that none of the
+	// files exists and to find the tails used by the short names
+	*/
+	memset(&query, 0, sizeof(query));
+	query.buffer = query.buff;
+	ret = fat_query_first_entry(volume, &parent.raw, 0, &query, 0);
+	if (ret != FAT_SUCCESS)
+		return ret;
+
+	while (*query.current_entry_raw->ENTRY.STD.name != 0)
+	{
+		#if !defined(FAT_DISABLE_LONG_FILENAMES)
+		fat_get_short_name_from_entry(short_name, query.current_entry_raw->ENTRY.STD.name);
+		#endif
+		for (i = 0; i < count; i++)
+		{
+			entry = (handles) ? &handles[i].directory_entry : &entries[i];
+			#if defined(FAT_DISABLE_LONG_FILENAMES)
+			if (fat_compare_short_name(query.current_entry_raw->ENTRY.STD.name, entry->raw.ENTRY.STD.name))
+				return FAT_FILENAME_ALREADY_EXISTS;
+			#else
+			if (FAT_TO_UPPER(query.long_filename[0]) == FAT_TO_UPPER(names[i][0]))
+			{
+				for (j = 0; FAT_TO_UPPER(query.long_filename[j]) == FAT_TO_UPPER(names[i][j]); j++)
+				{
+					if (names[i][j] == 0x0)
+						return FAT_FILENAME_ALREADY_EXISTS;
+				}
+			}
+			if (!entry->size)
+			{
+				if (fat_compare_short_name(query.current_entry_raw->ENTRY.STD.name, entry->raw.ENTRY.STD.name))
+					return FAT_FILENAME_ALREADY_EXISTS;
+			}
+			else
+			{
+				/*
+				// a long filename may be the 8.3 name of a file
+				// that has no long name in a different case
+				*/
+				if (fat_compare_filename(names[i], (char*) short_name))
+					return FAT_FILENAME_ALREADY_EXISTS;
+				fat_get_hashed_short_name_base(entry->raw.ENTRY.STD.name, entry->sector_offset, hashed_base);
+				fat_mark_short_name_tails(query.current_entry_raw->ENTRY.STD.name,
+					entry->raw.ENTRY.STD.name, hashed_base, &entry->sector_addr);
+			}
+			#endif
+		}
+		ret = fat_query_next_entry(volume, &query, 0, 0);
+		if (ret != FAT_SUCCESS)
+			return ret;
+	}
+	/*
+	// pick the short names of the long filenames. They must
+	// not clash with the 8.3 names or the short names picked
+	// before them. If all the tails are taken the file is
+	// created after the others by fat_create_directory_entry
+	*/
+	#if !defined(FAT_DISABLE_LONG_FILENAMES)
+	for (i = 0; i < count; i++)
+	{
+		entry = (handles) ? &handles[i].directory_entry : &entries[i];
+		if (!entry->size)
+			continue;
+
+		memcpy(base, entry->raw.ENTRY.STD.name, 11);
+		fat_get_hashed_short_name_base(base, entry->sector_offset, hashed_base);
+		for (j = 0; j < count; j++)
+		{
+			FAT_DIRECTORY_ENTRY* other = (handles) ? &handles[j].directory_entry : &entries[j];
+			if (!other->size || (j < i && other->raw.ENTRY.STD.name[0]))
+				fat_mark_short_name_tails(other->raw.ENTRY.STD.name, base, hashed_base, &entry->sector_addr);
+		}
+		if (!fat_pick_short_name_tail(entry->raw.ENTRY.STD.name, base, hashed_base, entry->sector_addr))
+			entry->raw.ENTRY.STD.name[0] = 0;
+	}
+	#endif
+	/*
+	// set the entry attributes
+	*/
+	fat_date = rtc_get_fat_date();
+	fat_time = rtc_get_fat_time();
+	for (i = 0; i < count; i++)
+	{
+		entry = (handles) ? &handles[i].directory_entry : &entries[i];
+		entry->attributes = 0;
+		entry->raw.ENTRY.STD.create_date = fat_date;
+		entry->raw.ENTRY.STD.create_time = fat_time;
+		entry->raw.ENTRY.STD.modify_date = fat_date;
+		entry->raw.ENTRY.STD.modify_time = fat_time;
+		entry->raw.ENTRY.STD.access_date = fat_date;
+		#if !defined(FAT_LAZY_DIRECTORY_TIMES)
+		entry->create_time = fat_decode_date_time(fat_date, fat_time);
+		entry->modify_time = entry->create_time;
+		entry->access_time = fat_decode_date_time(fat_date, 0);
+		#endif
+	}
+	/*
+	// find the directory's 1st cluster, on FAT12/16 volumes the
+	// root directory is not on a cluster
+	*/
+	((uint16_t*) &fat)[INT32_WORD0] = parent.raw.ENTRY.STD.first_cluster_lo;
+	((uint16_t*) &fat)[INT32_WORD1] = (volume->fs_type == FAT_FS_TYPE_FAT32) ? parent.raw.ENTRY.STD.first_cluster_hi : 0x0;
+	if (fat == 0x0)
+	{
+		if (volume->fs_type == FAT_FS_TYPE_FAT32)
+		{
+			fat = volume->root_cluster;
+		}
+		else
+		{
+			first_sector_of_cluster =
+				volume->no_of_reserved_sectors + (volume->no_of_fat_tables * volume->fat_size);
+		}
+	}
+	/*
+	// skip the files that will be created later
+	*/
+	for (i = 0; i < count; i++)
+	{
+		entry = (handles) ? &handles[i].directory_entry : &entries[i];
+		if (entry->raw.ENTRY.STD.name[0])
+			break;
+	}
+	/*
+	// acquire a lock on the buffer
+	*/
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	ENTER_CRITICAL_SECTION(volume->sector_buffer_lock);
+	#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+	ENTER_CRITICAL_SECTION(fat_shared_buffer_lock);
+	#endif
+	FAT_SET_LOADED_SECTOR(volume, FAT_UNKNOWN_SECTOR);
+	/*
+	// write the entries on the 1st free slots where they fit. The
+	// entries of a file go on a sector's free slots or after the
+	// last entry of the directory where they can span sectors, so
+	// each sector is read and written once
+	*/
+	while (i < count)
+	{
+		if (fat != 0x0)
+			first_sector_of_cluster = FIRST_SECTOR_OF_CLUSTER(volume, fat);
+
+		for (sector = first_sector_of_cluster; i < count &&
+			(fat == 0 || sector < first_sector_of_cluster + volume->no_of_sectors_per_cluster); sector++)
+		{
+			/*
+			// make sure that we don't overflow the root
+			// directory on FAT12/16 volumes
+			*/
+			if (!fat && sector >= first_sector_of_cluster + volume->root_directory_sectors)
+			{
+				ret = FAT_ROOT_DIRECTORY_LIMIT_EXCEEDED;
+				break;
+			}
+			/*
+			// a new cluster is already zeroed
+			*/
+			if (new_cluster)
+			{
+				memset(buffer, 0, volume->no_of_bytes_per_serctor);
+			}
+			else
+			{
+				ret = volume->device->read_sector(volume->device->driver, sector, buffer);
+				if (ret != STORAGE_SUCCESS)
+				{
+					ret = FAT_CANNOT_READ_MEDIA;
+					break;
+				}
+			}
+			dirty = 0;
+			run = 0;
+
+			for (offset = 0; i < count && offset < volume->no_of_bytes_per_serctor; offset += 0x20)
+			{
+				if (++entries_count == 0xFFFF)
+				{
+					ret = FAT_DIRECTORY_LIMIT_EXCEEDED;
+					break;
+				}
+				if (buffer[offset] == 0x0)
+					end_reached = 1;
+				if (!end_reached && buffer[offset] != FAT_DELETED_ENTRY)
+				{
+					run = 0;
+					continue;
+				}
+				entry = (handles) ? &handles[i].directory_entry : &entries[i];
+				needed = (unsigned char) entry->size + 1;
+				/*
+				// after the last entry of the directory all slots are free
+				// so we write the entries one by one, otherwise we wait until
+				// we find enough free slots on this sector
+				*/
+				if (end_reached)
+				{
+					fat_write_new_entry(entry, slot++, buffer + offset);
+				}
+				else if (++run == needed)
+				{
+					for (slot = 0; slot < needed; slot++)
+						fat_write_new_entry(entry, slot, buffer + offset - ((needed - 1 - slot) * 0x20));
+					run = 0;
+				}
 				else
 				{
-					no_of_lfn_entries_found = 0;
+					continue;
 				}
-				#endif
+				dirty = 1;
 				/*
-				// move the parent entry pointer to
-				// the next entry in the sector
+				// once all the entries of the file are written we
+				// store the address of the 8.3 entry and go on to
+				// the next file
 				*/
-				#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
-				/* fat_write_raw_directory_entry(parent_entry, buffer + parent_entry_offset); */
-				parent_entry_offset += 0x20;
-				fat_read_raw_directory_entry(parent_entry, buffer + parent_entry_offset);
-				#else
-				parent_entry++;
-				#endif
-			}
-			/*
-			// move to the next sector in the cluster
-			*/
-			sector++;
-			/*
-			// make sure that we don't overflow the root directory
-			// on FAT12/16 volumes
-			*/
-			if (!fat)
-			{
-				if (sector > first_sector_of_cluster + volume->root_directory_sectors)
+				if (slot == needed)
 				{
-					#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
-					LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
-					#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
-					LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+					entry->size = 0;
+					entry->sector_addr = sector;
+					entry->sector_offset = offset;
+					#if defined(FAT_DIRECTORY_INDEX)
+					fat_directory_index_add(volume, &parent.raw, entry, needed > 1);
 					#endif
-					return FAT_ROOT_DIRECTORY_LIMIT_EXCEEDED;
+					slot = 0;
+					while (++i < count)
+					{
+						entry = (handles) ? &handles[i].directory_entry : &entries[i];
+						if (entry->raw.ENTRY.STD.name[0])
+							break;
+					}
 				}
 			}
+			if (dirty)
+			{
+				if (volume->device->write_sector(volume->device->driver, sector, buffer) != STORAGE_SUCCESS)
+					ret = FAT_CANNOT_WRITE_MEDIA;
+			}
+			if (ret != FAT_SUCCESS)
+				break;
 		}
+		if (ret != FAT_SUCCESS || i == count)
+			break;
 		/*
 		// the following functions need the buffer so we must
 		// release it's lock before calling them
@@ -2767,48 +4352,346 @@ uint16_t fat_create_directory_entry(
 		LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
 		#endif
 		/*
-		// get the next cluster, we'll remember the last one in
-		// case we need to rewind to write lfn entries
+		// get the next cluster and if this is the end of the
+		// chain allocate a new one and link it to it
 		*/
 		last_fat = fat;
-		ret = fat_get_cluster_entry( volume, fat, &fat );
+		ret = fat_get_cluster_entry(volume, fat, &fat);
 		if (ret != FAT_SUCCESS)
 			return ret;
-		/*
-		// if this is the end of the FAT chain allocate
-		// a new cluster to this folder and continue
-		*/
 		if (fat_is_eof_entry(volume, fat))
 		{
-			FAT_ENTRY newfat;
-			/*
-			// allocate the cluster
-			*/
-			newfat = fat_allocate_data_cluster(volume, 1, 1, &ret);
-			if (ret != FAT_SUCCESS) 
+			fat = fat_allocate_data_cluster(volume, 1, 1, &ret);
+			if (ret != FAT_SUCCESS)
 				return ret;
-			/*
-			// link it to the cluster chain
-			*/
-			ret = fat_set_cluster_entry(volume, last_fat, newfat);
-			if (ret != FAT_SUCCESS) 
+			ret = fat_set_cluster_entry(volume, last_fat, fat);
+			if (ret != FAT_SUCCESS)
 				return ret;
-			fat = newfat;
+			new_cluster = 1;
 		}
-		/*
-		// re-acquire the lock on the buffer
-		*/
 		#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
 		ENTER_CRITICAL_SECTION(volume->sector_buffer_lock);
 		#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
 		ENTER_CRITICAL_SECTION(fat_shared_buffer_lock);
 		#endif
+		FAT_SET_LOADED_SECTOR(volume, FAT_UNKNOWN_SECTOR);
+	}
+	/*
+	// release the lock on the buffer
+	*/
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
+	#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+	LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+	#endif
+	/*
+	// the names are no longer missing from the directory
+	*/
+	#if defined(FAT_DENTRY_CACHE)
+	fat_dentry_cache_invalidate(volume, &parent.raw, 1);
+	#endif
+	if (ret != FAT_SUCCESS)
+		return ret;
+	/*
+	// create the files whose short names could not be picked
+	*/
+	#if !defined(FAT_DISABLE_LONG_FILENAMES)
+	for (i = 0; i < count; i++)
+	{
+		entry = (handles) ? &handles[i].directory_entry : &entries[i];
+		if (!entry->raw.ENTRY.STD.name[0])
+		{
+			ret = fat_create_directory_entry(volume, &parent.raw, names[i], 0, 0, entry);
+			if (ret != FAT_SUCCESS)
+				return ret;
+		}
+	}
+	#endif
+	/*
+	// open the files
+	*/
+	if (handles)
+	{
+		FAT_DIRECTORY_ENTRY file_entry;
+		access_flags = access_flags & (0xFF ^ FAT_FILE_ACCESS_APPEND);
+
+		for (i = 0; i < count; i++)
+		{
+			#if defined(FAT_ALLOCATE_FILE_BUFFERS)
+			if (!(access_flags & FAT_FILE_FLAG_NO_BUFFERING))
+				handles[i].buffer = handles[i].buffer_internal;
+			#else
+			handles[i].buffer = 0;
+			#endif
+			file_entry = handles[i].directory_entry;
+			ret = fat_open_file_by_entry(volume, &file_entry, &handles[i], access_flags);
+			if (ret != FAT_SUCCESS)
+				return ret;
+			handles[i].no_of_sequential_clusters = 0;
+		}
+	}
+	return FAT_SUCCESS;
+}
+#endif
+
+/*
+// compacts a directory
+*/
+uint16_t fat_compact_directory(FAT_VOLUME* volume, char* path, FAT_FILE** handles, uint16_t count)
+{
+	#if defined(FAT_READ_ONLY)
+	return FAT_FEATURE_NOT_SUPPORTED;
+	#else
+	uint16_t ret;
+	uint16_t i;
+	uint16_t offset;
+	uint16_t write_offset = 0;
+	uint32_t sector;
+	uint32_t last_sector = 0;
+	uint32_t end_sector;
+	uint32_t write_sector;
+	uint32_t first_sector_of_cluster = 0;
+	uint32_t write_first_sector;
+	char end_reached = 0;
+	char moved = 0;
+	FAT_ENTRY fat;
+	FAT_ENTRY write_fat;
+	FAT_DIRECTORY_ENTRY directory;
+	ALIGN16 unsigned char buffer[MAX_SECTOR_LENGTH];
+	ALIGN16 unsigned char write_buffer[MAX_SECTOR_LENGTH];
+	/*
+	// every file that is open on the volume must be passed
+	// in, a handle that is not updated would write it's entry
+	// to the wrong slot when it's closed
+	*/
+	if (volume->no_of_open_files > count)
+		return FAT_FILE_HANDLE_IN_USE;
+	/*
+	// get the entry of the directory
+	*/
+	ret = fat_get_file_entry(volume, path, &directory);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	if (*directory.name == 0)
+		return FAT_DIRECTORY_DOES_NOT_EXIST;
+	if (!(directory.attributes & FAT_ATTR_DIRECTORY))
+		return FAT_NOT_A_DIRECTORY;
+	/*
+	// find the directory's 1st cluster, on FAT12/16 volumes the
+	// root directory is not on a cluster
+	*/
+	((uint16_t*) &fat)[INT32_WORD0] = directory.raw.ENTRY.STD.first_cluster_lo;
+	((uint16_t*) &fat)[INT32_WORD1] = (volume->fs_type == FAT_FS_TYPE_FAT32) ? directory.raw.ENTRY.STD.first_cluster_hi : 0x0;
+	if (fat == 0x0)
+	{
+		if (volume->fs_type == FAT_FS_TYPE_FAT32)
+		{
+			fat = volume->root_cluster;
+		}
+		else
+		{
+			first_sector_of_cluster =
+				volume->no_of_reserved_sectors + (volume->no_of_fat_tables * volume->fat_size);
+		}
+	}
+	if (fat != 0x0)
+		first_sector_of_cluster = FIRST_SECTOR_OF_CLUSTER(volume, fat);
+	/*
+	// the entries are read with one cursor and written back
+	// with another one that stays behind it by the number of
+	// free slots found, so each sector is read once and only
+	// the sectors after the 1st free slot are written
+	*/
+	write_fat = fat;
+	write_first_sector = first_sector_of_cluster;
+	write_sector = first_sector_of_cluster;
+
+	while (!end_reached)
+	{
+		end_sector = first_sector_of_cluster + ((fat) ? volume->no_of_sectors_per_cluster : volume->root_directory_sectors);
+
+		for (sector = first_sector_of_cluster; !end_reached && sector < end_sector; sector++)
+		{
+			ret = volume->device->read_sector(volume->device->driver, sector, buffer);
+			if (ret != STORAGE_SUCCESS)
+				return FAT_CANNOT_READ_MEDIA;
+
+			last_sector = sector;
+
+			for (offset = 0; offset < volume->no_of_bytes_per_serctor; offset += 0x20)
+			{
+				if (buffer[offset] == 0x0)
+				{
+					end_reached = 1;
+					break;
+				}
+				if (buffer[offset] == FAT_DELETED_ENTRY)
+				{
+					moved = 1;
+					continue;
+				}
+				/*
+				// when the write buffer is full write it and
+				// move the write cursor to the next sector
+				*/
+				if (write_offset == volume->no_of_bytes_per_serctor)
+				{
+					if (moved)
+					{
+						ret = volume->device->write_sector(volume->device->driver, write_sector, write_buffer);
+						if (ret != STORAGE_SUCCESS)
+							return FAT_CANNOT_WRITE_MEDIA;
+					}
+					write_offset = 0;
+					if (++write_sector == write_first_sector + volume->no_of_sectors_per_cluster && write_fat)
+					{
+						ret = fat_get_cluster_entry(volume, write_fat, &write_fat);
+						if (ret != FAT_SUCCESS)
+							return ret;
+						write_first_sector = FIRST_SECTOR_OF_CLUSTER(volume, write_fat);
+						write_sector = write_first_sector;
+					}
+				}
+				memcpy(write_buffer + write_offset, buffer + offset, 0x20);
+				/*
+				// update the open files whose entry was moved
+				*/
+				if (moved && buffer[offset + 0xB] != FAT_ATTR_LONG_NAME)
+				{
+					for (i = 0; i < count; i++)
+					{
+						if (handles[i]->magic == FAT_OPEN_HANDLE_MAGIC && handles[i]->volume == volume &&
+							handles[i]->directory_entry.sector_addr == sector && 
+							handles[i]->directory_entry.sector_offset == offset)
+						{
+							handles[i]->directory_entry.sector_addr = write_sector;
+							handles[i]->directory_entry.sector_offset = write_offset;
+						}
+					}
+				}
+				write_offset += 0x20;
+			}
+		}
 		/*
-		// mark the loaded sector as unknown
+		// the root directory of a FAT12/16 volume ends with
+		// it's region, other directories with their chain
 		*/
-		FAT_SET_LOADED_SECTOR(volume, FAT_UNKNOWN_SECTOR);
+		if (end_reached || fat == 0x0)
+			break;
+
+		ret = fat_get_cluster_entry(volume, fat, &fat);
+		if (ret != FAT_SUCCESS)
+			return ret;
+		if (fat_is_eof_entry(volume, fat))
+			break;
+
+		first_sector_of_cluster = FIRST_SECTOR_OF_CLUSTER(volume, fat);
 	}
-	while (1);
+	if (moved)
+	{
+		/*
+		// write the last sector with the end of directory marker
+		// after the last entry and clear the sectors behind it
+		// that held entries that were moved
+		*/
+		memset(write_buffer + write_offset, 0, volume->no_of_bytes_per_serctor - write_offset);
+		ret = volume->device->write_sector(volume->device->driver, write_sector, write_buffer);
+		if (ret != STORAGE_SUCCESS)
+			return FAT_CANNOT_WRITE_MEDIA;
+
+		if (write_first_sector != first_sector_of_cluster)
+			last_sector = write_first_sector + volume->no_of_sectors_per_cluster - 1;
+
+		memset(write_buffer, 0, volume->no_of_bytes_per_serctor);
+		for (sector = write_sector + 1; sector <= last_sector; sector++)
+		{
+			ret = volume->device->write_sector(volume->device->driver, sector, write_buffer);
+			if (ret != STORAGE_SUCCESS)
+				return FAT_CANNOT_WRITE_MEDIA;
+		}
+	}
+	/*
+	// free the clusters after the one that holds the last entry
+	*/
+	if (write_fat != 0x0)
+	{
+		ret = fat_get_cluster_entry(volume, write_fat, &fat);
+		if (ret != FAT_SUCCESS)
+			return ret;
+
+		if (!fat_is_eof_entry(volume, fat))
+		{
+			switch (volume->fs_type) 
+			{
+				case FAT_FS_TYPE_FAT12 : ret = fat_set_cluster_entry(volume, write_fat, FAT12_EOC); break;
+				case FAT_FS_TYPE_FAT16 : ret = fat_set_cluster_entry(volume, write_fat, FAT16_EOC); break;
+				case FAT_FS_TYPE_FAT32 : ret = fat_set_cluster_entry(volume, write_fat, FAT32_EOC); break;
+			}
+			if (ret != FAT_SUCCESS)
+				return ret;
+
+			ret = fat_free_cluster_chain(volume, fat);
+			if (ret != FAT_SUCCESS)
+				return ret;
+		}
+	}
+	if (!moved)
+		return FAT_SUCCESS;
+	/*
+	// the sector held by the buffer may be one that we wrote
+	// and the entries remembered for the directory have moved
+	*/
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	ENTER_CRITICAL_SECTION(volume->sector_buffer_lock);
+	#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+	ENTER_CRITICAL_SECTION(fat_shared_buffer_lock);
+	#endif
+	FAT_SET_LOADED_SECTOR(volume, FAT_UNKNOWN_SECTOR);
+	#if defined(FAT_DIRECTORY_INDEX)
+	if (volume->index_directory == fat_get_directory_cluster(volume, &directory.raw))
+		volume->index_state = FAT_DIRECTORY_INDEX_NONE;
+	#endif
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
+	#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+	LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+	#endif
+	#if defined(FAT_DENTRY_CACHE)
+	fat_dentry_cache_invalidate(volume, &directory.raw, 0);
+	#endif
+	return FAT_SUCCESS;
+	#endif
+}
+
+#if defined(FAT_AUTO_COMPACT) && !defined(FAT_READ_ONLY)
+/*
+// counts the files deleted from a directory and compacts
+// it when there's enough of them. The entries of open files
+// cannot be moved so it waits until no file is open
+*/
+uint16_t fat_auto_compact_directory(FAT_VOLUME* volume, char* path)
+{
+	uint16_t ret;
+	uint32_t directory;
+	FAT_DIRECTORY_ENTRY entry;
+
+	ret = fat_get_file_entry(volume, path, &entry);
+	if (ret != FAT_SUCCESS)
+		return ret;
+
+	directory = fat_get_directory_cluster(volume, &entry.raw);
+	if (directory != volume->compact_directory)
+	{
+		volume->compact_directory = directory;
+		volume->compact_count = 0;
+	}
+	if (volume->compact_count < FAT_AUTO_COMPACT)
+		volume->compact_count++;
+	if (volume->compact_count < FAT_AUTO_COMPACT || volume->no_of_open_files)
+		return FAT_SUCCESS;
+
+	volume->compact_count = 0;
+	return fat_compact_directory(volume, path, 0, 0);
 }
 #endif
 
@@ -2895,7 +4778,7 @@ void INLINE fat_get_short_name_from_entry( unsigned char* dest, const unsigned c
 char INLINE get_long_name_for_entry(uint16_t* dst, unsigned char* src)
 {
 	register int i;
-	for (i = 0; i < (int) strlen((char*) src); i++)
+	for (i = 0; src[i]; i++)
 	{
 		dst[i] = (uint16_t) src[i];
 	}
@@ -2929,7 +4812,7 @@ char INLINE fat_compare_long_name( uint16_t* name1, uint16_t* name2 )
 	register short i;
 	for (i = 0; i < 256; i++)
 	{
-		if (toupper((char)name1[i]) != toupper((char)name2[i]))
+		if (FAT_TO_UPPER(name1[i]) != FAT_TO_UPPER(name2[i]))
 			return 0;
 		if ((char)name1[i] == 0x0)
 			return 1;
@@ -2984,7 +4867,7 @@ uint16_t get_short_name_for_entry(unsigned char* dest, unsigned char* src, char
 		{
 			for (i = 0; i < length; i++)
 			{
-				if (src[i] == 0x20 || src[i] != toupper(src[i]))
+				if (src[i] == 0x20 || src[i] != FAT_TO_UPPER(src[i]))
 				{
 					is_lfn = 1;
 					break;
@@ -3026,7 +4909,8 @@ uint16_t get_short_name_for_entry(unsigned char* dest, unsigned char* src, char
 				}
 				if (c < dot_index)
 				{
-					tmp[i] = toupper(src[c++]);
+					tmp[i] = FAT_TO_UPPER(src[c]);
+					c++;
 				}
 				else
 				{
@@ -3052,7 +4936,8 @@ uint16_t get_short_name_for_entry(unsigned char* dest, unsigned char* src, char
 				}
 				if (c < length)
 				{
-					tmp[i] = toupper(src[c++]);
+					tmp[i] = FAT_TO_UPPER(src[c]);
+					c++;
 				}
 				else
 				{
@@ -3116,10 +5001,10 @@ uint16_t get_short_name_for_entry(unsigned char* dest, unsigned char* src, char
 		{
 			if (i < length) 
 			{
-				if (lfn_disabled && (tmp[i] != toupper(tmp[i])))
+				if (lfn_disabled && ((unsigned char) tmp[i] != FAT_TO_UPPER(tmp[i])))
 					has_uppercase = 1;
 
-				*dest++ = toupper(tmp[i]);
+				*dest++ = FAT_TO_UPPER(tmp[i]);
 			}
 			else 
 			{
@@ -3130,10 +5015,10 @@ uint16_t get_short_name_for_entry(unsigned char* dest, unsigned char* src, char
 		{
 			if (i < dot_index - 0x1) 
 			{	
-				if (lfn_disabled && (tmp[i] != toupper(tmp[i])))
+				if (lfn_disabled && ((unsigned char) tmp[i] != FAT_TO_UPPER(tmp[i])))
 					has_uppercase = 1;
 
-				*dest++ = toupper(tmp[i]);
+				*dest++ = FAT_TO_UPPER(tmp[i]);
 			}
 			else 
 			{
@@ -3163,9 +5048,9 @@ uint16_t get_short_name_for_entry(unsigned char* dest, unsigned char* src, char
 		{
 			if ( i < length ) 
 			{
-				if (lfn_disabled && (tmp[i] != toupper(tmp[i])))
+				if (lfn_disabled && ((unsigned char) tmp[i] != FAT_TO_UPPER(tmp[i])))
 					has_uppercase = 1;
-				*dest++ = toupper(tmp[i]);
+				*dest++ = FAT_TO_UPPER(tmp[i]);
 			}
 			else 
 			{
@@ -3281,6 +5166,7 @@ time_t fat_decode_date_time(uint16_t date, uint16_t time) {
 	tm.tm_hour = (time) >> 11;
 	tm.tm_min = ((time) & 0x7E0) >> 5;
 	tm.tm_sec = ((time) & 0x1F) << 1;
+	tm.tm_isdst = -1;
 	return mktime(&tm);
 }
 
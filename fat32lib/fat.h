@@ -143,15 +143,109 @@
 */
 /* #define FAT_READ_ONLY */
 
-/*
-// this is the interval in sectors written at which an
-// open file will be flushed 0x800 = 1 MiB with 512 bytes
-// sectors
-*/
-#define FAT_FLUSH_INTERVAL				0x800
 #define FAT_STREAMING_IO
 #define FAT_OPTIMIZE_FOR_FLASH
 
+/*
+// Defines that file handles should support read-ahead. When a ring buffer
+// is set on a handle with fat_file_set_read_ahead the library will detect
+// sequential asynchronous reads and prefetch the sectors that follow the
+// cursor into the ring while the application processes the data.
+*/
+/* #define FAT_READ_AHEAD */
+
+/*
+// Defines that file handles should support multi-sector write-back buffers. When
+// a buffer larger than one sector is set on a handle with fat_file_set_buffer_ex
+// the sectors filled by small writes are held in it until it is full and then
+// written to the device in a single transfer.
+*/
+/* #define FAT_WRITE_BACK */
+
+/*
+// Defines the number of cluster chain tails that each volume remembers. When a
+// file that was written and closed is opened again the cluster under the end of
+// the file is found from the remembered tail instead of walking the whole chain
+// from it's start, so appending to a large file doesn't get slower as it grows.
+// The tails are only kept in memory while the volume is mounted, the first time
+// that a file is opened for append after the volume is mounted the chain is still
+// walked from it's start.
+*/
+/* #define FAT_TAIL_HINTS					4 */
+
+/*
+// Defines that files opened with FAT_FILE_ACCESS_OVERWRITE keep their cluster chain
+// and the new data is written over the old clusters. The clusters that are not
+// used by the new data are freed when the file is closed. When this option is not
+// defined the whole chain is freed when the file is opened and new clusters are
+// allocated as the file is written.
+*/
+/* #define FAT_OVERWRITE_IN_PLACE */
+
+/*
+// Defines that file handles should support checkpoints. When a checkpoint policy
+// is set on a handle with fat_file_set_checkpoint the directory entry of the file
+// is updated while it's being written every time the data on the device has grown
+// by the number of bytes or clusters specified or the time specified has elapsed,
+// so that a power loss only loses the data written since the last checkpoint.
+*/
+/* #define FAT_CHECKPOINTS */
+
+/*
+// Defines the number of path lookups that each volume remembers. Every name that
+// fat_get_file_entry looks up on a directory is remembered together with the entry
+// that was found (or with the fact that it wasn't found) so that paths that are
+// used often are resolved without reading the directories again. The entries are
+// kept up to date as they're written and forgotten when a directory changes.
+*/
+/* #define FAT_DENTRY_CACHE				8 */
+
+/*
+// Defines the number of entries that a directory must have to be indexed. When
+// the application gives a volume memory with fat_set_directory_index_buffer the
+// 1st directory that is scanned past this many entries gets an index of it's
+// names in that memory, so looking up or creating names on it no longer requires
+// reading the whole directory. Only one directory per volume is indexed at a time.
+*/
+/* #define FAT_DIRECTORY_INDEX				64 */
+
+/*
+// Defines the number of files that can be deleted from a directory before it's
+// compacted. Deleted files leave their entries behind as free slots that must
+// still be read when the directory is scanned, so once this many files have been
+// deleted from the same directory fat_file_delete calls fat_compact_directory on
+// it. Since the entries of open files cannot be moved this is skipped while any
+// file on the volume is open.
+*/
+/* #define FAT_AUTO_COMPACT				64 */
+
+/*
+// Defines the number of sectors that a directory query reads from the device at
+// a time. If the driver provides the read_sectors function the rest of a cluster,
+// and the clusters that follow it on the device, are read with the sector that the
+// query needs so listing or scanning a large directory doesn't take one call to the
+// driver per sector. Every query holds a buffer of this many sectors, including the
+// ones that the library keeps on the stack to look up and create files.
+*/
+/* #define FAT_QUERY_READ_SECTORS			8 */
+
+/*
+// Defines the number of sectors that fat_file_copy moves at a time. The data is
+// copied through a buffer of this many sectors on the stack and the sectors that
+// are contiguous on both files, across clusters, are read and written with a single
+// call to the driver's read_sectors and write_sectors functions. Without it files
+// are copied one sector at a time.
+*/
+/* #define FAT_COPY_SECTORS				16 */
+
+/*
+// Defines that the timestamps of directory entries are not decoded when the entries
+// are read. FAT_DIRECTORY_ENTRY doesn't have the create_time, modify_time and access_time
+// fields and fat_get_entry_times decodes them from the raw entry when they're needed, so
+// listing a large directory doesn't spend most of it's time on date conversions.
+*/
+/* #define FAT_LAZY_DIRECTORY_TIMES */
+
 /* #################################
 // end compile options
 // ################################# */
@@ -190,6 +284,7 @@
 #define FAT_FILE_ACCESS_CREATE_OR_APPEND		(FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_APPEND)
 #define FAT_FILE_FLAG_NO_BUFFERING				(0x20)
 #define FAT_FILE_FLAG_OPTIMIZE_FOR_FLASH		(0x40)
+#define FAT_FILE_FLAG_DELAYED_ALLOCATION		(0x80)
 
 /*
 // seek modes
@@ -280,48 +375,6 @@
 */
 typedef time_t (*FAT_GET_SYSTEM_TIME)(void);
 
-/*!
- * <summary>
- * This structure is the volume handle. All the fields in the structure are
- * reserved for internal use and should not be accessed directly by the
- * developer.
- * </summary>
-*/
-typedef struct FAT_VOLUME 
-{
-	uint32_t id;
-	uint32_t fat_size;
-	uint32_t root_cluster;
-	uint32_t first_data_sector;
-	uint32_t no_of_sectors;
-	uint32_t no_of_data_sectors;
-	uint32_t no_of_clusters;
-	uint32_t no_of_reserved_sectors;
-	uint32_t next_free_cluster;
-	uint32_t total_free_clusters;
-	uint32_t fsinfo_sector;
-	uint16_t root_directory_sectors;
-	uint16_t no_of_bytes_per_serctor;
-	uint16_t no_of_sectors_per_cluster;
-	char use_long_filenames;
-	unsigned char fs_type;
-	unsigned char no_of_fat_tables;
-	char label[12];
-	#if defined(FAT_ALLOCATE_VOLUME_BUFFER)
-	#if defined(FAT_MULTI_THREADED)
-	DEFINE_CRITICAL_SECTION(sector_buffer_lock);
-	#endif
-	ALIGN16 unsigned char sector_buffer[MAX_SECTOR_LENGTH];
-	uint32_t sector_buffer_sector;
-	#endif
-	#if defined(FAT_MULTI_THREADED)
-	DEFINE_CRITICAL_SECTION(write_lock);
-	unsigned char readers_count;
-	#endif
-	STORAGE_DEVICE* device;
-}	
-FAT_VOLUME;
-
 /*
 // fat 32-byte directory entry structure
 */
@@ -367,6 +420,139 @@ END_PACKED_STRUCT
 #pragma pack()
 #endif
 
+#if defined(FAT_TAIL_HINTS)
+/*
+ * remembers the last cluster of a file. first_cluster is
+ * zero when the entry is not in use
+ */
+typedef struct FAT_TAIL_HINT
+{
+	uint32_t first_cluster;
+	uint32_t clus_idx;
+	uint32_t clus_addr;
+}
+FAT_TAIL_HINT;
+#endif
+
+#if defined(FAT_DENTRY_CACHE)
+/*
+ * names longer than this are not remembered
+ */
+#define FAT_DENTRY_NAME_LENGTH			24
+
+/*
+ * remembers the result of looking up a name on a directory. parent is
+ * the 1st cluster of the directory and name the upper-case name that was
+ * looked up. If negative is set the name was not found, otherwise raw
+ * holds the entry found at sector_addr and sector_offset. hash is zero
+ * when the entry is not in use
+ */
+typedef struct FAT_DENTRY
+{
+	uint32_t parent;
+	uint32_t sector_addr;
+	uint16_t sector_offset;
+	uint16_t hash;
+	char negative;
+	unsigned char name[FAT_DENTRY_NAME_LENGTH + 1];
+	FAT_RAW_DIRECTORY_ENTRY raw;
+}
+FAT_DENTRY;
+#endif
+
+#if defined(FAT_DIRECTORY_INDEX)
+/*
+ * states of a directory index
+ */
+#define FAT_DIRECTORY_INDEX_NONE		0x0
+#define FAT_DIRECTORY_INDEX_BUILDING	0x1
+#define FAT_DIRECTORY_INDEX_READY		0x2
+
+/*
+ * a slot of a directory index. It holds the hash of either the
+ * short or the long name of an entry and the location of it's
+ * short entry. hash is zero when the slot is free
+ */
+typedef struct FAT_DIRECTORY_INDEX_SLOT
+{
+	uint32_t sector_addr;
+	uint16_t sector_offset;
+	uint16_t hash;
+}
+FAT_DIRECTORY_INDEX_SLOT;
+#endif
+
+/*!
+ * <summary>
+ * This structure is the volume handle. All the fields in the structure are
+ * reserved for internal use and should not be accessed directly by the
+ * developer.
+ * </summary>
+*/
+typedef struct FAT_VOLUME 
+{
+	uint32_t id;
+	uint32_t fat_size;
+	uint32_t root_cluster;
+	uint32_t first_data_sector;
+	uint32_t no_of_sectors;
+	uint32_t no_of_data_sectors;
+	uint32_t no_of_clusters;
+	uint32_t no_of_reserved_sectors;
+	uint32_t next_free_cluster;
+	uint32_t total_free_clusters;
+	uint32_t fsinfo_sector;
+	#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+	uint32_t reserved_clusters;
+	char free_clusters_counted;
+	#endif
+	uint16_t root_directory_sectors;
+	uint16_t no_of_bytes_per_serctor;
+	uint16_t no_of_sectors_per_cluster;
+	#if defined(FAT_TAIL_HINTS)
+	FAT_TAIL_HINT tail_hints[FAT_TAIL_HINTS];
+	uint16_t next_tail_hint;
+	#endif
+	#if defined(FAT_DENTRY_CACHE)
+	#if defined(FAT_MULTI_THREADED)
+	DEFINE_CRITICAL_SECTION(dentry_lock);
+	#endif
+	FAT_DENTRY dentries[FAT_DENTRY_CACHE];
+	uint16_t next_dentry;
+	#endif
+	#if defined(FAT_DIRECTORY_INDEX)
+	FAT_DIRECTORY_INDEX_SLOT* index_slots;
+	uint32_t index_size;
+	uint32_t index_count;
+	uint32_t index_directory;
+	unsigned char index_state;
+	#endif
+	#if defined(FAT_AUTO_COMPACT) && !defined(FAT_READ_ONLY)
+	uint32_t compact_directory;
+	uint16_t compact_count;
+	#endif
+	#if !defined(FAT_READ_ONLY)
+	uint16_t no_of_open_files;
+	#endif
+	char use_long_filenames;
+	unsigned char fs_type;
+	unsigned char no_of_fat_tables;
+	char label[12];
+	#if defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	#if defined(FAT_MULTI_THREADED)
+	DEFINE_CRITICAL_SECTION(sector_buffer_lock);
+	#endif
+	ALIGN16 unsigned char sector_buffer[MAX_SECTOR_LENGTH];
+	uint32_t sector_buffer_sector;
+	#endif
+	#if defined(FAT_MULTI_THREADED)
+	DEFINE_CRITICAL_SECTION(write_lock);
+	unsigned char readers_count;
+	#endif
+	STORAGE_DEVICE* device;
+}	
+FAT_VOLUME;
+
 /*!
  * <summary>
  * Stores information about directory entries.
@@ -382,6 +568,7 @@ typedef struct FAT_DIRECTORY_ENTRY
 	 * <summary>The list of file attributes ORed together.</summary>
 	*/
 	unsigned char attributes;
+	#if !defined(FAT_LAZY_DIRECTORY_TIMES)
 	/*!
 	 * <summary>The creation timestamp of the file.</summary>
 	*/
@@ -394,6 +581,7 @@ typedef struct FAT_DIRECTORY_ENTRY
 	 * <summary>The access timestamp of the file.</summary>
 	*/
 	time_t access_time;
+	#endif
 	/*!
 	 * <summary>The size of the file.</summary>
 	*/
@@ -439,9 +627,20 @@ typedef struct FAT_QUERY_STATE
 	unsigned char lfn_checksum;
 	#endif
 	/*
+	// sectors loaded on the buffer
+	*/
+	#if defined(FAT_QUERY_READ_SECTORS)
+	uint32_t loaded_sector_addr;
+	uint16_t loaded_sectors;
+	#endif
+	/*
 	// buffer (MUST ALWAYS BE LAST!!!)
 	*/
+	#if defined(FAT_QUERY_READ_SECTORS)
+	unsigned char buff[MAX_SECTOR_LENGTH * FAT_QUERY_READ_SECTORS];
+	#else
 	unsigned char buff[MAX_SECTOR_LENGTH];
+	#endif
 }
 FAT_QUERY_STATE;
 
@@ -461,11 +660,11 @@ typedef void FAT_STREAM_CALLBACK(void* context, uint16_t* state, unsigned char**
 typedef struct FAT_OP_STATE 
 {
 	uint32_t pos;
-	uint16_t bytes_remaining;
+	uint32_t bytes_remaining;
 	uint32_t sector_addr;
 	uint16_t* async_state;
 	uint32_t* bytes_read;
-	uint16_t length;
+	uint32_t length;
 	uint16_t storage_state;
 	unsigned char* end_of_buffer;
 	unsigned char* buffer;
@@ -484,6 +683,77 @@ typedef struct FAT_OP_STATE
 }
 FAT_OP_STATE;
 
+#if defined(FAT_READ_AHEAD)
+/*
+ * holds the state of the read-ahead ring of a file. The ring holds
+ * count consecutive sectors of the volume starting at sector_addr,
+ * the last of which is still being read if pending is set. The
+ * first borrowed sectors of the ring are lent to the user by
+ * fat_file_read_borrow until fat_file_read_release is called
+ */
+typedef struct FAT_READ_AHEAD_STATE
+{
+	unsigned char* buffer;
+	uint16_t depth;
+	uint16_t window;
+	uint16_t head;
+	uint16_t count;
+	uint16_t borrowed;
+	uint32_t sector_addr;
+	uint32_t run_clus_addr;
+	uint32_t sectors_left;
+	uint32_t file_sectors_left;
+	uint32_t next_pos;
+	uint32_t wait_addr;
+	unsigned char* wait_buffer;
+	char pending;
+	char discard;
+	char waiting;
+	uint16_t storage_state;
+	STORAGE_CALLBACK_INFO storage_callback_info;
+}
+FAT_READ_AHEAD_STATE;
+#endif
+
+#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+/*
+ * holds the state of the write-back buffer of a file. The first
+ * count sectors of the buffer hold the consecutive sectors of the volume
+ * starting at sector_addr that have been filled but not yet written, and
+ * the sector that follows them is the file buffer. When allocation is delayed
+ * the last virtual_clusters clusters under the cursor are not allocated yet
+ * and reserved_clusters are held on the volume for them
+ */
+typedef struct FAT_WRITE_BACK_STATE
+{
+	unsigned char* buffer;
+	uint16_t depth;
+	uint16_t count;
+	uint16_t written;
+	uint32_t sector_addr;
+	uint32_t virtual_clusters;
+	uint32_t reserved_clusters;
+	STORAGE_CALLBACK_INFO_EX storage_callback_info_ex;
+}
+FAT_WRITE_BACK_STATE;
+#endif
+
+#if defined(FAT_CHECKPOINTS) && !defined(FAT_READ_ONLY)
+/*
+ * holds the checkpoint policy of a file. Each field that is
+ * not zero is a condition that causes a checkpoint, time holds the
+ * time of the last one
+ */
+typedef struct FAT_CHECKPOINT
+{
+	uint32_t bytes;
+	uint32_t clusters;
+	uint16_t seconds;
+	time_t time;
+}
+FAT_CHECKPOINT;
+#endif
+
 /*!
  * <summary>
  * This is the file handle structure. All the fields in this structure
@@ -503,14 +773,26 @@ typedef struct FAT_FILE
 	uint32_t current_clus_idx;
 	uint32_t current_sector_idx;
 	uint32_t no_of_clusters_after_pos;
+	uint32_t cached_clus_addr;
+	uint32_t cached_clus_idx;
 	uint16_t no_of_sequential_clusters;
 	unsigned char* buffer_head;
 	char buffer_dirty;
 	char busy;
+	char borrowed;
 	unsigned char magic;
 	unsigned char access_flags;
 	FAT_OP_STATE op_state;
 	unsigned char* buffer;
+	#if defined(FAT_READ_AHEAD)
+	FAT_READ_AHEAD_STATE read_ahead;
+	#endif
+	#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+	FAT_WRITE_BACK_STATE write_back;
+	#endif
+	#if defined(FAT_CHECKPOINTS) && !defined(FAT_READ_ONLY)
+	FAT_CHECKPOINT checkpoint;
+	#endif
 	#if defined(FAT_ALLOCATE_FILE_BUFFERS)
 	unsigned char buffer_internal[MAX_SECTOR_LENGTH];	
 	#endif
@@ -520,12 +802,57 @@ typedef struct FAT_FILE
 }	
 FAT_FILE;
 
+/*!
+ * <summary>
+ * Holds the conditions that the entries returned by a directory query
+ * must meet. The fields that are set to zero are not checked.
+ * </summary>
+*/
+typedef struct FAT_QUERY_FILTER
+{
+	/*!
+	 * <summary>
+	 * A pattern that the name of the entries must match. The '*' wildcard
+	 * matches any number of characters and '?' matches one. It is not case sensitive.
+	 * </summary>
+	*/
+	char* pattern;
+	/*!
+	 * <summary>The attributes that must be set on the entries.</summary>
+	*/
+	unsigned char attributes_set;
+	/*!
+	 * <summary>The attributes that must be clear on the entries.</summary>
+	*/
+	unsigned char attributes_clear;
+	/*!
+	 * <summary>The minimum size of the entries.</summary>
+	*/
+	uint32_t min_size;
+	/*!
+	 * <summary>The maximum size of the entries.</summary>
+	*/
+	uint32_t max_size;
+	/*!
+	 * <summary>The entries must have been modified at or after this time.</summary>
+	*/
+	time_t modified_after;
+	/*!
+	 * <summary>The entries must have been modified before this time.</summary>
+	*/
+	time_t modified_before;
+}
+FAT_QUERY_FILTER;
+
 /*!
  * <summary>Holds the state of a directory query.</summary>
 */
 typedef struct FILESYSTEM_QUERY 
 {
 	FAT_DIRECTORY_ENTRY current_entry;
+	FAT_QUERY_FILTER* filter;
+	uint32_t filter_modified_after;
+	uint32_t filter_modified_before;
 	FAT_QUERY_STATE state;
 }	
 FAT_FILESYSTEM_QUERY;
@@ -610,6 +937,37 @@ uint16_t fat_get_file_entry
 	FAT_DIRECTORY_ENTRY* entry
 );
 
+#if defined(FAT_DIRECTORY_INDEX)
+/**
+ * <summary>
+ * Gives a volume memory to index a large directory. The 1st directory with
+ * more than FAT_DIRECTORY_INDEX entries that is scanned for a name is indexed
+ * in this memory and from then on names are found on it by reading only the
+ * sectors that hold them. The index moves to another directory when a large
+ * directory that isn't indexed is scanned and it's dropped when it no longer
+ * fits in the memory.
+ * </summary>
+ * <param name="volume">A pointer to the volume handle.</param>
+ * <param name="buffer">
+ * The memory for the index, or NULL to drop the index and get the memory back.
+ * It must remain valid until it's released or the volume is dismounted.
+ * </param>
+ * <param name="size">The size of the buffer in bytes.</param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+ * <remarks>
+ * Each name takes 8 bytes and a file with a long name has two, so indexing a
+ * directory of 20,000 files with long names takes a buffer of 512 KB. At most
+ * 65536 slots are used and the index is dropped when it's 3/4 full.
+ * </remarks>
+ */
+uint16_t fat_set_directory_index_buffer
+(
+	FAT_VOLUME* volume,
+	void* buffer,
+	uint32_t size
+);
+#endif
+
 /**
  * <summary>
  * Finds the first entry in a directory.
@@ -633,6 +991,35 @@ uint16_t fat_find_first_entry
 	FAT_FILESYSTEM_QUERY* query
 );
 
+/**
+ * <summary>
+ * Finds the first entry in a directory that meets the conditions of a filter.
+ * </summary>
+ * <param name="volume">A pointer to the volume handle (FAT_VOLUME).</param>
+ * <param name="path">The path of the directory to query.</param>
+ * <param name="attributes">An ORed list of file attributes to filter the query.</param>
+ * <param name="filter">A pointer to the filter. It must remain valid until the query is no longer used.</param>
+ * <param name="dir_entry">
+ * A pointer-to-pointer to a FAT_DIRECTORY_ENTRY structure. 
+ * When this function returns the pointer will be set to to point to the directory entry.
+ * </param>
+ * <param name="query">A pointer to a FAT_FILESYSTEM_QUERY that will be initialized as the query handle.</param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+ * <remarks>
+ * The entries are checked before they are decoded so the ones that don't meet the conditions
+ * cost no more than reading them. fat_find_next_entry returns the next entry that meets them.
+ * </remarks>
+*/
+uint16_t fat_find_first_entry_ex
+(
+	FAT_VOLUME* volume, 
+	char* path, 
+	unsigned char attributes, 
+	FAT_QUERY_FILTER* filter,
+	FAT_DIRECTORY_ENTRY** dir_entry,
+	FAT_FILESYSTEM_QUERY* query
+);
+
 /**
  * <summary>
  * Finds the next entry in a directory.
@@ -652,6 +1039,27 @@ uint16_t fat_find_next_entry
 	FAT_FILESYSTEM_QUERY* query
 );
 
+/**
+ * <summary>
+ * Decodes the timestamps of a directory entry.
+ * </summary>
+ * <param name="entry">A pointer to the directory entry.</param>
+ * <param name="create_time">A pointer to a time_t that receives the creation timestamp or NULL.</param>
+ * <param name="modify_time">A pointer to a time_t that receives the modification timestamp or NULL.</param>
+ * <param name="access_time">A pointer to a time_t that receives the access timestamp or NULL.</param>
+ * <remarks>
+ * Only the timestamps that are requested are decoded. When FAT_LAZY_DIRECTORY_TIMES is defined
+ * this is the only way to get them.
+ * </remarks>
+*/
+void fat_get_entry_times
+(
+	FAT_DIRECTORY_ENTRY* entry,
+	time_t* create_time,
+	time_t* modify_time,
+	time_t* access_time
+);
+
 /**
  * <summary>
  * Creates a new directory on the volume.
@@ -666,6 +1074,38 @@ uint16_t fat_create_directory
 	char* filename
 );
 
+/**
+ * <summary>
+ * Compacts a directory. The entries of the directory are moved to the lowest
+ * slots over the ones left by deleted files, keeping the long name entries of
+ * each file together, and the clusters that are left empty at the end of the
+ * directory are freed.
+ * </summary>
+ * <param name="volume">A pointer to the volume handle (FAT_VOLUME).</param>
+ * <param name="path">The path of the directory to compact.</param>
+ * <param name="handles">
+ * An array of pointers to the files that are open on the volume so their
+ * entries can be updated when they're moved, or NULL if none is open.
+ * </param>
+ * <param name="count">The number of pointers on the handles array.</param>
+ * <returns>
+ * One of the return codes defined in fat.h. FAT_FILE_HANDLE_IN_USE is returned
+ * if there are more files open on the volume than handles passed.
+ * </returns>
+ * <remarks>
+ * Every file that is open on the volume must be on the handles array so that
+ * it's entry can be updated if it's moved. If the power is lost while a
+ * directory is being compacted some entries may be listed twice.
+ * </remarks>
+*/
+uint16_t fat_compact_directory
+(
+	FAT_VOLUME* volume,
+	char* path,
+	FAT_FILE** handles,
+	uint16_t count
+);
+
 /**
  * <summary>
  * Deletes a file.
@@ -680,6 +1120,28 @@ uint16_t fat_file_delete
 	char* filename
 );
 
+/**
+ * <summary>
+ * Deletes a directory together with all the files and directories in it.
+ * </summary>
+ * <param name="volume">A pointer to the volume handle (FAT_VOLUME structure).</param>
+ * <param name="path">The full path of the directory to delete.</param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+ * <remarks>
+ * The tree is walked once and each directory sector is written once with
+ * all of it's entries marked as deleted. The cluster chains are freed in
+ * batches of FAT_DELETE_TREE_CHAINS so each FAT sector is written once per
+ * batch instead of once per file. If the path is a file it is deleted as
+ * by fat_file_delete. The root directory cannot be deleted. No file in the
+ * tree may be open.
+ * </remarks>
+*/
+uint16_t fat_delete_tree
+(
+	FAT_VOLUME* volume,
+	char* path
+);
+
 /**
  * <summary>
  * Renames a file.
@@ -696,6 +1158,27 @@ uint16_t fat_file_rename
 	char* new_filename
 );
 
+/**
+ * <summary>
+ * Copies a file.
+ * </summary>
+ * <param name="volume">A pointer to the volume handle (FAT_VOLUME structure).</param>
+ * <param name="src_filename">The full path and filename of the file to be copied.</param>
+ * <param name="dst_filename">The full path and filename of the copy. If it exists it is overwritten.</param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+ * <remarks>
+ * All the clusters of the copy are allocated before any data is copied and the data is
+ * copied between the clusters of both files without going through file buffers, one
+ * sector at a time or FAT_COPY_SECTORS sectors at a time if it is defined.
+ * </remarks>
+*/
+uint16_t fat_file_copy
+(
+	FAT_VOLUME* volume,
+	char* src_filename,
+	char* dst_filename
+);
+
 /**
  * <summary>
  * Opens or create a file.
@@ -714,6 +1197,36 @@ uint16_t fat_file_open
 	FAT_FILE* file
 );
 
+/**
+ * <summary>
+ * Creates several files on the same directory.
+ * </summary>
+ * <param name="volume">A pointer to the volume handle (FAT_VOLUME structure).</param>
+ * <param name="dir_path">The full path of the directory where the files are created.</param>
+ * <param name="names">An array with the filenames of the new files.</param>
+ * <param name="count">The number of files to create.</param>
+ * <param name="access_flags">The access flags used to open the files when handles is not NULL.</param>
+ * <param name="handles">An array of count file handles where the files are opened or NULL.</param>
+ * <param name="entries">An array of count directory entries that receives the entries of the files. Ignored when handles is not NULL.</param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+ * <remarks>
+ * If any of the files exists or a name is repeated no file is created and FAT_FILENAME_ALREADY_EXISTS
+ * is returned. The directory is scanned once to check the names and pick the short names of all the files,
+ * and the entries are then written with one read and one write per directory sector. If an error occurs
+ * while writing the entries the files written before it are left on the directory.
+ * </remarks>
+*/
+uint16_t fat_create_files
+(
+	FAT_VOLUME* volume,
+	char* dir_path,
+	char** names,
+	uint16_t count,
+	unsigned char access_flags,
+	FAT_FILE* handles,
+	FAT_DIRECTORY_ENTRY* entries
+);
+
 /**
  * <summary>
  * Sets an external buffer for this file handle.
@@ -725,6 +1238,104 @@ uint16_t fat_file_set_buffer
 	unsigned char* buffer
 );
 
+#if defined(FAT_READ_AHEAD)
+/**
+ * <summary>
+ * Sets the read-ahead ring of a file handle. Once set, asynchronous reads
+ * that follow each other sequentially will cause the sectors after the cursor
+ * to be prefetched into the ring. The prefetch window starts at one sector and
+ * doubles on every sequential read up to the depth of the ring, but it never
+ * reaches past the end of the run of contiguous clusters under the cursor.
+ * </summary>
+ * <param name="file">An open file handle.</param>
+ * <param name="buffer">
+ * A buffer large enough to hold depth sectors, or NULL to disable read-ahead.
+ * It must remain valid until read-ahead is disabled or the file is closed.
+ * </param>
+ * <param name="depth">The number of sectors that fit in the buffer.</param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+ * <remarks>
+ * While a prefetch is in flight fat_file_close will return FAT_FILE_HANDLE_IN_USE
+ * so the handle cannot be released under the device driver.
+ * </remarks>
+*/
+uint16_t fat_file_set_read_ahead
+(
+	FAT_FILE* file,
+	unsigned char* buffer,
+	uint16_t depth
+);
+#endif
+
+#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+/**
+ * <summary>
+ * Sets a multi-sector buffer for this file handle. The sectors filled by
+ * writes are kept in the buffer until it is full or the next sector of the
+ * file is not contiguous on the volume, and then they're written to the device
+ * together. On asynchronous writes the whole buffer is written with a single
+ * multiple sector transfer if the device supports it. Partially filled buffers
+ * are written when the file is flushed, closed, seeked or read.
+ * </summary>
+ * <param name="file">An open file handle.</param>
+ * <param name="buffer">
+ * The new file buffer. It must remain valid until the file is closed.
+ * </param>
+ * <param name="size">
+ * The size of the buffer in bytes. Only whole sectors are used, if it is
+ * smaller than two sectors this function behaves like fat_file_set_buffer.
+ * </param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+ * <remarks>
+ * If the file was opened with FAT_FILE_FLAG_DELAYED_ALLOCATION the clusters for
+ * the data written past the end of the cluster chain are only reserved when
+ * fat_file_write is called, so FAT_INSUFFICIENT_DISK_SPACE is still returned by
+ * the write, and they are allocated when the buffer is written to the device. This
+ * allows the allocator to find a single free run for the whole buffer. The first
+ * reservation made on a volume counts its free clusters, which requires a scan of
+ * the FAT.
+ * </remarks>
+*/
+uint16_t fat_file_set_buffer_ex
+(
+	FAT_FILE* file,
+	unsigned char* buffer,
+	uint32_t size
+);
+#endif
+
+#if defined(FAT_CHECKPOINTS) && !defined(FAT_READ_ONLY)
+/**
+ * <summary>
+ * Sets the checkpoint policy of a file handle. While the file is written its
+ * directory entry is updated to cover the data already on the device every time
+ * that data grows by the specified number of bytes or clusters, or when it grows
+ * after the specified number of seconds have elapsed since the last update. On
+ * FAT32 volumes the FSInfo sector is also updated when clusters have been allocated.
+ * </summary>
+ * <param name="file">An open file handle.</param>
+ * <param name="bytes">The number of bytes between checkpoints, or 0.</param>
+ * <param name="clusters">The number of clusters between checkpoints, or 0.</param>
+ * <param name="seconds">The number of seconds between checkpoints, or 0.</param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+ * <remarks>
+ * Checkpoints are taken at the end of each write and at sector boundaries within
+ * large writes. Streaming writes take them only when the transfer is stopped to
+ * follow the cluster chain. Data held by the file buffers is not covered until it
+ * is written to the device. The time is taken from the system time function, if
+ * FAT_USE_SYSTEM_TIME is not defined and no function has been registered time
+ * based checkpoints are never taken. Setting all the values to 0 disables checkpoints.
+ * </remarks>
+*/
+uint16_t fat_file_set_checkpoint
+(
+	FAT_FILE* file,
+	uint32_t bytes,
+	uint32_t clusters,
+	uint16_t seconds
+);
+#endif
+
 /**
  * <summary>
  * Gets the unique identifier of the file.
@@ -760,6 +1371,25 @@ uint16_t fat_file_alloc
 	uint32_t bytes
 );
 
+/**
+ * <summary>
+ * Shrinks a file to the specified size.
+ * </summary>
+ * <param name="handle">A pointer to the file handle FAT_FILE structure.</param>
+ * <param name="new_size">The new size of the file. It cannot be larger than the current size.</param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+ * <remarks>
+ * The cluster chain is cut after the last cluster needed to hold new_size bytes, the
+ * clusters after it are freed and the directory entry is updated. If the cursor is past
+ * the new end of the file it is moved to the end.
+ * </remarks>
+*/
+uint16_t fat_file_truncate
+(
+	FAT_FILE* handle,
+	uint32_t new_size
+);
+
 /**
  * <summary>
  * Moves the file cursor to a new position within the file.
@@ -877,6 +1507,53 @@ uint16_t fat_file_write_stream
 );
 #endif
 
+/*!
+ * <summary>
+ * Initiates a stream read. This is the counterpart of fat_file_write_stream. The
+ * file is read from the current position into your buffer and every time the buffer
+ * is full the callback function is invoked with the result pointer set to
+ * FAT_AWAITING_DATA. In the callback you must either consume the data or replace the
+ * buffer with a different one (a pointer to the buffer is passed to the function for
+ * this) and set the response argument to FAT_STREAMING_RESPONSE_READY to continue
+ * reading. If the driver supports multiple sector reads and you respond this way the
+ * device will read the whole run of contiguous clusters with a single command. If you're
+ * not ready to take the data set the response to FAT_STREAMING_RESPONSE_SKIP and the
+ * callback will be invoked again later, or set it to FAT_STREAMING_RESPONSE_STOP to end
+ * the transfer. When the end of the file is reached or the transfer is stopped the
+ * callback is invoked once more with the result set to FAT_SUCCESS (or an error code),
+ * at that point the buffer holds bytes_read bytes that have not been handed to you yet.
+ * </summary>
+ * <param name="handle">A pointer to a file handle FAT_FILE structure.</param>
+ * <param name="buffer">The buffer where the data will be copied to.</param>
+ * <param name="length">
+ * The size of the buffer. If the file was opened with FAT_FILE_FLAG_NO_BUFFERING it must
+ * be a multiple of the sector size and the sectors are read directly into it.
+ * </param>
+ * <param name="bytes_read">
+ * A pointer to a 32-bit integer where the amount of bytes in the buffer will be stored
+ * before each callback.
+ * </param>
+ * <param name="result">A pointer to a 16-bit unsigned integer where the result of the operation will be saved.</param>
+ * <param name="callback">A callback function that will be called every time the buffer is filled.</param>
+ * <param name="callback_context">A pointer that will be passed to the callback function.</param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+ * <remarks>
+ * If the file is opened for write access the file buffer is flushed before the transfer begins.
+ * </remarks>
+ */
+#if defined(FAT_STREAMING_IO)
+uint16_t fat_file_read_stream
+(
+	FAT_FILE* handle, 
+	unsigned char* buffer, 
+	uint32_t length, 
+	uint32_t* bytes_read,
+	uint16_t* result, 
+	FAT_STREAM_CALLBACK* callback, 
+	void* callback_context
+);
+#endif
+
 /**
  * <summary>
  * Reads the specified number of bytes from the current position on an opened file.
@@ -924,6 +1601,93 @@ uint16_t fat_file_read_async
 	void* callback_context
 );
 
+/**
+ * <summary>
+ * Reads from the current position on an opened file without copying the data. On return
+ * ptr points to the data inside the file's buffers and the file cursor has moved past it.
+ * </summary>
+ * <param name="handle">A pointer to a file handle FAT_FILE structure.</param>
+ * <param name="max_len">The maximum amount of bytes to borrow.</param>
+ * <param name="ptr">A pointer to a pointer where the address of the data will be written to.</param>
+ * <param name="len">A pointer to a 32 bit integer where the amount of bytes borrowed will be written to.</param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+ * <remarks>
+ * The data is borrowed from the file's sector buffer so no more than the rest of the sector
+ * is returned, except when the sectors that follow are already in the read-ahead ring, in
+ * which case a run of them may be returned at once. The data remains valid and the handle
+ * cannot be used until fat_file_read_release is called. At the end of the file len is set to
+ * zero and nothing is borrowed. This function is not supported on files opened with the
+ * FAT_FILE_FLAG_NO_BUFFERING flag.
+ * </remarks>
+*/
+uint16_t fat_file_read_borrow
+(
+	FAT_FILE* handle,
+	uint32_t max_len,
+	unsigned char** ptr,
+	uint32_t* len
+);
+
+/**
+ * <summary>
+ * Returns the data borrowed by fat_file_read_borrow to the file.
+ * </summary>
+ * <param name="handle">A pointer to a file handle FAT_FILE structure.</param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+*/
+uint16_t fat_file_read_release
+(
+	FAT_FILE* handle
+);
+
+/**
+ * <summary>
+ * Reads the specified number of bytes from the specified offset of an opened file
+ * without moving the file cursor.
+ * </summary>
+ * <param name="handle">A pointer to a file handle FAT_FILE structure.</param>
+ * <param name="offset">The offset within the file where the read begins.</param>
+ * <param name="buffer">A buffer where the bytes will be copied to.</param>
+ * <param name="length">The amount of bytes to read.</param>
+ * <param name="bytes_read">A pointer to a 32 bit integer where the amount of bytes read will be written to.</param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+ * <remarks>
+ * The cluster that contains the offset is looked up starting from the last cluster 
+ * accessed by this function or the cluster under the cursor, whichever is closer, so
+ * small random reads don't need to walk the whole cluster chain.
+ * </remarks>
+*/
+uint16_t fat_file_pread
+(
+	FAT_FILE* handle,
+	uint32_t offset,
+	unsigned char* buffer,
+	uint32_t length,
+	uint32_t* bytes_read
+);
+
+/**
+ * <summary>
+ * Writes the specified number of bytes to the specified offset of an opened file
+ * without moving the file cursor.
+ * </summary>
+ * <param name="handle">A pointer to a file handle FAT_FILE structure.</param>
+ * <param name="offset">The offset within the file where the write begins.</param>
+ * <param name="buffer">A buffer containing the bytes to be written.</param>
+ * <param name="length">The amount of bytes to write.</param>
+ * <returns>One of the return codes defined in fat.h.</returns>
+ * <remarks>
+ * The offset cannot be past the end of the file but the write may extend the file.
+ * </remarks>
+*/
+uint16_t fat_file_pwrite
+(
+	FAT_FILE* handle,
+	uint32_t offset,
+	unsigned char* buffer,
+	uint32_t length
+);
+
 /**
  * <summary>
  * Flushes file buffers and updates directory entry.
@@ -107,6 +107,7 @@
 static uint32_t INLINE fat_allocate_cluster(FAT_VOLUME* volume, FAT_RAW_DIRECTORY_ENTRY* parent, uint32_t count, char zero, uint32_t page_size, uint16_t* result);
 static uint16_t INLINE fat_initialize_directory_cluster(FAT_VOLUME* volume, FAT_RAW_DIRECTORY_ENTRY* parent, uint32_t cluster, unsigned char* buffer);
 static uint16_t INLINE fat_zero_cluster(FAT_VOLUME* volume, uint32_t cluster, unsigned char* buffer);
+static uint16_t INLINE fat_zero_sectors(FAT_VOLUME* volume, uint32_t sector_address, uint16_t count, unsigned char* buffer);
 static INLINE void fat_write_fat_sector(FAT_VOLUME* volume, uint32_t sector_address, unsigned char* buffer, uint16_t* ret);
 
 /*
@@ -1126,8 +1127,21 @@ static uint32_t INLINE fat_allocate_cluster(
 */
 #if !defined(FAT_READ_ONLY)
 uint16_t fat_free_cluster_chain(FAT_VOLUME* volume, uint32_t cluster) 
+{
+	return fat_free_cluster_chains(volume, &cluster, 1);
+}
+
+/*
+// marks all the clusters in a list of cluster chains as free. The
+// chains are walked one after the other and each FAT sector is only
+// written when the walk moves to another one, so chains that share
+// FAT sectors cost one write per sector instead of one per chain
+*/
+uint16_t fat_free_cluster_chains(FAT_VOLUME* volume, uint32_t* clusters, uint16_t count) 
 {
 	uint16_t ret;				/* temp variable / used to hold return codes from driver */
+	uint16_t chain = 0;			/* the index of the chain being freed */
+	uint32_t cluster;			/* the cluster being freed */
 	uint32_t fat_offset = 0;		/* the offset of the cluster entry within the FAT table */
 	uint32_t entry_offset;		/* the offset of the cluster entry within it's sector */
 	uint32_t entry_sector;		/* the sector where the entry is stored on the drive */
@@ -1142,11 +1156,15 @@ uint16_t fat_free_cluster_chain(FAT_VOLUME* volume, uint32_t cluster)
 	#else
 	ALIGN16 unsigned char buffer[MAX_SECTOR_LENGTH];
 	#endif
+
+	if (!count)
+		return FAT_SUCCESS;
 	/*
 	// get the offset of the cluster entry within the FAT table,
 	// the sector of the FAT table that contains the entry and the offset
 	// of the fat entry within the sector
 	*/				
+	cluster = clusters[0];
 	FAT_CALCULATE_ENTRY_OFFSET(volume->fs_type, cluster, fat_offset);
 	entry_sector = volume->no_of_reserved_sectors + (fat_offset / volume->no_of_bytes_per_serctor);
 	entry_offset = fat_offset % volume->no_of_bytes_per_serctor;
@@ -1203,6 +1221,20 @@ uint16_t fat_free_cluster_chain(FAT_VOLUME* volume, uint32_t cluster)
 				return FAT_INVALID_CLUSTER;
 			}
 			/*
+			// forget the tails of the chains that start or
+			// end on this cluster
+			*/
+			#if defined(FAT_TAIL_HINTS)
+			{
+				uint16_t i;
+				for (i = 0; i < FAT_TAIL_HINTS; i++)
+				{
+					if (volume->tail_hints[i].first_cluster == cluster || volume->tail_hints[i].clus_addr == cluster)
+						volume->tail_hints[i].first_cluster = 0;
+				}
+			}
+			#endif
+			/*
 			// read the cluster entry and mark it as free
 			*/
 			switch (volume->fs_type)
@@ -1368,9 +1400,14 @@ uint16_t fat_free_cluster_chain(FAT_VOLUME* volume, uint32_t cluster)
 			*/
 			volume->total_free_clusters++;
 			/*
-			// if it's the EOF marker we're done, flush the buffer and go
+			// if it's the EOF marker move on to the next chain, once
+			// the last one is freed flush the buffer and go
 			*/
-			if (fat_is_eof_entry(volume, cluster))
+			if (fat_is_eof_entry(volume, cluster) && ++chain < count)
+			{
+				cluster = clusters[chain];
+			}
+			else if (fat_is_eof_entry(volume, cluster))
 			{
 				fat_write_fat_sector(volume, current_sector, buffer, &ret);
 				if (ret != STORAGE_SUCCESS)
@@ -1565,6 +1602,32 @@ uint16_t fat_get_cluster_entry(
 	return FAT_SUCCESS;
 }
 
+#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+/*
+// counts the free clusters of the volume by
+// scanning the whole FAT
+*/
+uint16_t fat_count_free_clusters(FAT_VOLUME* volume, uint32_t* count)
+{
+	uint16_t ret;
+	uint32_t cluster;
+	FAT_ENTRY fat_entry;
+
+	*count = 0;
+
+	for (cluster = 2; cluster < volume->no_of_clusters + 2; cluster++)
+	{
+		ret = fat_get_cluster_entry(volume, cluster, &fat_entry);
+		if (ret != FAT_SUCCESS)
+			return ret;
+
+		if (fat_entry == 0)
+			(*count)++;
+	}
+	return FAT_SUCCESS;
+}
+#endif
+
 /*
 // updates the FAT entry for a given cluster
 */
@@ -1753,7 +1816,7 @@ uint16_t fat_set_cluster_entry(FAT_VOLUME* volume, uint32_t cluster, FAT_ENTRY f
 // current_cluster cluster
 */
 char fat_increase_cluster_address(
-	FAT_VOLUME* volume, uint32_t cluster, uint16_t count, uint32_t* value ) 
+	FAT_VOLUME* volume, uint32_t cluster, uint32_t count, uint32_t* value ) 
 {
 	uint16_t ret;
 	uint32_t fat_offset = 0;
@@ -1981,7 +2044,6 @@ static uint16_t INLINE fat_initialize_directory_cluster(
 	FAT_VOLUME* volume, FAT_RAW_DIRECTORY_ENTRY* parent, uint32_t cluster, unsigned char* buffer) 
 {
 	uint16_t ret;
-	uint16_t counter;
 	uint32_t current_sector;
 	FAT_RAW_DIRECTORY_ENTRY* entries;
 	/*
@@ -2094,17 +2156,7 @@ static uint16_t INLINE fat_initialize_directory_cluster(
 	// initialize the rest of the sectors of this cluster
 	*/
 	memset(buffer, 0, sizeof(FAT_RAW_DIRECTORY_ENTRY) * 2);
-	counter = volume->no_of_sectors_per_cluster - 1;
-	while (counter--)
-	{
-		ret = volume->device->write_sector(volume->device->driver, current_sector++, buffer);
-		if (ret != STORAGE_SUCCESS)
-			return FAT_CANNOT_WRITE_MEDIA;	
-	}
-	/*
-	// return success code
-	*/
-	return FAT_SUCCESS;
+	return fat_zero_sectors(volume, current_sector, volume->no_of_sectors_per_cluster - 1, buffer);
 }
 #endif
 
@@ -2114,36 +2166,47 @@ static uint16_t INLINE fat_initialize_directory_cluster(
 #if !defined(FAT_READ_ONLY)
 static uint16_t INLINE fat_zero_cluster(FAT_VOLUME* volume, uint32_t cluster, unsigned char* buffer) 
 {
-
-	uint16_t ret;
-	uint16_t counter;
-	uint32_t current_sector;
-
 	FAT_SET_LOADED_SECTOR(0xFFFFFFFF);
 	/*
 	// set all the bytes in the buffer to zero
 	*/
 	memset(buffer, 0, volume->no_of_bytes_per_serctor);
 	/*
-	// calculate the address of the 1st sector
-	// of the cluster
+	// zero every sector in the cluster
 	*/
-	current_sector = FIRST_SECTOR_OF_CLUSTER(volume, cluster);	
-	counter = volume->no_of_sectors_per_cluster;
-	/*
-	// write the zeroed buffer to every sector in the cluster
-	*/	
-	while (counter--) 
+	return fat_zero_sectors(volume, FIRST_SECTOR_OF_CLUSTER(volume, cluster), volume->no_of_sectors_per_cluster, buffer);
+}	
+#endif
+
+/*
+// sets a range of sectors to zeroes. If the driver can do it in a single
+// operation (by erasing them on a device where erased sectors read back
+// as zeroes or with a multi-sector write) we let it, otherwise we write
+// the zeroed buffer to each sector
+*/
+#if !defined(FAT_READ_ONLY)
+static uint16_t INLINE fat_zero_sectors(FAT_VOLUME* volume, uint32_t sector_address, uint16_t count, unsigned char* buffer)
+{
+	uint16_t ret;
+
+	if (!count)
+		return FAT_SUCCESS;
+
+	if (volume->device->zero_sectors)
 	{
-		ret = volume->device->write_sector(volume->device->driver, current_sector++, buffer);
-		if (ret != FAT_SUCCESS)
+		ret = volume->device->zero_sectors(volume->device->driver, sector_address, sector_address + count - 1);
+		if (ret != STORAGE_SUCCESS)
+			return FAT_CANNOT_WRITE_MEDIA;
+		return FAT_SUCCESS;
+	}
+	while (count--)
+	{
+		ret = volume->device->write_sector(volume->device->driver, sector_address++, buffer);
+		if (ret != STORAGE_SUCCESS)
 			return FAT_CANNOT_WRITE_MEDIA;
 	}
-	/*
-	// return success code
-	*/
 	return FAT_SUCCESS;
-}	
+}
 #endif
 
 /*
@@ -40,11 +40,88 @@
 #define FAT_SET_LOADED_SECTOR(volume, sector)	
 #endif
 
+#if defined(FAT_COPY_SECTORS)
+#define FAT_COPY_BUFFER_SECTORS		FAT_COPY_SECTORS
+#else
+#define FAT_COPY_BUFFER_SECTORS		1
+#endif
+
 #if !defined(FAT_READ_ONLY) && defined(FAT_STREAMING_IO)
 void fat_file_write_stream_callback(FAT_FILE* handle, uint16_t* async_state_in, unsigned char** transfer_buffer, uint16_t* response);
 #endif
+#if defined(FAT_STREAMING_IO)
+void fat_file_read_stream_callback(FAT_FILE* handle, uint16_t* result, unsigned char** transfer_buffer, uint16_t* response);
+static void fat_file_read_stream_sector_callback(FAT_FILE* handle, uint16_t* result);
+#endif
 
 uint16_t fat_file_update_sequential_cluster_count(FAT_FILE* file);
+static uint16_t fat_file_next_sector(FAT_FILE* handle);
+static uint16_t fat_file_get_cluster_address(FAT_FILE* handle, uint32_t clus_idx, uint32_t* clus_addr);
+static uint16_t fat_file_positional_io(FAT_FILE* handle, uint32_t offset, 
+	unsigned char* buff, uint32_t length, uint32_t* bytes_transferred, char write);
+static uint16_t fat_file_read_sector(FAT_FILE* handle, uint32_t sector_addr, unsigned char* buffer);
+static uint16_t fat_file_read_sectors(FAT_VOLUME* volume, uint32_t sector_addr, uint32_t count, unsigned char* buffer);
+#if !defined(FAT_READ_ONLY)
+static uint16_t fat_file_write_sectors(FAT_VOLUME* volume, uint32_t sector_addr, uint32_t count, unsigned char* buffer);
+static uint16_t fat_file_write_buffer(FAT_FILE* handle);
+static uint16_t fat_file_write_entry(FAT_FILE* handle, uint32_t size);
+#if defined(FAT_CHECKPOINTS)
+static uint16_t fat_file_checkpoint(FAT_FILE* handle, uint32_t pos);
+#endif
+#endif
+#if defined(FAT_TAIL_HINTS)
+static void fat_file_get_tail_hint(FAT_FILE* handle);
+static void fat_file_set_tail_hint(FAT_FILE* handle);
+#endif
+#if defined(FAT_READ_AHEAD)
+static void fat_file_read_ahead(FAT_FILE* handle);
+static void fat_file_read_ahead_restart(FAT_FILE* handle, char next);
+static void fat_file_read_ahead_reset(FAT_FILE* handle);
+static void fat_file_read_ahead_callback(FAT_FILE* handle, uint16_t* async_state);
+#endif
+#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+static uint16_t fat_file_write_back_commit(FAT_FILE* handle);
+static uint16_t fat_file_write_back_flush(FAT_FILE* handle);
+static uint16_t fat_file_write_back_next_sector(FAT_FILE* handle);
+static uint16_t fat_file_write_back_reserve(FAT_FILE* handle, uint32_t length);
+static uint16_t fat_file_write_back_allocate(FAT_FILE* handle);
+static void fat_file_write_back_callback(FAT_FILE* handle, uint16_t* result, unsigned char** buffer, uint16_t* response);
+#endif
+#if !defined(FAT_READ_ONLY) && !defined(FAT_DISABLE_LONG_FILENAMES)
+static uint16_t fat_file_delete_long_name(FAT_VOLUME* volume, char* parent_path, FAT_DIRECTORY_ENTRY* entry);
+#endif
+
+/*
+// moves the file cursor to the next sector, following the cluster
+// chain if the current sector is the last one on it's cluster
+*/
+static uint16_t fat_file_next_sector(FAT_FILE* handle)
+{
+	if (handle->current_sector_idx == handle->volume->no_of_sectors_per_cluster - 1)
+	{
+		/*
+		// update the cluster address with the address of the
+		// next cluster
+		*/
+		if (!fat_increase_cluster_address(handle->volume, handle->current_clus_addr, 1, &handle->current_clus_addr))
+			return FAT_CORRUPTED_FILE;
+		/*
+		// reset the current sector, increase the cluster index and
+		// calculate the address of the 1st sector of the cluster
+		*/
+		handle->current_sector_idx = 0x0;
+		handle->current_clus_idx++;
+		if (handle->no_of_clusters_after_pos)
+			handle->no_of_clusters_after_pos--;
+		handle->op_state.sector_addr = FIRST_SECTOR_OF_CLUSTER(handle->volume, handle->current_clus_addr);
+	}
+	else
+	{
+		handle->current_sector_idx++;
+		handle->op_state.sector_addr++;
+	}
+	return FAT_SUCCESS;
+}
 
 uint16_t fat_file_update_sequential_cluster_count(FAT_FILE* handle)
 {
@@ -78,6 +155,80 @@ uint16_t fat_file_update_sequential_cluster_count(FAT_FILE* handle)
 	return FAT_SUCCESS;
 }
 
+#if defined(FAT_TAIL_HINTS)
+/*
+// if we remember the tail of the file's cluster chain
+// cache it on the handle
+*/
+static void fat_file_get_tail_hint(FAT_FILE* handle)
+{
+	uint16_t i;
+
+	#if defined(FAT_MULTI_THREADED)
+	ENTER_CRITICAL_SECTION(handle->volume->write_lock);
+	#endif
+	for (i = 0; i < FAT_TAIL_HINTS; i++)
+	{
+		if (handle->current_clus_addr && handle->volume->tail_hints[i].first_cluster == handle->current_clus_addr)
+		{
+			handle->cached_clus_idx = handle->volume->tail_hints[i].clus_idx;
+			handle->cached_clus_addr = handle->volume->tail_hints[i].clus_addr;
+			break;
+		}
+	}
+	#if defined(FAT_MULTI_THREADED)
+	LEAVE_CRITICAL_SECTION(handle->volume->write_lock);
+	#endif
+}
+
+/*
+// remembers the cluster under the cursor as the tail
+// of the file's cluster chain
+*/
+static void fat_file_set_tail_hint(FAT_FILE* handle)
+{
+	uint16_t i;
+	uint32_t first_cluster;
+	FAT_TAIL_HINT* hint = 0;
+
+	((uint16_t*) &first_cluster)[INT32_WORD0] = handle->directory_entry.raw.ENTRY.STD.first_cluster_lo;
+	((uint16_t*) &first_cluster)[INT32_WORD1] = 
+		(handle->volume->fs_type == FAT_FS_TYPE_FAT32) ? handle->directory_entry.raw.ENTRY.STD.first_cluster_hi : 0;
+	/*
+	// a single cluster file is found without walking
+	*/
+	if (!first_cluster || !handle->current_clus_idx)
+		return;
+
+	#if defined(FAT_MULTI_THREADED)
+	ENTER_CRITICAL_SECTION(handle->volume->write_lock);
+	#endif
+	/*
+	// replace the entry for this file or else the
+	// oldest one
+	*/
+	for (i = 0; i < FAT_TAIL_HINTS; i++)
+	{
+		if (handle->volume->tail_hints[i].first_cluster == first_cluster)
+		{
+			hint = &handle->volume->tail_hints[i];
+			break;
+		}
+	}
+	if (!hint)
+	{
+		hint = &handle->volume->tail_hints[handle->volume->next_tail_hint];
+		handle->volume->next_tail_hint = (handle->volume->next_tail_hint + 1) % FAT_TAIL_HINTS;
+	}
+	hint->first_cluster = first_cluster;
+	hint->clus_idx = handle->current_clus_idx;
+	hint->clus_addr = handle->current_clus_addr;
+	#if defined(FAT_MULTI_THREADED)
+	LEAVE_CRITICAL_SECTION(handle->volume->write_lock);
+	#endif
+}
+#endif
+
 /*
 // opens a file
 */
@@ -325,6 +476,9 @@ uint16_t fat_file_open(FAT_VOLUME* volume,
 				#endif
 				return FAT_CANNOT_WRITE_MEDIA;
 			}
+			#if defined(FAT_DENTRY_CACHE)
+			fat_dentry_cache_update(volume, file_entry.sector_addr, handle->directory_entry.sector_offset, &handle->directory_entry.raw);
+			#endif
 			/*
 			// release lock on the buffer
 			*/
@@ -415,9 +569,40 @@ uint16_t fat_open_file_by_entry(FAT_VOLUME* volume,
 	handle->directory_entry = *entry;	
 	handle->current_size = entry->size;
 	handle->current_clus_idx = 0;
+	handle->cached_clus_addr = 0;
+	handle->cached_clus_idx = 0;
 	handle->access_flags = access_flags;
 	handle->magic = FAT_OPEN_HANDLE_MAGIC;
 	handle->busy = 0;
+	handle->borrowed = 0;
+	#if defined(FAT_READ_AHEAD)
+	handle->read_ahead.buffer = 0;
+	handle->read_ahead.depth = 0;
+	handle->read_ahead.window = 0;
+	handle->read_ahead.count = 0;
+	handle->read_ahead.borrowed = 0;
+	handle->read_ahead.next_pos = 0;
+	handle->read_ahead.pending = 0;
+	handle->read_ahead.discard = 0;
+	handle->read_ahead.waiting = 0;
+	handle->read_ahead.storage_callback_info.Callback = (STORAGE_CALLBACK) &fat_file_read_ahead_callback;
+	handle->read_ahead.storage_callback_info.Context = handle;
+	#endif
+	#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+	handle->write_back.buffer = 0;
+	handle->write_back.depth = 0;
+	handle->write_back.count = 0;
+	handle->write_back.virtual_clusters = 0;
+	handle->write_back.reserved_clusters = 0;
+	handle->write_back.storage_callback_info_ex.Callback = (STORAGE_CALLBACK_EX) &fat_file_write_back_callback;
+	handle->write_back.storage_callback_info_ex.Context = handle;
+	#endif
+	#if defined(FAT_CHECKPOINTS) && !defined(FAT_READ_ONLY)
+	handle->checkpoint.bytes = 0;
+	handle->checkpoint.clusters = 0;
+	handle->checkpoint.seconds = 0;
+	handle->checkpoint.time = 0;
+	#endif
 	/*
 	// calculate the # of clusters allocated
 	*/
@@ -436,6 +621,13 @@ uint16_t fat_open_file_by_entry(FAT_VOLUME* volume,
 	*/
 	((uint16_t*) &handle->current_clus_addr)[INT32_WORD0] = entry->raw.ENTRY.STD.first_cluster_lo;
 	((uint16_t*) &handle->current_clus_addr)[INT32_WORD1] = (volume->fs_type == FAT_FS_TYPE_FAT32) ? entry->raw.ENTRY.STD.first_cluster_hi : 0;
+	/*
+	// if we remember where the cluster chain ends the
+	// seek to the end of the file will start from there
+	*/
+	#if defined(FAT_TAIL_HINTS)
+	fat_file_get_tail_hint(handle);
+	#endif
 
 	#if defined(FAT_READ_ONLY)
 	if (access_flags & (FAT_FILE_ACCESS_APPEND | FAT_FILE_ACCESS_OVERWRITE)) 
@@ -457,6 +649,28 @@ uint16_t fat_open_file_by_entry(FAT_VOLUME* volume,
 		}
 	}
 	else if (access_flags & FAT_FILE_ACCESS_OVERWRITE) 
+	#if defined(FAT_OVERWRITE_IN_PLACE)
+	{
+		/*
+		// if the file is being opened with the OVERWRITE flag we keep it's clusters
+		// and write over them from the start. Only the size is cleared on the entry,
+		// the clusters that the new data doesn't use are freed when the file is closed
+		*/
+		if (entry->size)
+		{
+			handle->current_size = 0x0;
+			ret = fat_file_write_entry(handle, handle->current_size);
+			if (ret != FAT_SUCCESS)
+			{
+				handle->magic = 0;
+				return ret;
+			}
+			entry->raw.ENTRY.STD.size = 0x0;
+		}
+		handle->current_sector_idx = 0x0;
+		handle->buffer_head = handle->buffer;
+	}
+	#else
 	{
 		/*
 		// if the file is being opened with the OVERWRITE flag we must free all the clusters
@@ -532,6 +746,9 @@ uint16_t fat_open_file_by_entry(FAT_VOLUME* volume,
 				#endif
 				return FAT_CANNOT_WRITE_MEDIA;
 			}
+			#if defined(FAT_DENTRY_CACHE)
+			fat_dentry_cache_update(volume, entry->sector_addr, entry->sector_offset, &entry->raw);
+			#endif
 			/*
 			// release lock on the buffer
 			*/
@@ -561,6 +778,7 @@ uint16_t fat_open_file_by_entry(FAT_VOLUME* volume,
 		handle->buffer_head = handle->buffer;
 		handle->no_of_clusters_after_pos = 0;
 	}
+	#endif
 	else 
 	#endif
 	{
@@ -572,6 +790,19 @@ uint16_t fat_open_file_by_entry(FAT_VOLUME* volume,
 		handle->current_sector_idx = 0x0;
 		handle->buffer_head = handle->buffer;	
 	}
+	/*
+	// count the open files so directories are not
+	// compacted while they're open
+	*/
+	#if !defined(FAT_READ_ONLY)
+	#if defined(FAT_MULTI_THREADED)
+	ENTER_CRITICAL_SECTION(volume->write_lock);
+	#endif
+	volume->no_of_open_files++;
+	#if defined(FAT_MULTI_THREADED)
+	LEAVE_CRITICAL_SECTION(volume->write_lock);
+	#endif
+	#endif
 	return FAT_SUCCESS;
 }
 
@@ -580,12 +811,31 @@ uint16_t fat_open_file_by_entry(FAT_VOLUME* volume,
 */
 uint16_t fat_file_set_buffer(FAT_FILE* file, unsigned char* buffer)
 {
+	/*
+	// write any sectors held by the write-back buffer
+	// before we stop using it
+	*/
+	#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+	{
+		uint16_t ret = fat_file_write_back_flush(file);
+		if (ret != FAT_SUCCESS)
+			return ret;
+	}
+	file->write_back.depth = 0;
+	/*
+	// without it allocation is no longer delayed so we
+	// don't need the reserved clusters
+	*/
+	file->volume->reserved_clusters -= file->write_back.reserved_clusters;
+	file->write_back.reserved_clusters = 0;
+	#endif
+
 	if (file->buffer_head != file->buffer)
 	{
 		uint16_t ret;
 		uint32_t sector_address = file->current_sector_idx + FIRST_SECTOR_OF_CLUSTER(file->volume, file->current_clus_addr);
+		file->buffer_head = buffer + (uintptr_t) (file->buffer_head - file->buffer);
 		file->buffer = buffer;
-		file->buffer_head = buffer + (uintptr_t) file->buffer_head;
 		ret = file->volume->device->read_sector(file->volume->device->driver, sector_address, file->buffer);
 		if (ret != STORAGE_SUCCESS)
 		{
@@ -603,6 +853,91 @@ uint16_t fat_file_set_buffer(FAT_FILE* file, unsigned char* buffer)
 	return FAT_SUCCESS;
 }
 
+#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+/*
+// sets a multi-sector write-back buffer
+*/
+uint16_t fat_file_set_buffer_ex(FAT_FILE* file, unsigned char* buffer, uint32_t size)
+{
+	uint16_t ret;
+	uint32_t depth;
+	/*
+	// check that this is a valid handle
+	*/
+	if (file->magic != FAT_OPEN_HANDLE_MAGIC)
+		return FAT_INVALID_HANDLE;
+	if (file->busy)
+		return FAT_FILE_HANDLE_IN_USE;
+	/*
+	// only whole sectors are used
+	*/
+	depth = size / file->volume->no_of_bytes_per_serctor;
+	if (!buffer || !depth)
+		return FAT_INVALID_PARAMETERS;
+	/*
+	// the first sector of the buffer becomes the file buffer
+	*/
+	ret = fat_file_set_buffer(file, buffer);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	/*
+	// the rest of it holds the sectors waiting to be written
+	*/
+	if (depth > 1)
+	{
+		file->write_back.buffer = buffer;
+		file->write_back.depth = (uint16_t) MIN(depth, 0xFFFF);
+		file->write_back.count = 0;
+	}
+	return FAT_SUCCESS;
+}
+#endif
+
+#if defined(FAT_CHECKPOINTS) && !defined(FAT_READ_ONLY)
+/*
+// sets the checkpoint policy of a file
+*/
+uint16_t fat_file_set_checkpoint(FAT_FILE* file, uint32_t bytes, uint32_t clusters, uint16_t seconds)
+{
+	if (file->magic != FAT_OPEN_HANDLE_MAGIC)
+		return FAT_INVALID_HANDLE;
+	if (file->busy)
+		return FAT_FILE_HANDLE_IN_USE;
+
+	file->checkpoint.bytes = bytes;
+	file->checkpoint.clusters = clusters;
+	file->checkpoint.seconds = seconds;
+	file->checkpoint.time = (seconds) ? fat_get_time() : 0;
+	return FAT_SUCCESS;
+}
+#endif
+
+#if defined(FAT_READ_AHEAD)
+/*
+// sets the read-ahead ring of the file
+*/
+uint16_t fat_file_set_read_ahead(FAT_FILE* file, unsigned char* buffer, uint16_t depth)
+{
+	/*
+	// check that this is a valid handle
+	*/
+	if (file->magic != FAT_OPEN_HANDLE_MAGIC)
+		return FAT_INVALID_HANDLE;
+	/*
+	// the ring cannot be swapped while an operation or
+	// a prefetch is using it
+	*/
+	if (file->busy || file->read_ahead.pending)
+		return FAT_FILE_HANDLE_IN_USE;
+
+	file->read_ahead.buffer = buffer;
+	file->read_ahead.depth = buffer ? depth : 0;
+	fat_file_read_ahead_reset(file);
+
+	return FAT_SUCCESS;
+}
+#endif
+
 /*
 // gets a unique identifier of the file (ie. first cluster)
 */
@@ -626,6 +961,89 @@ uint32_t fat_file_get_unique_id(FAT_FILE* file)
 	return id;
 }
 
+#if !defined(FAT_READ_ONLY) && !defined(FAT_DISABLE_LONG_FILENAMES)
+/*
+// marks the lfn entries of a file as deleted. Other files may have
+// lfn entries with the same checksum so we only delete the ones
+// that are right before the file's 8.3 entry
+*/
+static uint16_t fat_file_delete_long_name(FAT_VOLUME* volume, char* parent_path, FAT_DIRECTORY_ENTRY* entry)
+{
+	uint16_t ret;
+	unsigned char i;
+	unsigned char count = 0;
+	unsigned char checksum;
+	uint32_t sector_addr[20];
+	uint16_t sector_offset[20];
+	FAT_FILESYSTEM_QUERY query;
+	unsigned char buffer[MAX_SECTOR_LENGTH];
+
+	checksum = fat_long_entry_checksum((unsigned char*) entry->raw.ENTRY.STD.name);
+	/*
+	// get the 1st entry of the parent directory
+	*/
+	memset(&query, 0, sizeof(query));
+	query.state.buffer = query.state.buff;
+	ret = fat_find_first_entry(volume, parent_path, FAT_ATTR_LONG_NAME, 0, &query);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	/*
+	// remember the address of the lfn entries that we go
+	// through until we find the file's 8.3 entry
+	*/
+	while (*query.current_entry.raw.ENTRY.STD.name != 0)
+	{
+		if (query.current_entry.raw.ENTRY.STD.attributes == FAT_ATTR_LONG_NAME)
+		{
+			if (query.current_entry.raw.ENTRY.LFN.lfn_sequence & FAT_FIRST_LFN_ENTRY)
+				count = 0;
+			if (query.current_entry.raw.ENTRY.LFN.lfn_checksum == checksum && count < 20)
+			{
+				sector_addr[count] = query.current_entry.sector_addr;
+				sector_offset[count++] = query.current_entry.sector_offset;
+			}
+			else
+			{
+				count = 0;
+			}
+		}
+		else if (query.current_entry.sector_addr == entry->sector_addr &&
+			query.current_entry.sector_offset == entry->sector_offset)
+		{
+			break;
+		}
+		else
+		{
+			count = 0;
+		}
+		/*
+		// get the next entry
+		*/
+		ret = fat_find_next_entry(volume, 0, &query);
+		if (ret != FAT_SUCCESS)
+			return ret;
+	}
+	if (*query.current_entry.raw.ENTRY.STD.name == 0)
+		return FAT_SUCCESS;
+	/*
+	// mark the entries as deleted
+	*/
+	for (i = 0; i < count; i++)
+	{
+		ret = volume->device->read_sector(volume->device->driver, sector_addr[i], buffer);
+		if (ret != STORAGE_SUCCESS)
+			return ret;
+
+		buffer[sector_offset[i]] = FAT_DELETED_ENTRY;
+
+		ret = volume->device->write_sector(volume->device->driver, sector_addr[i], buffer);
+		if (ret != STORAGE_SUCCESS)
+			return ret;
+	}
+	return FAT_SUCCESS;
+}
+#endif
+
 /*
 // Deletes a file.
 */
@@ -639,11 +1057,9 @@ uint16_t fat_file_delete(FAT_VOLUME* volume, char* filename)
 	FAT_DIRECTORY_ENTRY entry;
 	unsigned char buffer[MAX_SECTOR_LENGTH];
 
-	#if !defined(FAT_DISABLE_LONG_FILENAMES)
+	#if !defined(FAT_DISABLE_LONG_FILENAMES) || defined(FAT_AUTO_COMPACT)
 	char path_part[256];
 	char* name_part;
-	unsigned char checksum;
-	FAT_FILESYSTEM_QUERY query;
 	#endif
 
 	/*
@@ -655,20 +1071,26 @@ uint16_t fat_file_delete(FAT_VOLUME* volume, char* filename)
 	/*
 	// if the entry is located go ahead and delete it.
 	*/
-	if (entry.name != 0)
+	if (*entry.name != 0)
 	{
-		/*
-		// compute the checksum for the file
-		*/
-		#if !defined(FAT_DISABLE_LONG_FILENAMES)
-		checksum = fat_long_entry_checksum((unsigned char*)entry.raw.ENTRY.STD.name);
-		#endif
 		/*
 		// make sure we're not trying to delete a directory
 		*/
 		if (entry.attributes & FAT_ATTR_DIRECTORY)
 			return FAT_NOT_A_FILE;
 		/*
+		// delete the lfn entries while the 8.3 entry
+		// tells us which ones they are
+		*/
+		#if !defined(FAT_DISABLE_LONG_FILENAMES) || defined(FAT_AUTO_COMPACT)
+		fat_parse_path(filename, path_part, &name_part);
+		#endif
+		#if !defined(FAT_DISABLE_LONG_FILENAMES)
+		ret = fat_file_delete_long_name(volume, path_part, &entry);
+		if (ret != FAT_SUCCESS)
+			return ret;
+		#endif
+		/*
 		// find the entry's first cluster address
 		*/
 		((uint16_t*) &first_cluster)[INT32_WORD0] = entry.raw.ENTRY.STD.first_cluster_lo;
@@ -696,47 +1118,20 @@ uint16_t fat_file_delete(FAT_VOLUME* volume, char* filename)
 		ret = volume->device->write_sector(volume->device->driver, entry.sector_addr, buffer);
 		if (ret != STORAGE_SUCCESS)
 			return ret;
-	}
-
-	#if !defined(FAT_DISABLE_LONG_FILENAMES)
-	/*
-	// parse the filename
-	*/
-	fat_parse_path(filename, path_part, &name_part);
-	/*
-	// get the 1st LFN entry of the parent directory
-	*/
-	ret = fat_find_first_entry(volume, path_part, FAT_ATTR_LONG_NAME, 0, &query);
-	if (ret != FAT_SUCCESS)
-		return ret;
-	/*
-	// loop through each entry.
-	*/
-	while (*query.current_entry.raw.ENTRY.STD.name != 0)
-	{
-		if (query.current_entry.raw.ENTRY.LFN.lfn_checksum == checksum)
-		{
-			/*
-			// mark the entry as deleted
-			*/
-			query.current_entry.raw.ENTRY.STD.name[0] = FAT_DELETED_ENTRY;
-
-			ret = volume->device->read_sector(volume->device->driver, query.current_entry.sector_addr, buffer);
-			if (ret != STORAGE_SUCCESS)
-				return ret;
-
-			memcpy(buffer + query.current_entry.sector_offset, &query.current_entry.raw, sizeof(entry.raw));
-
-			ret = volume->device->write_sector(volume->device->driver, query.current_entry.sector_addr, buffer);
-			if (ret != STORAGE_SUCCESS)
-				return ret;
-		}
+		#if defined(FAT_DENTRY_CACHE)
+		fat_dentry_cache_update(volume, entry.sector_addr, entry.sector_offset, &entry.raw);
+		#endif
 		/*
-		// get the next LFN entry
+		// compact the directory if enough files
+		// have been deleted from it
 		*/
-		fat_find_next_entry(volume, 0, &query);
+		#if defined(FAT_AUTO_COMPACT)
+		ret = fat_auto_compact_directory(volume, path_part);
+		if (ret != FAT_SUCCESS)
+			return ret;
+		#endif
 	}
-	#endif
+
 	/*
 	// return success code
 	*/
@@ -745,22 +1140,317 @@ uint16_t fat_file_delete(FAT_VOLUME* volume, char* filename)
 }
 
 /*
-// renames a file
+// deletes a directory and everything in it. The tree is walked once
+// without recursion, the entries are marked as deleted with a single
+// write per directory sector and the cluster chains are collected and
+// freed in batches so the FAT sectors that they share are written once
 */
-uint16_t fat_file_rename(FAT_VOLUME* volume, char* original_filename, char* new_filename)
+uint16_t fat_delete_tree(FAT_VOLUME* volume, char* path)
 {
 	#if defined(FAT_READ_ONLY)
 	return FAT_FEATURE_NOT_SUPPORTED;
 	#else
 	uint16_t ret;
-	uint32_t entry_cluster;
-	char new_parent[256];
-	char* original_filename_part;
+	uint16_t offset;
+	uint16_t depth = 0;
+	uint16_t no_of_chains = 0;
+	uint32_t top;
+	uint32_t directory;
+	uint32_t parent = 0;
+	uint32_t done = 0;
+	uint32_t cluster;
+	uint32_t sector;
+	uint32_t first_cluster;
+	uint32_t chains[FAT_DELETE_TREE_CHAINS];
+	uint32_t resume_directory[FAT_DELETE_TREE_DEPTH];
+	uint32_t resume_parent[FAT_DELETE_TREE_DEPTH];
+	uint32_t resume_cluster[FAT_DELETE_TREE_DEPTH];
+	uint32_t resume_sector[FAT_DELETE_TREE_DEPTH];
+	char dirty;
+	char descend;
+	char end_reached;
+	FAT_DIRECTORY_ENTRY entry;
+	FAT_RAW_DIRECTORY_ENTRY* raw;
+	#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+	FAT_RAW_DIRECTORY_ENTRY raw_entry;
+	#endif
+	unsigned char buffer[MAX_SECTOR_LENGTH];
+
+	#if !defined(FAT_DISABLE_LONG_FILENAMES) || defined(FAT_AUTO_COMPACT)
+	char path_part[256];
+	char* name_part;
+	#endif
+
+	/*
+	// get the entry of the directory, files are
+	// deleted as usual
+	*/
+	ret = fat_get_file_entry(volume, path, &entry);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	if (*entry.name == 0 || !(entry.attributes & FAT_ATTR_DIRECTORY))
+		return fat_file_delete(volume, path);
+	/*
+	// the root directory has no entry and cannot be deleted
+	*/
+	((uint16_t*) &top)[INT32_WORD0] = entry.raw.ENTRY.STD.first_cluster_lo;
+	((uint16_t*) &top)[INT32_WORD1] = (volume->fs_type == FAT_FS_TYPE_FAT32) ? entry.raw.ENTRY.STD.first_cluster_hi : 0;
+	if (entry.sector_addr == 0x0 || top == 0x0 || (volume->fs_type == FAT_FS_TYPE_FAT32 && top == volume->root_cluster))
+		return FAT_INVALID_PATH;
+
+	directory = top;
+	cluster = top;
+	sector = FIRST_SECTOR_OF_CLUSTER(volume, top);
+
+	while (1)
+	{
+		ret = volume->device->read_sector(volume->device->driver, sector, buffer);
+		if (ret != STORAGE_SUCCESS)
+			return FAT_CANNOT_READ_MEDIA;
+
+		dirty = 0;
+		descend = 0;
+		end_reached = 0;
+
+		for (offset = 0; offset < volume->no_of_bytes_per_serctor; offset += 0x20)
+		{
+			#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+			fat_read_raw_directory_entry(&raw_entry, buffer + offset);
+			raw = &raw_entry;
+			#else
+			raw = (FAT_RAW_DIRECTORY_ENTRY*) (buffer + offset);
+			#endif
+
+			if (raw->ENTRY.STD.name[0] == 0x0)
+			{
+				end_reached = 1;
+				break;
+			}
+			if (raw->ENTRY.STD.name[0] == FAT_DELETED_ENTRY)
+				continue;
+			if (raw->ENTRY.STD.attributes == FAT_ATTR_LONG_NAME)
+			{
+				raw->ENTRY.STD.name[0] = FAT_DELETED_ENTRY;
+				#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+				fat_write_raw_directory_entry(raw, buffer + offset);
+				#endif
+				dirty = 1;
+				continue;
+			}
+			((uint16_t*) &first_cluster)[INT32_WORD0] = raw->ENTRY.STD.first_cluster_lo;
+			((uint16_t*) &first_cluster)[INT32_WORD1] = (volume->fs_type == FAT_FS_TYPE_FAT32) ? raw->ENTRY.STD.first_cluster_hi : 0;
+			/*
+			// the dot entries are left alone but the dotdot entry
+			// tells us where to go once the directory is empty
+			*/
+			if (raw->ENTRY.STD.name[0] == '.')
+			{
+				if (raw->ENTRY.STD.name[1] == '.')
+					parent = first_cluster;
+				continue;
+			}
+			/*
+			// if it's a subdirectory that we haven't emptied yet
+			// write what we've done so far and go into it
+			*/
+			if ((raw->ENTRY.STD.attributes & FAT_ATTR_DIRECTORY) && first_cluster != 0x0 && first_cluster != done)
+			{
+				descend = 1;
+				break;
+			}
+			#if defined(FAT_DENTRY_CACHE)
+			if (raw->ENTRY.STD.attributes & FAT_ATTR_DIRECTORY)
+				fat_dentry_cache_invalidate(volume, raw, 0);
+			#endif
+			/*
+			// mark the entry as deleted and add it's chain to the
+			// list, when the list is full the chains are freed
+			*/
+			raw->ENTRY.STD.name[0] = FAT_DELETED_ENTRY;
+			#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+			fat_write_raw_directory_entry(raw, buffer + offset);
+			#endif
+			dirty = 1;
+
+			if (first_cluster != 0x0)
+			{
+				/*
+				// the entries of the chains that we're about to free
+				// may be on this sector (this one's is) so it must be
+				// written first
+				*/
+				if (no_of_chains == FAT_DELETE_TREE_CHAINS)
+				{
+					ret = volume->device->write_sector(volume->device->driver, sector, buffer);
+					if (ret != STORAGE_SUCCESS)
+						return FAT_CANNOT_WRITE_MEDIA;
+					dirty = 0;
+					ret = fat_free_cluster_chains(volume, chains, no_of_chains);
+					if (ret != FAT_SUCCESS)
+						return ret;
+					no_of_chains = 0;
+				}
+				chains[no_of_chains++] = first_cluster;
+			}
+		}
+		if (dirty)
+		{
+			ret = volume->device->write_sector(volume->device->driver, sector, buffer);
+			if (ret != STORAGE_SUCCESS)
+				return FAT_CANNOT_WRITE_MEDIA;
+		}
+		/*
+		// remember where we are so we can continue from here
+		// once the subdirectory is empty, if the tree is too deep
+		// the directory will be scanned from it's 1st sector
+		*/
+		if (descend)
+		{
+			if (depth < FAT_DELETE_TREE_DEPTH)
+			{
+				resume_directory[depth] = directory;
+				resume_parent[depth] = parent;
+				resume_cluster[depth] = cluster;
+				resume_sector[depth] = sector;
+			}
+			depth++;
+			directory = first_cluster;
+			cluster = first_cluster;
+			sector = FIRST_SECTOR_OF_CLUSTER(volume, cluster);
+			continue;
+		}
+		/*
+		// move to the next sector of the directory
+		*/
+		if (!end_reached && ++sector == FIRST_SECTOR_OF_CLUSTER(volume, cluster) + volume->no_of_sectors_per_cluster)
+		{
+			ret = fat_get_cluster_entry(volume, cluster, &cluster);
+			if (ret != FAT_SUCCESS)
+				return ret;
+			if (fat_is_eof_entry(volume, cluster))
+				end_reached = 1;
+			else
+				sector = FIRST_SECTOR_OF_CLUSTER(volume, cluster);
+		}
+		if (!end_reached)
+			continue;
+		/*
+		// the directory is empty, go back to it's parent
+		// where it's own entry will be deleted
+		*/
+		if (directory == top)
+			break;
+
+		done = directory;
+		if (--depth < FAT_DELETE_TREE_DEPTH)
+		{
+			directory = resume_directory[depth];
+			parent = resume_parent[depth];
+			cluster = resume_cluster[depth];
+			sector = resume_sector[depth];
+		}
+		else
+		{
+			directory = parent;
+			cluster = parent;
+			sector = FIRST_SECTOR_OF_CLUSTER(volume, cluster);
+		}
+	}
+	/*
+	// delete the directory's own entry the same
+	// way that fat_file_delete does
+	*/
+	#if !defined(FAT_DISABLE_LONG_FILENAMES) || defined(FAT_AUTO_COMPACT)
+	fat_parse_path(path, path_part, &name_part);
+	#endif
+	#if !defined(FAT_DISABLE_LONG_FILENAMES)
+	ret = fat_file_delete_long_name(volume, path_part, &entry);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	#endif
+	entry.raw.ENTRY.STD.name[0] = FAT_DELETED_ENTRY;
+
+	ret = volume->device->read_sector(volume->device->driver, entry.sector_addr, buffer);
+	if (ret != STORAGE_SUCCESS)
+		return FAT_CANNOT_READ_MEDIA;
+
+	#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+	fat_write_raw_directory_entry(&entry.raw, buffer + entry.sector_offset);
+	#else
+	memcpy(buffer + entry.sector_offset, &entry.raw, sizeof(entry.raw));
+	#endif
+
+	ret = volume->device->write_sector(volume->device->driver, entry.sector_addr, buffer);
+	if (ret != STORAGE_SUCCESS)
+		return FAT_CANNOT_WRITE_MEDIA;
+	#if defined(FAT_DENTRY_CACHE)
+	fat_dentry_cache_update(volume, entry.sector_addr, entry.sector_offset, &entry.raw);
+	fat_dentry_cache_invalidate(volume, &entry.raw, 0);
+	#endif
+	/*
+	// free the chains that are left. The entries are written
+	// before their chains are freed so if the power is lost
+	// the clusters are lost but never cross-linked
+	*/
+	if (no_of_chains == FAT_DELETE_TREE_CHAINS)
+	{
+		ret = fat_free_cluster_chains(volume, chains, no_of_chains);
+		if (ret != FAT_SUCCESS)
+			return ret;
+		no_of_chains = 0;
+	}
+	chains[no_of_chains++] = top;
+	ret = fat_free_cluster_chains(volume, chains, no_of_chains);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	/*
+	// the sector held by the buffer may be one that we wrote and
+	// the indexed directory may have been deleted, if it's clusters
+	// are reused by a new directory the index would be wrong
+	*/
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	ENTER_CRITICAL_SECTION(volume->sector_buffer_lock);
+	#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+	ENTER_CRITICAL_SECTION(fat_shared_buffer_lock);
+	#endif
+	FAT_SET_LOADED_SECTOR(volume, FAT_UNKNOWN_SECTOR);
+	#if defined(FAT_DIRECTORY_INDEX)
+	volume->index_state = FAT_DIRECTORY_INDEX_NONE;
+	#endif
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	LEAVE_CRITICAL_SECTION(volume->sector_buffer_lock);
+	#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+	LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+	#endif
+	/*
+	// compact the parent directory if enough
+	// files have been deleted from it
+	*/
+	#if defined(FAT_AUTO_COMPACT)
+	ret = fat_auto_compact_directory(volume, path_part);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	#endif
+	return FAT_SUCCESS;
+	#endif
+}
+
+/*
+// renames a file
+*/
+uint16_t fat_file_rename(FAT_VOLUME* volume, char* original_filename, char* new_filename)
+{
+	#if defined(FAT_READ_ONLY)
+	return FAT_FEATURE_NOT_SUPPORTED;
+	#else
+	uint16_t ret;
+	uint32_t entry_cluster;
+	char new_parent[256];
+	char* original_filename_part;
 	FAT_DIRECTORY_ENTRY original_entry;
 	FAT_DIRECTORY_ENTRY new_entry;
 
 	#if !defined(FAT_DISABLE_LONG_FILENAMES)
-	unsigned char checksum = 0;
 	char original_parent[256];
 	#else
 	char original_parent[13];
@@ -797,12 +1487,6 @@ uint16_t fat_file_rename(FAT_VOLUME* volume, char* original_filename, char* new_
 	{
 		FAT_DIRECTORY_ENTRY parent;
 		/*
-		// compute the checksum for the file
-		*/
-		#if !defined(FAT_DISABLE_LONG_FILENAMES)
-		checksum = fat_long_entry_checksum((unsigned char*)original_entry.raw.ENTRY.STD.name);
-		#endif
-		/*
 		// get the cluster # for the entry
 		*/
 		((uint16_t*) &entry_cluster)[INT32_WORD0] = original_entry.raw.ENTRY.STD.first_cluster_lo;
@@ -834,6 +1518,14 @@ uint16_t fat_file_rename(FAT_VOLUME* volume, char* original_filename, char* new_
 		new_entry.raw.ENTRY.STD.reserved = original_entry.raw.ENTRY.STD.reserved;
 		new_entry.raw.ENTRY.STD.size = original_entry.raw.ENTRY.STD.size;
 		/*
+		// delete the lfn entries of the original name
+		*/
+		#if !defined(FAT_DISABLE_LONG_FILENAMES)
+		ret = fat_file_delete_long_name(volume, original_parent, &original_entry);
+		if (ret != FAT_SUCCESS)
+			return ret;
+		#endif
+		/*
 		// acquire a lock on the buffer
 		*/
 		#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
@@ -866,6 +1558,9 @@ uint16_t fat_file_rename(FAT_VOLUME* volume, char* original_filename, char* new_
 			#endif
 			return ret;
 		}
+		#if defined(FAT_DENTRY_CACHE)
+		fat_dentry_cache_update(volume, new_entry.sector_addr, new_entry.sector_offset, &new_entry.raw);
+		#endif
 		/*
 		// mark the original entry as deleted.
 		*/
@@ -891,6 +1586,9 @@ uint16_t fat_file_rename(FAT_VOLUME* volume, char* original_filename, char* new_
 			#endif
 			return ret;
 		}
+		#if defined(FAT_DENTRY_CACHE)
+		fat_dentry_cache_update(volume, original_entry.sector_addr, original_entry.sector_offset, &original_entry.raw);
+		#endif
 		/*
 		// release lock on the buffer
 		*/
@@ -900,60 +1598,152 @@ uint16_t fat_file_rename(FAT_VOLUME* volume, char* original_filename, char* new_
 		LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
 		#endif
 	}
-	#if !defined(FAT_DISABLE_LONG_FILENAMES)
+	return FAT_SUCCESS;
+	#endif
+}
+
+/*
+// copies a file
+*/
+uint16_t fat_file_copy(FAT_VOLUME* volume, char* src_filename, char* dst_filename)
+{
+	#if defined(FAT_READ_ONLY)
+	return FAT_FEATURE_NOT_SUPPORTED;
+	#else
+	uint16_t ret;
+	uint16_t i;
+	char contiguous;
+	uint32_t src_cluster;
+	uint32_t dst_cluster;
+	uint32_t next_cluster;
+	uint32_t sectors_left;
+	uint32_t src_sector;
+	uint32_t dst_sector;
+	uint32_t run;
+	uint32_t count;
+	FAT_FILE dst;
+	FAT_DIRECTORY_ENTRY entry;
+	FAT_DIRECTORY_ENTRY dst_entry;
+	ALIGN16 unsigned char buffer[MAX_SECTOR_LENGTH * FAT_COPY_BUFFER_SECTORS];
+	/*
+	// get the entry of the source file
+	*/
+	ret = fat_get_file_entry(volume, src_filename, &entry);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	if (*entry.name == 0)
+		return FAT_FILE_NOT_FOUND;
+	if (entry.attributes & FAT_ATTR_DIRECTORY)
+		return FAT_NOT_A_FILE;
+	/*
+	// make sure that we're not copying the file onto itself
+	*/
+	ret = fat_get_file_entry(volume, dst_filename, &dst_entry);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	if (*dst_entry.name != 0 && dst_entry.sector_addr == entry.sector_addr && 
+		dst_entry.sector_offset == entry.sector_offset)
+		return FAT_INVALID_PARAMETERS;
+	/*
+	// open the destination file. We don't need a buffer
+	// as we'll write to it's clusters directly
+	*/
+	dst.buffer = 0;
+	ret = fat_file_open(volume, dst_filename, FAT_FILE_ACCESS_CREATE | 
+		FAT_FILE_ACCESS_OVERWRITE | FAT_FILE_FLAG_NO_BUFFERING, &dst);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	/*
+	// allocate all the clusters that the copy needs at once so
+	// they're contiguous if there's enough contiguous free space
+	*/
+	if (entry.size)
 	{
-		FAT_FILESYSTEM_QUERY query;
-		/*
-		// get the 1st LFN entry of the parent directory
-		*/
-		ret = fat_find_first_entry(volume, original_parent, FAT_ATTR_LONG_NAME, 0, &query);
+		ret = fat_file_alloc(&dst, entry.size);
 		if (ret != FAT_SUCCESS)
+		{
+			fat_file_close(&dst);
 			return ret;
-		/*
-		// loop through each entry.
-		*/
-		while (*query.current_entry.raw.ENTRY.STD.name != 0)
+		}
+	}
+	/*
+	// copy the file following both cluster chains. Each transfer
+	// takes the sectors that are contiguous on both files, up to
+	// what fits in the buffer
+	*/
+	((uint16_t*) &src_cluster)[INT32_WORD0] = entry.raw.ENTRY.STD.first_cluster_lo;
+	((uint16_t*) &src_cluster)[INT32_WORD1] = 
+		(volume->fs_type == FAT_FS_TYPE_FAT32) ? entry.raw.ENTRY.STD.first_cluster_hi : 0;
+	dst_cluster = dst.current_clus_addr;
+	sectors_left = (entry.size + volume->no_of_bytes_per_serctor - 1) / volume->no_of_bytes_per_serctor;
+	i = 0;
+
+	while (sectors_left)
+	{
+		src_sector = FIRST_SECTOR_OF_CLUSTER(volume, src_cluster) + i;
+		dst_sector = FIRST_SECTOR_OF_CLUSTER(volume, dst_cluster) + i;
+		run = 0;
+
+		for (;;)
 		{
-			if (query.current_entry.raw.ENTRY.LFN.lfn_checksum == checksum)
+			count = MIN((uint32_t) (volume->no_of_sectors_per_cluster - i), sectors_left - run);
+			count = MIN(count, FAT_COPY_BUFFER_SECTORS - run);
+			run += count;
+			i += (uint16_t) count;
+			/*
+			// stop when the copy or the buffer ends in the middle of
+			// a cluster, otherwise move both files to their next cluster
+			*/
+			if (run == sectors_left || i < volume->no_of_sectors_per_cluster)
+				break;
+
+			ret = fat_get_cluster_entry(volume, src_cluster, &next_cluster);
+			if (ret == FAT_SUCCESS)
 			{
-				/*
-				// acquire a lock on the buffer
-				*/
-				#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
-				ENTER_CRITICAL_SECTION(file->volume->sector_buffer_lock);
-				#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
-				ENTER_CRITICAL_SECTION(fat_shared_buffer_lock);
-				#endif
-				/*
-				// mark the entry as deleted
-				*/
-				FAT_SET_LOADED_SECTOR(volume, FAT_UNKNOWN_SECTOR);
-				query.current_entry.raw.ENTRY.STD.name[0] = FAT_DELETED_ENTRY;
-				ret = volume->device->read_sector(volume->device->driver, query.current_entry.sector_addr, buffer);
-				if (ret != STORAGE_SUCCESS)
-					return ret;
-				memcpy(buffer + query.current_entry.sector_offset, &query.current_entry.raw, sizeof(query.current_entry.raw));
-				ret = volume->device->write_sector(volume->device->driver, query.current_entry.sector_addr, buffer);
-				if (ret != STORAGE_SUCCESS)
-					return ret;
-				/*
-				// release lock on the buffer
-				*/
-				#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
-				LEAVE_CRITICAL_SECTION(file->volume->sector_buffer_lock);
-				#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
-				LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
-				#endif
+				contiguous = (next_cluster == src_cluster + 1);
+				src_cluster = next_cluster;
+				ret = fat_get_cluster_entry(volume, dst_cluster, &next_cluster);
+			}
+			if (ret == FAT_SUCCESS)
+			{
+				contiguous = contiguous && (next_cluster == dst_cluster + 1);
+				dst_cluster = next_cluster;
+				if (fat_is_eof_entry(volume, src_cluster) || fat_is_eof_entry(volume, dst_cluster))
+					ret = FAT_CORRUPTED_FILE;
+			}
+			if (ret != FAT_SUCCESS)
+			{
+				fat_file_close(&dst);
+				return ret;
 			}
+			i = 0;
 			/*
-			// get the next LFN entry
+			// the run continues if both clusters follow
+			// the ones before them on the device
 			*/
-			fat_find_next_entry(volume, 0, &query);
+			if (!contiguous || run == FAT_COPY_BUFFER_SECTORS)
+				break;
+		}
+		ret = fat_file_read_sectors(volume, src_sector, run, buffer);
+		if (ret != STORAGE_SUCCESS)
+		{
+			fat_file_close(&dst);
+			return FAT_CANNOT_READ_MEDIA;
+		}
+		ret = fat_file_write_sectors(volume, dst_sector, run, buffer);
+		if (ret != STORAGE_SUCCESS)
+		{
+			fat_file_close(&dst);
+			return FAT_CANNOT_WRITE_MEDIA;
 		}
+		sectors_left -= run;
 	}
-	#endif
-
-	return FAT_SUCCESS;
+	/*
+	// set the size of the new file. The entry is written and
+	// the clusters that were not used are freed when it's closed
+	*/
+	dst.current_size = entry.size;
+	return fat_file_close(&dst);
 	#endif
 }
 
@@ -1005,6 +1795,21 @@ uint16_t fat_file_alloc(FAT_FILE* file, uint32_t bytes)
 		return FAT_SUCCESS;
 	}
 	/*
+	// leave alone the clusters reserved by other files
+	// that are delaying their allocation
+	*/
+	#if defined(FAT_WRITE_BACK)
+	if (file->volume->reserved_clusters)
+	{
+		if (no_of_clusters_needed > file->volume->total_free_clusters - 
+			(file->volume->reserved_clusters - file->write_back.reserved_clusters))
+		{
+			file->busy = 0;
+			return FAT_INSUFFICIENT_DISK_SPACE;
+		}
+	}
+	#endif
+	/*
 	// allocate a new cluster
 	*/
 	#if defined(FAT_OPTIMIZE_FOR_FLASH)
@@ -1162,6 +1967,9 @@ uint16_t fat_file_alloc(FAT_FILE* file, uint32_t bytes)
 			#endif
 			return ret;
 		}
+		#if defined(FAT_DENTRY_CACHE)
+		fat_dentry_cache_update(file->volume, file->directory_entry.sector_addr, file->directory_entry.sector_offset, &file->directory_entry.raw);
+		#endif
 		/*
 		// release the lock on the buffer
 		*/
@@ -1255,31 +2063,207 @@ uint16_t fat_file_alloc(FAT_FILE* file, uint32_t bytes)
 }
 
 /*
-// moves the file cursor to the specified offset
+// truncates a file
 */
-uint16_t fat_file_seek(FAT_FILE* file, uint32_t offset, char mode)
+uint16_t fat_file_truncate(FAT_FILE* handle, uint32_t new_size)
 {
-	uint32_t new_pos;
-	uint32_t sector_count;
-	uint32_t cluster_count;
-	uint32_t old_cluster;
-	uint32_t sector_address;
+	#if defined(FAT_READ_ONLY)
+	return FAT_FEATURE_NOT_SUPPORTED;
+	#else
 	uint16_t ret;
+	uint32_t pos;
+	uint32_t cluster_size;
+	uint32_t last_clus_idx;
+	uint32_t last_cluster;
+	FAT_ENTRY fat_entry;
 	/*
 	// check that this is a valid handle
 	*/
-	if (file->magic != FAT_OPEN_HANDLE_MAGIC)
+	if (handle->magic != FAT_OPEN_HANDLE_MAGIC)
 		return FAT_INVALID_HANDLE;
 	/*
-	// check that another operation is not using the
-	// handle at this time
+	// check that we got write access
 	*/
-	if (file->busy)
-		return FAT_FILE_HANDLE_IN_USE;
+	if (!(handle->access_flags & FAT_FILE_ACCESS_WRITE))
+		return FAT_FILE_NOT_OPENED_FOR_WRITE_ACCESS;
 	/*
-	// mark the handle as in use
+	// make sure that either a buffer has been set or the file was
+	// opened in unbuffered mode
+	*/
+	if (!handle->buffer && !(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING))
+		return FAT_FILE_BUFFER_NOT_SET;
+	/*
+	// a file can only be made shorter
+	*/
+	if (new_size > handle->current_size)
+		return FAT_INVALID_PARAMETERS;
+	/*
+	// check that another operation is not using the
+	// handle at this time
+	*/
+	if (handle->busy)
+		return FAT_FILE_HANDLE_IN_USE;
+	/*
+	// write the sectors held by the write-back buffer so that
+	// any delayed clusters get allocated before we cut the chain
+	*/
+	#if defined(FAT_WRITE_BACK)
+	ret = fat_file_write_back_flush(handle);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	#endif
+	/*
+	// calculate the cursor position and the index of the
+	// last cluster that the file will keep
+	*/
+	cluster_size = (uint32_t) handle->volume->no_of_sectors_per_cluster * handle->volume->no_of_bytes_per_serctor;
+	pos = handle->current_clus_idx * cluster_size;
+	pos += handle->current_sector_idx * handle->volume->no_of_bytes_per_serctor;
+	pos += (uint32_t) (handle->buffer_head - handle->buffer);
+	last_clus_idx = (new_size) ? (new_size - 1) / cluster_size : 0;
+	/*
+	// if the cursor is past the new end of the file write the
+	// buffered sector and move the cursor to the new end
+	*/
+	if (pos > new_size || handle->current_clus_idx > last_clus_idx)
+	{
+		if (!(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING))
+		{
+			handle->busy = 1;
+			ret = fat_file_write_buffer(handle);
+			handle->busy = 0;
+			if (ret != FAT_SUCCESS)
+				return ret;
+		}
+		ret = fat_file_seek(handle, new_size, FAT_SEEK_START);
+		if (ret != FAT_SUCCESS)
+			return ret;
+	}
+	/*
+	// mark the handle as in use
+	*/
+	handle->busy = 1;
+	/*
+	// the prefetched sectors may belong to the clusters
+	// that we're about to free
+	*/
+	#if defined(FAT_READ_AHEAD)
+	fat_file_read_ahead_reset(handle);
+	#endif
+
+	if (!new_size)
+	{
+		/*
+		// free the whole chain and detach it from the entry
+		*/
+		((uint16_t*) &last_cluster)[INT32_WORD0] = handle->directory_entry.raw.ENTRY.STD.first_cluster_lo;
+		((uint16_t*) &last_cluster)[INT32_WORD1] = 
+			(handle->volume->fs_type == FAT_FS_TYPE_FAT32) ? handle->directory_entry.raw.ENTRY.STD.first_cluster_hi : 0;
+
+		if (last_cluster)
+		{
+			ret = fat_free_cluster_chain(handle->volume, last_cluster);
+			if (ret != FAT_SUCCESS)
+			{
+				handle->busy = 0;
+				return ret;
+			}
+		}
+		handle->directory_entry.raw.ENTRY.STD.first_cluster_lo = 0;
+		handle->directory_entry.raw.ENTRY.STD.first_cluster_hi = 0;
+		handle->current_clus_addr = 0;
+		handle->no_of_clusters_after_pos = 0;
+		handle->cached_clus_addr = 0;
+	}
+	else
+	{
+		/*
+		// find the cluster that will be the last one and if it
+		// links to more clusters end the chain there before freeing
+		// the rest, so that if we fail halfway the tail is lost
+		// clusters rather than a cross-linked chain
+		*/
+		ret = fat_file_get_cluster_address(handle, last_clus_idx, &last_cluster);
+		if (ret != FAT_SUCCESS)
+		{
+			handle->busy = 0;
+			return ret;
+		}
+		ret = fat_get_cluster_entry(handle->volume, last_cluster, &fat_entry);
+		if (ret != FAT_SUCCESS)
+		{
+			handle->busy = 0;
+			return ret;
+		}
+		if (!fat_is_eof_entry(handle->volume, fat_entry))
+		{
+			switch (handle->volume->fs_type) 
+			{
+				case FAT_FS_TYPE_FAT12 : ret = fat_set_cluster_entry(handle->volume, last_cluster, FAT12_EOC); break;
+				case FAT_FS_TYPE_FAT16 : ret = fat_set_cluster_entry(handle->volume, last_cluster, FAT16_EOC); break;
+				case FAT_FS_TYPE_FAT32 : ret = fat_set_cluster_entry(handle->volume, last_cluster, FAT32_EOC); break;
+			}
+			if (ret == FAT_SUCCESS)
+				ret = fat_free_cluster_chain(handle->volume, fat_entry);
+			if (ret != FAT_SUCCESS)
+			{
+				handle->busy = 0;
+				return ret;
+			}
+		}
+		handle->no_of_clusters_after_pos = last_clus_idx - handle->current_clus_idx;
+		fat_file_update_sequential_cluster_count(handle);
+	}
+	/*
+	// update the file size on the entry
+	*/
+	handle->current_size = new_size;
+	ret = fat_file_write_entry(handle, handle->current_size);
+	handle->busy = 0;
+	return ret;
+	#endif
+}
+
+/*
+// moves the file cursor to the specified offset
+*/
+uint16_t fat_file_seek(FAT_FILE* file, uint32_t offset, char mode)
+{
+	uint32_t new_pos;
+	uint32_t sector_count;
+	uint32_t cluster_count;
+	uint32_t old_cluster;
+	uint32_t sector_address;
+	uint16_t ret;
+	/*
+	// check that this is a valid handle
+	*/
+	if (file->magic != FAT_OPEN_HANDLE_MAGIC)
+		return FAT_INVALID_HANDLE;
+	/*
+	// check that another operation is not using the
+	// handle at this time
+	*/
+	if (file->busy)
+		return FAT_FILE_HANDLE_IN_USE;
+	/*
+	// write the sectors held by the write-back buffer
+	*/
+	#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+	ret = fat_file_write_back_flush(file);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	#endif
+	/*
+	// mark the handle as in use
 	*/
 	file->busy = 1;
+	/*
+	// a seek breaks the sequential access pattern
+	*/
+	#if defined(FAT_READ_AHEAD)
+	fat_file_read_ahead_reset(file);
+	#endif
 
 	switch (mode)
 	{
@@ -1326,39 +2310,27 @@ uint16_t fat_file_seek(FAT_FILE* file, uint32_t offset, char mode)
 	}
 
 	old_cluster = file->current_clus_idx;
-	file->current_clus_idx = 0;
 	cluster_count = 1;
 	/*
 	// calculate the count of sectors being used by the file up to the desired position
 	*/
 	sector_count = (new_pos + file->volume->no_of_bytes_per_serctor - 1) / file->volume->no_of_bytes_per_serctor;
 	/*
-	// set the 1st cluster as the current cluster, we'll seek from there
+	// calculate the count of clusters occupied by the file
 	*/
-	((uint16_t*) &file->current_clus_addr)[INT32_WORD0] = file->directory_entry.raw.ENTRY.STD.first_cluster_lo;
-	((uint16_t*) &file->current_clus_addr)[INT32_WORD1] = 
-		(file->volume->fs_type == FAT_FS_TYPE_FAT32) ? file->directory_entry.raw.ENTRY.STD.first_cluster_hi : 0;
+	if (sector_count > file->volume->no_of_sectors_per_cluster) 
+		cluster_count = (sector_count + file->volume->no_of_sectors_per_cluster - 1) / file->volume->no_of_sectors_per_cluster;
 	/*
-	// if the file occupies more than one cluster
+	// set the file handle to point to the last cluster. The chain is followed from the
+	// closest cluster that we know of (the 1st one, the one under the cursor, the last one
+	// looked up or the remembered tail of the file). If the file doesn't have that many
+	// clusters allocated it is corrupted
 	*/
-	if (sector_count > file->volume->no_of_sectors_per_cluster) 
+	ret = fat_file_get_cluster_address(file, cluster_count - 1, &file->current_clus_addr);
+	if (ret != FAT_SUCCESS)
 	{
-		/*
-		// calculate the count of clusters occupied by the file and
-		// update the ClustersAllocated value of the file
-		*/
-		cluster_count = (sector_count + file->volume->no_of_sectors_per_cluster - 1) / file->volume->no_of_sectors_per_cluster;
-		/*
-		// set the file handle to point to the last cluster. if the file doesn't have
-		// that many clusters allocated this function will return 0. if that ever happens it means
-		// that the file is corrupted
-		*/
-		if (!fat_increase_cluster_address( 
-			file->volume, file->current_clus_addr, (cluster_count - 1), &file->current_clus_addr))
-		{
-			file->busy = 0;
-			return FAT_CORRUPTED_FILE;
-		}
+		file->busy = 0;
+		return ret;
 	}
 	/*
 	// calculate the last sector of the file and set the buffer
@@ -1474,14 +2446,18 @@ uint16_t fat_file_write_internal(
 	if (!(handle->access_flags & FAT_FILE_ACCESS_WRITE))
 		return FAT_FILE_NOT_OPENED_FOR_WRITE_ACCESS;
 	/*
-	// make sure length is not larger than 16-bit
-	*/
-	if (length > 0xFFFF)
-		return FAT_BUFFER_TOO_BIG;
-	/*
 	// if there's no clusters allocated to this file allocate
-	// enough clusters for this request
+	// enough clusters for this request. If allocation is delayed
+	// we only reserve them
 	*/
+	#if defined(FAT_WRITE_BACK)
+	if ((handle->access_flags & FAT_FILE_FLAG_DELAYED_ALLOCATION) && 
+		handle->write_back.depth && !(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING))
+	{
+		ret = fat_file_write_back_reserve(handle, length);
+	}
+	else
+	#endif
 	ret = fat_file_alloc(handle, length);
 	if (ret != FAT_SUCCESS)
 		return ret;
@@ -1502,6 +2478,13 @@ uint16_t fat_file_write_internal(
 	*/
 	handle->busy = 1;
 	/*
+	// drop any sectors prefetched by a previous read since
+	// we're about to overwrite them
+	*/
+	#if defined(FAT_READ_AHEAD)
+	fat_file_read_ahead_reset(handle);
+	#endif
+	/*
 	// calculate current pos
 	*/
 	handle->op_state.pos = handle->current_clus_idx * handle->volume->no_of_sectors_per_cluster * handle->volume->no_of_bytes_per_serctor;
@@ -1533,7 +2516,7 @@ uint16_t fat_file_write_internal(
 	// copy the length of the buffer to be writen
 	// into the counter
 	*/
-	handle->op_state.bytes_remaining = (uint16_t) length;	
+	handle->op_state.bytes_remaining = length;	
 	/*
 	// calculate the address of the current
 	// sector
@@ -1548,7 +2531,7 @@ uint16_t fat_file_write_internal(
 	handle->op_state.storage_callback_info.Context = handle;
 	handle->op_state.async_state = async_state;
 	handle->op_state.internal_state = 0x0;
-	handle->op_state.length = (uint16_t) length;
+	handle->op_state.length = length;
 	handle->op_state.buffer = buff;
 	/*
 	// call the callback routine which actually does
@@ -1604,10 +2587,16 @@ uint16_t fat_file_write_stream
 	if (!(handle->access_flags & FAT_FILE_ACCESS_WRITE))
 		return FAT_FILE_NOT_OPENED_FOR_WRITE_ACCESS;
 	/*
-	// make sure length is not larger than 16-bit
+	// write the sectors held by the write-back buffer. This
+	// also allocates any clusters that have been delayed
 	*/
-	if (length > 0xFFFF)
-		return FAT_BUFFER_TOO_BIG;
+	#if defined(FAT_WRITE_BACK)
+	if (handle->busy)
+		return FAT_FILE_HANDLE_IN_USE;
+	ret = fat_file_write_back_flush(handle);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	#endif
 	/*
 	// if there's no clusters allocated to this file allocate
 	// enough clusters for this request
@@ -1632,6 +2621,12 @@ uint16_t fat_file_write_stream
 	*/
 	handle->busy = 1;
 	/*
+	// the stream may overwrite prefetched sectors
+	*/
+	#if defined(FAT_READ_AHEAD)
+	fat_file_read_ahead_reset(handle);
+	#endif
+	/*
 	// calculate current pos
 	*/
 	handle->op_state.pos = handle->current_clus_idx * handle->volume->no_of_sectors_per_cluster * handle->volume->no_of_bytes_per_serctor;
@@ -1663,7 +2658,7 @@ uint16_t fat_file_write_stream
 	// copy the length of the buffer to be writen
 	// into the counter
 	*/
-	handle->op_state.bytes_remaining = (uint16_t) length;	
+	handle->op_state.bytes_remaining = length;	
 	/*
 	// calculate the address of the current
 	// sector
@@ -1679,7 +2674,7 @@ uint16_t fat_file_write_stream
 	handle->op_state.storage_callback_info_ex.Context = handle;
 	handle->op_state.async_state = async_state;
 	handle->op_state.internal_state = 0x0;
-	handle->op_state.length = (uint16_t) length;
+	handle->op_state.length = length;
 	handle->op_state.buffer = buff;
 	handle->op_state.original_buffer = buff;
 	/*
@@ -1700,20 +2695,22 @@ uint16_t fat_file_write_stream
 #if !defined(FAT_READ_ONLY) && defined(FAT_STREAMING_IO)
 void fat_file_write_stream_callback(FAT_FILE* handle, uint16_t* async_state_in, unsigned char** transfer_buffer, uint16_t* response)
 {
-	static uint16_t ret;
-	static uint16_t bytes_remaining;
-	/* static uint32_t current_cluster; */
-	/* static uint32_t next_cluster; */
-	static uint32_t pos;
-	static uint32_t current_size;
-	static unsigned char* buffer;
-	static unsigned char* op_buffer;
-	static unsigned char* buffer_head;
-	static unsigned char* end_of_buffer;
-	static char unbuffered;
-	/* static uint16_t bytes_per_sector; */
-
-	/* bytes_per_sector = handle->volume->no_of_bytes_per_serctor; */
+	/*
+	// these are working copies of the stream state, which lives in
+	// the file handle. They're loaded every time we're called and saved
+	// back before we relinquish control so that any number of streams
+	// may be in progress at the same time
+	*/
+	uint16_t ret;
+	uint32_t bytes_remaining;
+	uint32_t pos;
+	uint32_t current_size;
+	unsigned char* buffer;
+	unsigned char* op_buffer;
+	unsigned char* buffer_head;
+	unsigned char* end_of_buffer;
+	char unbuffered;
+
 	unbuffered = handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING;
 	bytes_remaining = handle->op_state.bytes_remaining;
 	buffer = handle->buffer;
@@ -1941,6 +2938,34 @@ stop_stream_callback:
 						handle->busy = 1;
 					}
 					/*
+					// the stream is stopped so this is a good time
+					// to take a checkpoint if one is due
+					*/
+					#if defined(FAT_CHECKPOINTS)
+					handle->buffer = buffer;
+					handle->buffer_head = buffer_head;
+					handle->current_size = current_size;
+					ret = fat_file_checkpoint(handle, pos);
+					if (ret != FAT_SUCCESS)
+					{
+						*handle->op_state.async_state = ret;
+						handle->busy = 0;
+						if (handle->op_state.callback_ex)
+						{
+							ret = 0;
+							handle->op_state.callback_ex(
+								handle->op_state.callback_context, 
+								handle->op_state.async_state,
+								&handle->op_state.original_buffer,
+								&ret
+							);
+						}
+						*response = STORAGE_MULTI_SECTOR_RESPONSE_STOP;
+						handle->op_state.internal_state = 6;
+						return;
+					}
+					#endif
+					/*
 					// before we go on we need to stop the stream
 					*/
 					#if defined(COMMENTED_OUT)
@@ -2081,13 +3106,6 @@ stop_stream_callback_two:
 				handle->current_sector_idx++;
 				handle->op_state.sector_addr++;
 			}
-			/*
-			// if we've reached a flush boundry then flush the file
-			*/
-			/* if (!(handle->op_state.pos % (handle->volume->no_of_bytes_per_serctor * FAT_FLUSH_INTERVAL)))
-			{
-				fat_file_flush(handle);
-			} */
 		}
 		/*
 		// if this is an unbuffered file update the buffer head and position
@@ -2229,6 +3247,7 @@ stream_completed:
 	/*
 	// invoke callback function
 	*/
+	ret = FAT_STREAMING_RESPONSE_STOP;
 	if (handle->op_state.callback_ex)
 		handle->op_state.callback_ex(handle->op_state.callback_context, handle->op_state.async_state, &handle->op_state.original_buffer, &ret);
 	/*
@@ -2245,6 +3264,7 @@ stream_completed:
 void fat_file_write_callback(FAT_FILE* handle, uint16_t* async_state_in) 
 {
 	uint16_t ret;
+	uint32_t count;
 	uint16_t* async_state;
 
 	if (handle->op_state.async_state)
@@ -2263,6 +3283,10 @@ void fat_file_write_callback(FAT_FILE* handle, uint16_t* async_state_in)
 	{
 		case 0 : goto begin_write;
 		case 1 : goto write_sector_callback;
+		case 2 : goto direct_write_completed;
+		#if defined(FAT_WRITE_BACK)
+		case 3 : goto write_back_completed;
+		#endif
 	}
 
 begin_write:
@@ -2278,6 +3302,99 @@ begin_write:
 		*/
 		if (handle->buffer_head == handle->op_state.end_of_buffer) 
 		{
+			#if defined(FAT_WRITE_BACK)
+			if (handle->write_back.depth && !(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING))
+			{
+				/*
+				// the sector is complete so we leave it on the write-back
+				// buffer and move the cursor to the next one
+				*/
+				if (!handle->write_back.count)
+					handle->write_back.sector_addr = handle->op_state.sector_addr;
+				handle->write_back.count++;
+
+				ret = fat_file_write_back_next_sector(handle);
+				if (ret != FAT_SUCCESS)
+				{
+					*async_state = ret;
+					handle->busy = 0;
+					if (handle->op_state.callback)
+						handle->op_state.callback(handle->op_state.callback_context, async_state);
+					return;
+				}
+				/*
+				// if the buffer is full or the next sector doesn't follow the
+				// buffered ones on the device write them all now. Sectors with
+				// no cluster yet can always follow since we'll allocate them
+				*/
+				if (handle->write_back.count == handle->write_back.depth || (!handle->write_back.virtual_clusters &&
+					handle->op_state.sector_addr != handle->write_back.sector_addr + handle->write_back.count))
+				{
+					if (handle->op_state.async_state && handle->volume->device->write_multiple_sectors &&
+						!handle->write_back.virtual_clusters)
+					{
+						/*
+						// set the state machine
+						*/
+						handle->op_state.internal_state = 0x3;
+						/*
+						// write all the sectors with a single transfer
+						*/
+						handle->write_back.written = 0;
+						handle->volume->device->write_multiple_sectors(
+							handle->volume->device->driver,
+							handle->write_back.sector_addr,
+							handle->write_back.buffer,
+							&handle->op_state.storage_state,
+							&handle->write_back.storage_callback_info_ex);
+						/*
+						// relinquish control
+						*/
+						return;
+
+write_back_completed:
+						if (handle->op_state.storage_state == STORAGE_SUCCESS)
+						{
+							handle->write_back.count = 0;
+							ret = FAT_SUCCESS;
+						}
+						else
+						{
+							ret = FAT_CANNOT_WRITE_MEDIA;
+						}
+					}
+					else
+					{
+						ret = fat_file_write_back_commit(handle);
+					}
+					/*
+					// the buffer is on the device now so take
+					// a checkpoint if one is due
+					*/
+					#if defined(FAT_CHECKPOINTS)
+					if (ret == FAT_SUCCESS)
+						ret = fat_file_checkpoint(handle, handle->op_state.pos);
+					#endif
+					if (ret != FAT_SUCCESS)
+					{
+						*async_state = ret;
+						handle->busy = 0;
+						if (handle->op_state.callback)
+							handle->op_state.callback(handle->op_state.callback_context, async_state);
+						return;
+					}
+				}
+				/*
+				// the next slot of the write-back buffer
+				// becomes the file buffer
+				*/
+				handle->buffer = handle->write_back.buffer + 
+					handle->write_back.count * handle->volume->no_of_bytes_per_serctor;
+				handle->buffer_head = handle->buffer;
+				handle->op_state.end_of_buffer = handle->buffer + handle->volume->no_of_bytes_per_serctor;
+				continue;
+			}
+			#endif
 			/*
 			// update the sector head
 			*/
@@ -2351,63 +3468,49 @@ write_sector_callback:
 				return;
 			}
 			/*
-			// if this sector is the last of the current cluster then
-			// locate the next cluster and continue writing
-			*/	
-			if (handle->current_sector_idx == handle->volume->no_of_sectors_per_cluster - 1) 
+			// move the cursor to the next sector, following the
+			// cluster chain if this sector is the last of its cluster
+			*/
+			ret = fat_file_next_sector(handle);
+			if (ret != FAT_SUCCESS)
 			{
-				ret = fat_get_cluster_entry(handle->volume, 
-					handle->current_clus_addr, &handle->current_clus_addr);
-				if (ret != STORAGE_SUCCESS) 
-				{
-					/*
-					// set result code
-					*/
-					*async_state = FAT_CANNOT_WRITE_MEDIA;
-					/*
-					// mark the file handle as no longer in use
-					*/
-					handle->busy = 0;
-					/*
-					// invoke callback function
-					*/
-					if (handle->op_state.callback)
-						handle->op_state.callback(handle->op_state.callback_context, async_state);
-					/*
-					// leave
-					*/
-					return;
-				}
 				/*
-				// reset the current sector and increase the cluster index
+				// set result code
 				*/
-				handle->current_sector_idx = 0x0;
-				handle->current_clus_idx++;
-				handle->no_of_clusters_after_pos--;
+				*async_state = ret;
 				/*
-				// calculate the sector address
+				// mark the file handle as no longer in use
 				*/
-				handle->op_state.sector_addr = 
-					FIRST_SECTOR_OF_CLUSTER(handle->volume, handle->current_clus_addr);
-			}
-			/*
-			// if there are more sectors in the
-			// current cluster then simply increase
-			// the current sector counter and address
-			*/
-			else 
-			{ 
-				handle->current_sector_idx++;
-				handle->op_state.sector_addr++;
+				handle->busy = 0;
+				/*
+				// invoke callback function
+				*/
+				if (handle->op_state.callback)
+					handle->op_state.callback(handle->op_state.callback_context, async_state);
+				/*
+				// leave
+				*/
+				return;
 			}
 			/*
-			// if we've reached a flush boundry then flush the file
+			// take a checkpoint at cluster boundaries
+			// if one is due
 			*/
-			/*if (!(handle->op_state.pos % (handle->volume->no_of_bytes_per_serctor * FAT_FLUSH_INTERVAL)))
+			#if defined(FAT_CHECKPOINTS)
+			if (!handle->current_sector_idx)
 			{
-				fat_file_flush(handle);
-			}*/
-		}
+				ret = fat_file_checkpoint(handle, handle->op_state.pos);
+				if (ret != FAT_SUCCESS)
+				{
+					*async_state = ret;
+					handle->busy = 0;
+					if (handle->op_state.callback)
+						handle->op_state.callback(handle->op_state.callback_context, async_state);
+					return;
+				}
+			}
+			#endif
+		}
 		if (handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING)
 		{
 			handle->buffer_head = handle->op_state.end_of_buffer;
@@ -2419,6 +3522,107 @@ write_sector_callback:
 			}
 			handle->op_state.bytes_remaining -= handle->volume->no_of_bytes_per_serctor;
 		}
+		else if (handle->buffer_head == handle->buffer &&
+			handle->op_state.bytes_remaining > handle->volume->no_of_bytes_per_serctor
+			#if defined(FAT_WRITE_BACK)
+			/*
+			// with a write-back buffer only requests that wouldn't fit
+			// in it bypass it, and only if allocation is not delayed
+			*/
+			&& (!handle->write_back.depth || (!(handle->access_flags & FAT_FILE_FLAG_DELAYED_ALLOCATION) &&
+				!handle->write_back.count && handle->op_state.bytes_remaining > 
+				(uint32_t) handle->write_back.depth * handle->volume->no_of_bytes_per_serctor))
+			#endif
+			)
+		{
+			/*
+			// the whole sector is being overwritten so we write it straight
+			// from the caller's buffer. The last sector of the request always
+			// goes through the file buffer so that it is left holding the sector
+			// under the cursor
+			*/
+			if (handle->op_state.async_state == 0)
+			{
+				/*
+				// write the run of full sectors left on this cluster with a
+				// single transfer, short of the last sector of the request
+				*/
+				count = (handle->op_state.bytes_remaining - 1) / handle->volume->no_of_bytes_per_serctor;
+				if (count > handle->volume->no_of_sectors_per_cluster - handle->current_sector_idx)
+					count = handle->volume->no_of_sectors_per_cluster - handle->current_sector_idx;
+				ret = fat_file_write_sectors(handle->volume, handle->op_state.sector_addr, count, handle->op_state.buffer);
+			}
+			else
+			{
+				/*
+				// set the state machine
+				*/
+				handle->op_state.internal_state = 0x2;
+				/*
+				// write the sector asynchronously
+				*/
+				ret = handle->volume->device->write_sector_async(
+					handle->volume->device->driver,
+					handle->op_state.sector_addr,
+					handle->op_state.buffer,
+					&handle->op_state.storage_state,
+					&handle->op_state.storage_callback_info);
+				/*
+				// relinquish control
+				*/
+				return;
+
+direct_write_completed:
+				/*
+				// copy the result value of the write sector routine
+				*/
+				ret = handle->op_state.storage_state;
+				count = 1;
+			}
+			if (ret != STORAGE_SUCCESS)
+			{
+				*async_state = FAT_CANNOT_WRITE_MEDIA;
+				handle->busy = 0;
+				if (handle->op_state.callback)
+					handle->op_state.callback(handle->op_state.callback_context, async_state);
+				return;
+			}
+			/*
+			// leave the cursor on the last sector written
+			*/
+			handle->current_sector_idx += count - 1;
+			handle->op_state.sector_addr += count - 1;
+			/*
+			// update the position, file size and the count of
+			// bytes remaining
+			*/
+			count *= handle->volume->no_of_bytes_per_serctor;
+			handle->op_state.buffer += count;
+			handle->op_state.pos += count;
+			handle->op_state.bytes_remaining -= count;
+			if (handle->op_state.pos > handle->current_size)
+			{
+				handle->current_size = handle->op_state.pos;
+			}
+			/*
+			// move the cursor to the next sector. There's always a next sector
+			// since at least one more byte is to be written and fat_file_alloc has
+			// already allocated the space for the whole request
+			*/
+			ret = fat_file_next_sector(handle);
+			#if defined(FAT_CHECKPOINTS)
+			if (ret == FAT_SUCCESS && !handle->current_sector_idx)
+				ret = fat_file_checkpoint(handle, handle->op_state.pos);
+			#endif
+			if (ret != FAT_SUCCESS)
+			{
+				*async_state = ret;
+				handle->busy = 0;
+				if (handle->op_state.callback)
+					handle->op_state.callback(handle->op_state.callback_context, async_state);
+				return;
+			}
+		}
 		else
 		{
 			/*
@@ -2437,9 +3641,14 @@ write_sector_callback:
 		}
 	}
 	/*
-	// return success
+	// take a checkpoint if one is due and
+	// return the result
 	*/
+	#if defined(FAT_CHECKPOINTS)
+	*async_state = fat_file_checkpoint(handle, handle->op_state.pos);
+	#else
 	*async_state = FAT_SUCCESS;
+	#endif
 	/*
 	// mark the file handle as no longer in use
 	*/
@@ -2456,6 +3665,297 @@ write_sector_callback:
 }
 #endif
 
+#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+/*
+// writes the sectors held by the write-back buffer to the device,
+// allocating the clusters that have been delayed first
+*/
+static uint16_t fat_file_write_back_commit(FAT_FILE* handle)
+{
+	uint16_t ret;
+	uint16_t i;
+	uint16_t run = 0;
+	uint32_t sector;
+	uint32_t first_virtual_sector;
+	uint32_t sector_addr = 0;
+	uint32_t next_sector_addr;
+	uint32_t clus_addr;
+	/*
+	// find the index within the file of the 1st buffered sector
+	// and of the 1st sector that has no cluster yet
+	*/
+	sector = handle->current_clus_idx * handle->volume->no_of_sectors_per_cluster +
+		handle->current_sector_idx - handle->write_back.count;
+	first_virtual_sector = (handle->current_clus_idx + 1 - handle->write_back.virtual_clusters) *
+		handle->volume->no_of_sectors_per_cluster;
+
+	if (handle->write_back.virtual_clusters)
+	{
+		ret = fat_file_write_back_allocate(handle);
+		if (ret != FAT_SUCCESS)
+			return ret;
+	}
+	/*
+	// the sectors that already had a cluster are contiguous
+	// so they're written with a single transfer
+	*/
+	i = (uint16_t) ((first_virtual_sector > sector) ? MIN(first_virtual_sector - sector, handle->write_back.count) : 0);
+	if (i)
+	{
+		ret = fat_file_write_sectors(handle->volume, handle->write_back.sector_addr, i, handle->write_back.buffer);
+		if (ret != STORAGE_SUCCESS)
+			return FAT_CANNOT_WRITE_MEDIA;
+		sector += i;
+	}
+	for (; i < handle->write_back.count; i++, sector++)
+	{
+		/*
+		// the rest have just been allocated so we look up their address
+		// once per cluster and write them a run of contiguous clusters
+		// at a time
+		*/
+		if (!run || !(sector % handle->volume->no_of_sectors_per_cluster))
+		{
+			ret = fat_file_get_cluster_address(handle, sector / handle->volume->no_of_sectors_per_cluster, &clus_addr);
+			if (ret != FAT_SUCCESS)
+				return ret;
+			next_sector_addr = FIRST_SECTOR_OF_CLUSTER(handle->volume, clus_addr) +
+				sector % handle->volume->no_of_sectors_per_cluster;
+
+			if (run && next_sector_addr != sector_addr + run)
+			{
+				ret = fat_file_write_sectors(handle->volume, sector_addr, run,
+					handle->write_back.buffer + (uint32_t) (i - run) * handle->volume->no_of_bytes_per_serctor);
+				if (ret != STORAGE_SUCCESS)
+					return FAT_CANNOT_WRITE_MEDIA;
+				run = 0;
+			}
+			if (!run)
+				sector_addr = next_sector_addr;
+		}
+		run++;
+	}
+	if (run)
+	{
+		ret = fat_file_write_sectors(handle->volume, sector_addr, run,
+			handle->write_back.buffer + (uint32_t) (i - run) * handle->volume->no_of_bytes_per_serctor);
+		if (ret != STORAGE_SUCCESS)
+			return FAT_CANNOT_WRITE_MEDIA;
+	}
+	handle->write_back.count = 0;
+	return FAT_SUCCESS;
+}
+
+/*
+// writes the sectors held by the write-back buffer and moves the
+// sector under the cursor back to the start of the buffer
+*/
+static uint16_t fat_file_write_back_flush(FAT_FILE* handle)
+{
+	uint16_t ret;
+
+	if (!handle->write_back.count && !handle->write_back.virtual_clusters)
+		return FAT_SUCCESS;
+
+	ret = fat_file_write_back_commit(handle);
+	if (ret != FAT_SUCCESS)
+		return ret;
+
+	if (handle->buffer != handle->write_back.buffer)
+	{
+		memcpy(handle->write_back.buffer, handle->buffer, handle->volume->no_of_bytes_per_serctor);
+		handle->buffer_head = handle->write_back.buffer + (uintptr_t) (handle->buffer_head - handle->buffer);
+		handle->buffer = handle->write_back.buffer;
+	}
+	return FAT_SUCCESS;
+}
+
+/*
+// moves the cursor to the next sector while writing through the
+// write-back buffer. If allocation is delayed and the cursor leaves
+// the last cluster of the chain it moves on to virtual clusters
+*/
+static uint16_t fat_file_write_back_next_sector(FAT_FILE* handle)
+{
+	uint16_t ret;
+	FAT_ENTRY fat_entry;
+
+	if (handle->access_flags & FAT_FILE_FLAG_DELAYED_ALLOCATION)
+	{
+		if (handle->current_sector_idx == handle->volume->no_of_sectors_per_cluster - 1)
+		{
+			if (!handle->write_back.virtual_clusters)
+			{
+				ret = fat_get_cluster_entry(handle->volume, handle->current_clus_addr, &fat_entry);
+				if (ret != FAT_SUCCESS)
+					return ret;
+				if (!fat_is_eof_entry(handle->volume, fat_entry))
+					return fat_file_next_sector(handle);
+			}
+			handle->current_sector_idx = 0x0;
+			handle->current_clus_idx++;
+			handle->write_back.virtual_clusters++;
+			return FAT_SUCCESS;
+		}
+		else if (handle->write_back.virtual_clusters)
+		{
+			handle->current_sector_idx++;
+			return FAT_SUCCESS;
+		}
+	}
+	return fat_file_next_sector(handle);
+}
+
+/*
+// reserves the clusters needed to write length bytes at the
+// current position of a file with delayed allocation
+*/
+static uint16_t fat_file_write_back_reserve(FAT_FILE* handle, uint32_t length)
+{
+	uint16_t ret;
+	uint32_t cluster_size;
+	uint32_t clusters;
+	uint32_t allocated;
+	uint32_t offset;
+
+	if (handle->busy)
+		return FAT_FILE_HANDLE_IN_USE;
+	if (!length)
+		return FAT_SUCCESS;
+	/*
+	// calculate how many clusters the file needs to hold
+	// the data and how many it already has
+	*/
+	cluster_size = (uint32_t) handle->volume->no_of_sectors_per_cluster * handle->volume->no_of_bytes_per_serctor;
+	offset = handle->current_sector_idx * handle->volume->no_of_bytes_per_serctor;
+	offset += (uintptr_t) (handle->buffer_head - handle->buffer);
+	clusters = handle->current_clus_idx + (length / cluster_size) +
+		((offset + (length % cluster_size) + cluster_size - 1) / cluster_size);
+	allocated = (handle->current_clus_addr) ? handle->current_clus_idx + 1 -
+		handle->write_back.virtual_clusters + handle->no_of_clusters_after_pos : 0;
+	clusters = (clusters > allocated) ? clusters - allocated : 0;
+	/*
+	// reserve the ones that are not reserved yet. The free
+	// clusters count cannot be trusted until we count them
+	*/
+	if (clusters > handle->write_back.reserved_clusters)
+	{
+		if (!handle->volume->free_clusters_counted)
+		{
+			ret = fat_count_free_clusters(handle->volume, &handle->volume->total_free_clusters);
+			if (ret != FAT_SUCCESS)
+				return ret;
+			handle->volume->free_clusters_counted = 1;
+		}
+		clusters -= handle->write_back.reserved_clusters;
+		if (clusters > handle->volume->total_free_clusters - handle->volume->reserved_clusters)
+			return FAT_INSUFFICIENT_DISK_SPACE;
+		handle->volume->reserved_clusters += clusters;
+		handle->write_back.reserved_clusters += clusters;
+	}
+	/*
+	// if the file has no clusters at all the
+	// cursor is on a virtual one
+	*/
+	if (!handle->current_clus_addr && !handle->write_back.virtual_clusters)
+		handle->write_back.virtual_clusters = 1;
+	return FAT_SUCCESS;
+}
+
+/*
+// allocates the virtual clusters of a file with delayed
+// allocation and moves the cursor to the one it's on
+*/
+static uint16_t fat_file_write_back_allocate(FAT_FILE* handle)
+{
+	uint16_t ret;
+	char busy;
+	uint32_t count;
+	uint32_t last_cluster;
+	uint32_t first_cluster;
+
+	count = handle->write_back.virtual_clusters;
+	last_cluster = handle->current_clus_addr;
+	/*
+	// the cursor's cluster is the last one on the chain so
+	// fat_file_alloc will link the new ones to it
+	*/
+	busy = handle->busy;
+	handle->busy = 0;
+	ret = fat_file_alloc(handle, count * handle->volume->no_of_sectors_per_cluster * handle->volume->no_of_bytes_per_serctor);
+	handle->busy = busy;
+	if (ret != FAT_SUCCESS)
+		return ret;
+	/*
+	// find the 1st new cluster
+	*/
+	if (last_cluster)
+	{
+		ret = fat_get_cluster_entry(handle->volume, last_cluster, &first_cluster);
+		if (ret != FAT_SUCCESS)
+			return ret;
+		handle->no_of_clusters_after_pos -= count;
+	}
+	else
+	{
+		first_cluster = handle->current_clus_addr;
+		handle->no_of_clusters_after_pos -= count - 1;
+	}
+	/*
+	// move the cursor to it's cluster and remember the 1st
+	// new one so the buffered sectors can be located
+	*/
+	if (!fat_increase_cluster_address(handle->volume, first_cluster, count - 1, &handle->current_clus_addr))
+		return FAT_CORRUPTED_FILE;
+	handle->cached_clus_idx = handle->current_clus_idx - (count - 1);
+	handle->cached_clus_addr = first_cluster;
+	handle->op_state.sector_addr =
+		FIRST_SECTOR_OF_CLUSTER(handle->volume, handle->current_clus_addr) + handle->current_sector_idx;
+	fat_file_update_sequential_cluster_count(handle);
+	handle->write_back.virtual_clusters = 0;
+	/*
+	// the clusters are no longer reserved
+	*/
+	count = MIN(count, handle->write_back.reserved_clusters);
+	handle->volume->reserved_clusters -= count;
+	handle->write_back.reserved_clusters -= count;
+	return FAT_SUCCESS;
+}
+
+/*
+// multiple sector write callback. The driver calls it every time
+// it's ready for the next sector and once more when the transfer
+// is done, at which point we resume the write
+*/
+static void fat_file_write_back_callback(FAT_FILE* handle, uint16_t* result, unsigned char** buffer, uint16_t* response)
+{
+	if (*result == STORAGE_AWAITING_DATA)
+	{
+		if (++handle->write_back.written < handle->write_back.count)
+		{
+			*buffer = handle->write_back.buffer + 
+				(uint32_t) handle->write_back.written * handle->volume->no_of_bytes_per_serctor;
+			*response = STORAGE_MULTI_SECTOR_RESPONSE_READY;
+		}
+		else
+		{
+			*response = STORAGE_MULTI_SECTOR_RESPONSE_STOP;
+		}
+		return;
+	}
+	/*
+	// if the transfer ended before all the sectors were
+	// written treat it as a failure
+	*/
+	if (*result == STORAGE_SUCCESS && handle->write_back.written < handle->write_back.count)
+		handle->op_state.storage_state = STORAGE_COMMUNICATION_ERROR;
+	else
+		handle->op_state.storage_state = *result;
+
+	fat_file_write_callback(handle, &handle->op_state.storage_state);
+}
+#endif
+
 /*
 // reads from a file synchronously
 */
@@ -2482,83 +3982,280 @@ uint16_t fat_file_read_async(FAT_FILE* handle, unsigned char* buff, uint32_t len
 }
 
 /*
-// reads from a file synchronously or asynchronously
+// lends the data at the cursor to the caller without copying it. The
+// data comes from the sector buffer or, when the cursor is at the end
+// of the buffer, from the read-ahead ring if it already holds the
+// sectors that follow
 */
-uint16_t fat_file_read_internal
-(	
-	FAT_FILE* handle, 
-	unsigned char* buff, 
-	uint32_t length, 
-	uint32_t* bytes_read,
-	uint16_t* async_state, 
-	FAT_ASYNC_CALLBACK* callback,
-	void* callback_context
-)
+uint16_t fat_file_read_borrow(FAT_FILE* handle, uint32_t max_len, unsigned char** ptr, uint32_t* len)
 {
-	/*uint32_t ret;*/
+	uint16_t ret;
+	uint32_t pos;
+	#if defined(FAT_READ_AHEAD)
+	FAT_READ_AHEAD_STATE* ra = &handle->read_ahead;
+	uint16_t sectors;
+	uint16_t i;
+	#endif
 	/*
 	// check that this is a valid handle
 	*/
 	if (handle->magic != FAT_OPEN_HANDLE_MAGIC)
 		return FAT_INVALID_HANDLE;
 	/*
-	// make sure that either a buffer is set or the file has been
-	// opened in unbuffered mode
+	// there's nothing to borrow from if the file is unbuffered
 	*/
-	if (!handle->buffer && !(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING))
+	if (handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING)
+		return FAT_FEATURE_NOT_SUPPORTED;
+	if (!handle->buffer)
 		return FAT_FILE_BUFFER_NOT_SET;
-	/*
-	// make sure length is not larger than 16-bit
-	*/
-	if (length > 0xFFFF)
-		return FAT_BUFFER_TOO_BIG;
-	/*
-	// check that another operation is not using the
-	// handle at this time
-	*/
 	if (handle->busy)
 		return FAT_FILE_HANDLE_IN_USE;
 	/*
-	// mark the handle as in use
+	// write the sectors held by the write-back buffer
 	*/
-	handle->busy = 1;
+	#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+	ret = fat_file_write_back_flush(handle);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	#endif
+
+	*ptr = 0;
+	*len = 0;
 	/*
-	// calculate current pos
+	// calculate the current position and trim the request
+	// to the end of the file
 	*/
-	handle->op_state.pos = handle->current_clus_idx * handle->volume->no_of_sectors_per_cluster * handle->volume->no_of_bytes_per_serctor;
-	handle->op_state.pos += (handle->current_sector_idx) * handle->volume->no_of_bytes_per_serctor;
-	handle->op_state.pos += (uintptr_t) (handle->buffer_head - handle->buffer);
+	pos = handle->current_clus_idx * handle->volume->no_of_sectors_per_cluster * handle->volume->no_of_bytes_per_serctor;
+	pos += handle->current_sector_idx * handle->volume->no_of_bytes_per_serctor;
+	pos += (uintptr_t) (handle->buffer_head - handle->buffer);
+
+	if (pos >= handle->current_size || !max_len)
+		return FAT_SUCCESS;
+	max_len = MIN(max_len, handle->current_size - pos);
 	/*
-	// calculate the address of the current
-	// sector and the address of the end of the buffer
+	// the handle stays busy until the data is returned
 	*/
-	handle->op_state.sector_addr = handle->current_sector_idx + FIRST_SECTOR_OF_CLUSTER( handle->volume, handle->current_clus_addr);
-	handle->op_state.end_of_buffer = handle->buffer + handle->volume->no_of_bytes_per_serctor;
+	handle->busy = 1;
+	handle->op_state.async_state = 0;
+	handle->op_state.sector_addr = handle->current_sector_idx + FIRST_SECTOR_OF_CLUSTER(handle->volume, handle->current_clus_addr);
 	/*
-	// if the file is opened in unbuffered mode make sure that
-	// we're reading a multiple of the sector size and set the buffer
-	// to the one supplied by the user in this call
+	// if we're at the end of the buffer move to the next sector
 	*/
-	if (handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING)
+	if (handle->buffer_head == handle->buffer + handle->volume->no_of_bytes_per_serctor)
 	{
-		if (length % handle->volume->no_of_bytes_per_serctor)
+		ret = fat_file_next_sector(handle);
+		if (ret != FAT_SUCCESS)
 		{
-			return FAT_MISALIGNED_IO;
-		}
+			handle->busy = 0;
+			return ret;
+		}
+		handle->buffer_head = handle->buffer;
+		handle->buffer_dirty = 1;
+		/*
+		// if the ring already holds this sector lend as many of the
+		// loaded sectors that follow it as the caller wants and are
+		// contiguous in memory. They stay in the ring until they're
+		// returned so prefetching cannot overwrite them
+		*/
+		#if defined(FAT_READ_AHEAD)
+		if (ra->count && handle->op_state.sector_addr >= ra->sector_addr &&
+			handle->op_state.sector_addr - ra->sector_addr < ra->count)
+		{
+			i = (uint16_t) (handle->op_state.sector_addr - ra->sector_addr);
+			ra->head = (ra->head + i) % ra->depth;
+			ra->count -= i;
+			ra->sector_addr = handle->op_state.sector_addr;
+
+			sectors = ra->count - ((ra->pending && !ra->discard) ? 1 : 0);
+			sectors = MIN(sectors, ra->depth - ra->head);
+			sectors = (uint16_t) MIN(sectors, (max_len + handle->volume->no_of_bytes_per_serctor - 1) /
+				handle->volume->no_of_bytes_per_serctor);
+			if (sectors)
+			{
+				for (i = 1; i < sectors; i++)
+				{
+					ret = fat_file_next_sector(handle);
+					if (ret != FAT_SUCCESS)
+					{
+						handle->busy = 0;
+						return ret;
+					}
+				}
+				*ptr = ra->buffer + (uintptr_t) ra->head * handle->volume->no_of_bytes_per_serctor;
+				*len = MIN(max_len, (uint32_t) sectors * handle->volume->no_of_bytes_per_serctor);
+				handle->buffer_head = handle->buffer + (uintptr_t) (*len - (uint32_t) (sectors - 1) * handle->volume->no_of_bytes_per_serctor);
+				ra->borrowed = sectors;
+				ra->next_pos = pos + *len;
+				handle->borrowed = 1;
+				return FAT_SUCCESS;
+			}
+		}
+		#endif
+	}
+	/*
+	// load the sector under the cursor if we don't have it
+	*/
+	if (handle->buffer_dirty)
+	{
+		ret = fat_file_read_sector(handle, handle->op_state.sector_addr, handle->buffer);
+		if (ret != STORAGE_SUCCESS)
+		{
+			handle->busy = 0;
+			return FAT_CANNOT_READ_MEDIA;
+		}
+		handle->buffer_dirty = 0;
+	}
+	/*
+	// lend the rest of the sector buffer
+	*/
+	*ptr = handle->buffer_head;
+	*len = MIN(max_len, (uint32_t) (handle->buffer + handle->volume->no_of_bytes_per_serctor - handle->buffer_head));
+	handle->buffer_head += *len;
+	#if defined(FAT_READ_AHEAD)
+	ra->next_pos = pos + *len;
+	#endif
+	handle->borrowed = 1;
+	return FAT_SUCCESS;
+}
+
+/*
+// returns the data lent by fat_file_read_borrow
+*/
+uint16_t fat_file_read_release(FAT_FILE* handle)
+{
+	#if defined(FAT_READ_AHEAD)
+	FAT_READ_AHEAD_STATE* ra = &handle->read_ahead;
+	#endif
+	/*
+	// check that this is a valid handle
+	*/
+	if (handle->magic != FAT_OPEN_HANDLE_MAGIC)
+		return FAT_INVALID_HANDLE;
+	if (!handle->borrowed)
+		return FAT_SUCCESS;
+	/*
+	// if the data came from the ring drop the borrowed sectors
+	// from it and copy the one under the cursor to the buffer
+	*/
+	#if defined(FAT_READ_AHEAD)
+	if (ra->borrowed)
+	{
+		memcpy(handle->buffer, ra->buffer + (uintptr_t) (ra->head + ra->borrowed - 1) * handle->volume->no_of_bytes_per_serctor,
+			handle->volume->no_of_bytes_per_serctor);
+		ra->head = (ra->head + ra->borrowed) % ra->depth;
+		ra->count -= ra->borrowed;
+		ra->sector_addr += ra->borrowed;
+		ra->borrowed = 0;
+		handle->buffer_dirty = 0;
+	}
+	#endif
+	handle->borrowed = 0;
+	handle->busy = 0;
+	return FAT_SUCCESS;
+}
+
+/*
+// reads from a file synchronously or asynchronously
+*/
+uint16_t fat_file_read_internal
+(	
+	FAT_FILE* handle, 
+	unsigned char* buff, 
+	uint32_t length, 
+	uint32_t* bytes_read,
+	uint16_t* async_state, 
+	FAT_ASYNC_CALLBACK* callback,
+	void* callback_context
+)
+{
+	/*uint32_t ret;*/
+	/*
+	// check that this is a valid handle
+	*/
+	if (handle->magic != FAT_OPEN_HANDLE_MAGIC)
+		return FAT_INVALID_HANDLE;
+	/*
+	// make sure that either a buffer is set or the file has been
+	// opened in unbuffered mode
+	*/
+	if (!handle->buffer && !(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING))
+		return FAT_FILE_BUFFER_NOT_SET;
+	/*
+	// check that another operation is not using the
+	// handle at this time
+	*/
+	if (handle->busy)
+		return FAT_FILE_HANDLE_IN_USE;
+	/*
+	// write the sectors held by the write-back buffer
+	*/
+	#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+	{
+		uint16_t ret = fat_file_write_back_flush(handle);
+		if (ret != FAT_SUCCESS)
+			return ret;
+	}
+	#endif
+	/*
+	// mark the handle as in use
+	*/
+	handle->busy = 1;
+	/*
+	// calculate current pos
+	*/
+	handle->op_state.pos = handle->current_clus_idx * handle->volume->no_of_sectors_per_cluster * handle->volume->no_of_bytes_per_serctor;
+	handle->op_state.pos += (handle->current_sector_idx) * handle->volume->no_of_bytes_per_serctor;
+	handle->op_state.pos += (uintptr_t) (handle->buffer_head - handle->buffer);
+	/*
+	// if this read starts where the last one ended grow the
+	// read-ahead window, otherwise stop prefetching until the
+	// reads become sequential again
+	*/
+	#if defined(FAT_READ_AHEAD)
+	if (handle->read_ahead.depth)
+	{
+		if (handle->op_state.pos == handle->read_ahead.next_pos)
+		{
+			handle->read_ahead.window = handle->read_ahead.window ? 
+				MIN(handle->read_ahead.window << 1, handle->read_ahead.depth) : 1;
+		}
+		else
+		{
+			handle->read_ahead.window = 0;
+		}
+	}
+	#endif
+	/*
+	// calculate the address of the current
+	// sector and the address of the end of the buffer
+	*/
+	handle->op_state.sector_addr = handle->current_sector_idx + FIRST_SECTOR_OF_CLUSTER( handle->volume, handle->current_clus_addr);
+	handle->op_state.end_of_buffer = handle->buffer + handle->volume->no_of_bytes_per_serctor;
+	/*
+	// if the file is opened in unbuffered mode make sure that
+	// we're reading a multiple of the sector size and set the buffer
+	// to the one supplied by the user in this call
+	*/
+	if (handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING)
+	{
+		if (length % handle->volume->no_of_bytes_per_serctor)
+		{
+			return FAT_MISALIGNED_IO;
+		}
 		handle->buffer = buff;
 		handle->op_state.end_of_buffer = handle->buffer_head = buff;
 	}
 	/*
 	// set the async op context
 	*/
-	handle->op_state.bytes_remaining = (uint16_t) length;	
+	handle->op_state.bytes_remaining = length;	
 	handle->op_state.callback = callback;
 	handle->op_state.callback_context = callback_context;
 	handle->op_state.storage_callback_info.Callback = (STORAGE_CALLBACK) &fat_file_read_callback;
 	handle->op_state.storage_callback_info.Context = handle;
 	handle->op_state.async_state = async_state;
 	handle->op_state.internal_state = 0x0;
-	handle->op_state.length = (uint16_t) length;
+	handle->op_state.length = length;
 	handle->op_state.buffer = buff;
 	handle->op_state.bytes_read = bytes_read;
 	/*
@@ -2595,6 +4292,7 @@ uint16_t fat_file_read_internal
 void fat_file_read_callback(FAT_FILE* handle, uint16_t* async_state)
 {
 	uint16_t ret;
+	uint32_t count;
 	/*
 	// jump table
 	*/
@@ -2603,6 +4301,7 @@ void fat_file_read_callback(FAT_FILE* handle, uint16_t* async_state)
 		case 0 : goto begin_read;
 		case 1 : goto initial_read_completed;
 		case 2 : goto sector_read_completed;
+		case 3 : goto direct_read_completed;
 	}
 
 begin_read:
@@ -2621,22 +4320,22 @@ begin_read:
 			/*
 			// read the current sector synchronously
 			*/			
-			ret = handle->volume->device->read_sector(
-				handle->volume->device->driver, handle->op_state.sector_addr, handle->buffer);
+			ret = fat_file_read_sector(handle, handle->op_state.sector_addr, handle->buffer);
 		}
 		else
 		{
 			handle->op_state.internal_state = 1;
 			/*
-			// read sector asyncronously
-			*/
-			ret = handle->volume->device->read_sector_async(
-				handle->volume->device->driver, handle->op_state.sector_addr, handle->buffer,
-				&handle->op_state.storage_state, &handle->op_state.storage_callback_info);
-			/*
-			// relinquish control
+			// read sector asyncronously, if it's already been
+			// prefetched we just continue
 			*/
-			return;
+			if (fat_file_read_sector(handle, handle->op_state.sector_addr, handle->buffer) == STORAGE_OP_IN_PROGRESS)
+			{
+				/*
+				// relinquish control
+				*/
+				return;
+			}
 initial_read_completed:
 			/*
 			// read async result
@@ -2701,8 +4400,101 @@ initial_read_completed:
 	// loop while there are bytes to be
 	// read
 	*/
-	while (handle->op_state.bytes_remaining) 
+	while (handle->op_state.bytes_remaining)
 	{
+		/*
+		// if the next sector is to be read in full we read it straight
+		// into the caller's buffer. The last sector of the request always
+		// goes through the file buffer so that it is left holding the sector
+		// under the cursor
+		*/
+		if (!(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING) &&
+			handle->buffer_head == handle->op_state.end_of_buffer &&
+			handle->op_state.bytes_remaining > handle->volume->no_of_bytes_per_serctor &&
+			handle->op_state.pos + handle->volume->no_of_bytes_per_serctor < handle->current_size)
+		{
+			ret = fat_file_next_sector(handle);
+			if (ret != FAT_SUCCESS)
+			{
+				*async_state = ret;
+				handle->busy = 0;
+				if (handle->op_state.callback)
+					handle->op_state.callback(handle->op_state.callback_context, async_state);
+				return;
+			}
+			if (!handle->op_state.async_state)
+			{
+				/*
+				// read the run of full sectors left on this cluster with a
+				// single transfer, short of the last sector of the request
+				*/
+				count = (handle->op_state.bytes_remaining - 1) / handle->volume->no_of_bytes_per_serctor;
+				if (count > (handle->current_size - handle->op_state.pos - 1) / handle->volume->no_of_bytes_per_serctor)
+					count = (handle->current_size - handle->op_state.pos - 1) / handle->volume->no_of_bytes_per_serctor;
+				if (count > handle->volume->no_of_sectors_per_cluster - handle->current_sector_idx)
+					count = handle->volume->no_of_sectors_per_cluster - handle->current_sector_idx;
+				#if defined(FAT_READ_AHEAD)
+				/*
+				// sectors already in the read-ahead ring are copied from it
+				*/
+				if (handle->read_ahead.count || handle->read_ahead.pending)
+					count = 1;
+				#endif
+				if (count > 1)
+				{
+					ret = fat_file_read_sectors(handle->volume, handle->op_state.sector_addr, count, handle->op_state.buffer);
+				}
+				else
+				{
+					ret = fat_file_read_sector(handle, handle->op_state.sector_addr, handle->op_state.buffer);
+				}
+			}
+			else
+			{
+				/*
+				// update the state machine
+				*/
+				handle->op_state.internal_state = 3;
+				/*
+				// read the sector asynchronously
+				*/
+				if (fat_file_read_sector(handle, handle->op_state.sector_addr, handle->op_state.buffer) == STORAGE_OP_IN_PROGRESS)
+				{
+					/*
+					// relinquish control
+					*/
+					return;
+				}
+
+direct_read_completed:
+				ret = handle->op_state.storage_state;
+				count = 1;
+			}
+			if (ret != STORAGE_SUCCESS)
+			{
+				*async_state = FAT_CANNOT_READ_MEDIA;
+				handle->busy = 0;
+				if (handle->op_state.callback)
+					handle->op_state.callback(handle->op_state.callback_context, async_state);
+				return;
+			}
+			/*
+			// leave the cursor on the last sector read
+			*/
+			handle->current_sector_idx += count - 1;
+			handle->op_state.sector_addr += count - 1;
+			/*
+			// update the count of bytes read/remaining and the
+			// file pointer
+			*/
+			count *= handle->volume->no_of_bytes_per_serctor;
+			handle->op_state.buffer += count;
+			handle->op_state.bytes_remaining -= count;
+			handle->op_state.pos += count;
+			if (handle->op_state.bytes_read)
+				(*handle->op_state.bytes_read) += count;
+			continue;
+		}
 		/*
 		// if we've reached the end of the current
 		// sector then we must load the next...
@@ -2724,49 +4516,26 @@ initial_read_completed:
 				handle->buffer_head = handle->buffer;	
 			}
 			/*
-			// if this sector is the last of the current cluster
-			// we must find the next cluster
-			*/	
-			if (handle->current_sector_idx == handle->volume->no_of_sectors_per_cluster - 1) 
+			// move the cursor to the next sector, following the
+			// cluster chain if this sector is the last of its cluster
+			*/
+			ret = fat_file_next_sector(handle);
+			if (ret != FAT_SUCCESS)
 			{
+				*async_state = ret;
 				/*
-				// update the cluster address with the address of the
-				// next cluster
-				*/	
-				if (!fat_increase_cluster_address(handle->volume, handle->current_clus_addr, 1, &handle->current_clus_addr))
-				{
-					*async_state = FAT_CORRUPTED_FILE;
-					/*
-					// mark the file handle as no longer in use
-					*/
-					handle->busy = 0;
-					/*
-					// invoke callback function
-					*/
-					if (handle->op_state.callback)
-						handle->op_state.callback(handle->op_state.callback_context, async_state);
-					/*
-					// leave
-					*/
-					return;
-				}
+				// mark the file handle as no longer in use
+				*/
+				handle->busy = 0;
 				/*
-				// reset the current sector increase the current cluster
-				// number and calculate the address of the first sector of the
-				// cluster
+				// invoke callback function
 				*/
-				handle->current_clus_idx++;
-				handle->current_sector_idx = 0x0;
-				handle->op_state.sector_addr = FIRST_SECTOR_OF_CLUSTER(handle->volume, handle->current_clus_addr);
-			}
-			else 
-			{ 
+				if (handle->op_state.callback)
+					handle->op_state.callback(handle->op_state.callback_context, async_state);
 				/*
-				// if there are more sectors in the current cluster then 
-				// simply increase the current sector counter and address
+				// leave
 				*/
-				handle->current_sector_idx++;
-				handle->op_state.sector_addr++;
+				return;
 			}
 
 			if (!handle->op_state.async_state)
@@ -2774,8 +4543,7 @@ initial_read_completed:
 				/*
 				// read the next sector into the cache
 				*/				
-				ret = handle->volume->device->read_sector(
-					handle->volume->device->driver, handle->op_state.sector_addr, handle->buffer);
+				ret = fat_file_read_sector(handle, handle->op_state.sector_addr, handle->buffer);
 			}
 			else
 			{
@@ -2786,13 +4554,13 @@ initial_read_completed:
 				/*
 				// read the next sector asynchronously
 				*/
-				ret = handle->volume->device->read_sector_async(
-					handle->volume->device->driver, handle->op_state.sector_addr, handle->buffer,
-					&handle->op_state.storage_state, &handle->op_state.storage_callback_info);
-				/*
-				// relinquish control
-				*/
-				return;
+				if (fat_file_read_sector(handle, handle->op_state.sector_addr, handle->buffer) == STORAGE_OP_IN_PROGRESS)
+				{
+					/*
+					// relinquish control
+					*/
+					return;
+				}
 				/*
 				// read result of asyync op
 				*/
@@ -2835,61 +4603,1324 @@ sector_read_completed:
 			if (handle->op_state.bytes_read)
 				(*handle->op_state.bytes_read) += handle->volume->no_of_bytes_per_serctor;
 
-			handle->op_state.pos += handle->volume->no_of_bytes_per_serctor;
+			handle->op_state.pos += handle->volume->no_of_bytes_per_serctor;
+
+			if (handle->op_state.pos >= handle->current_size)
+			{
+				if (handle->op_state.bytes_read)
+				{
+					*handle->op_state.bytes_read -= (handle->op_state.pos - handle->current_size);
+				}
+				handle->op_state.bytes_remaining = 0;
+			}
+		}
+		else
+		{
+			/*
+			// copy the next byte to the buffer
+			*/
+			*handle->op_state.buffer++ = *handle->buffer_head++;
+			/*
+			// update the  count of bytes read
+			*/
+			if (handle->op_state.bytes_read)
+				(*handle->op_state.bytes_read)++;
+			/*
+			// decrease the count of remaining bytes
+			*/
+			handle->op_state.bytes_remaining--;
+			/*
+			// increase the file pointer
+			*/
+			handle->op_state.pos++;
+			/*
+			// check if we've reached the end of the file
+			*/
+			if (handle->op_state.pos >= handle->current_size)
+				handle->op_state.bytes_remaining = 0;
+		}
+	}
+	/*
+	// set the return code
+	*/
+	*async_state = FAT_SUCCESS;
+	/*
+	// mark file handle as no longer in use
+	*/
+	handle->busy = 0;
+	/*
+	// remember where the next sequential read would begin and, if
+	// this is an asynchronous read, start prefetching the sectors
+	// that follow the cursor while the caller processes the data
+	*/
+	#if defined(FAT_READ_AHEAD)
+	handle->read_ahead.next_pos = handle->op_state.pos;
+	if (handle->op_state.async_state && handle->read_ahead.window)
+	{
+		if (!handle->read_ahead.count && !handle->read_ahead.pending)
+			fat_file_read_ahead_restart(handle, 1);
+		fat_file_read_ahead(handle);
+	}
+	#endif
+	/*
+	// invoke callback function
+	*/
+	if (handle->op_state.callback)
+		handle->op_state.callback(handle->op_state.callback_context, async_state);
+	/*
+	// leave
+	*/
+	return;
+}
+
+#if defined(FAT_STREAMING_IO)
+/*
+// initiates a stream read
+*/
+uint16_t fat_file_read_stream
+(
+	FAT_FILE* handle, 
+	unsigned char* buff, 
+	uint32_t length, 
+	uint32_t* bytes_read,
+	uint16_t* async_state, 
+	FAT_STREAM_CALLBACK* callback, 
+	void* callback_context
+)
+{
+	#if !defined(FAT_READ_ONLY)
+	uint16_t ret;
+	#endif
+	/*
+	// check that this is a valid handle
+	*/
+	if (handle->magic != FAT_OPEN_HANDLE_MAGIC)
+		return FAT_INVALID_HANDLE;
+	/*
+	// make sure the caller supplied a state pointer and a buffer
+	*/
+	if (!async_state || !length)
+		return FAT_INVALID_PARAMETERS;
+	/*
+	// make sure that either a buffer is set or the file has been opened in
+	// unbuffered mode, in which case the sectors are read straight into
+	// the caller's buffer so it must hold whole sectors
+	*/
+	if (!handle->buffer && !(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING))
+		return FAT_FILE_BUFFER_NOT_SET;
+	if ((handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING) && (length % handle->volume->no_of_bytes_per_serctor))
+		return FAT_MISALIGNED_IO;
+	/*
+	// check that another operation is not using the
+	// handle at this time
+	*/
+	#if defined(FAT_READ_AHEAD)
+	if (handle->read_ahead.pending)
+		return FAT_FILE_HANDLE_IN_USE;
+	#endif
+	if (handle->busy)
+		return FAT_FILE_HANDLE_IN_USE;
+	/*
+	// if the file buffer holds data that has not been written yet
+	// flush it so that the sector under the cursor can be reloaded
+	// from the device while we wait for the caller
+	*/
+	#if !defined(FAT_READ_ONLY)
+	if ((handle->access_flags & FAT_FILE_ACCESS_WRITE) && !(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING))
+	{
+		ret = fat_file_flush(handle);
+		if (ret != FAT_SUCCESS)
+			return ret;
+	}
+	#endif
+	/*
+	// mark the handle as in use
+	*/
+	handle->busy = 1;
+	/*
+	// calculate current pos
+	*/
+	handle->op_state.pos = handle->current_clus_idx * handle->volume->no_of_sectors_per_cluster * handle->volume->no_of_bytes_per_serctor;
+	handle->op_state.pos += (handle->current_sector_idx) * handle->volume->no_of_bytes_per_serctor;
+	handle->op_state.pos += (uintptr_t) (handle->buffer_head - handle->buffer);
+	/*
+	// calculate the address of the current sector and the
+	// end of the file buffer
+	*/
+	handle->op_state.sector_addr = handle->current_sector_idx +
+		FIRST_SECTOR_OF_CLUSTER(handle->volume, handle->current_clus_addr);
+	handle->op_state.end_of_buffer = handle->buffer + handle->volume->no_of_bytes_per_serctor;
+	/*
+	// set the async op context
+	*/
+	handle->op_state.bytes_remaining = length;
+	handle->op_state.length = length;
+	handle->op_state.buffer = buff;
+	handle->op_state.original_buffer = buff;
+	handle->op_state.bytes_read = bytes_read;
+	handle->op_state.async_state = async_state;
+	handle->op_state.callback_ex = callback;
+	handle->op_state.callback_context = callback_context;
+	handle->op_state.storage_callback_info_ex.Callback = (STORAGE_CALLBACK_EX) &fat_file_read_stream_callback;
+	handle->op_state.storage_callback_info_ex.Context = handle;
+	handle->op_state.storage_callback_info.Callback = (STORAGE_CALLBACK) &fat_file_read_stream_sector_callback;
+	handle->op_state.storage_callback_info.Context = handle;
+	handle->op_state.storage_state = STORAGE_SUCCESS;
+	handle->op_state.internal_state = 0x0;
+
+	if (bytes_read)
+		*bytes_read = 0;
+	/*
+	// set result code to op in progress
+	*/
+	*async_state = FAT_OP_IN_PROGRESS;
+	/*
+	// start the stream
+	*/
+	fat_file_read_stream_callback(handle, &handle->op_state.storage_state, 0, 0);
+	/*
+	// return op in progress code
+	*/
+	return FAT_OP_IN_PROGRESS;
+}
+
+/*
+// completion routine for the single sector reads used to
+// stream from devices that cannot read multiple sectors
+*/
+static void fat_file_read_stream_sector_callback(FAT_FILE* handle, uint16_t* result)
+{
+	fat_file_read_stream_callback(handle, result, 0, 0);
+}
+
+/*
+// stream read state machine. It is called by the device driver every time
+// a sector is loaded during a multiple sector read (result is STORAGE_AWAITING_DATA
+// and the driver is waiting for our response) and once more when the
+// transfer ends. When the device doesn't support multiple sector reads
+// it is called after every single sector read with no response pointer
+*/
+void fat_file_read_stream_callback(FAT_FILE* handle, uint16_t* result, unsigned char** transfer_buffer, uint16_t* response)
+{
+	uint16_t ret;
+	uint16_t bytes_per_sector = handle->volume->no_of_bytes_per_serctor;
+	uint32_t last_sector_addr;
+	/*
+	// jump table
+	*/
+	switch (handle->op_state.internal_state)
+	{
+		case 0 : goto begin_read_stream;
+		case 1 : goto stream_sector_read;
+		case 2 : goto stream_skipped;
+		case 3 : goto stream_restarted;
+		case 4 : goto stream_stopped;
+		case 5 : return;
+		case 6 : goto stream_skipped_sector_read;
+	}
+
+begin_read_stream:
+	/*
+	// the sector under the cursor may hold data
+	// that has not been read yet
+	*/
+	if (handle->buffer_dirty)
+		goto read_next_sector;
+
+process_sector:
+	/*
+	// copy data from the file buffer to the caller's buffer. On
+	// unbuffered handles the sector is already in place
+	*/
+	if (!(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING))
+	{
+		while (handle->buffer_head < handle->op_state.end_of_buffer &&
+			handle->op_state.bytes_remaining && handle->op_state.pos < handle->current_size)
+		{
+			*handle->op_state.buffer++ = *handle->buffer_head++;
+			handle->op_state.bytes_remaining--;
+			handle->op_state.pos++;
+			if (handle->op_state.bytes_read)
+				(*handle->op_state.bytes_read)++;
+		}
+	}
+	/*
+	// if we've reached the end of the file we're done
+	*/
+	if (handle->op_state.pos >= handle->current_size)
+		goto end_of_stream;
+	/*
+	// if the caller's buffer is full hand it over
+	*/
+	if (!handle->op_state.bytes_remaining)
+	{
+stream_skipped:
+		/*
+		// set the user response to the default stop
+		*/
+		ret = FAT_STREAMING_RESPONSE_STOP;
+		*handle->op_state.async_state = FAT_AWAITING_DATA;
+		if (handle->op_state.callback_ex)
+		{
+			handle->op_state.callback_ex(
+				handle->op_state.callback_context, 
+				handle->op_state.async_state, 
+				&handle->op_state.original_buffer, 
+				&ret
+				);
+		}
+		*handle->op_state.async_state = FAT_OP_IN_PROGRESS;
+		/*
+		// act according to caller's response
+		*/
+		switch (ret)
+		{
+			case FAT_STREAMING_RESPONSE_READY:
+				handle->op_state.buffer = handle->op_state.original_buffer;
+				handle->op_state.bytes_remaining = handle->op_state.length;
+				if (handle->op_state.bytes_read)
+					*handle->op_state.bytes_read = 0;
+				break;
+
+			case FAT_STREAMING_RESPONSE_SKIP:
+				handle->op_state.internal_state = 2;
+				/*
+				// if the driver is waiting on us it will call back
+				// when the device is free again
+				*/
+				if (response && *result == STORAGE_AWAITING_DATA)
+				{
+					*response = STORAGE_MULTI_SECTOR_RESPONSE_SKIP;
+					return;
+				}
+				/*
+				// otherwise we need a read to get called back. If the sector
+				// under the cursor has been copied out we move on and load the
+				// next one, which we'd have to read anyway. If it still holds
+				// data that has not been handed over (on unbuffered handles it's
+				// the last sector of the caller's buffer) we can only reload it
+				*/
+				if (!(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING) &&
+					handle->buffer_head >= handle->op_state.end_of_buffer)
+				{
+					ret = fat_file_next_sector(handle);
+					if (ret != FAT_SUCCESS)
+						goto stream_failed;
+					handle->buffer_dirty = 1;
+					handle->buffer_head = handle->buffer;
+					handle->op_state.internal_state = 6;
+				}
+				handle->volume->device->read_sector_async(
+					handle->volume->device->driver, handle->op_state.sector_addr, handle->buffer,
+					&handle->op_state.storage_state, &handle->op_state.storage_callback_info);
+				return;
+
+			default:
+				handle->op_state.bytes_remaining = handle->op_state.length;
+				if (handle->op_state.bytes_read)
+					*handle->op_state.bytes_read = 0;
+				goto end_of_stream;
+		}
+		/*
+		// the caller may have taken the whole sector
+		*/
+		if (!(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING) && 
+			handle->buffer_head < handle->op_state.end_of_buffer)
+		{
+			goto process_sector;
+		}
+	}
+	/*
+	// move the cursor to the next sector
+	*/
+	last_sector_addr = handle->op_state.sector_addr;
+	ret = fat_file_next_sector(handle);
+	if (ret != FAT_SUCCESS)
+		goto stream_failed;
+	handle->buffer_dirty = 1;
+	if (!(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING))
+		handle->buffer_head = handle->buffer;
+	/*
+	// if the driver is waiting on us and the next sector follows
+	// this one on the device keep the transfer going, otherwise stop it
+	// and start a new one once the driver is done
+	*/
+	if (response && *result == STORAGE_AWAITING_DATA)
+	{
+		if (handle->op_state.sector_addr == last_sector_addr + 1)
+		{
+			*transfer_buffer = (handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING) ?
+				handle->op_state.buffer : handle->buffer;
+			*response = STORAGE_MULTI_SECTOR_RESPONSE_READY;
+			handle->op_state.internal_state = 1;
+			return;
+		}
+		*response = STORAGE_MULTI_SECTOR_RESPONSE_STOP;
+		handle->op_state.internal_state = 3;
+		return;
+	}
+
+stream_restarted:
+	if (*result != STORAGE_SUCCESS)
+	{
+		ret = FAT_CANNOT_READ_MEDIA;
+		goto stream_failed;
+	}
+
+read_next_sector:
+	/*
+	// start reading at the sector under the cursor
+	*/
+	handle->op_state.internal_state = 1;
+	if (handle->volume->device->read_multiple_sectors)
+	{
+		ret = handle->volume->device->read_multiple_sectors(
+			handle->volume->device->driver, handle->op_state.sector_addr,
+			(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING) ? handle->op_state.buffer : handle->buffer,
+			&handle->op_state.storage_state, &handle->op_state.storage_callback_info_ex);
+	}
+	else
+	{
+		ret = handle->volume->device->read_sector_async(
+			handle->volume->device->driver, handle->op_state.sector_addr,
+			(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING) ? handle->op_state.buffer : handle->buffer,
+			&handle->op_state.storage_state, &handle->op_state.storage_callback_info);
+	}
+	/*
+	// relinquish control
+	*/
+	return;
+
+stream_sector_read:
+	/*
+	// if the transfer ended without loading the sector (ie. the driver
+	// stopped it to service another request) start a new one
+	*/
+	if (response && *result == STORAGE_SUCCESS)
+		goto read_next_sector;
+	if (*result != STORAGE_SUCCESS && *result != STORAGE_AWAITING_DATA)
+	{
+		ret = FAT_CANNOT_READ_MEDIA;
+		goto stream_failed;
+	}
+	/*
+	// the sector under the cursor is now loaded
+	*/
+	handle->buffer_dirty = 0;
+	if (handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING)
+	{
+		handle->buffer = handle->op_state.buffer;
+		handle->buffer_head = handle->op_state.end_of_buffer = handle->buffer + bytes_per_sector;
+		handle->op_state.buffer += bytes_per_sector;
+		handle->op_state.bytes_remaining -= bytes_per_sector;
+		handle->op_state.pos += bytes_per_sector;
+		if (handle->op_state.bytes_read)
+		{
+			(*handle->op_state.bytes_read) += bytes_per_sector;
+			if (handle->op_state.pos > handle->current_size)
+				*handle->op_state.bytes_read -= handle->op_state.pos - handle->current_size;
+		}
+	}
+	goto process_sector;
+
+stream_skipped_sector_read:
+	/*
+	// the sector that follows the skipped one is loaded
+	*/
+	if (*result != STORAGE_SUCCESS)
+	{
+		ret = FAT_CANNOT_READ_MEDIA;
+		goto stream_failed;
+	}
+	handle->buffer_dirty = 0;
+	goto stream_skipped;
+
+end_of_stream:
+	/*
+	// if the driver is waiting on us stop the transfer and
+	// wait for it to complete
+	*/
+	if (response && *result == STORAGE_AWAITING_DATA)
+	{
+		*response = STORAGE_MULTI_SECTOR_RESPONSE_STOP;
+		handle->op_state.internal_state = 4;
+		return;
+	}
+
+stream_stopped:
+	handle->op_state.internal_state = 5;
+	/*
+	// set the result to success
+	*/
+	*handle->op_state.async_state = FAT_SUCCESS;
+	/*
+	// mark the file handle as no longer in use
+	*/
+	handle->busy = 0;
+	/*
+	// invoke callback function with whatever is left on the buffer
+	*/
+	if (handle->op_state.callback_ex)
+	{
+		ret = FAT_STREAMING_RESPONSE_STOP;
+		handle->op_state.callback_ex(handle->op_state.callback_context, 
+			handle->op_state.async_state, &handle->op_state.original_buffer, &ret);
+	}
+	return;
+
+stream_failed:
+	/*
+	// stop the transfer if one is in progress
+	*/
+	if (response && *result == STORAGE_AWAITING_DATA)
+		*response = STORAGE_MULTI_SECTOR_RESPONSE_STOP;
+	handle->op_state.internal_state = 5;
+	/*
+	// set result code
+	*/
+	*handle->op_state.async_state = ret;
+	/*
+	// mark the file handle as no longer in use
+	*/
+	handle->busy = 0;
+	/*
+	// invoke callback function
+	*/
+	if (handle->op_state.callback_ex)
+	{
+		ret = FAT_STREAMING_RESPONSE_STOP;
+		handle->op_state.callback_ex(handle->op_state.callback_context, 
+			handle->op_state.async_state, &handle->op_state.original_buffer, &ret);
+	}
+}
+#endif
+
+/*
+// reads a sector into the given buffer. On asynchronous operations
+// it returns STORAGE_OP_IN_PROGRESS if the read callback will be invoked
+// when the sector is loaded, otherwise the sector has already been copied
+// from the read-ahead ring and the result is stored in op_state.storage_state
+*/
+static uint16_t fat_file_read_sector(FAT_FILE* handle, uint32_t sector_addr, unsigned char* buffer)
+{
+	#if defined(FAT_READ_AHEAD)
+	FAT_READ_AHEAD_STATE* ra = &handle->read_ahead;
+	uint16_t skip;
+	/*
+	// if the sector is in the ring drop the ones before it, otherwise
+	// the whole ring is useless. A sector that is still being read when
+	// the ring is dropped will be discarded when it completes
+	*/
+	if (ra->count && sector_addr >= ra->sector_addr && sector_addr - ra->sector_addr < ra->count)
+	{
+		skip = (uint16_t) (sector_addr - ra->sector_addr);
+		ra->head = (ra->head + skip) % ra->depth;
+		ra->count -= skip;
+		ra->sector_addr = sector_addr;
+	}
+	else if (ra->count)
+	{
+		ra->count = 0;
+		if (ra->pending)
+			ra->discard = 1;
+	}
+	/*
+	// if the sector has been loaded copy it from the ring
+	*/
+	if (ra->count > ((ra->pending && !ra->discard) ? 1 : 0))
+	{
+		memcpy(buffer, ra->buffer + (uintptr_t) ra->head * handle->volume->no_of_bytes_per_serctor,
+			handle->volume->no_of_bytes_per_serctor);
+		ra->head = (ra->head + 1) % ra->depth;
+		ra->count--;
+		ra->sector_addr++;
+		/*
+		// keep the ring full
+		*/
+		if (handle->op_state.async_state)
+			fat_file_read_ahead(handle);
+		handle->op_state.storage_state = STORAGE_SUCCESS;
+		return STORAGE_SUCCESS;
+	}
+	if (handle->op_state.async_state)
+	{
+		/*
+		// if we're reading sequentially restart the ring at this sector so
+		// the sectors that follow are prefetched while we wait for it
+		*/
+		if (ra->window && !ra->count && !ra->pending)
+		{
+			fat_file_read_ahead_restart(handle, 0);
+			fat_file_read_ahead(handle);
+		}
+		/*
+		// we must not start a transfer while a prefetch is in flight so
+		// we'll let the read-ahead callback resume this read
+		*/
+		if (ra->pending)
+		{
+			ra->waiting = 1;
+			ra->wait_addr = sector_addr;
+			ra->wait_buffer = buffer;
+			return STORAGE_OP_IN_PROGRESS;
+		}
+	}
+	else if (ra->count)
+	{
+		/*
+		// the only sector left is the one being prefetched, we'll read
+		// it synchronously and discard the prefetched copy
+		*/
+		ra->count = 0;
+		ra->discard = 1;
+	}
+	#endif
+	if (!handle->op_state.async_state)
+	{
+		return handle->volume->device->read_sector(
+			handle->volume->device->driver, sector_addr, buffer);
+	}
+	handle->volume->device->read_sector_async(
+		handle->volume->device->driver, sector_addr, buffer,
+		&handle->op_state.storage_state, &handle->op_state.storage_callback_info);
+	return STORAGE_OP_IN_PROGRESS;
+}
+
+/*
+// reads a range of contiguous sectors with a single transfer
+// if the driver supports it, otherwise one sector at a time
+*/
+static uint16_t fat_file_read_sectors(FAT_VOLUME* volume, uint32_t sector_addr, uint32_t count, unsigned char* buffer)
+{
+	uint16_t ret;
+
+	if (volume->device->read_sectors && count > 1)
+		return volume->device->read_sectors(volume->device->driver, sector_addr, sector_addr + count - 1, buffer);
+
+	while (count--)
+	{
+		ret = volume->device->read_sector(volume->device->driver, sector_addr++, buffer);
+		if (ret != STORAGE_SUCCESS)
+			return ret;
+		buffer += volume->no_of_bytes_per_serctor;
+	}
+	return STORAGE_SUCCESS;
+}
+
+#if !defined(FAT_READ_ONLY)
+/*
+// writes a range of contiguous sectors with a single transfer
+// if the driver supports it, otherwise one sector at a time
+*/
+static uint16_t fat_file_write_sectors(FAT_VOLUME* volume, uint32_t sector_addr, uint32_t count, unsigned char* buffer)
+{
+	uint16_t ret;
+
+	if (volume->device->write_sectors && count > 1)
+		return volume->device->write_sectors(volume->device->driver, sector_addr, sector_addr + count - 1, buffer);
+
+	while (count--)
+	{
+		ret = volume->device->write_sector(volume->device->driver, sector_addr++, buffer);
+		if (ret != STORAGE_SUCCESS)
+			return ret;
+		buffer += volume->no_of_bytes_per_serctor;
+	}
+	return STORAGE_SUCCESS;
+}
+#endif
+
+#if defined(FAT_READ_AHEAD)
+/*
+// issues the next prefetch of the read-ahead ring if there's room for it
+// in the window. The ring only grows through the run of contiguous clusters
+// under the cursor so prefetching never needs to follow the FAT chain
+*/
+static void fat_file_read_ahead(FAT_FILE* handle)
+{
+	FAT_READ_AHEAD_STATE* ra = &handle->read_ahead;
+	uint32_t next_cluster;
+	uint16_t slot;
+
+	if (ra->pending || ra->count >= ra->window || !ra->file_sectors_left)
+		return;
+	/*
+	// if we've reached the end of the cluster check that the
+	// next one follows it on the volume
+	*/
+	if (!ra->sectors_left)
+	{
+		if (fat_get_cluster_entry(handle->volume, ra->run_clus_addr, &next_cluster) != FAT_SUCCESS)
+			return;
+		if (next_cluster != ra->run_clus_addr + 1)
+			return;
+		ra->run_clus_addr = next_cluster;
+		ra->sectors_left = handle->volume->no_of_sectors_per_cluster;
+	}
+	/*
+	// read the next sector into the ring
+	*/
+	slot = (ra->head + ra->count) % ra->depth;
+	ra->count++;
+	ra->sectors_left--;
+	ra->file_sectors_left--;
+	ra->pending = 1;
+
+	handle->volume->device->read_sector_async(
+		handle->volume->device->driver, ra->sector_addr + ra->count - 1,
+		ra->buffer + (uintptr_t) slot * handle->volume->no_of_bytes_per_serctor,
+		&ra->storage_state, &ra->storage_callback_info);
+}
+
+/*
+// empties the read-ahead ring and positions it at the sector under the
+// cursor or, if next is set, at the one that follows it
+*/
+static void fat_file_read_ahead_restart(FAT_FILE* handle, char next)
+{
+	FAT_READ_AHEAD_STATE* ra = &handle->read_ahead;
+	uint32_t file_sector;
+	uint32_t file_sectors;
+
+	file_sector = handle->current_clus_idx * handle->volume->no_of_sectors_per_cluster;
+	file_sector += handle->current_sector_idx + next;
+	file_sectors = (handle->current_size + handle->volume->no_of_bytes_per_serctor - 1) / 
+		handle->volume->no_of_bytes_per_serctor;
+
+	ra->head = 0;
+	ra->count = 0;
+	ra->sector_addr = handle->op_state.sector_addr + next;
+	ra->run_clus_addr = handle->current_clus_addr;
+	ra->sectors_left = handle->volume->no_of_sectors_per_cluster - handle->current_sector_idx - next;
+	ra->file_sectors_left = (file_sectors > file_sector) ? file_sectors - file_sector : 0;
+}
+
+/*
+// drops the contents of the read-ahead ring and closes the window
+*/
+static void fat_file_read_ahead_reset(FAT_FILE* handle)
+{
+	handle->read_ahead.count = 0;
+	handle->read_ahead.window = 0;
+	handle->read_ahead.next_pos = 0xFFFFFFFF;
+	if (handle->read_ahead.pending)
+		handle->read_ahead.discard = 1;
+}
+
+/*
+// called by the storage driver when a prefetch completes
+*/
+static void fat_file_read_ahead_callback(FAT_FILE* handle, uint16_t* async_state)
+{
+	FAT_READ_AHEAD_STATE* ra = &handle->read_ahead;
+	uint16_t ret;
+
+	ra->pending = 0;
+	/*
+	// if the sector is no longer wanted forget about it, if
+	// it failed to load drop it from the ring and stop prefetching
+	*/
+	if (ra->discard)
+	{
+		ra->discard = 0;
+	}
+	else if (*async_state != STORAGE_SUCCESS)
+	{
+		ra->count--;
+		ra->window = 0;
+	}
+	/*
+	// if a read is waiting on this transfer resume it
+	*/
+	if (ra->waiting)
+	{
+		ra->waiting = 0;
+		ret = fat_file_read_sector(handle, ra->wait_addr, ra->wait_buffer);
+		if (ret != STORAGE_OP_IN_PROGRESS)
+		{
+			handle->op_state.storage_callback_info.Callback(
+				handle->op_state.storage_callback_info.Context, &handle->op_state.storage_state);
+		}
+		return;
+	}
+	/*
+	// keep the ring full
+	*/
+	fat_file_read_ahead(handle);
+}
+#endif
+
+/*
+// gets the address of the cluster at the specified index of the
+// file's cluster chain. The walk starts from the closest cluster that
+// we already know about (the last one looked up, the one under the
+// cursor or the 1st one) and the result is cached for the next lookup
+*/
+static uint16_t fat_file_get_cluster_address(FAT_FILE* handle, uint32_t clus_idx, uint32_t* clus_addr)
+{
+	uint32_t idx = 0;
+	uint32_t addr;
+	/*
+	// start with the 1st cluster of the file
+	*/
+	((uint16_t*) &addr)[INT32_WORD0] = handle->directory_entry.raw.ENTRY.STD.first_cluster_lo;
+	((uint16_t*) &addr)[INT32_WORD1] = 
+		(handle->volume->fs_type == FAT_FS_TYPE_FAT32) ? handle->directory_entry.raw.ENTRY.STD.first_cluster_hi : 0;
+	/*
+	// if the cached cluster or the cluster under the cursor are
+	// closer to the one requested start from there
+	*/
+	if (handle->cached_clus_addr && handle->cached_clus_idx <= clus_idx)
+	{
+		idx = handle->cached_clus_idx;
+		addr = handle->cached_clus_addr;
+	}
+	if (handle->current_clus_addr && handle->current_clus_idx <= clus_idx && handle->current_clus_idx > idx)
+	{
+		idx = handle->current_clus_idx;
+		addr = handle->current_clus_addr;
+	}
+	/*
+	// follow the chain up to the requested cluster
+	*/
+	if (!fat_increase_cluster_address(handle->volume, addr, clus_idx - idx, &addr))
+		return FAT_CORRUPTED_FILE;
+	/*
+	// remember the cluster for the next lookup
+	*/
+	handle->cached_clus_idx = clus_idx;
+	handle->cached_clus_addr = addr;
+	*clus_addr = addr;
+	return FAT_SUCCESS;
+}
+
+/*
+// performs the work for fat_file_pread and fat_file_pwrite
+*/
+static uint16_t fat_file_positional_io(FAT_FILE* handle, uint32_t offset, 
+	unsigned char* buff, uint32_t length, uint32_t* bytes_transferred, char write)
+{
+	uint16_t ret;
+	uint16_t chunk;
+	uint16_t sector_offset;
+	uint32_t sector_idx;
+	uint32_t sector_addr;
+	uint32_t cursor_sector = 0;
+	uint32_t clus_addr;
+	uint32_t cluster_size;
+	char buffered;
+	#if defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	unsigned char* buffer = handle->volume->sector_buffer;
+	#elif defined(FAT_ALLOCATE_SHARED_BUFFER)
+	unsigned char* buffer = fat_shared_buffer;
+	#else
+	ALIGN16 unsigned char buffer[MAX_SECTOR_LENGTH];
+	#endif
+
+	if (bytes_transferred)
+		*bytes_transferred = 0;
+	/*
+	// check that this is a valid handle
+	*/
+	if (handle->magic != FAT_OPEN_HANDLE_MAGIC)
+		return FAT_INVALID_HANDLE;
+	/*
+	// check that the file is open for write access
+	*/
+	if (write && !(handle->access_flags & FAT_FILE_ACCESS_WRITE))
+		return FAT_FILE_NOT_OPENED_FOR_WRITE_ACCESS;
+	/*
+	// if the file is opened in unbuffered mode make sure that
+	// the request is sector aligned
+	*/
+	buffered = !(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING);
+	if (!buffered)
+	{
+		if ((offset % handle->volume->no_of_bytes_per_serctor) || 
+			(length % handle->volume->no_of_bytes_per_serctor))
+		{
+			return FAT_MISALIGNED_IO;
+		}
+	}
+	cluster_size = (uint32_t) handle->volume->no_of_sectors_per_cluster * handle->volume->no_of_bytes_per_serctor;
+	/*
+	// check that another operation is not using the
+	// handle at this time
+	*/
+	if (handle->busy)
+		return FAT_FILE_HANDLE_IN_USE;
+	/*
+	// the sectors held by the write-back buffer must reach the
+	// device before we access it directly. With delayed allocation
+	// their clusters are only added to the chain by the flush so
+	// it must also happen before we count them below
+	*/
+	#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+	ret = fat_file_write_back_flush(handle);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	#endif
+
+	if (write)
+	{
+		uint32_t clusters_needed;
+		uint32_t clusters_allocated;
+		/*
+		// we don't allow writes past the end of the file
+		// as that would leave a gap of garbage on the file
+		*/
+		if (offset > handle->current_size)
+			return FAT_SEEK_FAILED;
+		/*
+		// make sure that there's enough clusters allocated
+		// to the file to complete the request
+		*/
+		clusters_needed = (offset + length + cluster_size - 1) / cluster_size;
+		clusters_allocated = 0;
+		if (handle->current_clus_addr)
+		{
+			/*
+			// the count of clusters after the cursor is not kept by
+			// every path that moves it so follow the chain from the
+			// cursor up to the last cluster needed and recompute it
+			*/
+			clus_addr = handle->current_clus_addr;
+			clusters_allocated = handle->current_clus_idx + 1;
+			while (clusters_allocated < clusters_needed)
+			{
+				ret = fat_get_cluster_entry(handle->volume, clus_addr, &clus_addr);
+				if (ret != FAT_SUCCESS)
+					return ret;
+				if (fat_is_eof_entry(handle->volume, clus_addr))
+					break;
+				clusters_allocated++;
+			}
+			if (clusters_allocated < clusters_needed || 
+				handle->no_of_clusters_after_pos < clusters_allocated - handle->current_clus_idx - 1)
+			{
+				handle->no_of_clusters_after_pos = clusters_allocated - handle->current_clus_idx - 1;
+			}
+		}
+		if (clusters_needed > clusters_allocated)
+		{
+			ret = fat_file_alloc(handle, 
+				(clusters_needed - clusters_allocated + handle->no_of_clusters_after_pos) * cluster_size);
+			if (ret != FAT_SUCCESS)
+				return ret;
+		}
+	}
+	else
+	{
+		/*
+		// make sure that we don't read past the end of the file
+		*/
+		if (offset >= handle->current_size)
+		{
+			length = 0;
+		}
+		else if (length > handle->current_size - offset)
+		{
+			length = handle->current_size - offset;
+		}
+	}
+	if (!length)
+		return FAT_SUCCESS;
+	/*
+	// mark the handle as in use
+	*/
+	handle->busy = 1;
+	/*
+	// data written through this call may be sitting in the
+	// read-ahead ring
+	*/
+	#if defined(FAT_READ_AHEAD)
+	if (write)
+		fat_file_read_ahead_reset(handle);
+	#endif
+	/*
+	// find the cluster that contains the offset
+	*/
+	ret = fat_file_get_cluster_address(handle, offset / cluster_size, &clus_addr);
+	if (ret != FAT_SUCCESS)
+	{
+		handle->busy = 0;
+		return ret;
+	}
+	sector_idx = (offset % cluster_size) / handle->volume->no_of_bytes_per_serctor;
+	sector_offset = (uint16_t) (offset % handle->volume->no_of_bytes_per_serctor);
+	/*
+	// calculate the address of the sector under the cursor. The handle
+	// buffer may hold data for that sector that has not been flushed yet
+	*/
+	if (buffered && handle->buffer && handle->current_clus_addr)
+	{
+		cursor_sector = handle->current_sector_idx + 
+			FIRST_SECTOR_OF_CLUSTER(handle->volume, handle->current_clus_addr);
+	}
+
+	while (length)
+	{
+		sector_addr = sector_idx + FIRST_SECTOR_OF_CLUSTER(handle->volume, clus_addr);
+		chunk = (uint16_t) MIN(length, (uint32_t) (handle->volume->no_of_bytes_per_serctor - sector_offset));
+		/*
+		// if we're transferring a whole sector do it directly
+		// to/from the caller's buffer
+		*/
+		if (chunk == handle->volume->no_of_bytes_per_serctor && sector_addr != cursor_sector)
+		{
+			if (write)
+			{
+				ret = handle->volume->device->write_sector(handle->volume->device->driver, sector_addr, buff);
+			}
+			else
+			{
+				ret = handle->volume->device->read_sector(handle->volume->device->driver, sector_addr, buff);
+			}
+			if (ret != STORAGE_SUCCESS)
+			{
+				handle->busy = 0;
+				return write ? FAT_CANNOT_WRITE_MEDIA : FAT_CANNOT_READ_MEDIA;
+			}
+		}
+		else
+		{
+			/*
+			// acquire a lock on the buffer
+			*/
+			#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+			ENTER_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
+			#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+			ENTER_CRITICAL_SECTION(fat_shared_buffer_lock);
+			#endif
+			/*
+			// mark the cached sector as unknown and load the sector
+			*/
+			FAT_SET_LOADED_SECTOR(handle->volume, FAT_UNKNOWN_SECTOR);
+			ret = handle->volume->device->read_sector(handle->volume->device->driver, sector_addr, buffer);
+			if (ret == STORAGE_SUCCESS)
+			{
+				/*
+				// if this is the sector under the cursor merge the
+				// data on the file buffer
+				*/
+				if (sector_addr == cursor_sector)
+				{
+					memcpy(buffer, handle->buffer, (uintptr_t) (handle->buffer_head - handle->buffer));
+				}
+				if (write)
+				{
+					/*
+					// update the sector and write it back. If this is the sector
+					// under the cursor update the file buffer too
+					*/
+					memcpy(buffer + sector_offset, buff, chunk);
+					ret = handle->volume->device->write_sector(handle->volume->device->driver, sector_addr, buffer);
+					if (sector_addr == cursor_sector)
+					{
+						memcpy(handle->buffer + sector_offset, buff, chunk);
+					}
+				}
+				else
+				{
+					memcpy(buff, buffer + sector_offset, chunk);
+				}
+			}
+			/*
+			// release the lock on the buffer
+			*/
+			#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+			LEAVE_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
+			#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+			LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+			#endif
+
+			if (ret != STORAGE_SUCCESS)
+			{
+				handle->busy = 0;
+				return write ? FAT_CANNOT_WRITE_MEDIA : FAT_CANNOT_READ_MEDIA;
+			}
+		}
+		/*
+		// update the offset, the counters and the file size
+		*/
+		buff += chunk;
+		offset += chunk;
+		length -= chunk;
+		sector_offset = 0;
+		if (bytes_transferred)
+			*bytes_transferred += chunk;
+		if (write && offset > handle->current_size)
+			handle->current_size = offset;
+		/*
+		// move on to the next sector
+		*/
+		if (length && ++sector_idx == handle->volume->no_of_sectors_per_cluster)
+		{
+			ret = fat_file_get_cluster_address(handle, offset / cluster_size, &clus_addr);
+			if (ret != FAT_SUCCESS)
+			{
+				handle->busy = 0;
+				return ret;
+			}
+			sector_idx = 0;
+		}
+	}
+	/*
+	// mark the file handle as no longer in use
+	*/
+	handle->busy = 0;
+	return FAT_SUCCESS;
+}
+
+/*
+// reads from a file at the specified offset without
+// moving the cursor
+*/
+uint16_t fat_file_pread(FAT_FILE* handle, uint32_t offset, unsigned char* buffer, uint32_t length, uint32_t* bytes_read)
+{
+	return fat_file_positional_io(handle, offset, buffer, length, bytes_read, 0);
+}
+
+/*
+// writes to a file at the specified offset without
+// moving the cursor
+*/
+uint16_t fat_file_pwrite(FAT_FILE* handle, uint32_t offset, unsigned char* buffer, uint32_t length)
+{
+	#if defined(FAT_READ_ONLY)
+	return FAT_FEATURE_NOT_SUPPORTED;
+	#else
+	return fat_file_positional_io(handle, offset, buffer, length, 0, 1);
+	#endif
+}
+
+#if !defined(FAT_READ_ONLY)
+/*
+// writes the sectors held by the file buffers
+// to the device
+*/
+static uint16_t fat_file_write_buffer(FAT_FILE* handle)
+{
+	uint16_t ret;
+	uint32_t sector_address;
+	/*
+	// write the sectors held by the write-back buffer
+	*/
+	#if defined(FAT_WRITE_BACK)
+	ret = fat_file_write_back_flush(handle);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	#endif
+	/*
+	// calculate the address of the current
+	// sector
+	*/
+	sector_address = handle->current_sector_idx +
+		FIRST_SECTOR_OF_CLUSTER(handle->volume, handle->current_clus_addr);
+	/*
+	// if the buffer is only partially filled we need to merge it
+	// with the one on the drive
+	*/
+	if (handle->buffer_head <= handle->buffer + handle->volume->no_of_bytes_per_serctor)
+	{
+		uint16_t i;
+		unsigned char buff[MAX_SECTOR_LENGTH];
+		ret = handle->volume->device->read_sector(handle->volume->device->driver, sector_address, buff);
+		if (ret != STORAGE_SUCCESS)
+			return ret;
+
+		for (i = (uint16_t) (handle->buffer_head - 
+			handle->buffer); i < handle->volume->no_of_bytes_per_serctor; i++)
+		{
+			handle->buffer[i] = buff[i];
+		}
+	}
+	/*
+	// write the cached sector to media
+	*/
+	ret = handle->volume->device->write_sector(handle->volume->device->driver, sector_address, handle->buffer);
+	if (ret != STORAGE_SUCCESS)
+		return FAT_CANNOT_WRITE_MEDIA;
+
+	return FAT_SUCCESS;
+}
+
+/*
+// writes the directory entry of the file
+// to the device
+*/
+static uint16_t fat_file_write_entry(FAT_FILE* handle, uint32_t size)
+{
+	uint16_t ret;
+	#if defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	unsigned char* buffer = handle->volume->sector_buffer;
+	#elif defined(FAT_ALLOCATE_SHARED_BUFFER)
+	unsigned char* buffer = fat_shared_buffer;
+	#else
+	ALIGN16 unsigned char buffer[MAX_SECTOR_LENGTH];
+	#endif
 
-			if (handle->op_state.pos >= handle->current_size)
-			{
-				if (handle->op_state.bytes_read)
-				{
-					*handle->op_state.bytes_read -= (handle->op_state.pos - handle->current_size);
-				}
-				handle->op_state.bytes_remaining = 0;
-			}
+	/*
+	// update the file size on the entry
+	*/
+	handle->directory_entry.raw.ENTRY.STD.size = size;
+	handle->directory_entry.raw.ENTRY.STD.modify_date = rtc_get_fat_date();
+	handle->directory_entry.raw.ENTRY.STD.modify_time = rtc_get_fat_time();
+	handle->directory_entry.raw.ENTRY.STD.access_date = handle->directory_entry.raw.ENTRY.STD.modify_date;
+	/*
+	// acquire a lock on the buffer
+	// todo: why can't we use the file buffer?? we just finished with it above
+	*/
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	ENTER_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
+	#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+	ENTER_CRITICAL_SECTION(fat_shared_buffer_lock);
+	#endif
+	/*
+	// try load the sector that contains the entry
+	*/		
+	FAT_SET_LOADED_SECTOR(volume, FAT_UNKNOWN_SECTOR);
+	
+	ret = handle->volume->device->read_sector(handle->volume->device->driver, handle->directory_entry.sector_addr, buffer);
+	if (ret != STORAGE_SUCCESS)
+	{
+		#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+		LEAVE_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
+		#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+		LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+		#endif
+		return FAT_CANNOT_READ_MEDIA;
+	}
+	/*
+	// copy the modified file entry to the
+	// sector buffer
+	*/
+	#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
+	fat_write_raw_directory_entry(&handle->directory_entry.raw, buffer + handle->directory_entry.sector_offset);
+	#else
+	memcpy(buffer + handle->directory_entry.sector_offset, &handle->directory_entry.raw, sizeof(FAT_RAW_DIRECTORY_ENTRY));
+	#endif
+	/*
+	// write the modified entry to the media
+	*/			
+	ret = handle->volume->device->write_sector(handle->volume->device->driver, handle->directory_entry.sector_addr, buffer);
+	if ( ret != STORAGE_SUCCESS )
+	{
+		#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+		LEAVE_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
+		#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+		LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+		#endif
+		return FAT_CANNOT_WRITE_MEDIA;
+	}
+	#if defined(FAT_DENTRY_CACHE)
+	fat_dentry_cache_update(handle->volume, handle->directory_entry.sector_addr, handle->directory_entry.sector_offset, &handle->directory_entry.raw);
+	#endif
+	/*
+	// some cards seem not to update the sector correctly if it
+	// is the first sector on the page and is the only sector written
+	// to so for now until we figure this out we'll write the next
+	// sector too TODO: implement this on driver!!
+	*/
+	{
+		ret = handle->volume->device->read_sector(handle->volume->device->driver, handle->directory_entry.sector_addr + 1, buffer);
+		if (ret != STORAGE_SUCCESS)
+		{
+			#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+			LEAVE_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
+			#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+			LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+			#endif
+			return FAT_CANNOT_READ_MEDIA;
 		}
-		else
+		ret = handle->volume->device->write_sector(handle->volume->device->driver, handle->directory_entry.sector_addr + 1, buffer);
+		if ( ret != STORAGE_SUCCESS )
 		{
-			/*
-			// copy the next byte to the buffer
-			*/
-			*handle->op_state.buffer++ = *handle->buffer_head++;
-			/*
-			// update the  count of bytes read
-			*/
-			if (handle->op_state.bytes_read)
-				(*handle->op_state.bytes_read)++;
-			/*
-			// decrease the count of remaining bytes
-			*/
-			handle->op_state.bytes_remaining--;
-			/*
-			// increase the file pointer
-			*/
-			handle->op_state.pos++;
-			/*
-			// check if we've reached the end of the file
-			*/
-			if (handle->op_state.pos >= handle->current_size)
-				handle->op_state.bytes_remaining = 0;
+			#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+			LEAVE_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
+			#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+			LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+			#endif
+			return FAT_CANNOT_WRITE_MEDIA;
 		}
-	}
+	}	
 	/*
-	// set the return code
+	// release the lock on the buffer
 	*/
-	*async_state = FAT_SUCCESS;
+	#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
+	LEAVE_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
+	#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
+	LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
+	#endif
+	return FAT_SUCCESS;
+}
+
+#if defined(FAT_CHECKPOINTS)
+/*
+// updates the directory entry to cover the data that has
+// been written to the device if the checkpoint policy says so
+*/
+static uint16_t fat_file_checkpoint(FAT_FILE* handle, uint32_t pos)
+{
+	uint16_t ret;
+	uint32_t size;
+	uint32_t cluster_size;
+	uint32_t clusters;
+	uint32_t last_clusters;
+
+	if (!handle->checkpoint.bytes && !handle->checkpoint.clusters && !handle->checkpoint.seconds)
+		return FAT_SUCCESS;
 	/*
-	// mark file handle as no longer in use
+	// the data held by the file buffers is not on the device
+	// yet so we can only go up to the 1st byte that they hold
 	*/
-	handle->busy = 0;
+	if (!(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING))
+	{
+		pos -= (uint32_t) (handle->buffer_head - handle->buffer);
+		#if defined(FAT_WRITE_BACK)
+		pos -= (uint32_t) handle->write_back.count * handle->volume->no_of_bytes_per_serctor;
+		#endif
+	}
+	size = MIN(pos, handle->current_size);
 	/*
-	// invoke callback function
+	// if the data on the device has not grown since the
+	// entry was last written there's nothing to do
 	*/
-	if (handle->op_state.callback)
-		handle->op_state.callback(handle->op_state.callback_context, async_state);
+	if (size <= handle->directory_entry.raw.ENTRY.STD.size)
+		return FAT_SUCCESS;
+
+	cluster_size = (uint32_t) handle->volume->no_of_sectors_per_cluster * handle->volume->no_of_bytes_per_serctor;
+	clusters = (size + cluster_size - 1) / cluster_size;
+	last_clusters = (handle->directory_entry.raw.ENTRY.STD.size + cluster_size - 1) / cluster_size;
 	/*
-	// leave
+	// check the policy. The time is only looked
+	// up when the other conditions are not met
 	*/
-	return;
+	if (!(handle->checkpoint.bytes && size - handle->directory_entry.raw.ENTRY.STD.size >= handle->checkpoint.bytes) &&
+		!(handle->checkpoint.clusters && clusters - last_clusters >= handle->checkpoint.clusters) &&
+		!(handle->checkpoint.seconds && fat_get_time() - handle->checkpoint.time >= handle->checkpoint.seconds))
+	{
+		return FAT_SUCCESS;
+	}
+	/*
+	// write the entry and if clusters have been allocated
+	// since the last time the FSInfo sector as well
+	*/
+	ret = fat_file_write_entry(handle, size);
+	if (ret != FAT_SUCCESS)
+		return ret;
+	if (clusters != last_clusters)
+	{
+		ret = fat_update_fsinfo(handle->volume);
+		if (ret != FAT_SUCCESS)
+			return ret;
+	}
+	if (handle->checkpoint.seconds)
+		handle->checkpoint.time = fat_get_time();
+	return FAT_SUCCESS;
 }
+#endif
+#endif
 
 /*
 // flushes file buffers
@@ -2900,14 +5931,6 @@ uint16_t fat_file_flush(FAT_FILE* handle)
 	return FAT_FEATURE_NOT_SUPPORTED;
 	#else
 	uint16_t ret;
-	uint32_t sector_address = 0;
-	#if defined(FAT_ALLOCATE_VOLUME_BUFFER)
-	unsigned char* buffer = handle->volume->sector_buffer;
-	#elif defined(FAT_ALLOCATE_SHARED_BUFFER)
-	unsigned char* buffer = fat_shared_buffer;
-	#else
-	ALIGN16 unsigned char buffer[MAX_SECTOR_LENGTH];
-	#endif
 	/*
 	// check that this is a valid handle
 	*/
@@ -2939,140 +5962,23 @@ uint16_t fat_file_flush(FAT_FILE* handle)
 		*/
 		if (!(handle->access_flags & FAT_FILE_FLAG_NO_BUFFERING))
 		{
-			/*
-			// calculate the address of the current
-			// sector
-			*/
-			sector_address = handle->current_sector_idx +
-				FIRST_SECTOR_OF_CLUSTER(handle->volume, handle->current_clus_addr);
-			/*
-			// if the buffer is only partially filled we need to merge it
-			// with the one on the drive
-			*/
-			if (handle->buffer_head <= handle->buffer + handle->volume->no_of_bytes_per_serctor)
-			{
-				uint16_t i;
-				unsigned char buff[MAX_SECTOR_LENGTH];
-				ret = handle->volume->device->read_sector(handle->volume->device->driver, sector_address, buff);
-				if (ret != STORAGE_SUCCESS)
-				{
-					handle->busy = 0;
-					return ret;
-				}
-
-				for (i = (uint16_t) (handle->buffer_head - 
-					handle->buffer); i < handle->volume->no_of_bytes_per_serctor; i++)
-				{
-					handle->buffer[i] = buff[i];
-				}
-			}
-			/*
-			// write the cached sector to media
-			*/
-			ret = handle->volume->device->write_sector(handle->volume->device->driver, sector_address, handle->buffer);
-			if (ret != STORAGE_SUCCESS)
+			ret = fat_file_write_buffer(handle);
+			if (ret != FAT_SUCCESS)
 			{
 				handle->busy = 0;
-				return FAT_CANNOT_WRITE_MEDIA;
+				return ret;
 			}
 		}
 		/*
 		// update the file size on the entry
 		*/
-		handle->directory_entry.raw.ENTRY.STD.size = handle->current_size;
-		handle->directory_entry.raw.ENTRY.STD.modify_date = rtc_get_fat_date();
-		handle->directory_entry.raw.ENTRY.STD.modify_time = rtc_get_fat_time();
-		handle->directory_entry.raw.ENTRY.STD.access_date = handle->directory_entry.raw.ENTRY.STD.modify_date;
-		/*
-		// acquire a lock on the buffer
-		// todo: why can't we use the file buffer?? we just finished with it above
-		*/
-		#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
-		ENTER_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
-		#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
-		ENTER_CRITICAL_SECTION(fat_shared_buffer_lock);
-		#endif
-		/*
-		// try load the sector that contains the entry
-		*/		
-		FAT_SET_LOADED_SECTOR(volume, FAT_UNKNOWN_SECTOR);
-		
-		ret = handle->volume->device->read_sector(handle->volume->device->driver, handle->directory_entry.sector_addr, buffer);
-		if (ret != STORAGE_SUCCESS)
-		{
-			handle->busy = 0;
-			#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
-			LEAVE_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
-			#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
-			LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
-			#endif
-			return FAT_CANNOT_READ_MEDIA;
-		}
-		/*
-		// copy the modified file entry to the
-		// sector buffer
-		*/
-		#if defined(NO_STRUCT_PACKING) || defined(BIG_ENDIAN)
-		fat_write_raw_directory_entry(&handle->directory_entry.raw, buffer + handle->directory_entry.sector_offset);
-		#else
-		memcpy(buffer + handle->directory_entry.sector_offset, &handle->directory_entry.raw, sizeof(FAT_RAW_DIRECTORY_ENTRY));
-		#endif
-		/*
-		// write the modified entry to the media
-		*/			
-		ret = handle->volume->device->write_sector(handle->volume->device->driver, handle->directory_entry.sector_addr, buffer);
-		if ( ret != STORAGE_SUCCESS )
-		{
-			handle->busy = 0;
-			#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
-			LEAVE_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
-			#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
-			LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
-			#endif
-			return FAT_CANNOT_WRITE_MEDIA;
-		}
-		/*
-		// some cards seem not to update the sector correctly if it
-		// is the first sector on the page and is the only sector written
-		// to so for now until we figure this out we'll write the next
-		// sector too TODO: implement this on driver!!
-		*/
-		{
-			ret = handle->volume->device->read_sector(handle->volume->device->driver, handle->directory_entry.sector_addr + 1, buffer);
-			if (ret != STORAGE_SUCCESS)
-			{
-				handle->busy = 0;
-				#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
-				LEAVE_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
-				#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
-				LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
-				#endif
-				return FAT_CANNOT_READ_MEDIA;
-			}
-			ret = handle->volume->device->write_sector(handle->volume->device->driver, handle->directory_entry.sector_addr + 1, buffer);
-			if ( ret != STORAGE_SUCCESS )
-			{
-				handle->busy = 0;
-				#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
-				LEAVE_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
-				#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
-				LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
-				#endif
-				return FAT_CANNOT_WRITE_MEDIA;
-			}
-		}	
-		/*
-		// release the lock on the buffer
-		*/
-		#if defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_VOLUME_BUFFER)
-		LEAVE_CRITICAL_SECTION(handle->volume->sector_buffer_lock);
-		#elif defined(FAT_MULTI_THREADED) && defined(FAT_ALLOCATE_SHARED_BUFFER)
-		LEAVE_CRITICAL_SECTION(fat_shared_buffer_lock);
-		#endif
+		ret = fat_file_write_entry(handle, handle->current_size);
 		/*
 		// mark the file handle as not busy
 		*/
 		handle->busy = 0;
+		if (ret != FAT_SUCCESS)
+			return ret;
 	}
 	/*
 	// return success code
@@ -3094,15 +6000,46 @@ uint16_t fat_file_close(FAT_FILE* handle)
 	if (handle->magic != FAT_OPEN_HANDLE_MAGIC)
 		return FAT_INVALID_HANDLE;
 	/*
+	// the handle cannot go away while the driver is
+	// still prefetching into it
+	*/
+	#if defined(FAT_READ_AHEAD)
+	if (handle->read_ahead.pending)
+		return FAT_FILE_HANDLE_IN_USE;
+	#endif
+	/*
+	// or while the user holds data borrowed from it
+	*/
+	if (handle->borrowed)
+		return FAT_FILE_HANDLE_IN_USE;
+	/*
 	// flush the file buffers
 	*/
 	#if !defined(FAT_READ_ONLY)
 	ret = fat_file_flush(handle);
 	if (ret != FAT_SUCCESS)
 		return ret;
-
-
-	if (handle->access_flags & FAT_FILE_ACCESS_WRITE)
+	/*
+	// release the clusters reserved for delayed allocation
+	*/
+	#if defined(FAT_WRITE_BACK)
+	handle->volume->reserved_clusters -= handle->write_back.reserved_clusters;
+	handle->write_back.reserved_clusters = 0;
+	#endif
+	/*
+	// an empty file keeps no clusters (and there's no
+	// last byte to seek to)
+	*/
+	if ((handle->access_flags & FAT_FILE_ACCESS_WRITE) && !handle->current_size)
+	{
+		if (handle->directory_entry.raw.ENTRY.STD.first_cluster_lo || handle->directory_entry.raw.ENTRY.STD.first_cluster_hi)
+		{
+			ret = fat_file_truncate(handle, 0);
+			if (ret != FAT_SUCCESS)
+				return ret;
+		}
+	}
+	else if (handle->access_flags & FAT_FILE_ACCESS_WRITE)
 	{
 		/*
 		// clear the no buffering attribute so we can seek to a misaligned
@@ -3117,6 +6054,13 @@ uint16_t fat_file_close(FAT_FILE* handle)
 		if (ret != FAT_SUCCESS)
 			return ret;
 		/*
+		// remember where the chain ends for the next time
+		// the file is opened
+		*/
+		#if defined(FAT_TAIL_HINTS)
+		fat_file_set_tail_hint(handle);
+		#endif
+		/*
 		// check that another operation is not using the
 		// handle at this time
 		*/
@@ -3155,6 +6099,15 @@ uint16_t fat_file_close(FAT_FILE* handle)
 	// invalidate the file handle
 	*/
 	handle->magic = 0;
+	#if !defined(FAT_READ_ONLY)
+	#if defined(FAT_MULTI_THREADED)
+	ENTER_CRITICAL_SECTION(handle->volume->write_lock);
+	#endif
+	handle->volume->no_of_open_files--;
+	#if defined(FAT_MULTI_THREADED)
+	LEAVE_CRITICAL_SECTION(handle->volume->write_lock);
+	#endif
+	#endif
 	/*
 	// return success
 	*/
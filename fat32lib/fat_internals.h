@@ -39,6 +39,8 @@
 #define FAT_OPEN_HANDLE_MAGIC			( 0x4B )
 #define FAT_DELETED_ENTRY				( 0xE5 )
 #define FAT_UNKNOWN_SECTOR				( 0xFFFFFFFF )
+#define FAT_DELETE_TREE_DEPTH			( 0x8 )
+#define FAT_DELETE_TREE_CHAINS			( 0x20 )
 
 /*
 // macro for computing the 1st sector of a cluster
@@ -125,6 +127,9 @@ FAT_RAW_DIRECTORY_ENTRY;
 */
 typedef struct _FILESYSTEM_QUERY_INNER {
 	FAT_DIRECTORY_ENTRY current_entry;
+	FAT_QUERY_FILTER* filter;
+	uint32_t filter_modified_after;
+	uint32_t filter_modified_before;
 	FAT_QUERY_STATE state;
 }	
 FAT_FILESYSTEM_QUERY_INNER;
@@ -278,9 +283,13 @@ FAT_QUERY_STATE_INTERNAL;
 uint16_t fat_get_cluster_entry(FAT_VOLUME* volume, uint32_t cluster, FAT_ENTRY* fat_entry);
 uint16_t fat_set_cluster_entry(FAT_VOLUME* volume, uint32_t cluster, FAT_ENTRY fat_entry);
 uint16_t fat_free_cluster_chain(FAT_VOLUME* volume, uint32_t cluster);
+uint16_t fat_free_cluster_chains(FAT_VOLUME* volume, uint32_t* clusters, uint16_t count);
+#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+uint16_t fat_count_free_clusters(FAT_VOLUME* volume, uint32_t* count);
+#endif
 uint32_t fat_allocate_data_cluster(FAT_VOLUME* volume, uint32_t count, char zero, uint16_t* result);
 uint16_t fat_create_directory_entry(FAT_VOLUME* volume, FAT_RAW_DIRECTORY_ENTRY* parent, char* name, unsigned char attribs, uint32_t entry_cluster, FAT_DIRECTORY_ENTRY* entry);
-char fat_increase_cluster_address(FAT_VOLUME* volume, uint32_t current_cluster, uint16_t count, uint32_t* value);
+char fat_increase_cluster_address(FAT_VOLUME* volume, uint32_t current_cluster, uint32_t count, uint32_t* value);
 char INLINE fat_is_eof_entry(FAT_VOLUME* volume, FAT_ENTRY fat);
 
 unsigned char fat_long_entry_checksum( unsigned char* filename);
@@ -302,10 +311,21 @@ unsigned char INLINE fat_get_fat16_sec_per_clus(uint32_t sector_count);
 void INLINE fat_fill_directory_entry_from_raw(FAT_DIRECTORY_ENTRY* entry, FAT_RAW_DIRECTORY_ENTRY* raw_entry);
 uint16_t rtc_get_fat_date();
 uint16_t rtc_get_fat_time();
+#if !defined(FAT_READ_ONLY)
+time_t fat_get_time();
+uint16_t fat_update_fsinfo(FAT_VOLUME* volume);
+#endif
 INLINE time_t fat_decode_date_time(uint16_t date, uint16_t time);
 INLINE void strtrim(char* dest, char* src, size_t max );
 void fat_parse_path(char* path, char* path_part, char** filename_part);
 
+#if defined(FAT_DENTRY_CACHE)
+void fat_dentry_cache_update(FAT_VOLUME* volume, uint32_t sector_addr, uint16_t sector_offset, FAT_RAW_DIRECTORY_ENTRY* raw);
+void fat_dentry_cache_invalidate(FAT_VOLUME* volume, FAT_RAW_DIRECTORY_ENTRY* directory, char negative_only);
+#endif
+#if defined(FAT_AUTO_COMPACT) && !defined(FAT_READ_ONLY)
+uint16_t fat_auto_compact_directory(FAT_VOLUME* volume, char* path);
+#endif
 #if defined(FAT_OPTIMIZE_FOR_FLASH)
 uint32_t fat_allocate_data_cluster_ex(FAT_VOLUME* volume, uint32_t count, char zero, uint32_t page_size, uint16_t* result);
 #endif
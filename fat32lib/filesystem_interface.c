@@ -35,9 +35,17 @@ void fat_get_filesystem_interface(FILESYSTEM* filesystem)
 	filesystem->dir_entry_name_offset = (uintptr_t) tmp.name - (uintptr_t) &tmp;
 	filesystem->dir_entry_size_offset = (uintptr_t) &tmp.size - (uintptr_t) &tmp;
 	filesystem->dir_entry_attributes_offset = (uintptr_t) &tmp.attributes - (uintptr_t) &tmp;
+	#if defined(FAT_LAZY_DIRECTORY_TIMES)
+	filesystem->dir_entry_create_time_offset = 0;
+	filesystem->dir_entry_modify_time_offset = 0;
+	filesystem->dir_entry_access_time_offset = 0;
+	filesystem->get_entry_times = (FILESYSTEM_GET_ENTRY_TIMES) &fat_get_entry_times;
+	#else
 	filesystem->dir_entry_create_time_offset = (uintptr_t) &tmp.create_time - (uintptr_t) &tmp;
 	filesystem->dir_entry_modify_time_offset = (uintptr_t) &tmp.modify_time - (uintptr_t) &tmp;
 	filesystem->dir_entry_access_time_offset = (uintptr_t) &tmp.access_time - (uintptr_t) &tmp;
+	filesystem->get_entry_times = 0;
+	#endif
 	#if defined(FAT_DISABLE_LONG_FILENAMES)
 	filesystem->dir_entry_name_size = 13;
 	#else
@@ -58,11 +66,18 @@ void fat_get_filesystem_interface(FILESYSTEM* filesystem)
 	filesystem->file_open = (FILESYSTEM_FILE_OPEN) &fat_file_open;
 	filesystem->file_read = (FILESYSTEM_FILE_READ) &fat_file_read;
 	filesystem->file_read_async = (FILESYSTEM_FILE_READ_ASYNC) &fat_file_read_async;
+	filesystem->file_pread = (FILESYSTEM_FILE_PREAD) &fat_file_pread;
+	filesystem->file_pwrite = (FILESYSTEM_FILE_PWRITE) &fat_file_pwrite;
 	filesystem->file_rename = (FILESYSTEM_FILE_RENAME) &fat_file_rename;
 	filesystem->file_seek = (FILESYSTEM_FILE_SEEK) &fat_file_seek;
 	filesystem->file_write = (FILESYSTEM_FILE_WRITE) &fat_file_write;
 	filesystem->file_write_async = (FILESYSTEM_FILE_WRITE_ASYNC) &fat_file_write_async;
 	filesystem->file_set_buffer = (FILESYSTEM_FILE_SET_BUFFER) &fat_file_set_buffer;
+	#if defined(FAT_READ_AHEAD)
+	filesystem->file_set_read_ahead = (FILESYSTEM_FILE_SET_READ_AHEAD) &fat_file_set_read_ahead;
+	#else
+	filesystem->file_set_read_ahead = 0;
+	#endif
 	filesystem->mount_volume = (FILESYSTEM_MOUNT_VOLUME) &fat_mount_volume;
 	filesystem->dismount_volume = (FILESYSTEM_DISMOUNT_VOLUME) &fat_dismount_volume;
 	filesystem->find_first_entry = (FILESYSTEM_FIND_FIRST_ENTRY) &fat_find_first_entry;
@@ -72,7 +87,29 @@ void fat_get_filesystem_interface(FILESYSTEM* filesystem)
 	filesystem->file_get_unique_id = (FILESYSTEM_FILE_GET_UNIQUE_ID) &fat_file_get_unique_id;
 	#if defined(FAT_STREAMING_IO)
 	filesystem->file_write_stream = (FILESYSTEM_FILE_WRITE_STREAM) &fat_file_write_stream;
+	filesystem->file_read_stream = (FILESYSTEM_FILE_READ_STREAM) &fat_file_read_stream;
+	#else
+	filesystem->file_read_stream = 0;
+	#endif
+	#if defined(FAT_WRITE_BACK) && !defined(FAT_READ_ONLY)
+	filesystem->file_set_buffer_ex = (FILESYSTEM_FILE_SET_BUFFER_EX) &fat_file_set_buffer_ex;
+	#else
+	filesystem->file_set_buffer_ex = 0;
+	#endif
+	#if !defined(FAT_READ_ONLY)
+	filesystem->file_truncate = (FILESYSTEM_FILE_TRUNCATE) &fat_file_truncate;
+	filesystem->file_copy = (FILESYSTEM_FILE_COPY) &fat_file_copy;
+	#else
+	filesystem->file_truncate = 0;
+	filesystem->file_copy = 0;
+	#endif
+	#if defined(FAT_CHECKPOINTS) && !defined(FAT_READ_ONLY)
+	filesystem->file_set_checkpoint = (FILESYSTEM_FILE_SET_CHECKPOINT) &fat_file_set_checkpoint;
+	#else
+	filesystem->file_set_checkpoint = 0;
 	#endif
+	filesystem->file_read_borrow = (FILESYSTEM_FILE_READ_BORROW) &fat_file_read_borrow;
+	filesystem->file_read_release = (FILESYSTEM_FILE_READ_RELEASE) &fat_file_read_release;
 
 }
 
@@ -244,6 +244,36 @@ typedef uint16_t (*STORAGE_DEVICE_READ_ASYNC)(void* device, uint32_t sector_addr
  */
 typedef uint16_t (*STORAGE_DEVICE_ERASE_SECTORS)(void* device, uint32_t start_sector_address, uint32_t end_sector_address);
 
+/*!
+ * <summary>
+ * A function pointer to the driver function used to set a range of sectors to zeroes in a
+ * single operation, either by erasing them on devices that guarantee that erased sectors read
+ * back as zeroes or by writing them with a multi-sector write from a zeroed buffer. The file
+ * system uses it to initialize new directory clusters. Drivers that cannot do better than
+ * writing each sector must set the function pointer to NULL.
+ * </summary>
+ * <param name="device">A pointer to the device driver handle.</param>
+ * <param name="start_sector_address">A 32-bit unsigned integer representing the address of the 1st sector to zero.</param>
+ * <param name="end_sector_address">A 32-bit unsigned integer representing the address of the last sector to zero.</param>
+ * <returns>One of the result codes defined in storage_device.h</returns>
+ */
+typedef uint16_t (*STORAGE_DEVICE_ZERO_SECTORS)(void* device, uint32_t start_sector_address, uint32_t end_sector_address);
+
+/*!
+ * <summary>
+ * A function pointer to the driver function used to read a range of contiguous sectors in a
+ * single operation. The file system uses it to read directories a cluster or more at a time.
+ * Drivers that cannot do better than reading each sector must set the function pointer to NULL.
+ * </summary>
+ * <param name="device">A pointer to the device driver handle.</param>
+ * <param name="start_sector_address">A 32-bit unsigned integer representing the address of the 1st sector to read.</param>
+ * <param name="end_sector_address">A 32-bit unsigned integer representing the address of the last sector to read.</param>
+ * <param name="buffer">A buffer large enough to hold all the sectors where the data will be copied to.</param>
+ * <returns>One of the result codes defined in storage_device.h</returns>
+ */
+typedef uint16_t (*STORAGE_DEVICE_READ_SECTORS)(void* device, uint32_t start_sector_address, 
+				uint32_t end_sector_address, unsigned char* buffer);
+
 /*!
  * <summary>
  * A function pointer to the driver function used to write a sector to the device.
@@ -255,6 +285,22 @@ typedef uint16_t (*STORAGE_DEVICE_ERASE_SECTORS)(void* device, uint32_t start_se
  */
 typedef uint16_t (*STORAGE_DEVICE_WRITE)(void* device, uint32_t sector_address, unsigned char* buffer);
 
+/*!
+ * <summary>
+ * A function pointer to the driver function used to write a range of contiguous sectors in a
+ * single operation. The file system uses it to write the sectors held by the write-back buffer
+ * of a file. Drivers that cannot do better than writing each sector must set the function
+ * pointer to NULL.
+ * </summary>
+ * <param name="device">A pointer to the device driver handle.</param>
+ * <param name="start_sector_address">A 32-bit unsigned integer representing the address of the 1st sector to write.</param>
+ * <param name="end_sector_address">A 32-bit unsigned integer representing the address of the last sector to write.</param>
+ * <param name="buffer">A buffer holding the data of all the sectors.</param>
+ * <returns>One of the result codes defined in storage_device.h</returns>
+ */
+typedef uint16_t (*STORAGE_DEVICE_WRITE_SECTORS)(void* device, uint32_t start_sector_address, 
+				uint32_t end_sector_address, unsigned char* buffer);
+
 /*!
  * <summary>
  * A function pointer to the driver function used to write a sector to the device asynchronously.
@@ -309,6 +355,39 @@ typedef uint16_t (*STORAGE_DEVICE_WRITE_ASYNC)(void* device, uint32_t sector_add
 typedef uint16_t (*STORAGE_DEVICE_WRITE_MULTIPLE_SECTORS)(void* device, uint32_t sector_address, 
 				unsigned char* buffer, uint16_t* result, STORAGE_CALLBACK_INFO_EX* callback_info);
 
+/*!
+ * <summary>
+ * A function pointer to the driver function used to read multiple sectors from the device asynchronously.
+ * This is the counterpart of STORAGE_DEVICE_WRITE_MULTIPLE_SECTORS. Every time a sector has been read
+ * the driver calls back with the result set to STORAGE_AWAITING_DATA and the buffer pointer pointing to
+ * the data. The file system driver then sets the buffer pointer to where the next sector should be stored
+ * and responds with STORAGE_MULTI_SECTOR_RESPONSE_READY to continue reading, STORAGE_MULTI_SECTOR_RESPONSE_SKIP
+ * to be called back later with the same data or STORAGE_MULTI_SECTOR_RESPONSE_STOP to end the transfer, in
+ * which case the callback is invoked once more with the result of the operation. Drivers that don't support
+ * this function must set the function pointer to NULL.
+ * </summary>
+ * <param name="device">A pointer to the device driver handle.</param>
+ * <param name="sector_address">
+ * A 32-bit unsigned integer representing the address of the 1st sector
+ * to be read.
+ * </param>
+ * <param name="buffer">A sector-sized buffer where the 1st sector will be copied to.</param>
+ * <param name="result">
+ * A pointer to a 16-bit unsigned integer where the result of the multiple-sector read operation
+ * will be stored.
+ * </param>
+ * <param name="callback_info">
+ * A pointer to a STORAGE_CALLBACK_INFO_EX structure that holds the callback function pointer
+ * and a context pointer that will be passed back to the callback function.
+ * </param>
+ * <returns>
+ * If successful it should return STORAGE_OP_IN_PROGRESS, otherwise one of the result codes
+ * defined in storage_device.h
+ * </returns>
+ */
+typedef uint16_t (*STORAGE_DEVICE_READ_MULTIPLE_SECTORS)(void* device, uint32_t sector_address, 
+				unsigned char* buffer, uint16_t* result, STORAGE_CALLBACK_INFO_EX* callback_info);
+
 
 /*!
  * <summary>
@@ -366,6 +445,22 @@ typedef struct _STORAGE_DEVICE
 	 * <summary>A pointer to the driver's STORAGE_DEVICE_ERASE_SECTORS function.</summary>
 	 */
 	STORAGE_DEVICE_ERASE_SECTORS erase_sectors;
+	/*!
+	 * <summary>A pointer to the driver's STORAGE_DEVICE_READ_MULTIPLE_SECTORS function.</summary>
+	 */
+	STORAGE_DEVICE_READ_MULTIPLE_SECTORS read_multiple_sectors;
+	/*!
+	 * <summary>A pointer to the driver's STORAGE_DEVICE_ZERO_SECTORS function.</summary>
+	 */
+	STORAGE_DEVICE_ZERO_SECTORS zero_sectors;
+	/*!
+	 * <summary>A pointer to the driver's STORAGE_DEVICE_READ_SECTORS function.</summary>
+	 */
+	STORAGE_DEVICE_READ_SECTORS read_sectors;
+	/*!
+	 * <summary>A pointer to the driver's STORAGE_DEVICE_WRITE_SECTORS function.</summary>
+	 */
+	STORAGE_DEVICE_WRITE_SECTORS write_sectors;
 }	
 STORAGE_DEVICE, *PSTORAGE_DEVICE;
 
@@ -35,6 +35,9 @@ uint32_t ramdrv_get_total_sectors(RAMDRIVE* total_sectors);
 void ramdrv_register_media_changed_callback(STORAGE_MEDIA_CHANGED_CALLBACK callback);
 uint16_t ramdrv_read_sector(RAMDRIVE* ramdrive, uint32_t sector, unsigned char* buffer);
 uint16_t ramdrv_write_sector(RAMDRIVE* ramdrive, uint32_t sector, unsigned char* buffer);
+uint16_t ramdrv_zero_sectors(RAMDRIVE* ramdrive, uint32_t start_sector, uint32_t end_sector);
+uint16_t ramdrv_read_sectors(RAMDRIVE* ramdrive, uint32_t start_sector, uint32_t end_sector, unsigned char* buffer);
+uint16_t ramdrv_write_sectors(RAMDRIVE* ramdrive, uint32_t start_sector, uint32_t end_sector, unsigned char* buffer);
 
 void ramdrv_init(RAMDRIVE* ramdrive, uint16_t total_sectors, uint16_t sector_size, unsigned char* buffer, STORAGE_DEVICE* device)
 {
@@ -49,6 +52,11 @@ void ramdrv_init(RAMDRIVE* ramdrive, uint16_t total_sectors, uint16_t sector_siz
 	device->get_total_sectors				= (STORAGE_DEVICE_GET_SECTOR_COUNT) &ramdrv_get_total_sectors;
 	device->register_media_changed_callback = (STORAGE_REGISTER_MEDIA_CHANGED_CALLBACK) &ramdrv_register_media_changed_callback;
 	device->get_device_id					= (STORAGE_GET_DEVICE_ID) &ramdrv_get_device_id;
+	device->write_multiple_sectors			= 0;
+	device->read_multiple_sectors			= 0;
+	device->zero_sectors					= (STORAGE_DEVICE_ZERO_SECTORS) &ramdrv_zero_sectors;
+	device->read_sectors					= (STORAGE_DEVICE_READ_SECTORS) &ramdrv_read_sectors;
+	device->write_sectors					= (STORAGE_DEVICE_WRITE_SECTORS) &ramdrv_write_sectors;
 }
 
 uint16_t ramdrv_get_device_id(RAMDRIVE* device)
@@ -100,3 +108,48 @@ uint16_t ramdrv_write_sector(RAMDRIVE* device, uint32_t sector, unsigned char* b
 	return STORAGE_SUCCESS;
 
 }
+
+uint16_t ramdrv_zero_sectors(RAMDRIVE* device, uint32_t start_sector, uint32_t end_sector)
+{
+	uint64_t offset;
+	uint64_t end;
+	offset = (uint64_t) start_sector * device->sector_size;
+	end = (uint64_t) (end_sector + 1) * device->sector_size;
+
+	while (offset < end)
+	{
+		device->buffer[offset++] = 0;
+	}
+
+	return STORAGE_SUCCESS;
+}
+
+uint16_t ramdrv_read_sectors(RAMDRIVE* device, uint32_t start_sector, uint32_t end_sector, unsigned char* buffer)
+{
+	uint64_t offset;
+	uint64_t end;
+	offset = (uint64_t) start_sector * device->sector_size;
+	end = (uint64_t) (end_sector + 1) * device->sector_size;
+
+	while (offset < end)
+	{
+		*buffer++ = device->buffer[offset++];
+	}
+
+	return STORAGE_SUCCESS;
+}
+
+uint16_t ramdrv_write_sectors(RAMDRIVE* device, uint32_t start_sector, uint32_t end_sector, unsigned char* buffer)
+{
+	uint64_t offset;
+	uint64_t end;
+	offset = (uint64_t) start_sector * device->sector_size;
+	end = (uint64_t) (end_sector + 1) * device->sector_size;
+
+	while (offset < end)
+	{
+		device->buffer[offset++] = *buffer++;
+	}
+
+	return STORAGE_SUCCESS;
+}
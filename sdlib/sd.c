@@ -74,6 +74,8 @@
 #define SEND_BLOCK_LEN							(CMD_MASK | 0x10)
 #define SEND_STATUS								(CMD_MASK | 0x0D)
 #define READ_SINGLE_BLOCK						(CMD_MASK | 0x11)
+#define READ_MULTIPLE_BLOCK						(CMD_MASK | 0x12)
+#define STOP_TRANSMISSION						(CMD_MASK | 0x0C)
 #define WRITE_SINGLE_BLOCK						(CMD_MASK | 0x18)
 #define WRITE_MULTIPLE_BLOCK					(CMD_MASK | 0X19)
 #define SD_APP_OP_COND							(CMD_MASK | 0x29)
@@ -251,6 +253,8 @@ unsigned char calc_crc7(unsigned char value, unsigned char crc);
 uint16_t sd_read(SD_DRIVER*, uint32_t address, unsigned char* buffer, uint16_t* async_state, SD_CALLBACK_INFO* callback_info, char from_queue);
 uint16_t sd_write(SD_DRIVER* driver, uint32_t address, unsigned char* buffer, uint16_t* async_state, SD_CALLBACK_INFO* callback_info, char from_queue);
 uint16_t sd_erase(SD_DRIVER* driver, uint32_t start_address, uint32_t end_address, char from_queue);
+uint16_t sd_read_blocks(SD_DRIVER* driver, uint32_t address, uint32_t count, unsigned char* buffer);
+uint16_t sd_write_blocks(SD_DRIVER* driver, uint32_t address, uint32_t count, unsigned char* buffer);
 static uint16_t sd_wait_for_data(SD_DRIVER* driver);
 static void sd_wait_for_response(SD_DRIVER* driver, unsigned char* data);
 static unsigned char sd_translate_response(unsigned char response);
@@ -279,6 +283,9 @@ uint16_t sd_read_sector_async(SD_DRIVER* driver, uint32_t sector_address, unsign
 uint16_t sd_write_sector_async(SD_DRIVER* driver, uint32_t sector_address, unsigned char* buffer, uint16_t* async_state, PSD_CALLBACK_INFO callback_info);
 uint16_t sd_write_multiple_sectors(SD_DRIVER* driver, uint32_t sector_address, unsigned char* buffer, uint16_t* async_state, SD_CALLBACK_INFO_EX* callback_info);
 uint16_t sd_erase_sectors(SD_DRIVER* driver, uint32_t start_address, uint32_t end_address);
+uint16_t sd_read_sectors(SD_DRIVER* driver, uint32_t start_address, uint32_t end_address, unsigned char* buffer);
+uint16_t sd_write_sectors(SD_DRIVER* driver, uint32_t start_address, uint32_t end_address, unsigned char* buffer);
+uint16_t sd_zero_sectors(SD_DRIVER* driver, uint32_t start_address, uint32_t end_address);
 uint32_t sd_get_total_sectors(SD_DRIVER* driver);
 uint32_t sd_get_device_id(SD_DRIVER* driver);
 uint32_t sd_get_page_size(SD_DRIVER* driver);
@@ -302,7 +309,13 @@ void sd_get_storage_device_interface(SD_DRIVER* driver, STORAGE_DEVICE* device)
 	device->erase_sectors 					= (STORAGE_DEVICE_ERASE_SECTORS) &sd_erase_sectors;
 	#if defined(SD_ENABLE_MULTI_BLOCK_WRITE)
 	device->write_multiple_sectors 			= (STORAGE_DEVICE_WRITE_MULTIPLE_SECTORS) &sd_write_multiple_sectors;
+	#else
+	device->write_multiple_sectors 			= 0;
 	#endif
+	device->read_multiple_sectors 			= 0;
+	device->zero_sectors 					= (STORAGE_DEVICE_ZERO_SECTORS) &sd_zero_sectors;
+	device->read_sectors 					= (STORAGE_DEVICE_READ_SECTORS) &sd_read_sectors;
+	device->write_sectors 					= (STORAGE_DEVICE_WRITE_SECTORS) &sd_write_sectors;
 	
 }
 
@@ -407,6 +420,36 @@ uint16_t sd_write_sector_async(SD_DRIVER* driver,
 	return sd_write(driver, address, buffer, async_state, callback, 0);
 }	
 
+/*
+// read a range of sectors synchronously
+*/
+uint16_t sd_read_sectors(SD_DRIVER* driver, uint32_t start_address, uint32_t end_address, unsigned char* buffer)
+{
+	uint32_t address = (driver->card_info.high_capacity) ? 
+		start_address : start_address * driver->card_info.block_length;
+	return sd_read_blocks(driver, address, end_address - start_address + 1, buffer);
+}
+
+/*
+// write a range of sectors synchronously
+*/
+uint16_t sd_write_sectors(SD_DRIVER* driver, uint32_t start_address, uint32_t end_address, unsigned char* buffer)
+{
+	uint32_t address = (driver->card_info.high_capacity) ? 
+		start_address : start_address * driver->card_info.block_length;
+	return sd_write_blocks(driver, address, end_address - start_address + 1, buffer);
+}
+
+/*
+// zero a range of sectors synchronously
+*/
+uint16_t sd_zero_sectors(SD_DRIVER* driver, uint32_t start_address, uint32_t end_address)
+{
+	uint32_t address = (driver->card_info.high_capacity) ? 
+		start_address : start_address * driver->card_info.block_length;
+	return sd_write_blocks(driver, address, end_address - start_address + 1, 0);
+}
+
 #if defined(SD_ENABLE_MULTI_BLOCK_WRITE)
 uint16_t sd_write_multiple_sectors(SD_DRIVER* driver, uint32_t sector_address, unsigned char* buffer, uint16_t* async_state, SD_CALLBACK_INFO_EX* callback)
 {
@@ -1754,6 +1797,151 @@ uint16_t sd_read
 	}
 }
 
+/*
+// Reads a range of blocks from an SD card synchronously
+// with a single READ_MULTIPLE_BLOCK command.
+*/
+uint16_t sd_read_blocks
+(
+	SD_DRIVER* driver,
+	uint32_t address,
+	uint32_t count,
+	unsigned char* buffer
+)
+{
+	unsigned char tmp;
+	uint16_t ret = SD_SUCCESS;
+	/*
+	// if the card is not ready return error
+	*/
+	if (BP_GET(driver->context.media_ready))
+		return SD_CARD_NOT_READY;
+	/*
+	// wait for the card to be released
+	*/
+	#if defined(SD_MULTI_THREADED)
+	ENTER_CRITICAL_SECTION(driver->context.busy_lock);
+	#endif
+	while (driver->context.busy)
+	{
+		#if defined(SD_MULTI_THREADED)
+		LEAVE_CRITICAL_SECTION(driver->context.busy_lock);
+		#endif
+		sd_idle_processing(driver);
+		#if defined(SD_MULTI_THREADED)
+		ENTER_CRITICAL_SECTION(driver->context.busy_lock);
+		#endif
+	}	
+	/*
+	// mark the driver as busy
+	*/
+	driver->context.busy = 1;
+	#if defined(SD_MULTI_THREADED)
+	LEAVE_CRITICAL_SECTION(driver->context.busy_lock);
+	#endif
+	
+	#if defined(SD_PRINT_DEBUG_INFO)
+	printf("SDDRIVER: Multiple Block Read @ Address: 0x%lx, Blocks: %ld\r\n", address, count);
+	#endif
+	/*
+	// set busy signal
+	*/
+	BP_SET(driver->context.busy_signal);
+	/*
+	// assert the CS line
+	*/
+	ASSERT_CS(driver);
+	/*
+	// send the read command
+	*/	
+	SEND_IO_COMMAND(driver->context.spi_module, READ_MULTIPLE_BLOCK, address);
+	/*
+	// read the response
+	*/
+	WAIT_FOR_RESPONSE(driver, tmp);
+	/*
+	// check for timeout condition
+	*/
+	if (driver->context.timeout) 
+	{
+		DEASSERT_CS(driver);
+		BP_CLR(driver->context.busy_signal);
+		driver->context.busy = 0;
+		return SD_TIMEOUT;	
+	}
+	/*
+	// translate the response
+	*/
+	tmp = TRANSLATE_RESPONSE(tmp);
+	/*
+	// check for an error response
+	*/
+	if (tmp != 0) 
+	{
+		spi_write(driver->context.spi_module, 0xFF);
+		DEASSERT_CS(driver);
+		BP_CLR(driver->context.busy_signal);
+		driver->context.busy = 0;
+		return tmp;			
+	}
+	/*
+	// read the blocks as the card sends them
+	*/
+	while (count--)
+	{
+		/*
+		// wait for the start token. On an error token the
+		// card has already been released
+		*/
+		ret = sd_wait_for_data(driver);
+		if (ret != SD_SUCCESS)
+		{
+			driver->context.busy = 0;
+			return ret;
+		}
+		if (driver->context.timeout)
+		{
+			ret = SD_TIMEOUT;
+			break;
+		}
+		spi_read_buffer(driver->context.spi_module, buffer, SD_BLOCK_LENGTH);
+		buffer += SD_BLOCK_LENGTH;
+		/*
+		// read and discard the 16-bit crc
+		*/
+		tmp = spi_read(driver->context.spi_module);
+		tmp = spi_read(driver->context.spi_module);
+	}
+	/*
+	// stop the transmission. The byte that follows the
+	// command is a stuff byte, then comes the response and
+	// the card may hold the line low while it's busy
+	*/
+	SEND_IO_COMMAND(driver->context.spi_module, STOP_TRANSMISSION, 0);
+	tmp = spi_read(driver->context.spi_module);
+	WAIT_FOR_RESPONSE(driver, tmp);
+	if (driver->context.timeout && ret == SD_SUCCESS)
+		ret = SD_TIMEOUT;
+	WAIT_WHILE_CARD_BUSY(driver->context.spi_module);
+	/*
+	// clock out 8 cycles
+	*/
+	spi_write(driver->context.spi_module, 0xFF);
+	/*
+	// de-assert the CS line
+	*/
+	DEASSERT_CS(driver);
+	/*
+	// clear busy signal
+	*/
+	BP_CLR(driver->context.busy_signal);
+	/*
+	// mark the card as not busy
+	*/
+	driver->context.busy = 0;
+	return ret;
+}
+
 uint16_t sd_erase
 (
 	SD_DRIVER* driver, 
@@ -2327,6 +2515,164 @@ uint16_t sd_write
 	}
 }
 
+/*
+// Writes a range of blocks to an SD card synchronously
+// with a single WRITE_MULTIPLE_BLOCK command. If no buffer
+// is given the blocks are filled with zeroes.
+*/
+uint16_t sd_write_blocks
+(
+	SD_DRIVER* driver,
+	uint32_t address,
+	uint32_t count,
+	unsigned char* buffer
+)
+{
+	unsigned char tmp;
+	uint16_t i;
+	uint16_t ret = SD_SUCCESS;
+	/*
+	// if the card is not ready return error
+	*/
+	if (BP_GET(driver->context.media_ready))
+		return SD_CARD_NOT_READY;
+	/*
+	// wait for the card to be released
+	*/
+	#if defined(SD_MULTI_THREADED)
+	ENTER_CRITICAL_SECTION(driver->context.busy_lock);
+	#endif
+	while (driver->context.busy)
+	{
+		#if defined(SD_MULTI_THREADED)
+		LEAVE_CRITICAL_SECTION(driver->context.busy_lock);
+		#endif
+		sd_idle_processing(driver);
+		#if defined(SD_MULTI_THREADED)
+		ENTER_CRITICAL_SECTION(driver->context.busy_lock);
+		#endif
+	}	
+	/*
+	// mark the driver as busy
+	*/
+	driver->context.busy = 1;
+	#if defined(SD_MULTI_THREADED)
+	LEAVE_CRITICAL_SECTION(driver->context.busy_lock);
+	#endif
+	
+	#if defined(SD_PRINT_DEBUG_INFO)
+	printf("SDDRIVER: Multiple Block Write @ Address: 0x%lx, Blocks: %ld\r\n", address, count);
+	#endif
+	/*
+	// set busy signal
+	*/
+	BP_SET(driver->context.busy_signal);
+	/*
+	// assert the CS line
+	*/
+	ASSERT_CS(driver);
+	/*
+	// send 16 clock pulses to the card
+	*/
+	spi_write(driver->context.spi_module, 0xFF);
+	spi_write(driver->context.spi_module, 0xFF);
+	/*
+	// send the write command
+	*/	
+	SEND_IO_COMMAND(driver->context.spi_module, WRITE_MULTIPLE_BLOCK, address);
+	/*
+	// read the response
+	*/
+	WAIT_FOR_RESPONSE(driver, tmp);
+	/*
+	// check for timeout condition
+	*/
+	if (driver->context.timeout) 
+	{
+		DEASSERT_CS(driver);
+		BP_CLR(driver->context.busy_signal);
+		driver->context.busy = 0;
+		return SD_TIMEOUT;	
+	}
+	/*
+	// translate the response
+	*/
+	tmp = TRANSLATE_RESPONSE(tmp);
+	/*
+	// checks for an error code on the response
+	*/
+	if (tmp) 
+	{		
+		spi_write(driver->context.spi_module, 0xFF);
+		DEASSERT_CS(driver);
+		BP_CLR(driver->context.busy_signal);
+		driver->context.busy = 0;
+		return tmp;	
+	}
+	/*
+	// send the blocks one after the other waiting for
+	// the card to program each one
+	*/
+	while (count--)
+	{
+		spi_write(driver->context.spi_module, SD_BLOCK_START_TOKEN_MULT);
+		if (buffer)
+		{
+			spi_write_buffer(driver->context.spi_module, buffer, SD_BLOCK_LENGTH);
+			buffer += SD_BLOCK_LENGTH;
+		}
+		else
+		{
+			for (i = 0; i < SD_BLOCK_LENGTH; i++)
+				spi_write(driver->context.spi_module, 0x00);
+		}
+		/*
+		// read the data response
+		*/
+		WAIT_FOR_DATA_RESPONSE_TOKEN(driver, tmp);
+		if (driver->context.timeout)
+		{
+			ret = SD_TIMEOUT;
+			break;
+		}
+		if (tmp == SD_DATA_RESPONSE_REJECTED_CRC_ERROR)
+		{
+			ret = SD_CRC_ERROR;
+			break;
+		}
+		if (tmp == SD_DATA_RESPONSE_REJECTED_WRITE_ERROR)
+		{
+			ret = SD_UNKNOWN_ERROR;
+			break;
+		}
+		WAIT_WHILE_CARD_BUSY(driver->context.spi_module);
+	}
+	/*
+	// send the stop token and wait for the
+	// card to finish programming
+	*/
+	spi_write(driver->context.spi_module, SD_BLOCK_STOP_TOKEN_MULT);
+	spi_write(driver->context.spi_module, 0xFF);
+	WAIT_WHILE_CARD_BUSY(driver->context.spi_module);
+	/*
+	// clock out 8 cycles
+	*/
+	spi_write(driver->context.spi_module, 0xFF);
+	/*
+	// de-assert the CS line
+	*/
+	DEASSERT_CS(driver);
+	/*
+	// clear busy signal
+	*/
+	BP_CLR(driver->context.busy_signal);
+	/*
+	// mark the card as not busy
+	*/
+	driver->context.busy = 0;
+	return ret;
+}
+
 /*
 // writes multiple blocks to SD card
 */
@@ -20,6 +20,7 @@
 #ifndef STOREMANLIB_FILESYSTEM_H
 #define STOREMANLIB_FILESYSTEM_H
 #include "../compiler/compiler.h"
+#include <time.h>
 
 /*! \file filesystem.h
  * \brief This header file defines the interface used
@@ -84,14 +85,25 @@ typedef uint16_t (*FILESYSTEM_FILE_SEEK)(void* file, uint32_t offset, char mode)
 typedef uint16_t (*FILESYSTEM_FILE_WRITE)(void* file, unsigned char* buffer, uint32_t length);
 typedef uint16_t (*FILESYSTEM_FILE_WRITE_ASYNC)(void* file, unsigned char* buffer, uint32_t length, uint16_t* result, FILESYSTEM_ASYNC_CALLBACK callback, void* callback_context);
 typedef uint16_t (*FILESYSTEM_FILE_WRITE_STREAM)(void* file, unsigned char* buffer, uint32_t length, uint16_t* result, FILESYSTEM_STREAM_CALLBACK callback, void* callback_context);
+typedef uint16_t (*FILESYSTEM_FILE_SET_BUFFER_EX)(void* file, unsigned char* buffer, uint32_t size);
+typedef uint16_t (*FILESYSTEM_FILE_TRUNCATE)(void* file, uint32_t new_size);
+typedef uint16_t (*FILESYSTEM_FILE_COPY)(void* volume, char* src_filename, char* dst_filename);
+typedef uint16_t (*FILESYSTEM_FILE_SET_CHECKPOINT)(void* file, uint32_t bytes, uint32_t clusters, uint16_t seconds);
+typedef uint16_t (*FILESYSTEM_FILE_READ_BORROW)(void* file, uint32_t max_len, unsigned char** ptr, uint32_t* len);
+typedef uint16_t (*FILESYSTEM_FILE_READ_RELEASE)(void* file);
+typedef uint16_t (*FILESYSTEM_FILE_READ_STREAM)(void* file, unsigned char* buffer, uint32_t length, uint32_t* bytes_read, uint16_t* result, FILESYSTEM_STREAM_CALLBACK callback, void* callback_context);
 typedef uint16_t (*FILESYSTEM_FILE_READ)(void* file, unsigned char* buffer, uint32_t length, uint32_t* bytes_read);
 typedef uint16_t (*FILESYSTEM_FILE_READ_ASYNC)(void* file, unsigned char* buffer, uint32_t length, uint32_t* bytes_read, uint16_t* result, FILESYSTEM_ASYNC_CALLBACK callback, void* callback_context);
+typedef uint16_t (*FILESYSTEM_FILE_PREAD)(void* file, uint32_t offset, unsigned char* buffer, uint32_t length, uint32_t* bytes_read);
+typedef uint16_t (*FILESYSTEM_FILE_PWRITE)(void* file, uint32_t offset, unsigned char* buffer, uint32_t length);
 typedef uint16_t (*FILESYSTEM_FILE_FLUSH)(void* file);
 typedef uint16_t (*FILESYSTEM_FILE_CLOSE)(void* file);
 typedef uint16_t (*FILESYSTEM_GET_SECTOR_SIZE)(void* volume);
 typedef uint16_t (*FILESYSTEM_FILE_SET_BUFFER)(void* file, unsigned char* buffer);
+typedef uint16_t (*FILESYSTEM_FILE_SET_READ_AHEAD)(void* file, unsigned char* buffer, uint16_t depth);
 typedef uint16_t (*FILESYSTEM_GET_FILE_ENTRY)(void* volume, char* filename, void* file_entry);
 typedef uint32_t (*FILESYSTEM_FILE_GET_UNIQUE_ID)(void* file);
+typedef void (*FILESYSTEM_GET_ENTRY_TIMES)(void* dir_entry, time_t* create_time, time_t* modify_time, time_t* access_time);
 
 /*!
  * <summary>
@@ -137,6 +149,17 @@ typedef struct FILESYSTEM
 	FILESYSTEM_GET_FILE_ENTRY get_file_entry;
 	FILESYSTEM_FILE_GET_UNIQUE_ID file_get_unique_id;
 	FILESYSTEM_FILE_WRITE_STREAM file_write_stream;
+	FILESYSTEM_FILE_PREAD file_pread;
+	FILESYSTEM_FILE_PWRITE file_pwrite;
+	FILESYSTEM_FILE_SET_READ_AHEAD file_set_read_ahead;
+	FILESYSTEM_FILE_READ_STREAM file_read_stream;
+	FILESYSTEM_FILE_SET_BUFFER_EX file_set_buffer_ex;
+	FILESYSTEM_FILE_TRUNCATE file_truncate;
+	FILESYSTEM_FILE_COPY file_copy;
+	FILESYSTEM_FILE_SET_CHECKPOINT file_set_checkpoint;
+	FILESYSTEM_FILE_READ_BORROW file_read_borrow;
+	FILESYSTEM_FILE_READ_RELEASE file_read_release;
+	FILESYSTEM_GET_ENTRY_TIMES get_entry_times;
 }
 FILESYSTEM;
 
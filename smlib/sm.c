@@ -495,6 +495,41 @@ uint16_t sm_file_rename(char* original_filename, char* new_filename)
 	return volume->filesystem->file_rename(volume->volume, original_volume_path, new_volume_path);
 }
 
+/*
+// copies a file
+*/
+uint16_t sm_file_copy(char* src_filename, char* dst_filename)
+{
+	uint16_t ret;
+	SM_VOLUME* volume;
+	SM_VOLUME* volume_1;
+	char* src_volume_path;
+	char* dst_volume_path;
+	/*
+	// resolve paths
+	*/
+	ret = sm_resolve_path(src_filename, &volume, &src_volume_path);
+	if (ret != SM_SUCCESS)
+		return ret;
+	ret = sm_resolve_path(dst_filename, &volume_1, &dst_volume_path);
+	if (ret != SM_SUCCESS)
+		return ret;
+	/*
+	// make sure that both paths are on the same volume
+	*/
+	if (volume != volume_1)
+		return SM_OPERATION_NOT_SUPPORTED_ACCROSS_VOLUMES;
+	/*
+	// make sure the filesystem supports copying files
+	*/
+	if (!volume->filesystem->file_copy)
+		return FILESYSTEM_FEATURE_NOT_SUPPORTED;
+	/*
+	// call on the filesystem to perform the operation
+	*/
+	return volume->filesystem->file_copy(volume->volume, src_volume_path, dst_volume_path);
+}
+
 /*
 // opens a file
 */
@@ -666,6 +701,77 @@ uint16_t sm_file_set_buffer(SM_FILE* file, unsigned char* buffer)
 	return file->filesystem->file_set_buffer(file->filesystem_file_handle, buffer);
 }
 
+uint16_t sm_file_set_buffer_ex(SM_FILE* file, unsigned char* buffer, uint32_t size)
+{
+	/*
+	// check that we got a valid file handle
+	*/
+	if (!file)
+		return SM_INVALID_FILE_HANDLE;
+	if (file->magic != SM_FILE_HANDLE_MAGIC)
+		return SM_INVALID_FILE_HANDLE;
+	/*
+	// make sure the filesystem supports write-back buffers
+	*/
+	if (!file->filesystem->file_set_buffer_ex)
+		return FILESYSTEM_FEATURE_NOT_SUPPORTED;
+	/*
+	// if the file has a managed buffer free it
+	*/
+	if (file->managed_buffer)
+	{
+		free(file->managed_buffer);
+		file->managed_buffer = 0;
+	}
+	/*
+	// call on the filesystem to perform the operation
+	*/
+	return file->filesystem->file_set_buffer_ex(file->filesystem_file_handle, buffer, size);
+}
+
+/*
+// sets the checkpoint policy of a file
+*/
+uint16_t sm_file_set_checkpoint(SM_FILE* file, uint32_t bytes, uint32_t clusters, uint16_t seconds)
+{
+	/*
+	// check that we got a valid file handle
+	*/
+	if (!file)
+		return SM_INVALID_FILE_HANDLE;
+	if (file->magic != SM_FILE_HANDLE_MAGIC)
+		return SM_INVALID_FILE_HANDLE;
+	/*
+	// make sure the filesystem supports checkpoints
+	*/
+	if (!file->filesystem->file_set_checkpoint)
+		return FILESYSTEM_FEATURE_NOT_SUPPORTED;
+	/*
+	// call on the filesystem to perform the operation
+	*/
+	return file->filesystem->file_set_checkpoint(file->filesystem_file_handle, bytes, clusters, seconds);
+}
+
+uint16_t sm_file_set_read_ahead(SM_FILE* file, unsigned char* buffer, uint16_t depth)
+{
+	/*
+	// check that we got a valid file handle
+	*/
+	if (!file)
+		return SM_INVALID_FILE_HANDLE;
+	if (file->magic != SM_FILE_HANDLE_MAGIC)
+		return SM_INVALID_FILE_HANDLE;
+	/*
+	// make sure the filesystem supports read-ahead
+	*/
+	if (!file->filesystem->file_set_read_ahead)
+		return FILESYSTEM_FEATURE_NOT_SUPPORTED;
+	/*
+	// call on the filesystem to perform the operation
+	*/
+	return file->filesystem->file_set_read_ahead(file->filesystem_file_handle, buffer, depth);
+}
+
 /*
 // performs a seek operation on a file.
 */
@@ -684,6 +790,29 @@ uint16_t sm_file_seek(SM_FILE* file, uint32_t offset, char mode)
 	return file->filesystem->file_seek(file->filesystem_file_handle, offset, mode);
 }
 
+/*
+// shrinks a file
+*/
+uint16_t sm_file_truncate(SM_FILE* file, uint32_t new_size)
+{
+	/*
+	// check that we got a valid file handle
+	*/
+	if (!file)
+		return SM_INVALID_FILE_HANDLE;
+	if (file->magic != SM_FILE_HANDLE_MAGIC)
+		return SM_INVALID_FILE_HANDLE;
+	/*
+	// make sure the filesystem supports truncating files
+	*/
+	if (!file->filesystem->file_truncate)
+		return FILESYSTEM_FEATURE_NOT_SUPPORTED;
+	/*
+	// call on the filesystem to perform the operation
+	*/
+	return file->filesystem->file_truncate(file->filesystem_file_handle, new_size);
+}
+
 /*
 // writes data to a file.
 */
@@ -751,6 +880,32 @@ uint16_t sm_file_write_stream
 	return file->filesystem->file_write_stream(file->filesystem_file_handle, buffer, length, result, (SM_STREAM_CALLBACK) callback, callback_context);
 }
 
+uint16_t sm_file_read_stream
+(
+	SM_FILE* file, 
+	unsigned char* buffer, 
+	uint32_t length, 
+	uint32_t* bytes_read,
+	uint16_t* result, 
+	SM_STREAM_CALLBACK callback, 
+	void* callback_context
+)
+{
+	/*
+	// check that we got a valid file handle
+	*/
+	if (!file)
+		return SM_INVALID_FILE_HANDLE;
+	if (file->magic != SM_FILE_HANDLE_MAGIC)
+		return SM_INVALID_FILE_HANDLE;
+	if (!file->filesystem->file_read_stream)
+		return FILESYSTEM_FEATURE_NOT_SUPPORTED;
+	/*
+	// call on the filesystem to perform the operation
+	*/
+	return file->filesystem->file_read_stream(file->filesystem_file_handle, buffer, length, bytes_read, result, (SM_STREAM_CALLBACK) callback, callback_context);
+}
+
 
 /*
 // reads data from a file
@@ -798,6 +953,85 @@ uint16_t sm_file_read_async
 		file->filesystem_file_handle, buffer, length, bytes_read, result, (FILESYSTEM_ASYNC_CALLBACK) callback, callback_context);
 }
 
+/*
+// lends the data at the file pointer without copying it
+*/
+uint16_t sm_file_read_borrow(SM_FILE* file, uint32_t max_len, unsigned char** ptr, uint32_t* len)
+{
+	/*
+	// check that we got a valid file handle
+	*/
+	if (!file)
+		return SM_INVALID_FILE_HANDLE;
+	if (file->magic != SM_FILE_HANDLE_MAGIC)
+		return SM_INVALID_FILE_HANDLE;
+	/*
+	// make sure the filesystem supports borrowing
+	*/
+	if (!file->filesystem->file_read_borrow)
+		return FILESYSTEM_FEATURE_NOT_SUPPORTED;
+	/*
+	// call on the filesystem to perform the operation
+	*/
+	return file->filesystem->file_read_borrow(file->filesystem_file_handle, max_len, ptr, len);
+}
+
+/*
+// returns the data lent by sm_file_read_borrow
+*/
+uint16_t sm_file_read_release(SM_FILE* file)
+{
+	/*
+	// check that we got a valid file handle
+	*/
+	if (!file)
+		return SM_INVALID_FILE_HANDLE;
+	if (file->magic != SM_FILE_HANDLE_MAGIC)
+		return SM_INVALID_FILE_HANDLE;
+	if (!file->filesystem->file_read_release)
+		return FILESYSTEM_FEATURE_NOT_SUPPORTED;
+	/*
+	// call on the filesystem to perform the operation
+	*/
+	return file->filesystem->file_read_release(file->filesystem_file_handle);
+}
+
+/*
+// reads data from the specified offset of a file
+*/
+uint16_t sm_file_pread(SM_FILE* file, uint32_t offset, unsigned char* buffer, uint32_t length, uint32_t* bytes_read)
+{
+	/*
+	// check that we got a valid file handle
+	*/
+	if (!file)
+		return SM_INVALID_FILE_HANDLE;
+	if (file->magic != SM_FILE_HANDLE_MAGIC)
+		return SM_INVALID_FILE_HANDLE;
+	/*
+	// call on the filesystem to perform the operation
+	*/
+	return file->filesystem->file_pread(file->filesystem_file_handle, offset, buffer, length, bytes_read);
+}
+
+/*
+// writes data to the specified offset of a file
+*/
+uint16_t sm_file_pwrite(SM_FILE* file, uint32_t offset, unsigned char* buffer, uint32_t length)
+{
+	/*
+	// check that we got a valid file handle
+	*/
+	if (!file)
+		return SM_INVALID_FILE_HANDLE;
+	if (file->magic != SM_FILE_HANDLE_MAGIC)
+		return SM_INVALID_FILE_HANDLE;
+	/*
+	// call on the filesystem to perform the operation
+	*/
+	return file->filesystem->file_pwrite(file->filesystem_file_handle, offset, buffer, length);
+}
+
 /*
 // flushes file buffers
 */
@@ -829,7 +1063,6 @@ uint16_t sm_file_flush(SM_FILE* file)
 uint16_t sm_file_close(SM_FILE* file)
 {
 	uint16_t ret;
-	uint32_t file_id;
 	SM_OPEN_FILE** open_file;
 	/*
 	// check that we got a valid file handle
@@ -839,10 +1072,6 @@ uint16_t sm_file_close(SM_FILE* file)
 	if (file->magic != SM_FILE_HANDLE_MAGIC)
 		return SM_INVALID_FILE_HANDLE;
 	/*
-	// get the file id
-	*/
-	file_id = file->filesystem->file_get_unique_id(file->filesystem_file_handle);
-	/*
 	// call on the filesystem to perform the operation
 	*/
 	ret = file->filesystem->file_close(file->filesystem_file_handle);
@@ -865,14 +1094,14 @@ uint16_t sm_file_close(SM_FILE* file)
 	// remove the file from the locked files list
 	*/
 	#if defined(SM_SUPPORT_FILE_LOCKS)
-	_ASSERT(file_id);
 	/*
-	// try to find the file in the locked files list
+	// try to find the file in the locked files list. We look it up
+	// by handle since the id changes if the file is truncated to zero
 	*/
 	open_file = &open_files;
 	while ((*open_file))
 	{
-		if ((*open_file)->id == file_id)
+		if ((*open_file)->handle == file)
 		{
 			break;
 		}
@@ -934,9 +1163,16 @@ uint16_t sm_get_file_entry(char* filename, SM_DIRECTORY_ENTRY* entry)
 	*/
 	memcpy(entry->name, (void*)((uintptr_t) dir_entry + fs->dir_entry_name_offset), fs->dir_entry_name_size);
 	entry->size = *((uint32_t*) ((uintptr_t) dir_entry + fs->dir_entry_size_offset));
-	entry->create_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_create_time_offset));
-	entry->modify_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_modify_time_offset));
-	entry->access_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_access_time_offset));
+	if (fs->get_entry_times)
+	{
+		fs->get_entry_times(dir_entry, &entry->create_time, &entry->modify_time, &entry->access_time);
+	}
+	else
+	{
+		entry->create_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_create_time_offset));
+		entry->modify_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_modify_time_offset));
+		entry->access_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_access_time_offset));
+	}
 	entry->attributes = *((unsigned char*) ((uintptr_t) dir_entry + fs->dir_entry_attributes_offset));
 	/*
 	// free the filesystem entry
@@ -991,9 +1227,16 @@ uint16_t sm_find_first_entry(char* path, unsigned char attributes, SM_DIRECTORY_
 	*/
 	memcpy(entry->name, (void*)((uintptr_t) dir_entry + fs->dir_entry_name_offset), fs->dir_entry_name_size);
 	entry->size = *((uint32_t*) ((uintptr_t) dir_entry + fs->dir_entry_size_offset));
-	entry->create_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_create_time_offset));
-	entry->modify_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_modify_time_offset));
-	entry->access_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_access_time_offset));
+	if (fs->get_entry_times)
+	{
+		fs->get_entry_times(dir_entry, &entry->create_time, &entry->modify_time, &entry->access_time);
+	}
+	else
+	{
+		entry->create_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_create_time_offset));
+		entry->modify_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_modify_time_offset));
+		entry->access_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_access_time_offset));
+	}
 	entry->attributes = *((unsigned char*) ((uintptr_t) dir_entry + fs->dir_entry_attributes_offset));
 	/*
 	// return success
@@ -1024,9 +1267,16 @@ uint16_t sm_find_next_entry(SM_DIRECTORY_ENTRY* entry, SM_QUERY* query)
 	*/
 	memcpy(entry->name, (void*)((uintptr_t) dir_entry + fs->dir_entry_name_offset), fs->dir_entry_name_size);
 	entry->size = *((uint32_t*) ((uintptr_t) dir_entry + fs->dir_entry_size_offset));
-	entry->create_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_create_time_offset));
-	entry->modify_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_modify_time_offset));
-	entry->access_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_access_time_offset));
+	if (fs->get_entry_times)
+	{
+		fs->get_entry_times(dir_entry, &entry->create_time, &entry->modify_time, &entry->access_time);
+	}
+	else
+	{
+		entry->create_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_create_time_offset));
+		entry->modify_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_modify_time_offset));
+		entry->access_time = *((time_t*) ((uintptr_t) dir_entry + fs->dir_entry_access_time_offset));
+	}
 	entry->attributes = *((unsigned char*) ((uintptr_t) dir_entry + fs->dir_entry_attributes_offset));
 	/*
 	// return success
@@ -122,6 +122,13 @@
  * <summary>Specifies that the file should be optimized for flash stream writes.</summary>
  */
 #define SM_FILE_FLAG_OPTIMIZE_FOR_FLASH			(0x40)
+/*!
+ * <summary>
+ * Specifies that clusters should only be reserved when the file is written and
+ * allocated when the buffer set with sm_file_set_buffer_ex is written to the device.
+ * </summary>
+ */
+#define SM_FILE_FLAG_DELAYED_ALLOCATION			(0x80)
 
 /*
 // seek modes
@@ -542,6 +549,29 @@ uint16_t sm_file_rename
 	char* new_filename
 );
 
+/*!
+ * <summary>
+ * Copies a file.
+ * </summary>
+ * <param name="src_filename">The full path to the file to be copied.</param>
+ * <param name="dst_filename">
+ * The full path to the copy. If the file exists it will be overwritten.
+ * </param>
+ * <returns>
+ * If successful it will return FILESYSTEM_SUCCESS, otherwise one of
+ * the return codes defined in filesystem.h and sm.h
+ * </returns>
+ * <remarks>
+ * Both filenames need to be on the same volume. The data is copied between
+ * the clusters of both files without going through file buffers.
+ * </remarks>
+*/
+uint16_t sm_file_copy
+(
+	char* src_filename,
+	char* dst_filename
+);
+
 /*!
  * <summary>
  * Opens or creates a file for read and/or write access.
@@ -624,6 +654,27 @@ uint16_t sm_file_seek
 	char mode
 );
 
+/*!
+ * <summary>
+ * Shrinks a file to the specified size. The clusters that are no longer
+ * needed are freed. If the file pointer is past the new end of the file
+ * it is moved to the end.
+ * </summary>
+ * <param name="file">A file handle opened with write access.</param>
+ * <param name="new_size">
+ * The new size of the file. It cannot be larger than the current size.
+ * </param>
+ * <returns>
+ * If successful it will return FILESYSTEM_SUCCESS, otherwise one of the result
+ * codes defined on filesystem.h and sm.h.
+ * </returns>
+*/
+uint16_t sm_file_truncate
+(
+	SM_FILE* file,
+	uint32_t new_size
+);
+
 /*!
  * <summary>
  * Writes the specified number of bytes to a file synchronously
@@ -739,6 +790,50 @@ uint16_t sm_file_write_stream
 	void* callback_context
 );
 
+/*!
+ * <summary>
+ * Starts a stream read transfer. This is the counterpart of sm_file_write_stream.
+ * Every time the buffer is filled the callback function is invoked with the result
+ * pointer set to SM_AWAITING_DATA and bytes_read set to the amount of data in the
+ * buffer. You can then consume the data or swap buffers and set the response pointer
+ * to SM_STREAM_RESPONSE_READY to continue reading, to SM_STREAM_RESPONSE_SKIP to be
+ * called back later, or to SM_STREAM_RESPONSE_STOP to end the transfer. When the end
+ * of the file is reached or the transfer is stopped the callback is invoked once more
+ * with the result pointer set to SM_SUCCESS or an error code and bytes_read set to the
+ * amount of data left in the buffer.
+ * </summary>
+ * <param name="file">An open file handle.</param>
+ * <param name="buffer">The buffer where the data will be copied to.</param>
+ * <param name="length">The size of the buffer.</param>
+ * <param name="bytes_read">
+ * A pointer to a 32-bit integer where the number of bytes in the buffer is stored
+ * before each callback.
+ * </param>
+ * <param name="result">
+ * A pointer to a 16-bit integer where the result of the transfer will be stored.
+ * </param>
+ * <param name="callback">
+ * A function pointer to the callback function.
+ * </param>
+ * <param name="callback_context">
+ * A pointer that will be passed to the callback function.
+ * </param>
+ * <returns>
+ * If successful it will return FILESYSTEM_OP_IN_PROGRESS, otherwise it will return
+ * one of the result codes defined in filesystem.h or sm.h.
+ * </returns>
+ */
+uint16_t sm_file_read_stream
+(
+	SM_FILE* file, 
+	unsigned char* buffer, 
+	uint32_t length, 
+	uint32_t* bytes_read,
+	uint16_t* result, 
+	SM_STREAM_CALLBACK callback, 
+	void* callback_context
+);
+
 /*!
  * <summary>
  * Reads the specified number of bytes from the file.
@@ -747,7 +842,7 @@ uint16_t sm_file_write_stream
  * <param name="buffer">The buffer where the data will be written to.</param>
  * <param name="bytes_to_read">The number of bytes to be written.</param>
  * <param name="bytes_read">
- * A pointer to a 16-bit integer where the number of bytes read will be stored 
+ * A pointer to a 32-bit integer where the number of bytes read will be stored 
  * when the operation completes.
  * </param>
  * <returns>
@@ -803,6 +898,102 @@ uint16_t sm_file_read_async
 	void* callback_context
 );
 
+/*!
+ * <summary>
+ * Reads from the current position of a file without copying the data.
+ * </summary>
+ * <param name="file">An open file handle.</param>
+ * <param name="max_len">The maximum number of bytes to borrow.</param>
+ * <param name="ptr">A pointer to a pointer where the address of the data will be stored.</param>
+ * <param name="len">A pointer to a 32-bit integer where the number of bytes borrowed will be stored.</param>
+ * <returns>
+ * If successful it will return FILESYSTEM_SUCCESS, otherwise one of the
+ * error codes defined in filesystem.h or sm.h
+ * </returns>
+ * <remarks>
+ * The data belongs to the file's buffers and may be shorter than max_len. It
+ * stays valid and the file cannot be used until sm_file_read_release is called.
+ * At the end of the file len is set to zero.
+ * </remarks>
+ * <seealso cref="sm_file_read_release" />
+*/
+uint16_t sm_file_read_borrow
+(
+	SM_FILE* file,
+	uint32_t max_len,
+	unsigned char** ptr,
+	uint32_t* len
+);
+
+/*!
+ * <summary>
+ * Returns the data borrowed by sm_file_read_borrow to the file.
+ * </summary>
+ * <param name="file">An open file handle.</param>
+ * <returns>
+ * If successful it will return FILESYSTEM_SUCCESS, otherwise one of the
+ * error codes defined in filesystem.h or sm.h
+ * </returns>
+ * <seealso cref="sm_file_read_borrow" />
+*/
+uint16_t sm_file_read_release
+(
+	SM_FILE* file
+);
+
+/*!
+ * <summary>
+ * Reads the specified number of bytes from the specified offset of a file
+ * without moving the file pointer.
+ * </summary>
+ * <param name="file">An open file handle.</param>
+ * <param name="offset">The offset within the file where the read begins.</param>
+ * <param name="buffer">The buffer where the data will be written to.</param>
+ * <param name="bytes_to_read">The number of bytes to be read.</param>
+ * <param name="bytes_read">
+ * A pointer to a 32-bit integer where the number of bytes read will be stored 
+ * when the operation completes.
+ * </param>
+ * <returns>
+ * If successful it will return FILESYSTEM_SUCCESS, otherwise one of the
+ * error codes defined in filesystem.h or sm.h
+ * </returns>
+ * <seealso cref="sm_file_read" />
+*/
+uint16_t sm_file_pread
+(
+	SM_FILE* file, 
+	uint32_t offset,
+	unsigned char* buffer, 
+	uint32_t bytes_to_read, 
+	uint32_t* bytes_read
+);
+
+/*!
+ * <summary>
+ * Writes the specified number of bytes to the specified offset of a file
+ * without moving the file pointer.
+ * </summary>
+ * <param name="file">An open file handle.</param>
+ * <param name="offset">
+ * The offset within the file where the write begins. It cannot be past the end of the file.
+ * </param>
+ * <param name="buffer">The buffer containing the data to be written.</param>
+ * <param name="bytes_to_write">The number of bytes to write</param>
+ * <returns>
+ * If successful it will return FILESYSTEM_SUCCESS, otherwise it will return
+ * one of the result codes defined in filesystem.h or sm.h.
+ * </returns>
+ * <seealso cref="sm_file_write" />
+*/
+uint16_t sm_file_pwrite
+(
+	SM_FILE* file, 
+	uint32_t offset,
+	unsigned char* buffer, 
+	uint32_t bytes_to_write
+);
+
 /*!
  * <summary>
  * Flushes the file buffer to the drive and updates the file size and timestamps.
@@ -853,4 +1044,78 @@ uint16_t sm_file_set_buffer
 	unsigned char* buffer
 );
 
+/*!
+ * <summary>
+ * Sets a multi-sector file buffer. Small writes are gathered on this
+ * buffer and written to the device a whole buffer at a time instead of
+ * one sector at a time. Sectors that are still on the buffer are written
+ * when the file is flushed or closed.
+ * </summary>
+ * <param name="file">An open file handle.</param>
+ * <param name="buffer">
+ * The new file buffer. It must remain valid until the file is closed.
+ * </param>
+ * <param name="size">The size of the buffer in bytes.</param>
+ * <returns>
+ * If successful it will return FILESYSTEM_SUCCESS, otherwise one of the result
+ * codes defined on filesystem.h and sm.h.
+ * </returns>
+*/
+uint16_t sm_file_set_buffer_ex
+(
+	SM_FILE* file,
+	unsigned char* buffer,
+	uint32_t size
+);
+
+/*!
+ * <summary>
+ * Sets the checkpoint policy of a file. While the file is written its
+ * directory entry is updated to cover the data already written to the
+ * device every time it grows by the specified number of bytes or clusters,
+ * or when it grows after the specified number of seconds have elapsed since
+ * the last update, so a power loss only loses the data written since then.
+ * </summary>
+ * <param name="file">An open file handle.</param>
+ * <param name="bytes">The number of bytes between checkpoints, or 0.</param>
+ * <param name="clusters">The number of clusters between checkpoints, or 0.</param>
+ * <param name="seconds">The number of seconds between checkpoints, or 0.</param>
+ * <returns>
+ * If successful it will return FILESYSTEM_SUCCESS, otherwise one of the result
+ * codes defined on filesystem.h and sm.h.
+ * </returns>
+*/
+uint16_t sm_file_set_checkpoint
+(
+	SM_FILE* file,
+	uint32_t bytes,
+	uint32_t clusters,
+	uint16_t seconds
+);
+
+/*!
+ * <summary>
+ * Sets the read-ahead buffer of a file. When the file is read sequentially
+ * with sm_file_read_async the filesystem will prefetch the sectors that follow
+ * the file pointer into this buffer so that the next read doesn't have
+ * to wait for the device.
+ * </summary>
+ * <param name="file">An open file handle.</param>
+ * <param name="buffer">
+ * A buffer large enough to hold depth sectors of the volume or NULL
+ * to disable read-ahead. The buffer must remain valid until the file is closed.
+ * </param>
+ * <param name="depth">The number of sectors that fit in the buffer.</param>
+ * <returns>
+ * If successful it will return FILESYSTEM_SUCCESS, otherwise one of the result
+ * codes defined on filesystem.h and sm.h.
+ * </returns>
+*/
+uint16_t sm_file_set_read_ahead
+(
+	SM_FILE* file,
+	unsigned char* buffer,
+	uint16_t depth
+);
+
 #endif
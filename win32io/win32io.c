@@ -48,9 +48,20 @@ HANDLE h;
 HANDLE hAsyncEvent;
 HANDLE hAsyncThread;
 DWORD last_sector = 0;
-WIN32IO_ASYNC_PARAMS async_args;
+CRITICAL_SECTION io_lock;
 char runAsync = 1;
 
+//
+// queue of pending async requests. Each file handle has at most
+// one request outstanding so this only needs to be as deep as the
+// number of streams that may run at the same time
+//
+#define WIN32IO_MAX_ASYNC_REQUESTS		16
+CRITICAL_SECTION async_lock;
+WIN32IO_ASYNC_PARAMS async_queue[WIN32IO_MAX_ASYNC_REQUESTS];
+int async_queue_head = 0;
+int async_queue_count = 0;
+
 typedef struct WIN32IO_MULTI_BLOCK_CONTEXT
 {
 	void* device;
@@ -66,6 +77,9 @@ WIN32IO_MULTI_BLOCK_CONTEXT;
 static void win32io_write_multiple_blocks_callback(WIN32IO_MULTI_BLOCK_CONTEXT* context, uint16_t* result);
 static uint16_t win32io_write_multiple_blocks(
 	void* device, uint32_t sector_address, unsigned char* buffer, uint16_t* async_state, STORAGE_CALLBACK_INFO_EX* callback_info);
+static void win32io_read_multiple_blocks_callback(WIN32IO_MULTI_BLOCK_CONTEXT* context, uint16_t* result);
+static uint16_t win32io_read_multiple_blocks(
+	void* device, uint32_t sector_address, unsigned char* buffer, uint16_t* async_state, STORAGE_CALLBACK_INFO_EX* callback_info);
 
 //
 // STORAGE_DEVICE interface functions
@@ -73,6 +87,9 @@ static uint16_t win32io_write_multiple_blocks(
 static uint16_t win32io_read_sector(void* device, uint32_t sector_address, unsigned char* buffer);
 static uint16_t win32io_read_sector_async(void* device, uint32_t sector_address, unsigned char* buffer, uint16_t* async_state, PSTORAGE_CALLBACK_INFO callback_info);
 static uint16_t win32io_write_sector(void* device, uint32_t sector_address, unsigned char* buffer);
+static uint16_t win32io_zero_sectors(void* device, uint32_t start_sector_address, uint32_t end_sector_address);
+static uint16_t win32io_read_sectors(void* device, uint32_t start_sector_address, uint32_t end_sector_address, unsigned char* buffer);
+static uint16_t win32io_write_sectors(void* device, uint32_t start_sector_address, uint32_t end_sector_address, unsigned char* buffer);
 static uint16_t win32io_write_sector_async(void* device, uint32_t sector_address, unsigned char* buffer, uint16_t* async_state, PSTORAGE_CALLBACK_INFO callback_info);
 static uint16_t win32io_get_sector_size(void* device);
 static uint32_t win32io_get_sector_count(void* device);
@@ -81,6 +98,8 @@ static uint32_t win32io_get_sector_count(void* device);
 // async call worker
 //
 static void win32io_async_worker();
+static void win32io_queue_request(
+	void* device, uint32_t sector_address, unsigned char* buffer, uint16_t* async_state, PSTORAGE_CALLBACK_INFO callback_info, char write);
 
 //
 // gets the STORAGE_DEVICE interface used by the filesystem
@@ -103,6 +122,10 @@ void win32io_get_storage_device(TCHAR* physical_drive, STORAGE_DEVICE* device)
 	device->write_sector_async		= (STORAGE_DEVICE_WRITE_ASYNC) &win32io_write_sector_async;
 	device->get_total_sectors		= (STORAGE_DEVICE_GET_SECTOR_COUNT) &win32io_get_sector_count;
 	device->write_multiple_sectors	= (STORAGE_DEVICE_WRITE_MULTIPLE_SECTORS) &win32io_write_multiple_blocks;
+	device->read_multiple_sectors	= (STORAGE_DEVICE_READ_MULTIPLE_SECTORS) &win32io_read_multiple_blocks;
+	device->zero_sectors			= (STORAGE_DEVICE_ZERO_SECTORS) &win32io_zero_sectors;
+	device->read_sectors			= (STORAGE_DEVICE_READ_SECTORS) &win32io_read_sectors;
+	device->write_sectors			= (STORAGE_DEVICE_WRITE_SECTORS) &win32io_write_sectors;
 
 	h = CreateFile((TCHAR*) physical_drive, GENERIC_READ | GENERIC_WRITE, 
 		FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
@@ -144,6 +167,10 @@ void win32io_get_storage_device(TCHAR* physical_drive, STORAGE_DEVICE* device)
 	}
 
 	runAsync = 1;
+	InitializeCriticalSection(&io_lock);
+	InitializeCriticalSection(&async_lock);
+	async_queue_head = 0;
+	async_queue_count = 0;
 	hAsyncEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
 	hAsyncThread = CreateThread(
 						NULL, 
@@ -164,6 +191,8 @@ void win32io_release_storage_device()
 	runAsync = 0;
 	SetEvent(hAsyncEvent);
 	CloseHandle(hAsyncThread);
+	DeleteCriticalSection(&io_lock);
+	DeleteCriticalSection(&async_lock);
 }
 
 //
@@ -175,14 +204,23 @@ static uint16_t win32io_read_sector(void* device, uint32_t sector_address, unsig
 	WIN32IO_DEVICE* dev = device;
 	DWORD sector = sector_address * win32io_get_sector_size(device);
 	DWORD bytes_to_read = win32io_get_sector_size(device);
+	BOOL result;
 
+	//
+	// the filesystem may read synchronously while an async
+	// request is being serviced by the worker thread (ie. FAT reads
+	// during a read-ahead) so we serialize access to the file pointer
+	//
+	EnterCriticalSection(&io_lock);
 	if (sector != (last_sector + win32io_get_sector_size(device)))
 	{
 		SetFilePointer(h, sector, NULL, FILE_BEGIN);
 	}
 	last_sector = sector;
+	result = ReadFile(h, buffer, bytes_to_read, &bytes_read, NULL);
+	LeaveCriticalSection(&io_lock);
 
-	if (!ReadFile(h, buffer, bytes_to_read, &bytes_read, NULL))
+	if (!result)
 		return STORAGE_COMMUNICATION_ERROR;
 
 	if (bytes_read < win32io_get_sector_size(device))
@@ -200,6 +238,7 @@ static uint16_t win32io_write_sector(void* device, uint32_t sector_address, unsi
 	WIN32IO_DEVICE* dev = device;
 	DWORD sector = sector_address * win32io_get_sector_size(device);
 
+	EnterCriticalSection(&io_lock);
 	if (sector != (last_sector + win32io_get_sector_size(device)))
 	{
 		SetFilePointer(h, sector, NULL, FILE_BEGIN);
@@ -207,6 +246,7 @@ static uint16_t win32io_write_sector(void* device, uint32_t sector_address, unsi
 	last_sector = sector;
 	
 	WriteFile(h, buffer, win32io_get_sector_size(device), &bytes_written, NULL);
+	LeaveCriticalSection(&io_lock);
 
 	if (bytes_written < win32io_get_sector_size(device))
 	{
@@ -217,6 +257,93 @@ static uint16_t win32io_write_sector(void* device, uint32_t sector_address, unsi
 	return STORAGE_SUCCESS;
 }
 
+//
+// zeroes a range of sectors with a single write
+//
+static uint16_t win32io_zero_sectors(void* device, uint32_t start_sector_address, uint32_t end_sector_address)
+{
+	DWORD bytes_written = 0;
+	DWORD length = (end_sector_address - start_sector_address + 1) * win32io_get_sector_size(device);
+	DWORD sector = start_sector_address * win32io_get_sector_size(device);
+	unsigned char* zeroes = calloc(1, length);
+
+	if (!zeroes)
+		return STORAGE_COMMUNICATION_ERROR;
+
+	EnterCriticalSection(&io_lock);
+	if (sector != (last_sector + win32io_get_sector_size(device)))
+	{
+		SetFilePointer(h, sector, NULL, FILE_BEGIN);
+	}
+	last_sector = sector + length - win32io_get_sector_size(device);
+
+	WriteFile(h, zeroes, length, &bytes_written, NULL);
+	LeaveCriticalSection(&io_lock);
+	free(zeroes);
+
+	if (bytes_written < length)
+	{
+		printf("win32io: Zero operation on sectors %x-%x failed!\n", start_sector_address, end_sector_address);
+		return STORAGE_COMMUNICATION_ERROR;
+	}
+
+	return STORAGE_SUCCESS;
+}
+
+//
+// reads a range of sectors with a single read
+//
+static uint16_t win32io_read_sectors(void* device, uint32_t start_sector_address, uint32_t end_sector_address, unsigned char* buffer)
+{
+	DWORD bytes_read = 0;
+	DWORD length = (end_sector_address - start_sector_address + 1) * win32io_get_sector_size(device);
+	DWORD sector = start_sector_address * win32io_get_sector_size(device);
+	BOOL result;
+
+	EnterCriticalSection(&io_lock);
+	if (sector != (last_sector + win32io_get_sector_size(device)))
+	{
+		SetFilePointer(h, sector, NULL, FILE_BEGIN);
+	}
+	last_sector = sector + length - win32io_get_sector_size(device);
+
+	result = ReadFile(h, buffer, length, &bytes_read, NULL);
+	LeaveCriticalSection(&io_lock);
+
+	if (!result || bytes_read < length)
+		return STORAGE_COMMUNICATION_ERROR;
+
+	return STORAGE_SUCCESS;
+}
+
+//
+// writes a range of sectors with a single write
+//
+static uint16_t win32io_write_sectors(void* device, uint32_t start_sector_address, uint32_t end_sector_address, unsigned char* buffer)
+{
+	DWORD bytes_written = 0;
+	DWORD length = (end_sector_address - start_sector_address + 1) * win32io_get_sector_size(device);
+	DWORD sector = start_sector_address * win32io_get_sector_size(device);
+
+	EnterCriticalSection(&io_lock);
+	if (sector != (last_sector + win32io_get_sector_size(device)))
+	{
+		SetFilePointer(h, sector, NULL, FILE_BEGIN);
+	}
+	last_sector = sector + length - win32io_get_sector_size(device);
+
+	WriteFile(h, buffer, length, &bytes_written, NULL);
+	LeaveCriticalSection(&io_lock);
+
+	if (bytes_written < length)
+	{
+		printf("win32io: Write operation on sectors %x-%x failed!\n", start_sector_address, end_sector_address);
+		return STORAGE_COMMUNICATION_ERROR;
+	}
+
+	return STORAGE_SUCCESS;
+}
+
 //
 // fires a new thread to call win32io_read_sector.
 // this emulates the hardware driver asynchronous IO support.
@@ -224,17 +351,7 @@ static uint16_t win32io_write_sector(void* device, uint32_t sector_address, unsi
 static uint16_t win32io_read_sector_async(
 	void* device, uint32_t sector_address, unsigned char* buffer, uint16_t* async_state, PSTORAGE_CALLBACK_INFO callback_info)
 {
-	async_args.device = device;
-	async_args.sector_address = sector_address; 
-	async_args.buffer = buffer;
-	async_args.async_state = async_state;
-	async_args.callback_info = callback_info;
-	async_args.write = 0;
-	/*
-	// start async op
-	*/
-	SetEvent(hAsyncEvent);
-
+	win32io_queue_request(device, sector_address, buffer, async_state, callback_info, 0);
 	return STORAGE_OP_IN_PROGRESS;
 }
 
@@ -245,18 +362,38 @@ static uint16_t win32io_read_sector_async(
 static uint16_t win32io_write_sector_async(
 	void* device, uint32_t sector_address, unsigned char* buffer, uint16_t* async_state, PSTORAGE_CALLBACK_INFO callback_info)
 {
-	async_args.device = device;
-	async_args.sector_address = sector_address;
-	async_args.buffer = buffer;
-	async_args.async_state = async_state;
-	async_args.callback_info = callback_info;
-	async_args.write = 1;
+	win32io_queue_request(device, sector_address, buffer, async_state, callback_info, 1);
+	return STORAGE_OP_IN_PROGRESS;
+}
+
+//
+// queues an async request and signals the worker thread
+//
+static void win32io_queue_request(
+	void* device, uint32_t sector_address, unsigned char* buffer, uint16_t* async_state, PSTORAGE_CALLBACK_INFO callback_info, char write)
+{
+	WIN32IO_ASYNC_PARAMS* args;
+
+	EnterCriticalSection(&async_lock);
+	while (async_queue_count == WIN32IO_MAX_ASYNC_REQUESTS)
+	{
+		LeaveCriticalSection(&async_lock);
+		Sleep(1);
+		EnterCriticalSection(&async_lock);
+	}
+	args = &async_queue[(async_queue_head + async_queue_count) % WIN32IO_MAX_ASYNC_REQUESTS];
+	args->device = device;
+	args->sector_address = sector_address;
+	args->buffer = buffer;
+	args->async_state = async_state;
+	args->callback_info = callback_info;
+	args->write = write;
+	async_queue_count++;
+	LeaveCriticalSection(&async_lock);
 	//
 	// start async op
 	//
 	SetEvent(hAsyncEvent);
-
-	return STORAGE_OP_IN_PROGRESS;
 }
 
 /*
@@ -327,6 +464,68 @@ do_it_again:
 	}
 }
 
+/*
+// emulates a multiple block read. Like the write emulation above it
+// only exists to test the streaming read code in windows.
+*/
+static uint16_t win32io_read_multiple_blocks(
+	void* device, uint32_t sector_address, unsigned char* buffer, uint16_t* async_state, STORAGE_CALLBACK_INFO_EX* callback_info)
+{
+	WIN32IO_MULTI_BLOCK_CONTEXT* context = GlobalAlloc(GPTR, sizeof(WIN32IO_MULTI_BLOCK_CONTEXT));
+
+	context->device = device;
+	context->sector_address = sector_address + 1;
+	context->buffer = buffer;
+	context->async_state = async_state;
+	context->callback_info = *callback_info;
+	context->cinfo.Callback = &win32io_read_multiple_blocks_callback;
+	context->cinfo.Context = context;
+
+	return win32io_read_sector_async(device, sector_address, buffer, async_state, &context->cinfo);
+}
+
+static void win32io_read_multiple_blocks_callback(WIN32IO_MULTI_BLOCK_CONTEXT* context, uint16_t* result)
+{
+	uint16_t response;
+
+	/*
+	// if the read failed end the transfer
+	*/
+	if (*context->async_state != STORAGE_SUCCESS)
+	{
+		response = STORAGE_MULTI_SECTOR_RESPONSE_STOP;
+		if (context->callback_info.Callback)
+			context->callback_info.Callback(context->callback_info.Context, context->async_state, &(context->buffer), &response);
+		GlobalFree(context);
+		return;
+	}
+	
+do_it_again:
+	response = STORAGE_MULTI_SECTOR_RESPONSE_STOP;
+	*context->async_state = STORAGE_AWAITING_DATA;
+
+	if (context->callback_info.Callback)
+		context->callback_info.Callback(context->callback_info.Context, context->async_state, &(context->buffer), &response);
+
+	switch  (response)
+	{
+		case STORAGE_MULTI_SECTOR_RESPONSE_READY:
+			win32io_read_sector_async(context->device, context->sector_address++, context->buffer, context->async_state, &context->cinfo);
+			break;
+		case STORAGE_MULTI_SECTOR_RESPONSE_SKIP:
+			Sleep(500);
+			goto do_it_again;
+		case STORAGE_MULTI_SECTOR_RESPONSE_STOP:
+		default:
+			*context->async_state = STORAGE_SUCCESS;
+			if (context->callback_info.Callback)
+				context->callback_info.Callback(context->callback_info.Context, context->async_state, &(context->buffer), &response);
+
+			GlobalFree(context);
+			break;
+	}
+}
+
 	
 	
 //
@@ -353,12 +552,28 @@ static uint32_t win32io_get_sector_count(void* device)
 */
 static void win32io_async_worker()
 {
-	DWORD bytes_written;
+	WIN32IO_ASYNC_PARAMS async_args;
 
 	WaitForSingleObject(hAsyncEvent, INFINITE);
 
 	while (runAsync)
 	{
+		//
+		// take the next request off the queue. If the queue is
+		// empty wait until a new one is queued
+		//
+		EnterCriticalSection(&async_lock);
+		if (!async_queue_count)
+		{
+			LeaveCriticalSection(&async_lock);
+			WaitForSingleObject(hAsyncEvent, INFINITE);
+			continue;
+		}
+		async_args = async_queue[async_queue_head];
+		async_queue_head = (async_queue_head + 1) % WIN32IO_MAX_ASYNC_REQUESTS;
+		async_queue_count--;
+		LeaveCriticalSection(&async_lock);
+
 		if (async_args.write)
 		{
 			*async_args.async_state = win32io_write_sector(async_args.device, async_args.sector_address, async_args.buffer);
@@ -370,7 +585,5 @@ static void win32io_async_worker()
 		}
 		if (async_args.callback_info->Callback)
 			async_args.callback_info->Callback(async_args.callback_info->Context, async_args.async_state);
-
-		WaitForSingleObject(hAsyncEvent, INFINITE);
 	}
 }
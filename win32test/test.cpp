@@ -81,6 +81,16 @@ static void test_directory_struct();
 static void test_write_file(char prealloc);
 static void test_read_file();
 static void test_append_file(char prealloc);
+static void test_append_reopen();
+static void test_truncate_file();
+static void test_overwrite_file();
+static void test_copy_file();
+#if defined(FAT_CHECKPOINTS)
+static void test_checkpoint_file();
+#endif
+static void test_borrow_file();
+static void test_dentry_cache();
+static void test_short_names();
 static void test_create_100_files();
 static void test_seek_file();
 static void test_delete_file();
@@ -88,9 +98,18 @@ static void test_rename_file();
 static void test_dir_listing();
 static void test_write_file_async();
 static void write_file_async_callback(CALLBACK_CONTEXT* context, uint16_t* result);
+#if defined(FAT_WRITE_BACK)
+static void test_write_file_write_back();
+static void test_write_file_delayed_allocation();
+#endif
 static char test_chkdsk();
 static void format_filesize(uint32_t filesize, char* output);
 static void test_read_file_async();
+#if defined(FAT_READ_AHEAD)
+static void test_read_file_read_ahead();
+#endif
+static void test_read_stream();
+static void test_read_stream_callback(CALLBACK_CONTEXT* context, uint16_t* result, unsigned char** buffer, uint16_t* action);
 static void read_file_async_callback(CALLBACK_CONTEXT* context, uint16_t* result);
 static void test_read_file_unbuffered();
 static void test_write_file_unbuffered(char prealloc);
@@ -98,7 +117,25 @@ static void test_another_async_write_callback(SM_FILE* file, uint16_t* result);
 static void test_another_async_write();
 static void test_write_stream();
 static void test_write_stream_callback(SM_FILE* file, uint16_t* result, unsigned char** buffer, uint16_t* action);
+static void test_concurrent_streams();
 static void test_check_file(unsigned char* filename);
+static void test_positional_io();
+static void test_delete_tree();
+static void test_compact_directory();
+static void test_pwrite_after_read();
+static void test_direct_transfer();
+static void test_large_transfer();
+static void test_create_files();
+#if defined(FAT_DIRECTORY_INDEX)
+static void test_directory_index();
+#endif
+static void test_zero_fill();
+static void test_query_read_sectors();
+static void test_query_filter();
+static void test_entry_times();
+static void test_long_names();
+static uint16_t test_query_filter_list(FAT_QUERY_FILTER* filter, char* names);
+static uint16_t test_query_read_sectors_hook(void* driver, uint32_t start, uint32_t end, unsigned char* buffer);
 
 
 int cmd_test(char* args)
@@ -182,23 +219,62 @@ int cmd_test(char* args)
 		test_create_100_files();
 		test_write_file_async();
 		test_another_async_write();
+		#if defined(FAT_WRITE_BACK)
+		test_write_file_write_back();
+		test_write_file_delayed_allocation();
+		#endif
 		test_write_file_unbuffered(1);
 		test_read_file_unbuffered();
 		test_write_file(1);
 		test_read_file();
 		test_read_file_async();
+		#if defined(FAT_READ_AHEAD)
+		test_read_file_read_ahead();
+		#endif
+		test_read_stream();
 		test_append_file(1);	
+		test_append_reopen();
+		test_truncate_file();
+		test_overwrite_file();
+		test_copy_file();
+		#if defined(FAT_CHECKPOINTS)
+		test_checkpoint_file();
+		#endif
+		test_borrow_file();
+		test_dentry_cache();
+		test_short_names();
 		test_seek_file();
+		test_positional_io();
 		test_rename_file();
 		test_write_file(1);
 		test_delete_file();	
 		test_write_stream();
+		test_concurrent_streams();
 		test_dir_listing();
 		
 		/*
 		// release the lock on the volume
 		*/
 		sm_dismount_volume("x:");
+		/*
+		// perform the tests that use fat32lib directly
+		*/
+		fat_mount_volume(&fat_volume, &storage_device);
+		test_delete_tree();
+		test_compact_directory();
+		test_pwrite_after_read();
+		test_direct_transfer();
+		test_large_transfer();
+		test_create_files();
+		#if defined(FAT_DIRECTORY_INDEX)
+		test_directory_index();
+		#endif
+		test_zero_fill();
+		test_query_read_sectors();
+		test_query_filter();
+		test_entry_times();
+		test_long_names();
+		fat_dismount_volume(&fat_volume);
 		win32io_release_storage_device();
 		
 		printf("\n\n");
@@ -800,6 +876,155 @@ static void write_file_async_callback(CALLBACK_CONTEXT* context, uint16_t* resul
 	}
 }
 
+#if defined(FAT_WRITE_BACK)
+static void test_write_file_write_back()
+{
+	static unsigned char wbbuff[16 * 512];
+	CALLBACK_CONTEXT context;
+	unsigned char buff[1024];
+	uint32_t bytes_read;
+	uint16_t r;
+	FILE* f;
+	size_t i, sz;
+
+	context.completed = 0;
+	printf("Writing file asynchronously with write-back buffer...");
+	time(&context.start);
+	/*
+	// write the local file to the device through a 16 sectors buffer
+	*/
+	context.f = fopen(LOCAL_FILE, "rb");
+	r = sm_file_open(&context.file, "x:\\mrt_wb.exe", SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_OVERWRITE);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		fclose(context.f);
+		return;
+	}
+	r = sm_file_set_buffer_ex(&context.file, wbbuff, sizeof(wbbuff));
+	if (r != SM_SUCCESS)
+	{
+		printf("Error setting buffer: 0x%x\n", r);
+		fclose(context.f);
+		sm_file_close(&context.file);
+		return;
+	}
+	context.bytes_written = 0;		
+	context.bytes_read = fread(context.buff, 1, 1024, context.f);
+	r = sm_file_write_async(&context.file, context.buff, context.bytes_read, &context.result, &write_file_async_callback, &context);
+	while (!context.completed)
+		Sleep(1);
+	/*
+	// read it back and compare it with the original
+	*/
+	r = sm_file_open(&context.file, "x:\\mrt_wb.exe", SM_FILE_ACCESS_READ);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		return;
+	}
+	f = fopen(LOCAL_FILE, "rb");
+	do
+	{
+		r = sm_file_read(&context.file, buff, 1024, &bytes_read);
+		sz = fread(context.buff, 1, 1024, f);
+		if (r != SM_SUCCESS || bytes_read != sz)
+		{
+			printf("Files don't match!\n");
+			break;
+		}
+		for (i = 0; i < sz; i++)
+		{
+			if (buff[i] != context.buff[i])
+				break;
+		}
+		if (i < sz)
+		{
+			printf("Files don't match!\n");
+			break;
+		}
+	}
+	while (sz);
+	fclose(f);
+	sm_file_close(&context.file);
+}
+
+static void test_write_file_delayed_allocation()
+{
+	static unsigned char wbbuff[16 * 512];
+	static unsigned char buff[1000], buff2[1000];
+	SM_FILE file;
+	uint32_t bytes_read;
+	uint16_t r;
+	FILE* f;
+	size_t i, sz;
+
+	printf("Writing file with delayed allocation...");
+	/*
+	// write the local file in chunks that don't line up with
+	// the sectors so the clusters are allocated as the buffer fills
+	*/
+	r = sm_file_open(&file, "x:\\mrt_da.exe", SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_OVERWRITE | SM_FILE_FLAG_DELAYED_ALLOCATION);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		return;
+	}
+	r = sm_file_set_buffer_ex(&file, wbbuff, sizeof(wbbuff));
+	if (r != SM_SUCCESS)
+	{
+		printf("Error setting buffer: 0x%x\n", r);
+		sm_file_close(&file);
+		return;
+	}
+	f = fopen(LOCAL_FILE, "rb");
+	while ((sz = fread(buff, 1, sizeof(buff), f)) != 0)
+	{
+		r = sm_file_write(&file, buff, (uint32_t) sz);
+		if (r != SM_SUCCESS)
+		{
+			printf("Error writing file: 0x%x\n", r);
+			break;
+		}
+	}
+	fclose(f);
+	r = sm_file_close(&file);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error closing file: 0x%x\n", r);
+		return;
+	}
+	/*
+	// read it back and compare it with the original
+	*/
+	r = sm_file_open(&file, "x:\\mrt_da.exe", SM_FILE_ACCESS_READ);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		return;
+	}
+	f = fopen(LOCAL_FILE, "rb");
+	do
+	{
+		r = sm_file_read(&file, buff, sizeof(buff), &bytes_read);
+		sz = fread(buff2, 1, sizeof(buff2), f);
+		if (r != SM_SUCCESS || bytes_read != sz)
+			break;
+		for (i = 0; i < sz; i++)
+		{
+			if (buff[i] != buff2[i])
+				break;
+		}
+		if (i < sz)
+			break;
+	}
+	while (sz);
+	fclose(f);
+	sm_file_close(&file);
+	printf(sz ? "Files don't match!\n" : "Completed.\n");
+}
+#endif
+
 static void test_read_file_async()
 {
 	CALLBACK_CONTEXT context;
@@ -823,6 +1048,148 @@ static void test_read_file_async()
 
 }
 
+#if defined(FAT_READ_AHEAD)
+static void test_read_file_read_ahead()
+{
+	static unsigned char ring[8 * 512];
+	CALLBACK_CONTEXT context;
+	uint16_t ret;
+	FILE* f1;
+	FILE* f2;
+	int c1, c2;
+
+	printf("Reading file asynchronously with read-ahead...");
+	/*
+	// read the file with an 8 sectors read-ahead ring and
+	// write it to the local filesystem
+	*/
+	context.completed = 0;
+	context.bytes_read = 0;
+	ret = sm_file_open(&context.file, "x:\\mrt.exe", SM_FILE_ACCESS_READ);
+	if (ret != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", ret);
+		return;
+	}
+	ret = sm_file_set_read_ahead(&context.file, ring, 8);
+	if (ret != SM_SUCCESS)
+	{
+		printf("Error setting read-ahead buffer: 0x%x\n", ret);
+		sm_file_close(&context.file);
+		return;
+	}
+	context.f = fopen(LOCAL_FOLDER "mrt_ra.exe", "wb");
+
+	sm_file_read_async(&context.file, context.buff, 1024, &context.bytes_read, &context.result, &read_file_async_callback, &context);
+
+	while(!context.completed)
+		Sleep(1);
+	/*
+	// compare the copy with the original
+	*/
+	f1 = fopen(LOCAL_FILE, "rb");
+	f2 = fopen(LOCAL_FOLDER "mrt_ra.exe", "rb");
+	do
+	{
+		c1 = fgetc(f1);
+		c2 = fgetc(f2);
+	}
+	while (c1 == c2 && c1 != EOF);
+	fclose(f1);
+	fclose(f2);
+
+	if (c1 != c2)
+	{
+		printf("Files don't match!\n");
+		return;
+	}
+	printf("Completed.\n");
+}
+#endif
+
+static uint32_t read_stream_bytes;
+
+static void test_read_stream()
+{
+	CALLBACK_CONTEXT context;
+	uint16_t ret;
+	FILE* f1;
+	FILE* f2;
+	int c1, c2;
+
+	printf("Reading stream...");
+	/*
+	// stream the file to the local filesystem
+	*/
+	context.completed = 0;
+	ret = sm_file_open(&context.file, "x:\\mrt.exe", SM_FILE_ACCESS_READ);
+	if (ret != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", ret);
+		return;
+	}
+	context.f = fopen(LOCAL_FOLDER "mrt_st.exe", "wb");
+
+	ret = sm_file_read_stream(&context.file, context.buff, 1024, &read_stream_bytes, 
+		&context.result, (SM_STREAM_CALLBACK) &test_read_stream_callback, &context);
+	if (ret != FILESYSTEM_OP_IN_PROGRESS)
+	{
+		printf("Error: 0x%x\n", ret);
+		fclose(context.f);
+		sm_file_close(&context.file);
+		return;
+	}
+
+	while(!context.completed)
+		Sleep(1);
+
+	if (context.result != SM_SUCCESS)
+	{
+		printf("Error: 0x%x\n", context.result);
+		return;
+	}
+	/*
+	// compare the copy with the original
+	*/
+	f1 = fopen(LOCAL_FILE, "rb");
+	f2 = fopen(LOCAL_FOLDER "mrt_st.exe", "rb");
+	do
+	{
+		c1 = fgetc(f1);
+		c2 = fgetc(f2);
+	}
+	while (c1 == c2 && c1 != EOF);
+	fclose(f1);
+	fclose(f2);
+
+	if (c1 != c2)
+	{
+		printf("Files don't match!\n");
+		return;
+	}
+	printf("Completed.\n");
+}
+
+static void test_read_stream_callback(CALLBACK_CONTEXT* context, uint16_t* result, unsigned char** buffer, uint16_t* action)
+{
+	/*
+	// save whatever is in the buffer
+	*/
+	if (read_stream_bytes)
+		fwrite(*buffer, 1, read_stream_bytes, context->f);
+
+	if (*result == FILESYSTEM_AWAITING_DATA)
+	{
+		*action = FAT_STREAMING_RESPONSE_READY;
+	}
+	else
+	{
+		fclose(context->f);
+		sm_file_close(&context->file);
+		context->completed = 1;
+	}
+}
+
 static void read_file_async_callback(CALLBACK_CONTEXT* context, uint16_t* result)
 {
 	uint16_t* r;
@@ -911,6 +1278,136 @@ static void test_seek_file()
 
 }
 
+static void test_positional_io()
+{
+	SM_FILE file;
+	uint32_t r;
+	unsigned char buff[1024];
+	unsigned char local_buff[1024];
+	#if defined(FAT_WRITE_BACK)
+	unsigned char wbbuff[6144];
+	unsigned char data[5383 + 3505];
+	#endif
+	uint32_t bytes_read;
+	uint32_t offset;
+	size_t sz;
+	int i;
+	FILE* f;
+
+	printf("Testing positional IO...");
+
+	f = fopen(LOCAL_FILE, "rb");
+	fseek(f, 0, SEEK_END);
+	sz = ftell(f);
+	rewind(f);
+
+	r = sm_file_open(&file, "x:\\mrt.exe", SM_FILE_ACCESS_WRITE);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		fclose(f);
+		return;
+	}
+	/*
+	// read random chunks at unaligned offsets and compare them
+	// with the local copy
+	*/
+	srand((unsigned int) time(NULL));
+	for (i = 0; i < 500; i++)
+	{
+		offset = (uint32_t) ((((size_t) rand() << 15) | rand()) % sz);
+
+		r = sm_file_pread(&file, offset, buff, 1000, &bytes_read);
+		if (r != SM_SUCCESS)
+		{
+			printf("pread error: 0x%x\n", r);
+			break;
+		}
+		fseek(f, offset, SEEK_SET);
+		if (fread(local_buff, 1, 1000, f) != bytes_read || memcmp(buff, local_buff, bytes_read))
+		{
+			printf("pread returned wrong data at offset 0x%x\n", offset);
+			break;
+		}
+	}
+	/*
+	// overwrite a chunk in place and read it back, then restore it
+	*/
+	if (i == 500)
+	{
+		offset = (uint32_t) (sz / 2) + 7;
+		memset(buff, 0xAA, sizeof(buff));
+		r = sm_file_pwrite(&file, offset, buff, sizeof(buff));
+		if (r == SM_SUCCESS)
+			r = sm_file_pread(&file, offset, local_buff, sizeof(local_buff), &bytes_read);
+		if (r != SM_SUCCESS || bytes_read != sizeof(buff) || memcmp(buff, local_buff, sizeof(buff)))
+		{
+			printf("pwrite error: 0x%x\n", r);
+			r = FILESYSTEM_UNKNOWN_ERROR;
+		}
+		else
+		{
+			fseek(f, offset, SEEK_SET);
+			bytes_read = (uint32_t) fread(local_buff, 1, sizeof(local_buff), f);
+			r = sm_file_pwrite(&file, offset, local_buff, bytes_read);
+			if (r != SM_SUCCESS)
+				printf("pwrite error: 0x%x\n", r);
+		}
+	}
+	sm_file_close(&file);
+	fclose(f);
+	if (i != 500 || r != SM_SUCCESS)
+		return;
+	#if defined(FAT_WRITE_BACK)
+	/*
+	// extend a file with pwrite while part of it is still held by
+	// a write-back buffer without clusters allocated to it
+	*/
+	r = sm_file_open(&file, "x:\\mrt_da_pwrite.bin", SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_OVERWRITE | SM_FILE_FLAG_DELAYED_ALLOCATION);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		return;
+	}
+	r = sm_file_set_buffer_ex(&file, wbbuff, sizeof(wbbuff));
+	for (offset = 0; offset < sizeof(data); offset++)
+		data[offset] = (unsigned char) (offset * 13 + (offset >> 8));
+	if (r == SM_SUCCESS)
+		r = sm_file_write(&file, data, 7033);
+	if (r == SM_SUCCESS)
+		r = sm_file_pwrite(&file, 5383, data + 5383, 3505);
+	sm_file_close(&file);
+	if (r != SM_SUCCESS)
+	{
+		printf("pwrite past the end error: 0x%x\n", r);
+		return;
+	}
+	r = sm_file_open(&file, "x:\\mrt_da_pwrite.bin", SM_FILE_ACCESS_READ);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		return;
+	}
+	memset(data, 0, sizeof(data));
+	r = sm_file_read(&file, data, sizeof(data), &bytes_read);
+	sm_file_close(&file);
+	if (r != SM_SUCCESS || bytes_read != 5383 + 3505)
+	{
+		printf("File size wrong.\n");
+		return;
+	}
+	for (offset = 0; offset < bytes_read; offset++)
+	{
+		if (data[offset] != (unsigned char) (offset * 13 + (offset >> 8)))
+		{
+			printf("Data mismatch at 0x%x\n", offset);
+			return;
+		}
+	}
+	#endif
+	printf("Completed.\n");
+}
+
 static void test_append_file(char prealloc)
 {
 	SM_FILE file;
@@ -969,243 +1466,2135 @@ static void test_append_file(char prealloc)
 	printf("Completed in %.f seconds\n", ellapsed);
 }
 
-static void test_read_file()
+static void test_append_reopen()
 {
 	SM_FILE file;
-	uint32_t r;
-	unsigned char buff[102400];
-	size_t bytes_read;
-	uint32_t total_bytes_read = 0;
-	FILE* f;
-	SM_DIRECTORY_ENTRY file_entry;
+	uint16_t r;
+	uint32_t buff[1024];
+	uint32_t bytes_read;
+	uint32_t value;
+	int pass, i, j;
+
+	printf("Appending records with a reopen each...");
+	/*
+	// the 2nd pass overwrites the file so the tail remembered
+	// from the 1st one must not be used
+	*/
+	for (pass = 0; pass < 2; pass++)
+	{
+		value = 0;
+		for (i = 0; i < 64; i++)
+		{
+			r = sm_file_open(&file, "x:\\mrt_tail.bin", (i == 0) ?
+				SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_OVERWRITE : SM_FILE_ACCESS_APPEND);
+			if (r != SM_SUCCESS)
+			{
+				printf("Error opening file: 0x%x\n", r);
+				return;
+			}
+			for (j = 0; j < 1024; j++)
+				buff[j] = value++;
+			r = sm_file_write(&file, (unsigned char*) buff, sizeof(buff) - pass * 4);
+			if (r != SM_SUCCESS)
+			{
+				printf("Error writing file: 0x%x\n", r);
+				sm_file_close(&file);
+				return;
+			}
+			value -= pass;
+			sm_file_close(&file);
+		}
+	}
+	/*
+	// read it back
+	*/
+	r = sm_file_open(&file, "x:\\mrt_tail.bin", SM_FILE_ACCESS_READ);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		return;
+	}
+	value = 0;
+	for (i = 0; i < 64; i++)
+	{
+		r = sm_file_read(&file, (unsigned char*) buff, sizeof(buff) - 4, &bytes_read);
+		if (r != SM_SUCCESS || bytes_read != sizeof(buff) - 4)
+			break;
+		for (j = 0; j < 1023; j++)
+		{
+			if (buff[j] != value++)
+				break;
+		}
+		if (j < 1023)
+			break;
+	}
+	bytes_read = 0;
+	r = sm_file_read(&file, (unsigned char*) buff, sizeof(buff), &bytes_read);
+	sm_file_close(&file);
+	printf((i < 64 || bytes_read) ? "File corrupted.\n" : "File OK\n");
+}
+
+static void test_truncate_file()
+{
+	SM_FILE file;
+	uint16_t r;
+	uint32_t buff[1024];
+	uint32_t bytes_read;
+	uint32_t value;
+	int i, j;
+	SM_DIRECTORY_ENTRY file_entry;
+
+	printf("Truncating file...");
+	/*
+	// write 64 KiB, cut it in the middle of a sector and
+	// append past the cut
+	*/
+	r = sm_file_open(&file, "x:\\mrt_trunc.bin", SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_OVERWRITE);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		return;
+	}
+	for (value = 0, i = 0; i < 16; i++)
+	{
+		for (j = 0; j < 1024; j++)
+			buff[j] = value++;
+		r = sm_file_write(&file, (unsigned char*) buff, sizeof(buff));
+		if (r != SM_SUCCESS)
+		{
+			printf("Error writing file: 0x%x\n", r);
+			sm_file_close(&file);
+			return;
+		}
+	}
+	r = sm_file_truncate(&file, 2501 * 4);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error truncating file: 0x%x\n", r);
+		sm_file_close(&file);
+		return;
+	}
+	for (value = 2501, j = 0; j < 1024; j++)
+		buff[j] = value++;
+	r = sm_file_write(&file, (unsigned char*) buff, sizeof(buff));
+	sm_file_close(&file);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error writing file: 0x%x\n", r);
+		return;
+	}
+	/*
+	// read it back
+	*/
+	r = sm_get_file_entry("x:\\mrt_trunc.bin", &file_entry);
+	if (r != SM_SUCCESS || file_entry.size != (2501 + 1024) * 4)
+	{
+		printf("File size wrong.\n");
+		return;
+	}
+	r = sm_file_open(&file, "x:\\mrt_trunc.bin", SM_FILE_ACCESS_READ);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		return;
+	}
+	for (value = 0, i = 0; i < 4; i++)
+	{
+		r = sm_file_read(&file, (unsigned char*) buff, sizeof(buff), &bytes_read);
+		if (r != SM_SUCCESS)
+			break;
+		for (j = 0; j < (int) (bytes_read / 4); j++)
+		{
+			if (buff[j] != value++)
+				break;
+		}
+		if (j < (int) (bytes_read / 4))
+			break;
+	}
+	sm_file_close(&file);
+	if (value != 2501 + 1024)
+	{
+		printf("File corrupted.\n");
+		return;
+	}
+	/*
+	// truncate it to zero
+	*/
+	r = sm_file_open(&file, "x:\\mrt_trunc.bin", SM_FILE_ACCESS_APPEND);
+	if (r == SM_SUCCESS)
+	{
+		r = sm_file_truncate(&file, 0);
+		sm_file_close(&file);
+	}
+	if (r == SM_SUCCESS)
+		r = sm_get_file_entry("x:\\mrt_trunc.bin", &file_entry);
+	printf((r != SM_SUCCESS || file_entry.size) ? "Truncate to zero failed.\n" : "File OK\n");
+}
+
+static void test_overwrite_file()
+{
+	SM_FILE file;
+	uint16_t r;
+	uint32_t buff[1024];
+	uint32_t bytes_read;
+	uint32_t value;
+	uint32_t size;
+	int pass, i, j;
+	SM_DIRECTORY_ENTRY file_entry;
+
+	printf("Overwriting file...");
+	/*
+	// rewrite the file growing it on the 2nd pass
+	// and shrinking it on the 3rd
+	*/
+	for (pass = 0; pass < 3; pass++)
+	{
+		size = (pass == 1) ? 24 : (pass == 2) ? 5 : 16;
+		r = sm_file_open(&file, "x:\\mrt_over.bin", SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_OVERWRITE);
+		if (r != SM_SUCCESS)
+		{
+			printf("Error opening file: 0x%x\n", r);
+			return;
+		}
+		for (value = pass << 24, i = 0; i < (int) size; i++)
+		{
+			for (j = 0; j < 1024; j++)
+				buff[j] = value++;
+			r = sm_file_write(&file, (unsigned char*) buff, sizeof(buff) - 12);
+			value -= 3;
+			if (r != SM_SUCCESS)
+			{
+				printf("Error writing file: 0x%x\n", r);
+				sm_file_close(&file);
+				return;
+			}
+		}
+		sm_file_close(&file);
+	}
+	/*
+	// read it back
+	*/
+	r = sm_get_file_entry("x:\\mrt_over.bin", &file_entry);
+	if (r != SM_SUCCESS || file_entry.size != size * (sizeof(buff) - 12))
+	{
+		printf("File size wrong.\n");
+		return;
+	}
+	r = sm_file_open(&file, "x:\\mrt_over.bin", SM_FILE_ACCESS_READ);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		return;
+	}
+	for (value = 2 << 24, i = 0; i < (int) size; i++)
+	{
+		r = sm_file_read(&file, (unsigned char*) buff, sizeof(buff) - 12, &bytes_read);
+		if (r != SM_SUCCESS || bytes_read != sizeof(buff) - 12)
+			break;
+		for (j = 0; j < 1021; j++)
+		{
+			if (buff[j] != value++)
+				break;
+		}
+		if (j < 1021)
+			break;
+	}
+	sm_file_close(&file);
+	printf((i < (int) size) ? "File corrupted.\n" : "File OK\n");
+}
+
+static void test_copy_file()
+{
+	SM_FILE src;
+	SM_FILE dst;
+	uint16_t r;
+	unsigned char src_buff[4096];
+	unsigned char dst_buff[4096];
+	uint32_t src_bytes_read;
+	uint32_t dst_bytes_read;
+	uint32_t total_bytes_read = 0;
+
+	printf("Copying file...");
+
+	r = sm_file_copy("x:\\mrt_over.bin", "x:\\mrt_copy.bin");
+	if (r != SM_SUCCESS)
+	{
+		printf("Error copying file: 0x%x\n", r);
+		return;
+	}
+	/*
+	// compare both files
+	*/
+	r = sm_file_open(&src, "x:\\mrt_over.bin", SM_FILE_ACCESS_READ);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		return;
+	}
+	r = sm_file_open(&dst, "x:\\mrt_copy.bin", SM_FILE_ACCESS_READ);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		sm_file_close(&src);
+		return;
+	}
+	do
+	{
+		src_bytes_read = dst_bytes_read = 0;
+		sm_file_read(&src, src_buff, sizeof(src_buff), &src_bytes_read);
+		sm_file_read(&dst, dst_buff, sizeof(dst_buff), &dst_bytes_read);
+		if (src_bytes_read != dst_bytes_read || memcmp(src_buff, dst_buff, src_bytes_read))
+			break;
+		total_bytes_read += src_bytes_read;
+	}
+	while (src_bytes_read);
+	sm_file_close(&src);
+	sm_file_close(&dst);
+	printf((src_bytes_read || !total_bytes_read) ? "Files differ.\n" : "File OK\n");
+}
+
+#if defined(FAT_CHECKPOINTS)
+static void test_checkpoint_file()
+{
+	SM_FILE file;
+	uint16_t r;
+	unsigned char buff[1000];
+	int i;
+	SM_DIRECTORY_ENTRY file_entry;
+
+	printf("Writing file with checkpoints...");
+
+	r = sm_file_open(&file, "x:\\mrt_ckpt.bin", SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_OVERWRITE);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		return;
+	}
+	r = sm_file_set_checkpoint(&file, 4096, 0, 0);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error setting checkpoint policy: 0x%x\n", r);
+		sm_file_close(&file);
+		return;
+	}
+	memset(buff, 0x5A, sizeof(buff));
+	for (i = 0; i < 10; i++)
+	{
+		r = sm_file_write(&file, buff, sizeof(buff));
+		if (r != SM_SUCCESS)
+		{
+			printf("Error writing file: 0x%x\n", r);
+			sm_file_close(&file);
+			return;
+		}
+	}
+	/*
+	// the entry must already cover most of the
+	// data without the file being flushed
+	*/
+	r = sm_get_file_entry("x:\\mrt_ckpt.bin", &file_entry);
+	sm_file_close(&file);
+	if (r != SM_SUCCESS || file_entry.size < 4096 || file_entry.size > 10000)
+	{
+		printf("No checkpoint taken.\n");
+		return;
+	}
+	r = sm_get_file_entry("x:\\mrt_ckpt.bin", &file_entry);
+	printf((r != SM_SUCCESS || file_entry.size != 10000) ? "File size wrong.\n" : "File OK\n");
+}
+#endif
+
+static void test_borrow_file()
+{
+	SM_FILE file;
+	SM_FILE copy;
+	uint16_t r;
+	unsigned char buff[700];
+	unsigned char* ptr;
+	uint32_t len;
+	uint32_t bytes_read;
+	uint32_t total = 0;
+
+	printf("Reading file without copying...");
+
+	r = sm_file_open(&file, "x:\\mrt.exe", SM_FILE_ACCESS_READ);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		return;
+	}
+	r = sm_file_open(&copy, "x:\\mrt.exe", SM_FILE_ACCESS_READ);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error opening file: 0x%x\n", r);
+		sm_file_close(&file);
+		return;
+	}
+	/*
+	// borrow the file in pieces that don't line up with the
+	// sectors and compare them with what a normal read returns
+	*/
+	do
+	{
+		r = sm_file_read_borrow(&file, sizeof(buff), &ptr, &len);
+		if (r != SM_SUCCESS)
+		{
+			printf("Error borrowing data: 0x%x\n", r);
+			break;
+		}
+		if (sm_file_read(&copy, buff, len, &bytes_read) != SM_SUCCESS || 
+			bytes_read != len || (len && memcmp(ptr, buff, len)))
+		{
+			printf("Data mismatch at 0x%x\n", total);
+			r = FILESYSTEM_UNKNOWN_ERROR;
+		}
+		sm_file_read_release(&file);
+		total += len;
+	}
+	while (len && r == SM_SUCCESS);
+
+	sm_file_close(&copy);
+	sm_file_close(&file);
+	if (r == SM_SUCCESS)
+		printf("Completed (0x%x bytes).\n", total);
+}
+
+static void test_dentry_cache()
+{
+	SM_FILE file;
+	SM_DIRECTORY_ENTRY entry;
+	uint16_t r;
+
+	printf("Testing lookup cache...");
+	/*
+	// look up a file that doesn't exist twice so the
+	// 2nd lookup is answered by a negative entry
+	*/
+	sm_file_delete("x:\\dcache.txt");
+	sm_get_file_entry("x:\\dcache.txt", &entry);
+	r = sm_get_file_entry("x:\\dcache.txt", &entry);
+	if (r != SM_SUCCESS || *entry.name)
+	{
+		printf("Found a file that doesn't exist.\n");
+		return;
+	}
+	/*
+	// creating the file must drop the negative entry
+	*/
+	r = sm_file_open(&file, "x:\\dcache.txt", SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_WRITE);
+	if (r != SM_SUCCESS)
+	{
+		printf("Error creating file: 0x%x\n", r);
+		return;
+	}
+	sm_file_write(&file, (unsigned char*) "dentry", 6);
+	sm_file_close(&file);
+	r = sm_get_file_entry("x:\\dcache.txt", &entry);
+	if (r != SM_SUCCESS || !*entry.name || entry.size != 6)
+	{
+		printf("Cached entry is stale after create.\n");
+		return;
+	}
+	/*
+	// renaming and deleting it must update the cached entry
+	*/
+	r = sm_file_rename("x:\\dcache.txt", "x:\\dcache2.txt");
+	if (r != SM_SUCCESS)
+	{
+		printf("Error renaming file: 0x%x\n", r);
+		return;
+	}
+	r = sm_get_file_entry("x:\\dcache.txt", &entry);
+	if (r != SM_SUCCESS || *entry.name)
+	{
+		printf("Cached entry is stale after rename.\n");
+		return;
+	}
+	sm_file_delete("x:\\dcache2.txt");
+	r = sm_get_file_entry("x:\\dcache2.txt", &entry);
+	if (r != SM_SUCCESS || *entry.name)
+	{
+		printf("Cached entry is stale after delete.\n");
+		return;
+	}
+	printf("Completed.\n");
+}
+
+static void test_short_names()
+{
+	SM_FILE file;
+	SM_DIRECTORY_ENTRY entry;
+	uint16_t r;
+	uint16_t i;
+	char buff[64];
+
+	printf("Testing short name generation...");
+	#if defined(USE_LONG_FILENAMES)
+	r = sm_create_directory("x:\\Short Names");
+	if (r != SM_SUCCESS && r != FILESYSTEM_FILENAME_ALREADY_EXISTS)
+	{
+		printf("Could not create folder. Error: %x\n", r);
+		return;
+	}
+	/*
+	// create more files with the same prefix than there
+	// are ~N tails so that the hashed names get used
+	*/
+	for (i = 1; i <= 30; i++)
+	{
+		sprintf(buff, "x:\\Short Names\\same prefix %i.txt", i);
+		r = sm_file_open(&file, buff, SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_OVERWRITE);
+		if (r != SM_SUCCESS)
+		{
+			printf("Could not open file '%s'. Error: %x\n", buff, r);
+			return;
+		}
+		sm_file_close(&file);
+	}
+	for (i = 1; i <= 30; i++)
+	{
+		sprintf(buff, "x:\\Short Names\\same prefix %i.txt", i);
+		r = sm_get_file_entry(buff, &entry);
+		if (r != SM_SUCCESS || !*entry.name)
+		{
+			printf("Could not find file '%s'. Error: %x\n", buff, r);
+			return;
+		}
+	}
+	printf("Completed.\n");
+	#else
+	printf("Skipped.\n");
+	#endif
+}
+
+static void test_read_file()
+{
+	SM_FILE file;
+	uint32_t r;
+	unsigned char buff[102400];
+	size_t bytes_read;
+	uint32_t total_bytes_read = 0;
+	FILE* f;
+	SM_DIRECTORY_ENTRY file_entry;
+
+	printf("Reading file...");
+
+	r = sm_get_file_entry("x:\\mrt.exe", &file_entry);
+
+	/*
+	// read a file from the device and write it to the local filesystem
+	*/
+	bytes_read = 0;
+	r = sm_file_open(&file, "x:\\mrt.exe", SM_FILE_ACCESS_READ);
+	f = fopen(LOCAL_FOLDER "mrt.exe", "wb");
+	do
+	{
+		r = sm_file_read(&file, buff, 1024, &bytes_read);
+		fwrite(buff, 1, bytes_read, f);
+		total_bytes_read += bytes_read;
+	}
+	while (bytes_read);
+	fclose(f);
+	r = sm_file_close(&file);
+
+	if (file_entry.size != total_bytes_read)
+	{
+		printf("Error: file is reported as %x bytes but we only read %x\n", file_entry.size, total_bytes_read);
+	}
+	else
+	{
+		printf("Completed.\n");
+	}
+}
+
+static void test_read_file_unbuffered()
+{
+	SM_FILE file;
+	uint32_t r;
+	unsigned char buff[1024];
+	size_t bytes_read;
+	FILE* f;
+	uint32_t total_bytes_written = 0;
+
+	printf("Reading file (unbuffered)...");
+	/*
+	// read a file from the device and write it to the local filesystem
+	*/
+	bytes_read = 0;
+	r = sm_file_open(&file, "x:\\mrt.exe", SM_FILE_ACCESS_READ | SM_FILE_FLAG_NO_BUFFERING);
+	f = fopen(LOCAL_FOLDER "mrt_unbuffered.exe", "wb");
+	do
+	{
+		r = sm_file_read(&file, buff, 1024, &bytes_read);
+		if (r != SM_SUCCESS)
+		{
+			printf("Read error 0x%x\n", r);
+			fclose(f);
+			r = sm_file_close(&file);
+			return;
+
+		}
+		fwrite(buff, 1, bytes_read, f);
+		total_bytes_written += bytes_read;
+	}
+	while (bytes_read);
+	fclose(f);
+	r = sm_file_close(&file);
+
+	printf("Completed.\n");
+}
+
+int file1writes;
+unsigned char buff1[4096];
+
+static void test_another_async_write()
+{
+	int i;
+	uint16_t err;
+	SM_FILE file;
+
+	//
+	// fill buffer with data
+	//
+	for (i = 0; i < 4096; i++)
+	{
+		buff1[i] = (i & 1)?'X':'x';
+	}
+	buff1[0] = 'h';
+	buff1[1] = 'e';
+	buff1[2] = 'l';
+	buff1[3] = 'l';
+	buff1[4] = 'o';
+	buff1[5] = ' ';
+	/*
+	// reset the file writes count
+	*/
+	file1writes = 0;
+
+	printf("Writing another file...");
+	err = sm_file_open(&file, "x:\\xxx.txt", SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_OVERWRITE);
+	sm_file_write_async(&file, buff1, 4096, &err, (void*) &test_another_async_write_callback, &file);
+
+	while (file1writes < 20)
+		Sleep(1);
+
+	printf("Completed.\n");
+
+}
+
+static void test_another_async_write_callback(SM_FILE* file, uint16_t* result)
+{
+	file1writes++;
+	if (file1writes == 10)
+	{
+		/*
+		// close the file
+		*/
+		sm_file_close(file);
+		file1writes = 20;
+	}
+	else
+	{
+		sm_file_write_async(file, buff1, 4096, result, (void*) &test_another_async_write_callback, file);
+	}
+
+}
+
+FILE* streamf;
+unsigned char streambuff[1024];
+char stream_completed;
+
+static void test_write_stream()
+{
+
+	int i;
+	uint16_t err;
+	SM_FILE file;
+	size_t sz;
+
+	printf("Writing stream...");
+	stream_completed = 0;
+	/*
+	// open local file
+	*/
+	streamf = fopen("c:\\stream.old.txt", "rb");
+	if (!streamf)
+	{
+		printf("Could not open local file.\n");
+		return;
+	}
+	fseek(streamf, 0, SEEK_END);
+	sz = ftell(streamf);
+	rewind(streamf);
+
+	/*
+	// open the file
+	*/
+	err = sm_file_open(&file, "x:\\stream.txt", SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_OVERWRITE | SM_FILE_FLAG_NO_BUFFERING);
+	if (err != SM_SUCCESS)
+	{
+		printf("Could not open file. Error: 0x%x\n", err);
+		return;
+	}
+	/*
+	// allocate disk space
+	*/
+	err = sm_file_alloc(&file, sz);
+	/*
+	// read local file
+	*/
+	err = fread(streambuff, 1, 1024, streamf);
+	if (!err)
+	{
+		printf("Could not read local file.\n");
+		return;
+	}
+	/*
+	// initiate stream write
+	*/
+	err = sm_file_write_stream(&file, streambuff, 1024, &err, (SM_STREAM_CALLBACK) &test_write_stream_callback, &file);
+	if (err != FILESYSTEM_OP_IN_PROGRESS)
+	{
+		printf("Error: 0x%x\n", err);
+		return;
+	}
+	/*
+	// wait until it's done
+	*/
+	while (!stream_completed)
+		Sleep(1);
+}
+
+
+static void test_write_stream_callback(SM_FILE* file, uint16_t* result, unsigned char** buffer, uint16_t* action)
+{
+	if (*result == FILESYSTEM_AWAITING_DATA)
+	{
+		/*
+		// reload the buffer
+		*/
+		uint16_t bytes;
+		bytes = fread(streambuff, 1, 1024, streamf);
+		/*
+		// if we got data set the response to READY otherwise set it to STOP
+		*/
+		if (bytes)
+		{
+			*action = FAT_STREAMING_RESPONSE_READY;
+		}
+		else
+		{
+			*action = FAT_STREAMING_RESPONSE_STOP;
+		}
+	}
+	else
+	{
+		if (*result == SM_SUCCESS)
+		{
+			printf("Completed.\n");
+		}
+		else
+		{
+			printf("Error: 0x%x\n", *result);
+		}
+		/*
+		// close the file
+		*/
+		sm_file_close(file);
+		/*
+		// signal that we're done
+		*/
+		stream_completed = 1;
+	}
+}
+
+/*
+// state of each of the streams written by test_concurrent_streams
+*/
+#define CONCURRENT_STREAMS			4
+#define CONCURRENT_STREAM_SIZE		(256 * 1024)
+
+typedef struct CONCURRENT_STREAM
+{
+	SM_FILE file;
+	unsigned char buff[1024];
+	uint32_t bytes_written;
+	uint16_t result;
+	int channel;
+	char completed;
+}
+CONCURRENT_STREAM;
+
+static void concurrent_stream_fill(CONCURRENT_STREAM* stream)
+{
+	int i;
+	for (i = 0; i < 1024; i++)
+		stream->buff[i] = (unsigned char) ((stream->channel << 6) + ((stream->bytes_written + i) >> 10) + i);
+}
+
+static void concurrent_stream_callback(CONCURRENT_STREAM* stream, uint16_t* result, unsigned char** buffer, uint16_t* action)
+{
+	if (*result == FILESYSTEM_AWAITING_DATA)
+	{
+		stream->bytes_written += 1024;
+		if (stream->bytes_written < CONCURRENT_STREAM_SIZE)
+		{
+			concurrent_stream_fill(stream);
+			*action = FAT_STREAMING_RESPONSE_READY;
+		}
+		else
+		{
+			*action = FAT_STREAMING_RESPONSE_STOP;
+		}
+	}
+	else
+	{
+		stream->result = *result;
+		sm_file_close(&stream->file);
+		stream->completed = 1;
+	}
+}
+
+/*
+// writes several streams at the same time and checks that
+// none of them stepped on the others
+*/
+static void test_concurrent_streams()
+{
+	static CONCURRENT_STREAM streams[CONCURRENT_STREAMS];
+	char filename[32];
+	unsigned char buff[1024];
+	unsigned char expected;
+	uint32_t bytes_read;
+	uint32_t offset;
+	uint16_t ret;
+	int i, j;
+
+	printf("Writing %i concurrent streams...", CONCURRENT_STREAMS);
+	/*
+	// open the files and preallocate them
+	*/
+	for (i = 0; i < CONCURRENT_STREAMS; i++)
+	{
+		sprintf(filename, "x:\\stream%i.txt", i);
+		streams[i].channel = i;
+		streams[i].bytes_written = 0;
+		streams[i].completed = 0;
+		ret = sm_file_open(&streams[i].file, filename, 
+			SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_OVERWRITE | SM_FILE_FLAG_NO_BUFFERING);
+		if (ret != SM_SUCCESS)
+		{
+			printf("Could not open file. Error: 0x%x\n", ret);
+			return;
+		}
+		ret = sm_file_alloc(&streams[i].file, CONCURRENT_STREAM_SIZE);
+		if (ret != SM_SUCCESS)
+		{
+			printf("Could not allocate file. Error: 0x%x\n", ret);
+			return;
+		}
+	}
+	/*
+	// start all the streams
+	*/
+	for (i = 0; i < CONCURRENT_STREAMS; i++)
+	{
+		concurrent_stream_fill(&streams[i]);
+		ret = sm_file_write_stream(&streams[i].file, streams[i].buff, 1024, &streams[i].result, 
+			(SM_STREAM_CALLBACK) &concurrent_stream_callback, &streams[i]);
+		if (ret != FILESYSTEM_OP_IN_PROGRESS)
+		{
+			printf("Error: 0x%x\n", ret);
+			return;
+		}
+	}
+	/*
+	// wait for all of them to complete
+	*/
+	for (i = 0; i < CONCURRENT_STREAMS; i++)
+	{
+		while (!streams[i].completed)
+			Sleep(1);
+		if (streams[i].result != SM_SUCCESS)
+		{
+			printf("Stream %i failed. Error: 0x%x\n", i, streams[i].result);
+			return;
+		}
+	}
+	/*
+	// read the files back and check their contents
+	*/
+	for (i = 0; i < CONCURRENT_STREAMS; i++)
+	{
+		sprintf(filename, "x:\\stream%i.txt", i);
+		ret = sm_file_open(&streams[i].file, filename, SM_FILE_ACCESS_READ | SM_FILE_FLAG_NO_BUFFERING);
+		if (ret != SM_SUCCESS)
+		{
+			printf("Could not open file. Error: 0x%x\n", ret);
+			return;
+		}
+		for (offset = 0; offset < CONCURRENT_STREAM_SIZE; offset += 1024)
+		{
+			ret = sm_file_read(&streams[i].file, buff, 1024, &bytes_read);
+			if (ret != SM_SUCCESS || bytes_read != 1024)
+			{
+				printf("Error reading stream %i: 0x%x\n", i, ret);
+				sm_file_close(&streams[i].file);
+				return;
+			}
+			for (j = 0; j < 1024; j++)
+			{
+				expected = (unsigned char) ((i << 6) + ((offset + j) >> 10) + j);
+				if (buff[j] != expected)
+				{
+					printf("Stream %i is corrupted at offset %u\n", i, offset + j);
+					sm_file_close(&streams[i].file);
+					return;
+				}
+			}
+		}
+		sm_file_close(&streams[i].file);
+	}
+	printf("Completed.\n");
+}
+
+static void test_delete_tree()
+{
+	FAT_FILE file;
+	FAT_DIRECTORY_ENTRY entry;
+	uint16_t r;
+	uint16_t i;
+	uint16_t j;
+	uint32_t free_clusters;
+	char path[256];
+	char filename[256];
+	unsigned char buff[512];
+	unsigned char data[700];
+
+	printf("Deleting directory tree...");
+	/*
+	// build a tree that is deeper than the 8 resume frames
+	// and has more files than fit in a batch of 32 chains
+	*/
+	free_clusters = fat_volume.total_free_clusters;
+	memset(data, 0x3C, sizeof(data));
+	strcpy(path, "\\Delete Tree");
+	for (i = 0; i < 12; i++)
+	{
+		r = fat_create_directory(&fat_volume, path);
+		if (r != FAT_SUCCESS)
+		{
+			printf("Could not create folder. Error: %x\n", r);
+			return;
+		}
+		for (j = 0; j < 4; j++)
+		{
+			sprintf(filename, "%s\\file number %i.bin", path, j);
+			r = fat_file_open(&fat_volume, filename, FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_WRITE, &file);
+			if (r != FAT_SUCCESS)
+			{
+				printf("Could not open file '%s'. Error: %x\n", filename, r);
+				return;
+			}
+			fat_file_set_buffer(&file, buff);
+			r = fat_file_write(&file, data, sizeof(data));
+			fat_file_close(&file);
+			if (r != FAT_SUCCESS)
+			{
+				printf("Error writing file: %x\n", r);
+				return;
+			}
+		}
+		strcat(path, "\\level");
+	}
+	r = fat_delete_tree(&fat_volume, "\\Delete Tree");
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error: %x\n", r);
+		return;
+	}
+	r = fat_get_file_entry(&fat_volume, "\\Delete Tree", &entry);
+	if (r != FAT_SUCCESS || *entry.name)
+	{
+		printf("The directory was not deleted.\n");
+		return;
+	}
+	if (fat_volume.total_free_clusters != free_clusters)
+	{
+		printf("Leaked %i clusters.\n", (int) (free_clusters - fat_volume.total_free_clusters));
+		return;
+	}
+	printf("Completed.\n");
+}
+
+static void test_compact_directory()
+{
+	FAT_FILE file;
+	FAT_FILE* handles[1];
+	FAT_FILESYSTEM_QUERY query;
+	FAT_DIRECTORY_ENTRY* entry;
+	FAT_DIRECTORY_ENTRY file_entry;
+	uint16_t r;
+	uint16_t i;
+	char filename[64];
+	unsigned char buff[512];
+
+	printf("Compacting directory...");
+
+	r = fat_create_directory(&fat_volume, "\\Compact Me");
+	if (r != FAT_SUCCESS)
+	{
+		printf("Could not create folder. Error: %x\n", r);
+		return;
+	}
+	/*
+	// create 20 files and delete every other one
+	// to leave holes in the directory
+	*/
+	for (i = 0; i < 20; i++)
+	{
+		sprintf(filename, "\\Compact Me\\compacted file %02i.txt", i);
+		r = fat_file_open(&fat_volume, filename, FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_WRITE, &file);
+		if (r != FAT_SUCCESS)
+		{
+			printf("Could not open file '%s'. Error: %x\n", filename, r);
+			return;
+		}
+		fat_file_set_buffer(&file, buff);
+		fat_file_write(&file, (unsigned char*) filename, 10);
+		fat_file_close(&file);
+	}
+	for (i = 1; i < 20; i += 2)
+	{
+		sprintf(filename, "\\Compact Me\\compacted file %02i.txt", i);
+		fat_file_delete(&fat_volume, filename);
+	}
+	/*
+	// keep the last file open, the directory cannot
+	// be compacted unless it's handle is passed
+	*/
+	r = fat_file_open(&fat_volume, "\\Compact Me\\compacted file 18.txt", FAT_FILE_ACCESS_WRITE | FAT_FILE_ACCESS_APPEND, &file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error opening file: %x\n", r);
+		return;
+	}
+	fat_file_set_buffer(&file, buff);
+	r = fat_compact_directory(&fat_volume, "\\Compact Me", 0, 0);
+	if (r != FAT_FILE_HANDLE_IN_USE)
+	{
+		printf("Compacted a directory with an unknown open file.\n");
+		fat_file_close(&file);
+		return;
+	}
+	handles[0] = &file;
+	r = fat_compact_directory(&fat_volume, "\\Compact Me", handles, 1);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error: %x\n", r);
+		fat_file_close(&file);
+		return;
+	}
+	/*
+	// the entry of the open file has moved, it must be
+	// written to it's new slot when the file is closed
+	*/
+	fat_file_write(&file, (unsigned char*) "appended", 8);
+	r = fat_file_close(&file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error closing file: %x\n", r);
+		return;
+	}
+	r = fat_get_file_entry(&fat_volume, "\\Compact Me\\compacted file 18.txt", &file_entry);
+	if (r != FAT_SUCCESS || !*file_entry.name || file_entry.size != 18)
+	{
+		printf("Moved entry not updated.\n");
+		return;
+	}
+	/*
+	// the remaining files must be listed in the same order
+	*/
+	i = 0;
+	memset(&query, 0, sizeof(query));
+	r = fat_find_first_entry(&fat_volume, "\\Compact Me", 0, &entry, &query);
+	while (r == FAT_SUCCESS && *entry->name)
+	{
+		if (*entry->name != '.')
+		{
+			sprintf(filename, "compacted file %02i.txt", i);
+			if (strcmp((char*) entry->name, filename))
+				break;
+			i += 2;
+		}
+		r = fat_find_next_entry(&fat_volume, &entry, &query);
+	}
+	if (r != FAT_SUCCESS || i != 20)
+	{
+		printf("Wrong listing after compaction.\n");
+		return;
+	}
+	printf("Completed.\n");
+}
+
+static void test_pwrite_after_read()
+{
+	FAT_FILE file;
+	uint16_t r;
+	uint32_t i;
+	uint32_t cluster_size;
+	uint32_t bytes_read;
+	uint32_t offset;
+	unsigned char buff[512];
+	unsigned char data[512];
+
+	printf("Writing past the cluster under the cursor...");
+
+	cluster_size = (uint32_t) fat_volume.no_of_sectors_per_cluster * fat_volume.no_of_bytes_per_serctor;
+	r = fat_file_open(&fat_volume, "\\pwrite boundary.bin", FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_OVERWRITE | FAT_FILE_ACCESS_WRITE, &file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error opening file: %x\n", r);
+		return;
+	}
+	fat_file_set_buffer(&file, buff);
+	for (offset = 0; offset < cluster_size * 2; offset += sizeof(data))
+	{
+		for (i = 0; i < sizeof(data); i++)
+			data[i] = (unsigned char) ((offset + i) * 7);
+		r = fat_file_write(&file, data, sizeof(data));
+		if (r != FAT_SUCCESS)
+		{
+			printf("Error writing file: %x\n", r);
+			fat_file_close(&file);
+			return;
+		}
+	}
+	fat_file_close(&file);
+	/*
+	// read the whole file so the cursor is left on the
+	// last cluster and then write across the cluster boundaries
+	// with pwrite, the 2nd write needs a new cluster
+	*/
+	r = fat_file_open(&fat_volume, "\\pwrite boundary.bin", FAT_FILE_ACCESS_READ | FAT_FILE_ACCESS_WRITE, &file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error opening file: %x\n", r);
+		return;
+	}
+	fat_file_set_buffer(&file, buff);
+	do
+	{
+		r = fat_file_read(&file, data, sizeof(data), &bytes_read);
+	}
+	while (r == FAT_SUCCESS && bytes_read == sizeof(data));
+	memset(data, 0xA5, sizeof(data));
+	r = fat_file_pwrite(&file, cluster_size - 50, data, 100);
+	if (r == FAT_SUCCESS)
+		r = fat_file_pwrite(&file, cluster_size * 2 - 100, data, 300);
+	fat_file_close(&file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("pwrite error: %x\n", r);
+		return;
+	}
+	/*
+	// read it back
+	*/
+	r = fat_file_open(&fat_volume, "\\pwrite boundary.bin", FAT_FILE_ACCESS_READ, &file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error opening file: %x\n", r);
+		return;
+	}
+	fat_file_set_buffer(&file, buff);
+	for (offset = 0; ; offset += bytes_read)
+	{
+		r = fat_file_read(&file, data, sizeof(data), &bytes_read);
+		if (r != FAT_SUCCESS || !bytes_read)
+			break;
+		for (i = 0; i < bytes_read; i++)
+		{
+			if ((offset + i >= cluster_size - 50 && offset + i < cluster_size + 50) ||
+				offset + i >= cluster_size * 2 - 100)
+			{
+				if (data[i] != 0xA5)
+					break;
+			}
+			else if (data[i] != (unsigned char) ((offset + i) * 7))
+			{
+				break;
+			}
+		}
+		if (i < bytes_read)
+		{
+			printf("Data mismatch at 0x%x\n", offset + i);
+			fat_file_close(&file);
+			return;
+		}
+	}
+	fat_file_close(&file);
+	if (r != FAT_SUCCESS || offset != cluster_size * 2 + 200)
+	{
+		printf("File size wrong.\n");
+		return;
+	}
+	printf("Completed.\n");
+}
 
-	printf("Reading file...");
+static unsigned char test_transfer_data[60000];
 
-	r = sm_get_file_entry("x:\\mrt.exe", &file_entry);
+static void test_direct_transfer()
+{
+	FAT_FILE file;
+	uint16_t r;
+	uint32_t i;
+	uint32_t cluster_size;
+	uint32_t bytes_read;
+	uint32_t length;
+	unsigned char buff[512];
+
+	printf("Transferring whole sectors directly...");
+
+	cluster_size = (uint32_t) fat_volume.no_of_sectors_per_cluster * fat_volume.no_of_bytes_per_serctor;
+	for (i = 0; i < sizeof(test_transfer_data); i++)
+		test_transfer_data[i] = (unsigned char) (i * 7 + (i >> 9));
+	/*
+	// write the file with an unaligned head and tail so that
+	// the middle of the request is written straight from our
+	// buffer across several clusters
+	*/
+	r = fat_file_open(&fat_volume, "\\direct transfer.bin", FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_OVERWRITE | FAT_FILE_ACCESS_WRITE, &file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error opening file: %x\n", r);
+		return;
+	}
+	fat_file_set_buffer(&file, buff);
+	r = fat_file_write(&file, test_transfer_data, 5);
+	if (r == FAT_SUCCESS)
+		r = fat_file_write(&file, test_transfer_data + 5, sizeof(test_transfer_data) - 10);
+	if (r == FAT_SUCCESS)
+		r = fat_file_write(&file, test_transfer_data + sizeof(test_transfer_data) - 5, 5);
+	fat_file_close(&file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error writing file: %x\n", r);
+		return;
+	}
+	/*
+	// read it back the same way and then append a cluster and a bit
+	// more at the cursor, the append needs to allocate a new cluster
+	// so the cursor must have been left on the right one
+	*/
+	r = fat_file_open(&fat_volume, "\\direct transfer.bin", FAT_FILE_ACCESS_READ | FAT_FILE_ACCESS_WRITE, &file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error opening file: %x\n", r);
+		return;
+	}
+	fat_file_set_buffer(&file, buff);
+	memset(test_transfer_data, 0, sizeof(test_transfer_data));
+	r = fat_file_read(&file, test_transfer_data, 3, &bytes_read);
+	length = bytes_read;
+	if (r == FAT_SUCCESS)
+	{
+		r = fat_file_read(&file, test_transfer_data + 3, sizeof(test_transfer_data) - 3 - 1000, &bytes_read);
+		length += bytes_read;
+	}
+	if (r == FAT_SUCCESS)
+	{
+		r = fat_file_read(&file, test_transfer_data + length, 5000, &bytes_read);
+		length += bytes_read;
+	}
+	if (r != FAT_SUCCESS || length != sizeof(test_transfer_data))
+	{
+		printf("Error reading file: %x\n", r);
+		fat_file_close(&file);
+		return;
+	}
+	for (i = 0; i < sizeof(test_transfer_data); i++)
+	{
+		if (test_transfer_data[i] != (unsigned char) (i * 7 + (i >> 9)))
+		{
+			printf("Data mismatch at 0x%x\n", i);
+			fat_file_close(&file);
+			return;
+		}
+	}
+	r = fat_file_write(&file, test_transfer_data, cluster_size + 100);
+	fat_file_close(&file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error appending to file: %x\n", r);
+		return;
+	}
+	/*
+	// check the appended data
+	*/
+	r = fat_file_open(&fat_volume, "\\direct transfer.bin", FAT_FILE_ACCESS_READ, &file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error opening file: %x\n", r);
+		return;
+	}
+	fat_file_set_buffer(&file, buff);
+	r = fat_file_seek(&file, sizeof(test_transfer_data) - 1, FAT_SEEK_START);
+	if (r == FAT_SUCCESS)
+		r = fat_file_read(&file, test_transfer_data, cluster_size + 1000, &bytes_read);
+	fat_file_close(&file);
+	if (r != FAT_SUCCESS || bytes_read != cluster_size + 101)
+	{
+		printf("File size wrong.\n");
+		return;
+	}
+	for (i = 1; i < bytes_read; i++)
+	{
+		if (test_transfer_data[i] != (unsigned char) ((i - 1) * 7 + ((i - 1) >> 9)))
+		{
+			printf("Data mismatch at 0x%x\n", (uint32_t) sizeof(test_transfer_data) - 1 + i);
+			return;
+		}
+	}
+	printf("Completed.\n");
+}
+
+static unsigned char test_large_data[70000];
+
+static void test_large_transfer()
+{
+	FAT_FILE file;
+	FAT_DIRECTORY_ENTRY entry;
+	uint16_t r;
+	uint32_t i;
+	uint32_t bytes_read;
+	unsigned char buff[512];
+
+	printf("Transferring more than 64 KiB at once...");
+
+	for (i = 0; i < sizeof(test_large_data); i++)
+		test_large_data[i] = (unsigned char) (i * 3 + (i >> 16));
+	/*
+	// write the whole buffer with a single call
+	*/
+	r = fat_file_open(&fat_volume, "\\large transfer.bin", FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_OVERWRITE | FAT_FILE_ACCESS_WRITE, &file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error opening file: %x\n", r);
+		return;
+	}
+	fat_file_set_buffer(&file, buff);
+	r = fat_file_write(&file, test_large_data, sizeof(test_large_data));
+	fat_file_close(&file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error writing file: %x\n", r);
+		return;
+	}
+	r = fat_get_file_entry(&fat_volume, "\\large transfer.bin", &entry);
+	if (r != FAT_SUCCESS || entry.size != sizeof(test_large_data))
+	{
+		printf("File size wrong.\n");
+		return;
+	}
+	/*
+	// read it back with a single call that asks for more
+	// than what's in the file
+	*/
+	r = fat_file_open(&fat_volume, "\\large transfer.bin", FAT_FILE_ACCESS_READ, &file);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error opening file: %x\n", r);
+		return;
+	}
+	fat_file_set_buffer(&file, buff);
+	memset(test_large_data, 0, sizeof(test_large_data));
+	r = fat_file_read(&file, test_large_data, sizeof(test_large_data) + 1, &bytes_read);
+	fat_file_close(&file);
+	if (r != FAT_SUCCESS || bytes_read != sizeof(test_large_data))
+	{
+		printf("Error reading file: %x\n", r);
+		return;
+	}
+	for (i = 0; i < sizeof(test_large_data); i++)
+	{
+		if (test_large_data[i] != (unsigned char) (i * 3 + (i >> 16)))
+		{
+			printf("Data mismatch at 0x%x\n", i);
+			return;
+		}
+	}
+	printf("Completed.\n");
+}
+
+static void test_create_files()
+{
+	FAT_FILE file;
+	FAT_DIRECTORY_ENTRY entry;
+	FAT_DIRECTORY_ENTRY entries[7];
+	uint16_t r;
+	uint16_t i;
+	uint16_t j;
+	char filename[64];
+	unsigned char buff[512];
+	char* names[7] = 
+	{
+		"batch file one.txt", "batch file two.txt", "batch file three.txt", 
+		"batch file four.txt", "batch file five.txt", "batch file six.txt", "BATCH.TXT"
+	};
+	char* clash_short[2] = { "not created.txt", "exist.txt" };
+	char* clash_long[1] = { "Batch File Two.TXT" };
+	char* clash_batch[2] = { "same name.txt", "SAME NAME.TXT" };
+
+	printf("Creating files in a batch...");
+
+	r = fat_create_directory(&fat_volume, "\\Batch Files");
+	if (r != FAT_SUCCESS)
+	{
+		printf("Could not create folder. Error: %x\n", r);
+		return;
+	}
+	/*
+	// create a file with an 8.3 name and one that
+	// takes the 1st ~N tail of the batch's short names
+	*/
+	r = fat_file_open(&fat_volume, "\\Batch Files\\EXIST.TXT", FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_WRITE, &file);
+	if (r == FAT_SUCCESS)
+	{
+		fat_file_set_buffer(&file, buff);
+		r = fat_file_close(&file);
+	}
+	/*
+	// the file gets a long name so drop it and set the short
+	// name to EXIST.TXT the way that other systems write it
+	*/
+	if (r == FAT_SUCCESS)
+		r = storage_device.read_sector(storage_device.driver, file.directory_entry.sector_addr, buff);
+	if (r == STORAGE_SUCCESS)
+	{
+		buff[file.directory_entry.sector_offset - 0x20] = 0xE5;
+		memcpy(buff + file.directory_entry.sector_offset, "EXIST   TXT", 11);
+		r = storage_device.write_sector(storage_device.driver, file.directory_entry.sector_addr, buff);
+	}
+	if (r == FAT_SUCCESS)
+		r = fat_file_open(&fat_volume, "\\Batch Files\\batch file zero.txt", FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_WRITE, &file);
+	if (r == FAT_SUCCESS)
+	{
+		fat_file_set_buffer(&file, buff);
+		r = fat_file_close(&file);
+	}
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error creating file: %x\n", r);
+		return;
+	}
+	r = fat_get_file_entry(&fat_volume, "\\Batch Files\\batch file zero.txt", &entry);
+	if (r != FAT_SUCCESS || !*entry.name)
+	{
+		printf("Could not find file. Error: %x\n", r);
+		return;
+	}
+	/*
+	// create the batch and check that every file got
+	// a short name that is not used by any other file
+	*/
+	r = fat_create_files(&fat_volume, "\\Batch Files", names, 7, 0, 0, entries);
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error: %x\n", r);
+		return;
+	}
+	for (i = 0; i < 7; i++)
+	{
+		if (!memcmp(entries[i].raw.ENTRY.STD.name, entry.raw.ENTRY.STD.name, 11) ||
+			!memcmp(entries[i].raw.ENTRY.STD.name, "EXIST   TXT", 11))
+		{
+			break;
+		}
+		for (j = 0; j < i; j++)
+		{
+			if (!memcmp(entries[i].raw.ENTRY.STD.name, entries[j].raw.ENTRY.STD.name, 11))
+				break;
+		}
+		if (j < i)
+			break;
+		if (i < 6)
+		{
+			sprintf(filename, "\\Batch Files\\%s", names[i]);
+			r = fat_get_file_entry(&fat_volume, filename, &entry);
+			if (r != FAT_SUCCESS || !*entry.name || memcmp(entry.raw.ENTRY.STD.name, entries[i].raw.ENTRY.STD.name, 11))
+			{
+				printf("Could not find file '%s'. Error: %x\n", names[i], r);
+				return;
+			}
+		}
+	}
+	if (i < 7)
+	{
+		printf("Short name of '%s' is used twice.\n", names[i]);
+		return;
+	}
+	/*
+	// the batches that repeat a name must fail without creating
+	// any file, the names are compared without case
+	*/
+	r = fat_create_files(&fat_volume, "\\Batch Files", clash_short, 2, 0, 0, entries);
+	if (r != FAT_FILENAME_ALREADY_EXISTS)
+	{
+		printf("Created a file over an 8.3 name.\n");
+		return;
+	}
+	r = fat_create_files(&fat_volume, "\\Batch Files", clash_long, 1, 0, 0, entries);
+	if (r != FAT_FILENAME_ALREADY_EXISTS)
+	{
+		printf("Created a file over a long name.\n");
+		return;
+	}
+	r = fat_create_files(&fat_volume, "\\Batch Files", clash_batch, 2, 0, 0, entries);
+	if (r != FAT_FILENAME_ALREADY_EXISTS)
+	{
+		printf("Created the same file twice.\n");
+		return;
+	}
+	r = fat_get_file_entry(&fat_volume, "\\Batch Files\\not created.txt", &entry);
+	if (r != FAT_SUCCESS || *entry.name)
+	{
+		printf("A failed batch created a file.\n");
+		return;
+	}
+	printf("Completed.\n");
+}
+
+#if defined(FAT_DIRECTORY_INDEX)
+static void test_directory_index()
+{
+	static FAT_DIRECTORY_INDEX_SLOT slots[512];
+	FAT_FILE file;
+	FAT_DIRECTORY_ENTRY entry;
+	uint16_t r;
+	uint16_t i;
+	char filename[64];
+	unsigned char buff[512];
+
+	printf("Testing directory index...");
+
+	r = fat_set_directory_index_buffer(&fat_volume, slots, sizeof(slots));
+	if (r == FAT_SUCCESS)
+		r = fat_create_directory(&fat_volume, "\\Indexed");
+	for (i = 0; i < 80 && r == FAT_SUCCESS; i++)
+	{
+		sprintf(filename, "\\Indexed\\indexed file %i.txt", i);
+		r = fat_file_open(&fat_volume, filename, FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_WRITE, &file);
+		if (r == FAT_SUCCESS)
+		{
+			fat_file_set_buffer(&file, buff);
+			r = fat_file_close(&file);
+		}
+	}
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error creating files: %x\n", r);
+		return;
+	}
+	/*
+	// looking for a name that is not there indexes the directory
+	*/
+	r = fat_get_file_entry(&fat_volume, "\\Indexed\\not there.txt", &entry);
+	if (r != FAT_SUCCESS || *entry.name || fat_volume.index_state != FAT_DIRECTORY_INDEX_READY)
+	{
+		printf("Directory not indexed. Error: %x\n", r);
+		return;
+	}
+	/*
+	// rename the last file behind the library's back the way that
+	// another system would, the index doesn't know the new name
+	// but the file must still be found
+	*/
+	r = fat_get_file_entry(&fat_volume, "\\Indexed\\indexed file 79.txt", &entry);
+	if (r != FAT_SUCCESS || !*entry.name)
+	{
+		printf("Could not find file. Error: %x\n", r);
+		return;
+	}
+	r = storage_device.read_sector(storage_device.driver, entry.sector_addr, buff);
+	if (r == STORAGE_SUCCESS)
+	{
+		for (i = 0x20; i <= entry.sector_offset && buff[entry.sector_offset - i + 11] == 0x0F; i += 0x20)
+			buff[entry.sector_offset - i] = 0xE5;
+		memcpy(buff + entry.sector_offset, "RENAMED TXT", 11);
+		r = storage_device.write_sector(storage_device.driver, entry.sector_addr, buff);
+	}
+	if (r != STORAGE_SUCCESS)
+	{
+		printf("Could not write entry. Error: %x\n", r);
+		return;
+	}
+	r = fat_get_file_entry(&fat_volume, "\\Indexed\\RENAMED.TXT", &entry);
+	if (r != FAT_SUCCESS || !*entry.name || memcmp(entry.raw.ENTRY.STD.name, "RENAMED TXT", 11))
+	{
+		printf("Name not on the index was not found. Error: %x\n", r);
+		return;
+	}
+	r = fat_get_file_entry(&fat_volume, "\\Indexed\\indexed file 78.txt", &entry);
+	if (r != FAT_SUCCESS || !*entry.name)
+	{
+		printf("Could not find file. Error: %x\n", r);
+		return;
+	}
+	printf("Completed.\n");
+}
+#endif
+
+static void test_zero_fill()
+{
+	FAT_FILE file;
+	FAT_DIRECTORY_ENTRY entry;
+	FAT_DIRECTORY_ENTRY* pentry;
+	FAT_FILESYSTEM_QUERY query;
+	uint16_t r;
+	uint16_t i;
+	uint16_t j;
+	uint32_t cluster;
+	uint32_t cluster_size;
+	char filename[64];
+	unsigned char buff[512];
+	unsigned char data[512];
+
+	printf("Zeroing new directory clusters...");
+	/*
+	// fill enough clusters for the directory and the files that
+	// will be created in it with bytes that read back as directory
+	// entries and free them
+	*/
+	cluster_size = (uint32_t) fat_volume.no_of_sectors_per_cluster * fat_volume.no_of_bytes_per_serctor;
+	j = (uint16_t) ((cluster_size + 512) / (3 * 32) + 8);
+	memset(data, 0x30, sizeof(data));
+	r = fat_file_open(&fat_volume, "\\zero fill.bin", FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_WRITE, &file);
+	if (r == FAT_SUCCESS)
+	{
+		fat_file_set_buffer(&file, buff);
+		for (i = 0; i < j * fat_volume.no_of_sectors_per_cluster && r == FAT_SUCCESS; i++)
+			r = fat_file_write(&file, data, sizeof(data));
+		if (r == FAT_SUCCESS)
+			r = fat_file_close(&file);
+	}
+	if (r == FAT_SUCCESS)
+		r = fat_get_file_entry(&fat_volume, "\\zero fill.bin", &entry);
+	if (r == FAT_SUCCESS)
+		r = fat_file_delete(&fat_volume, "\\zero fill.bin");
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error: %x\n", r);
+		return;
+	}
+	/*
+	// make every allocation start on those clusters and create a
+	// directory that takes more than one cluster. Every cluster must
+	// be zeroed or the garbage would be listed as files
+	*/
+	cluster = entry.raw.ENTRY.STD.first_cluster_lo;
+	if (fat_volume.fs_type == FAT_FS_TYPE_FAT32)
+		cluster |= (uint32_t) entry.raw.ENTRY.STD.first_cluster_hi << 16;
+	fat_volume.next_free_cluster = cluster;
+
+	r = fat_create_directory(&fat_volume, "\\Zero Filled");
+	for (i = 0; r == FAT_SUCCESS && i * 3 * 32 < cluster_size + 512; i++)
+	{
+		sprintf(filename, "\\Zero Filled\\zero filled file %i.txt", i);
+		fat_volume.next_free_cluster = cluster;
+		r = fat_file_open(&fat_volume, filename, FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_WRITE, &file);
+		if (r == FAT_SUCCESS)
+		{
+			fat_file_set_buffer(&file, buff);
+			r = fat_file_close(&file);
+		}
+	}
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error creating files: %x\n", r);
+		return;
+	}
+	j = 0;
+	memset(&query, 0, sizeof(query));
+	r = fat_find_first_entry(&fat_volume, "\\Zero Filled", 0, &pentry, &query);
+	while (r == FAT_SUCCESS && *pentry->name)
+	{
+		if (*pentry->name != '.')
+		{
+			sprintf(filename, "zero filled file %i.txt", j);
+			if (j++ == i || strcmp((char*) pentry->name, filename))
+				break;
+		}
+		r = fat_find_next_entry(&fat_volume, &pentry, &query);
+	}
+	if (r != FAT_SUCCESS || *pentry->name || j != i)
+	{
+		printf("New directory clusters were not zeroed.\n");
+		return;
+	}
+	printf("Completed.\n");
+}
+
+static STORAGE_DEVICE_READ_SECTORS test_query_read_sectors_device;
+static uint32_t test_query_read_sectors_count;
+
+static uint16_t test_query_read_sectors_hook(void* driver, uint32_t start, uint32_t end, unsigned char* buffer)
+{
+	test_query_read_sectors_count += end - start + 1;
+	return test_query_read_sectors_device(driver, start, end, buffer);
+}
+
+static void test_query_read_sectors()
+{
+	FAT_FILE file;
+	FAT_FILESYSTEM_QUERY query;
+	FAT_DIRECTORY_ENTRY* pentry;
+	uint16_t r;
+	uint16_t i;
+	uint16_t j;
+	uint16_t count;
+	char filename[64];
+	char new_filename[64];
+	unsigned char buff[512];
 
+	printf("Reading directory cluster runs...");
+	/*
+	// create enough files for a few clusters on a directory. Every
+	// file takes a cluster so this directory's clusters are not
+	// contiguous
+	*/
+	count = (uint16_t) (((uint32_t) fat_volume.no_of_sectors_per_cluster * 
+		fat_volume.no_of_bytes_per_serctor * 3) / (3 * 32));
+	r = fat_create_directory(&fat_volume, "\\Read Ahead Files");
+	if (r == FAT_SUCCESS)
+		r = fat_create_directory(&fat_volume, "\\Read Ahead");
+	for (i = 0; i < count && r == FAT_SUCCESS; i++)
+	{
+		sprintf(filename, "\\Read Ahead Files\\read ahead file %i.txt", i);
+		r = fat_file_open(&fat_volume, filename, FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_WRITE, &file);
+		if (r == FAT_SUCCESS)
+		{
+			fat_file_set_buffer(&file, buff);
+			r = fat_file_close(&file);
+		}
+	}
+	/*
+	// moving them allocates nothing but the clusters of the other
+	// directory, so those are contiguous
+	*/
+	for (i = 0; i < count && r == FAT_SUCCESS; i++)
+	{
+		sprintf(filename, "\\Read Ahead Files\\read ahead file %i.txt", i);
+		sprintf(new_filename, "\\Read Ahead\\read ahead file %i.txt", i);
+		r = fat_file_rename(&fat_volume, filename, new_filename);
+	}
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error creating files: %x\n", r);
+		return;
+	}
 	/*
-	// read a file from the device and write it to the local filesystem
+	// count the sectors read by the driver while listing them
 	*/
-	bytes_read = 0;
-	r = sm_file_open(&file, "x:\\mrt.exe", SM_FILE_ACCESS_READ);
-	f = fopen(LOCAL_FOLDER "mrt.exe", "wb");
-	do
+	test_query_read_sectors_count = 0;
+	test_query_read_sectors_device = storage_device.read_sectors;
+	if (test_query_read_sectors_device)
+		storage_device.read_sectors = (STORAGE_DEVICE_READ_SECTORS) &test_query_read_sectors_hook;
+
+	j = 0;
+	memset(&query, 0, sizeof(query));
+	r = fat_find_first_entry(&fat_volume, "\\Read Ahead", 0, &pentry, &query);
+	while (r == FAT_SUCCESS && *pentry->name)
 	{
-		r = sm_file_read(&file, buff, 1024, &bytes_read);
-		fwrite(buff, 1, bytes_read, f);
-		total_bytes_read += bytes_read;
+		if (*pentry->name != '.')
+		{
+			sprintf(filename, "read ahead file %i.txt", j);
+			if (j++ == count || strcmp((char*) pentry->name, filename))
+				break;
+		}
+		r = fat_find_next_entry(&fat_volume, &pentry, &query);
 	}
-	while (bytes_read);
-	fclose(f);
-	r = sm_file_close(&file);
+	if (r == FAT_SUCCESS && !*pentry->name && j == count)
+	{
+		memset(&query, 0, sizeof(query));
+		r = fat_find_first_entry(&fat_volume, "\\Read Ahead Files", 0, &pentry, &query);
+		while (r == FAT_SUCCESS && *pentry->name == '.')
+			r = fat_find_next_entry(&fat_volume, &pentry, &query);
+		j = (r == FAT_SUCCESS && !*pentry->name) ? count : 0;
+	}
+	storage_device.read_sectors = test_query_read_sectors_device;
 
-	if (file_entry.size != total_bytes_read)
+	if (r != FAT_SUCCESS || *pentry->name || j != count)
 	{
-		printf("Error: file is reported as %x bytes but we only read %x\n", file_entry.size, total_bytes_read);
+		printf("Directories were not listed correctly. Error: %x\n", r);
+		return;
 	}
-	else
+	#if defined(FAT_QUERY_READ_SECTORS)
+	if (test_query_read_sectors_device && !test_query_read_sectors_count)
 	{
-		printf("Completed.\n");
+		printf("Directories were read one sector at a time.\n");
+		return;
 	}
+	#endif
+	printf("Completed.\n");
 }
 
-static void test_read_file_unbuffered()
+static void test_query_filter()
 {
-	SM_FILE file;
-	uint32_t r;
-	unsigned char buff[1024];
-	size_t bytes_read;
-	FILE* f;
-	uint32_t total_bytes_written = 0;
+	FAT_FILE file;
+	FAT_QUERY_FILTER filter;
+	uint16_t r;
+	uint16_t i;
+	char names[256];
+	char filename[64];
+	unsigned char buff[512];
+	char* files[4] = { "report 1.txt", "report 2.TXT", "REPORT3.TXT", "notes.doc" };
 
-	printf("Reading file (unbuffered)...");
+	printf("Filtering directory queries...");
 	/*
-	// read a file from the device and write it to the local filesystem
+	// create a few files, only the 1st one has data
 	*/
-	bytes_read = 0;
-	r = sm_file_open(&file, "x:\\mrt.exe", SM_FILE_ACCESS_READ | SM_FILE_FLAG_NO_BUFFERING);
-	f = fopen(LOCAL_FOLDER "mrt_unbuffered.exe", "wb");
-	do
+	r = fat_create_directory(&fat_volume, "\\Filtered");
+	if (r == FAT_SUCCESS)
+		r = fat_create_directory(&fat_volume, "\\Filtered\\reports");
+	for (i = 0; i < 4 && r == FAT_SUCCESS; i++)
 	{
-		r = sm_file_read(&file, buff, 1024, &bytes_read);
-		if (r != SM_SUCCESS)
+		sprintf(filename, "\\Filtered\\%s", files[i]);
+		r = fat_file_open(&fat_volume, filename, FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_WRITE, &file);
+		if (r == FAT_SUCCESS)
 		{
-			printf("Read error 0x%x\n", r);
-			fclose(f);
-			r = sm_file_close(&file);
-			return;
-
+			fat_file_set_buffer(&file, buff);
+			if (!i)
+				r = fat_file_write(&file, (unsigned char*) "report", 6);
+			if (r == FAT_SUCCESS)
+				r = fat_file_close(&file);
 		}
-		fwrite(buff, 1, bytes_read, f);
-		total_bytes_written += bytes_read;
 	}
-	while (bytes_read);
-	fclose(f);
-	r = sm_file_close(&file);
-
-	printf("Completed.\n");
-}
-
-int file1writes;
-unsigned char buff1[4096];
-
-static void test_another_async_write()
-{
-	int i;
-	uint16_t err;
-	SM_FILE file;
-
-	//
-	// fill buffer with data
-	//
-	for (i = 0; i < 4096; i++)
+	if (r != FAT_SUCCESS)
 	{
-		buff1[i] = (i & 1)?'X':'x';
+		printf("Error creating files: %x\n", r);
+		return;
 	}
-	buff1[0] = 'h';
-	buff1[1] = 'e';
-	buff1[2] = 'l';
-	buff1[3] = 'l';
-	buff1[4] = 'o';
-	buff1[5] = ' ';
 	/*
-	// reset the file writes count
+	// patterns are not case sensitive
 	*/
-	file1writes = 0;
-
-	printf("Writing another file...");
-	err = sm_file_open(&file, "x:\\xxx.txt", SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_OVERWRITE);
-	sm_file_write_async(&file, buff1, 4096, &err, (void*) &test_another_async_write_callback, &file);
-
-	while (file1writes < 20)
-		Sleep(1);
-
-	printf("Completed.\n");
-
-}
-
-static void test_another_async_write_callback(SM_FILE* file, uint16_t* result)
-{
-	file1writes++;
-	if (file1writes == 10)
+	memset(&filter, 0, sizeof(filter));
+	filter.pattern = "report*.txt";
+	r = test_query_filter_list(&filter, names);
+	if (r != FAT_SUCCESS || strcmp(names, "report 1.txt|report 2.TXT|REPORT3.TXT|"))
 	{
-		/*
-		// close the file
-		*/
-		sm_file_close(file);
-		file1writes = 20;
+		printf("Pattern filter returned %s. Error: %x\n", names, r);
+		return;
 	}
-	else
+	filter.pattern = "REPORT ?.*";
+	r = test_query_filter_list(&filter, names);
+	if (r != FAT_SUCCESS || strcmp(names, "report 1.txt|report 2.TXT|"))
 	{
-		sm_file_write_async(file, buff1, 4096, result, (void*) &test_another_async_write_callback, file);
+		printf("Pattern filter returned %s. Error: %x\n", names, r);
+		return;
 	}
-
-}
-
-FILE* streamf;
-unsigned char streambuff[1024];
-char stream_completed;
-
-static void test_write_stream()
-{
-
-	int i;
-	uint16_t err;
-	SM_FILE file;
-	size_t sz;
-
-	printf("Writing stream...");
-	stream_completed = 0;
 	/*
-	// open local file
+	// attribute filters, with and without a pattern
 	*/
-	streamf = fopen("c:\\stream.old.txt", "rb");
-	if (!streamf)
+	memset(&filter, 0, sizeof(filter));
+	filter.attributes_set = FAT_ATTR_DIRECTORY;
+	r = test_query_filter_list(&filter, names);
+	if (r != FAT_SUCCESS || strcmp(names, "reports|"))
 	{
-		printf("Could not open local file.\n");
+		printf("Attribute filter returned %s. Error: %x\n", names, r);
+		return;
+	}
+	filter.attributes_set = 0;
+	filter.attributes_clear = FAT_ATTR_DIRECTORY;
+	filter.pattern = "report*";
+	r = test_query_filter_list(&filter, names);
+	if (r != FAT_SUCCESS || strcmp(names, "report 1.txt|report 2.TXT|REPORT3.TXT|"))
+	{
+		printf("Attribute filter returned %s. Error: %x\n", names, r);
+		return;
+	}
+	filter.min_size = 1;
+	r = test_query_filter_list(&filter, names);
+	if (r != FAT_SUCCESS || strcmp(names, "report 1.txt|"))
+	{
+		printf("Size filter returned %s. Error: %x\n", names, r);
 		return;
 	}
-	fseek(streamf, 0, SEEK_END);
-	sz = ftell(streamf);
-	rewind(streamf);
-
 	/*
-	// open the file
+	// a filter that nothing matches returns an empty result
 	*/
-	err = sm_file_open(&file, "x:\\stream.txt", SM_FILE_ACCESS_CREATE | SM_FILE_ACCESS_OVERWRITE | SM_FILE_FLAG_NO_BUFFERING);
-	if (err != SM_SUCCESS)
+	memset(&filter, 0, sizeof(filter));
+	filter.pattern = "*.xyz";
+	r = test_query_filter_list(&filter, names);
+	if (r != FAT_SUCCESS || *names)
 	{
-		printf("Could not open file. Error: 0x%x\n", err);
+		printf("Empty filter returned %s. Error: %x\n", names, r);
+		return;
+	}
+	filter.pattern = 0;
+	filter.attributes_set = FAT_ATTR_DIRECTORY;
+	filter.attributes_clear = FAT_ATTR_DIRECTORY;
+	r = test_query_filter_list(&filter, names);
+	if (r != FAT_SUCCESS || *names)
+	{
+		printf("Empty filter returned %s. Error: %x\n", names, r);
 		return;
 	}
+	printf("Completed.\n");
+}
+
+/*
+// lists the entries of \Filtered that match a filter
+// on a single string, each name followed by a '|'
+*/
+static uint16_t test_query_filter_list(FAT_QUERY_FILTER* filter, char* names)
+{
+	FAT_FILESYSTEM_QUERY query;
+	FAT_DIRECTORY_ENTRY* pentry;
+	uint16_t r;
+
+	*names = 0;
+	memset(&query, 0, sizeof(query));
+	r = fat_find_first_entry_ex(&fat_volume, "\\Filtered", 0, filter, &pentry, &query);
+	while (r == FAT_SUCCESS && *pentry->name)
+	{
+		if (*pentry->name != '.')
+		{
+			strcat(names, (char*) pentry->name);
+			strcat(names, "|");
+		}
+		r = fat_find_next_entry(&fat_volume, &pentry, &query);
+	}
+	return r;
+}
+
+static void test_entry_times()
+{
+	FAT_FILE file;
+	FAT_DIRECTORY_ENTRY entry;
+	FAT_FILESYSTEM_QUERY query;
+	FAT_DIRECTORY_ENTRY* pentry;
+	struct tm tm;
+	time_t expected[3];
+	time_t decoded[3];
+	uint16_t r;
+	uint16_t i;
+	unsigned char buff[512];
 	/*
-	// allocate disk space
+	// the timestamps written to the entry: created on 2013-01-15
+	// 08:30:10, modified on 2013-07-04 21:05:58 and accessed on
+	// 2013-07-05. Only one of them falls on daylight saving time
 	*/
-	err = sm_file_alloc(&file, sz);
+	uint16_t create_date = ((2013 - 1980) << 9) | (1 << 5) | 15;
+	uint16_t create_time = (8 << 11) | (30 << 5) | (10 / 2);
+	uint16_t modify_date = ((2013 - 1980) << 9) | (7 << 5) | 4;
+	uint16_t modify_time = (21 << 11) | (5 << 5) | (58 / 2);
+	uint16_t access_date = ((2013 - 1980) << 9) | (7 << 5) | 5;
+
+	printf("Decoding entry timestamps...");
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_isdst = -1;
+	tm.tm_year = 113; tm.tm_mon = 0; tm.tm_mday = 15;
+	tm.tm_hour = 8; tm.tm_min = 30; tm.tm_sec = 10;
+	expected[0] = mktime(&tm);
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_isdst = -1;
+	tm.tm_year = 113; tm.tm_mon = 6; tm.tm_mday = 4;
+	tm.tm_hour = 21; tm.tm_min = 5; tm.tm_sec = 58;
+	expected[1] = mktime(&tm);
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_isdst = -1;
+	tm.tm_year = 113; tm.tm_mon = 6; tm.tm_mday = 5;
+	expected[2] = mktime(&tm);
+
+	r = fat_file_open(&fat_volume, "\\entry times.txt", FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_WRITE, &file);
+	if (r == FAT_SUCCESS)
+	{
+		fat_file_set_buffer(&file, buff);
+		r = fat_file_close(&file);
+	}
 	/*
-	// read local file
+	// write the timestamps on the entry
 	*/
-	err = fread(streambuff, 1, 1024, streamf);
-	if (!err)
+	if (r == FAT_SUCCESS)
+		r = storage_device.read_sector(storage_device.driver, file.directory_entry.sector_addr, buff);
+	if (r == STORAGE_SUCCESS)
 	{
-		printf("Could not read local file.\n");
+		i = file.directory_entry.sector_offset;
+		buff[i + 14] = (unsigned char) create_time; buff[i + 15] = (unsigned char) (create_time >> 8);
+		buff[i + 16] = (unsigned char) create_date; buff[i + 17] = (unsigned char) (create_date >> 8);
+		buff[i + 18] = (unsigned char) access_date; buff[i + 19] = (unsigned char) (access_date >> 8);
+		buff[i + 22] = (unsigned char) modify_time; buff[i + 23] = (unsigned char) (modify_time >> 8);
+		buff[i + 24] = (unsigned char) modify_date; buff[i + 25] = (unsigned char) (modify_date >> 8);
+		r = storage_device.write_sector(storage_device.driver, file.directory_entry.sector_addr, buff);
+	}
+	if (r != STORAGE_SUCCESS)
+	{
+		printf("Could not write entry. Error: %x\n", r);
 		return;
 	}
 	/*
-	// initiate stream write
+	// the decoded timestamps must match both when the entry
+	// is looked up and when it's listed
 	*/
-	err = sm_file_write_stream(&file, streambuff, 1024, &err, (SM_STREAM_CALLBACK) &test_write_stream_callback, &file);
-	if (err != FILESYSTEM_OP_IN_PROGRESS)
+	r = fat_get_file_entry(&fat_volume, "\\entry times.txt", &entry);
+	if (r != FAT_SUCCESS || !*entry.name)
 	{
-		printf("Error: 0x%x\n", err);
+		printf("Could not find file. Error: %x\n", r);
+		return;
+	}
+	fat_get_entry_times(&entry, &decoded[0], &decoded[1], &decoded[2]);
+	if (memcmp(decoded, expected, sizeof(expected)))
+	{
+		printf("Timestamps decoded wrong.\n");
 		return;
 	}
+	#if !defined(FAT_LAZY_DIRECTORY_TIMES)
+	if (entry.create_time != decoded[0] || entry.modify_time != decoded[1] || entry.access_time != decoded[2])
+	{
+		printf("Timestamps decoded on demand don't match the entry.\n");
+		return;
+	}
+	#endif
+	memset(&query, 0, sizeof(query));
+	r = fat_find_first_entry(&fat_volume, "\\", 0, &pentry, &query);
+	while (r == FAT_SUCCESS && *pentry->name && strcmp((char*) pentry->name, "entry times.txt"))
+		r = fat_find_next_entry(&fat_volume, &pentry, &query);
+	if (r != FAT_SUCCESS || !*pentry->name)
+	{
+		printf("File not listed. Error: %x\n", r);
+		return;
+	}
+	fat_get_entry_times(pentry, &decoded[0], &decoded[1], &decoded[2]);
+	if (memcmp(decoded, expected, sizeof(expected)))
+	{
+		printf("Timestamps decoded wrong on a query.\n");
+		return;
+	}
+	#if !defined(FAT_LAZY_DIRECTORY_TIMES)
+	if (pentry->create_time != decoded[0] || pentry->modify_time != decoded[1] || pentry->access_time != decoded[2])
+	{
+		printf("Timestamps decoded on demand don't match the entry.\n");
+		return;
+	}
+	#endif
+	printf("Completed.\n");
+}
+
+static void test_long_names()
+{
+	FAT_FILE file;
+	FAT_DIRECTORY_ENTRY entry;
+	FAT_DIRECTORY_ENTRY folded_entry;
+	FAT_FILESYSTEM_QUERY query;
+	FAT_DIRECTORY_ENTRY* pentry;
+	uint16_t r;
+	uint16_t i;
+	uint16_t j;
+	char name[64];
+	char filename[64];
+	unsigned char buff[512];
 	/*
-	// wait until it's done
+	// long names are stored 13 chars per entry so the names end
+	// on both sides of the 1st, 2nd and 3rd entry. They all have
+	// two dots so they're looked up by their long names
 	*/
-	while (!stream_completed)
-		Sleep(1);
-}
+	uint16_t lengths[9] = { 12, 13, 14, 25, 26, 27, 38, 39, 40 };
 
+	printf("Assembling and folding long names...");
 
-static void test_write_stream_callback(SM_FILE* file, uint16_t* result, unsigned char** buffer, uint16_t* action)
-{
-	if (*result == FILESYSTEM_AWAITING_DATA)
+	r = fat_create_directory(&fat_volume, "\\Long Names");
+	for (i = 0; i < 9 && r == FAT_SUCCESS; i++)
 	{
-		/*
-		// reload the buffer
-		*/
-		uint16_t bytes;
-		bytes = fread(streambuff, 1, 1024, streamf);
-		/*
-		// if we got data set the response to READY otherwise set it to STOP
-		*/
-		if (bytes)
-		{
-			*action = FAT_STREAMING_RESPONSE_READY;
-		}
-		else
+		for (j = 0; j < lengths[i] - 4; j++)
+			name[j] = (j == 4) ? '.' : 'a' + (j % 26);
+		strcpy(name + j, ".txt");
+		sprintf(filename, "\\Long Names\\%s", name);
+		r = fat_file_open(&fat_volume, filename, FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_WRITE, &file);
+		if (r == FAT_SUCCESS)
 		{
-			*action = FAT_STREAMING_RESPONSE_STOP;
+			fat_file_set_buffer(&file, buff);
+			r = fat_file_close(&file);
 		}
 	}
-	else
+	/*
+	// the chars next to the letters on the ASCII table
+	// must not be folded
+	*/
+	if (r == FAT_SUCCESS)
+		r = fat_file_open(&fat_volume, "\\Long Names\\fold.@`^~.txt", FAT_FILE_ACCESS_CREATE | FAT_FILE_ACCESS_WRITE, &file);
+	if (r == FAT_SUCCESS)
 	{
-		if (*result == SM_SUCCESS)
+		fat_file_set_buffer(&file, buff);
+		r = fat_file_close(&file);
+	}
+	if (r != FAT_SUCCESS)
+	{
+		printf("Error creating files: %x\n", r);
+		return;
+	}
+	/*
+	// list the names, every one must come back whole
+	*/
+	i = 0;
+	memset(&query, 0, sizeof(query));
+	r = fat_find_first_entry(&fat_volume, "\\Long Names", 0, &pentry, &query);
+	while (r == FAT_SUCCESS && *pentry->name && i < 9)
+	{
+		if (*pentry->name != '.')
 		{
-			printf("Completed.\n");
+			for (j = 0; j < lengths[i] - 4; j++)
+				name[j] = (j == 4) ? '.' : 'a' + (j % 26);
+			strcpy(name + j, ".txt");
+			if (strcmp((char*) pentry->name, name))
+				break;
+			i++;
 		}
-		else
+		r = fat_find_next_entry(&fat_volume, &pentry, &query);
+	}
+	if (r != FAT_SUCCESS || i != 9)
+	{
+		printf("Long name %i was not assembled right. Error: %x\n", i, r);
+		return;
+	}
+	/*
+	// looking them up in upper case must find the same entries
+	*/
+	for (i = 0; i < 9; i++)
+	{
+		for (j = 0; j < lengths[i] - 4; j++)
+			name[j] = (j == 4) ? '.' : 'a' + (j % 26);
+		strcpy(name + j, ".txt");
+		sprintf(filename, "\\Long Names\\%s", name);
+		r = fat_get_file_entry(&fat_volume, filename, &entry);
+		for (j = 0; j < lengths[i] - 4; j++)
+			name[j] = (j == 4) ? '.' : 'A' + (j % 26);
+		strcpy(name + j, ".TXT");
+		sprintf(filename, "\\LONG NAMES\\%s", name);
+		if (r == FAT_SUCCESS)
+			r = fat_get_file_entry(&fat_volume, filename, &folded_entry);
+		if (r != FAT_SUCCESS || !*entry.name || !*folded_entry.name ||
+			entry.sector_addr != folded_entry.sector_addr || entry.sector_offset != folded_entry.sector_offset)
 		{
-			printf("Error: 0x%x\n", *result);
+			printf("Could not find %s. Error: %x\n", filename, r);
+			return;
 		}
-		/*
-		// close the file
-		*/
-		sm_file_close(file);
-		/*
-		// signal that we're done
-		*/
-		stream_completed = 1;
 	}
-}
\ No newline at end of file
+	r = fat_get_file_entry(&fat_volume, "\\Long Names\\fold.@`^~.txt", &entry);
+	if (r == FAT_SUCCESS)
+		r = fat_get_file_entry(&fat_volume, "\\LONG NAMES\\FOLD.@`^~.TXT", &folded_entry);
+	if (r != FAT_SUCCESS || !*entry.name || !*folded_entry.name ||
+		entry.sector_addr != folded_entry.sector_addr || entry.sector_offset != folded_entry.sector_offset)
+	{
+		printf("Could not find FOLD.@`^~.TXT. Error: %x\n", r);
+		return;
+	}
+	r = fat_get_file_entry(&fat_volume, "\\Long Names\\fold.`@~^.txt", &entry);
+	if (r != FAT_SUCCESS || *entry.name)
+	{
+		printf("Symbols were folded. Error: %x\n", r);
+		return;
+	}
+	printf("Completed.\n");
+}